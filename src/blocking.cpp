@@ -0,0 +1,111 @@
+#include <cstdlib>
+#include <string.h>
+#include "blocking.h"
+#include "utils/common.h"
+
+static void free_key(Blocking* b, BlockedKey* bk) {
+    hm_remove_key(&b->keys, &bk->node);
+    delete bk;
+}
+
+void block_conn(Blocking* b, Conn* conn, dstr** keys, size_t n, uint64_t deadline_ms) {
+    BlockState* state = new BlockState();
+    state->conn = conn;
+    state->deadline_ms = deadline_ms;
+    conn->blocked = state;
+
+    for (size_t i = 0; i < n; i++) {
+        BlockedKey* bk = hm_find_entry<BlockedKey>(&b->keys, keys[i]->buf, keys[i]->size);
+        if (!bk) {
+            bk = new BlockedKey();
+            hm_insert_key(&b->keys, &bk->node, keys[i]->buf, keys[i]->size);
+        }
+
+        // The same key twice (XREAD STREAMS s s) waits once
+        bool dup = false;
+        for (BlockedKey* seen : state->keys) {
+            dup |= seen == bk;
+        }
+        if (!dup) {
+            bk->waiters.push_back(conn);
+            state->keys.push_back(bk);
+        }
+    }
+
+    if (deadline_ms) {
+        b->timeouts.push_back({deadline_ms, &state->heap_idx});
+        heap_fix(b->timeouts, b->timeouts.size() - 1);
+    }
+}
+
+void unblock_conn(Blocking* b, Conn* conn) {
+    BlockState* state = conn->blocked;
+    if (!state) {
+        return;
+    }
+    for (BlockedKey* bk : state->keys) {
+        for (size_t i = 0; i < bk->waiters.size(); i++) {
+            if (bk->waiters[i] == conn) {
+                bk->waiters.erase(bk->waiters.begin() + i);
+                break;
+            }
+        }
+        if (bk->waiters.empty() && !bk->ready && !bk->serving) {
+            free_key(b, bk);
+        }
+    }
+
+    // Out of the timeout heap, like rem_ttl()
+    size_t pos = state->heap_idx;
+    if (pos < b->timeouts.size()) {
+        b->timeouts[pos] = b->timeouts.back();
+        b->timeouts.pop_back();
+        if (pos < b->timeouts.size()) {
+            heap_fix(b->timeouts, pos);
+        }
+    }
+
+    for (dstr* arg : state->argv) {
+        free(arg);
+    }
+    delete state;
+    conn->blocked = NULL;
+}
+
+BlockedKey* block_find(Blocking* b, const char* key, size_t len) {
+    if (!hm_size(&b->keys)) {
+        return NULL;
+    }
+    return hm_find_entry<BlockedKey>(&b->keys, key, len);
+}
+
+void block_signal(Blocking* b, const char* key, size_t len) {
+    BlockedKey* bk = block_find(b, key, len);
+    if (bk && !bk->ready) {
+        bk->ready = true;
+        b->ready.push_back(bk);
+    }
+}
+
+void block_take_ready(Blocking* b, std::vector<BlockedKey*>& out) {
+    out.clear();
+    out.swap(b->ready);
+    for (BlockedKey* bk : out) {
+        bk->ready = false;
+        bk->serving = true;
+    }
+}
+
+void block_done(Blocking* b, BlockedKey* bk) {
+    bk->serving = false;
+    if (bk->waiters.empty() && !bk->ready) {
+        free_key(b, bk);
+    }
+}
+
+Conn* block_expired(Blocking* b, uint64_t now_ms) {
+    if (b->timeouts.empty() || b->timeouts[0].val > now_ms) {
+        return NULL;
+    }
+    return container_of(b->timeouts[0].pos_ref, BlockState, heap_idx)->conn;
+}
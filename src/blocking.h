@@ -0,0 +1,52 @@
+#ifndef BLOCKING_H
+#define BLOCKING_H
+
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "server.h"
+#include "data_structures/heap.h"
+
+// Connections blocked on keys (XREAD BLOCK, BLPOP). A blocked connection keeps its command and runs no
+// further requests. When one of its keys gets data the server runs the command again, and replies
+// null once the timeout passes. Serving the waiters is up to the server, which owns the handlers.
+
+// A key at least one connection is blocked on
+struct BlockedKey {
+    HNode node; // node.key is the map's own copy of the key
+    std::deque<Conn*> waiters; // in the order they blocked, the first one is served first
+    bool ready = false; // in Blocking::ready
+    bool serving = false; // taken from ready and not passed to block_done() yet
+};
+
+struct BlockState {
+    Conn* conn;
+    const CmdSpec* spec = NULL; // set with argv once the handler returned
+    std::vector<dstr*> argv; // what is run again, the handler may have rewritten arguments (XREAD $)
+    std::vector<BlockedKey*> keys;
+    uint64_t deadline_ms = 0; // 0 blocks forever
+    size_t heap_idx = -1; // in Blocking::timeouts
+    bool rearmed = false; // the handler blocked again when it was run again
+    bool takes_pushes = false; // a list pop (BLPOP), a push hands it the element without storing it
+    dstr* handoff_key = NULL; // while it runs with an element pushed to it: the list and the element
+    dstr* handoff = NULL;
+};
+
+struct Blocking {
+    HMap keys; // BlockedKey nodes
+    std::vector<BlockedKey*> ready; // keys that got data since the waiters were last served
+    std::vector<HeapNode> timeouts; // BlockState::deadline_ms
+};
+
+void block_conn(Blocking* b, Conn* conn, dstr** keys, size_t n, uint64_t deadline_ms);
+void unblock_conn(Blocking* b, Conn* conn); // frees the state with its arguments
+// The key got data. Nothing but a size check while no connection is blocked
+void block_signal(Blocking* b, const char* key, size_t len);
+BlockedKey* block_find(Blocking* b, const char* key, size_t len); // NULL if nobody waits on key
+// Takes the ready keys, the caller serves their waiters and then passes them to block_done()
+void block_take_ready(Blocking* b, std::vector<BlockedKey*>& out);
+void block_done(Blocking* b, BlockedKey* bk); // frees the key if nobody waits on it anymore
+Conn* block_expired(Blocking* b, uint64_t now_ms); // a conn whose timeout passed, NULL if none
+
+#endif
@@ -1,4 +1,5 @@
 #include <vector>
+#include <stddef.h>
 #include <stdint.h>
 
 void buf_append(std::vector<uint8_t>& buf, const uint8_t* data, size_t len) {
@@ -17,6 +18,10 @@ void buf_append_u32(std::vector<uint8_t>& buf, uint32_t data) {
     buf_append(buf, (uint8_t*)&data, 4);
 }
 
+void buf_append_i64(std::vector<uint8_t>& buf, int64_t data) {
+    buf_append(buf, (uint8_t*)&data, 8);
+}
+
 void buf_append_double(std::vector<uint8_t>& buf, double data) {
     buf_append(buf, (uint8_t*)&data, 8);
 }
@@ -8,6 +8,7 @@ void buf_append(std::vector<uint8_t>& buf, const uint8_t* data, size_t len);
 void buf_consume(std::vector<uint8_t>& buf, size_t len);
 void buf_append_u8(std::vector<uint8_t>& buf, uint8_t data);
 void buf_append_u32(std::vector<uint8_t>& buf, uint32_t data);
+void buf_append_i64(std::vector<uint8_t>& buf, int64_t data);
 void buf_append_double(std::vector<uint8_t>& buf, double data);
 void buf_rem_last_res_code(std::vector<uint8_t>& buf);
 
@@ -0,0 +1,441 @@
+#include <stdint.h>
+#include <string.h>
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+#endif
+
+typedef uint64_t (*popcount_fn)(const uint8_t *buf, size_t len);
+typedef void (*op_fn)(uint8_t op, uint8_t *dest, const uint8_t *src, size_t len);
+typedef size_t (*skip_fn)(const uint8_t *buf, size_t len, uint8_t skip);
+
+// === SCALAR KERNELS ===
+static inline uint64_t load_u64(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    return word;
+}
+
+static inline void store_u64(uint8_t *p, uint64_t word) {
+    memcpy(p, &word, 8);
+}
+
+static uint64_t popcount_scalar(const uint8_t *buf, size_t len) {
+    uint64_t cnt = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        cnt += __builtin_popcountll(load_u64(buf + i));
+    }
+    for (; i < len; i++) {
+        cnt += __builtin_popcount(buf[i]);
+    }
+    return cnt;
+}
+
+static void op_scalar(uint8_t op, uint8_t *dest, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    switch (op) {
+        case BITOP_AND:
+            for (; i + 8 <= len; i += 8) {
+                store_u64(dest + i, load_u64(dest + i) & load_u64(src + i));
+            }
+            for (; i < len; i++) {
+                dest[i] &= src[i];
+            }
+            break;
+        case BITOP_OR:
+            for (; i + 8 <= len; i += 8) {
+                store_u64(dest + i, load_u64(dest + i) | load_u64(src + i));
+            }
+            for (; i < len; i++) {
+                dest[i] |= src[i];
+            }
+            break;
+        case BITOP_XOR:
+            for (; i + 8 <= len; i += 8) {
+                store_u64(dest + i, load_u64(dest + i) ^ load_u64(src + i));
+            }
+            for (; i < len; i++) {
+                dest[i] ^= src[i];
+            }
+            break;
+        case BITOP_NOT:
+            for (; i + 8 <= len; i += 8) {
+                store_u64(dest + i, ~load_u64(src + i));
+            }
+            for (; i < len; i++) {
+                dest[i] = ~src[i];
+            }
+            break;
+    }
+}
+
+// Index of the first byte in [0, len) that is not equal to skip (0x00 or 0xff), len if there is none
+static size_t skip_scalar(const uint8_t *buf, size_t len, uint8_t skip) {
+    uint64_t skip_word = skip ? UINT64_MAX : 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        if (load_u64(buf + i) != skip_word) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        if (buf[i] != skip) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef BITMAP_X86
+// === POPCNT KERNEL ===
+// Same loop as the scalar one, but compiled so that __builtin_popcountll becomes a single popcnt instruction
+__attribute__((target("popcnt"))) static uint64_t popcount_hw(const uint8_t *buf, size_t len) {
+    uint64_t cnt0 = 0, cnt1 = 0, cnt2 = 0, cnt3 = 0;
+    size_t i = 0;
+
+    // 4 independent accumulators so the popcnt's are not serialized on one register
+    for (; i + 32 <= len; i += 32) {
+        cnt0 += __builtin_popcountll(load_u64(buf + i));
+        cnt1 += __builtin_popcountll(load_u64(buf + i + 8));
+        cnt2 += __builtin_popcountll(load_u64(buf + i + 16));
+        cnt3 += __builtin_popcountll(load_u64(buf + i + 24));
+    }
+    for (; i + 8 <= len; i += 8) {
+        cnt0 += __builtin_popcountll(load_u64(buf + i));
+    }
+    for (; i < len; i++) {
+        cnt0 += __builtin_popcount(buf[i]);
+    }
+    return cnt0 + cnt1 + cnt2 + cnt3;
+}
+
+// === AVX2 KERNELS ===
+// Popcount of every byte via a 4 bit lookup table (vpshufb), summed into 4 u64 lanes
+__attribute__((target("avx2"))) static inline __m256i popcount256(__m256i v) {
+    const __m256i lookup =
+        _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+// Carry-save adder: (h, l) = a + b + c bitwise
+__attribute__((target("avx2"))) static inline void csa256(__m256i *h, __m256i *l, __m256i a, __m256i b, __m256i c) {
+    __m256i u = _mm256_xor_si256(a, b);
+    *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    *l = _mm256_xor_si256(u, c);
+}
+
+/*
+ *  Harley-Seal popcount: 16 vectors (512 bytes) are reduced through a tree of carry-save adders
+ *  so the expensive popcount256() runs only once per 16 loaded vectors.
+ */
+__attribute__((target("avx2"))) static uint64_t popcount_avx2(const uint8_t *buf, size_t len) {
+    const __m256i *data = (const __m256i *)buf;
+    size_t nvec = len / 32;
+    size_t limit = nvec - nvec % 16;
+
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256();
+    __m256i twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256();
+    __m256i eights = _mm256_setzero_si256();
+    __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+
+    size_t i = 0;
+    for (; i < limit; i += 16) {
+        csa256(&twos_a, &ones, ones, _mm256_loadu_si256(data + i), _mm256_loadu_si256(data + i + 1));
+        csa256(&twos_b, &ones, ones, _mm256_loadu_si256(data + i + 2), _mm256_loadu_si256(data + i + 3));
+        csa256(&fours_a, &twos, twos, twos_a, twos_b);
+        csa256(&twos_a, &ones, ones, _mm256_loadu_si256(data + i + 4), _mm256_loadu_si256(data + i + 5));
+        csa256(&twos_b, &ones, ones, _mm256_loadu_si256(data + i + 6), _mm256_loadu_si256(data + i + 7));
+        csa256(&fours_b, &twos, twos, twos_a, twos_b);
+        csa256(&eights_a, &fours, fours, fours_a, fours_b);
+        csa256(&twos_a, &ones, ones, _mm256_loadu_si256(data + i + 8), _mm256_loadu_si256(data + i + 9));
+        csa256(&twos_b, &ones, ones, _mm256_loadu_si256(data + i + 10), _mm256_loadu_si256(data + i + 11));
+        csa256(&fours_a, &twos, twos, twos_a, twos_b);
+        csa256(&twos_a, &ones, ones, _mm256_loadu_si256(data + i + 12), _mm256_loadu_si256(data + i + 13));
+        csa256(&twos_b, &ones, ones, _mm256_loadu_si256(data + i + 14), _mm256_loadu_si256(data + i + 15));
+        csa256(&fours_b, &twos, twos, twos_a, twos_b);
+        csa256(&eights_b, &fours, fours, fours_a, fours_b);
+        csa256(&sixteens, &eights, eights, eights_a, eights_b);
+
+        total = _mm256_add_epi64(total, popcount256(sixteens));
+    }
+
+    // Weigh the partial counters
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(twos), 1));
+    total = _mm256_add_epi64(total, popcount256(ones));
+
+    // Vectors that did not fill a whole block of 16
+    for (; i < nvec; i++) {
+        total = _mm256_add_epi64(total, popcount256(_mm256_loadu_si256(data + i)));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    uint64_t cnt = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    // Bytes that do not fill a vector
+    return cnt + popcount_hw(buf + nvec * 32, len - nvec * 32);
+}
+
+__attribute__((target("avx2"))) static void op_avx2(uint8_t op, uint8_t *dest, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    switch (op) {
+        case BITOP_AND:
+            for (; i + 32 <= len; i += 32) {
+                __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+                __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+                _mm256_storeu_si256((__m256i *)(dest + i), _mm256_and_si256(a, b));
+            }
+            break;
+        case BITOP_OR:
+            for (; i + 32 <= len; i += 32) {
+                __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+                __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+                _mm256_storeu_si256((__m256i *)(dest + i), _mm256_or_si256(a, b));
+            }
+            break;
+        case BITOP_XOR:
+            for (; i + 32 <= len; i += 32) {
+                __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+                __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+                _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(a, b));
+            }
+            break;
+        case BITOP_NOT: {
+            const __m256i all = _mm256_set1_epi8(-1);
+            for (; i + 32 <= len; i += 32) {
+                __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+                _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(b, all));
+            }
+            break;
+        }
+    }
+    op_scalar(op, dest + i, src + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t skip_avx2(const uint8_t *buf, size_t len, uint8_t skip) {
+    const __m256i skipv = _mm256_set1_epi8((char)skip);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, skipv)) != UINT32_MAX) {
+            break;
+        }
+    }
+    return i + skip_scalar(buf + i, len - i, skip);
+}
+
+// === AVX-512 KERNEL ===
+__attribute__((target("avx512f,avx512vpopcntdq"))) static uint64_t popcount_avx512(const uint8_t *buf, size_t len) {
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(buf + i)));
+    }
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, total);
+    uint64_t count = 0;
+    for (uint64_t lane : lanes) {
+        count += lane;
+    }
+    return count + popcount_hw(buf + i, len - i);
+}
+#endif
+
+// === CPU DISPATCH ===
+static popcount_fn resolve_popcount() {
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        return &popcount_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return &popcount_avx2;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return &popcount_hw;
+    }
+#endif
+    return &popcount_scalar;
+}
+
+static op_fn resolve_op() {
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &op_avx2;
+    }
+#endif
+    return &op_scalar;
+}
+
+static skip_fn resolve_skip() {
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &skip_avx2;
+    }
+#endif
+    return &skip_scalar;
+}
+
+// Resolved once at startup, the hot path only pays for an indirect call
+static const popcount_fn popcount_impl = resolve_popcount();
+static const op_fn op_impl = resolve_op();
+static const skip_fn skip_impl = resolve_skip();
+
+static inline uint8_t get_bit(const uint8_t *buf, uint64_t pos) {
+    return (buf[pos / 8] >> (7 - pos % 8)) & 1;
+}
+
+static inline uint64_t field_mask(uint8_t bits) {
+    return bits == 64 ? UINT64_MAX : (1ull << bits) - 1;
+}
+
+// === API ===
+uint64_t bitmap_popcount(const uint8_t *buf, size_t len) {
+    return popcount_impl(buf, len);
+}
+
+uint64_t bitmap_count_range(const uint8_t *buf, uint64_t start_bit, uint64_t end_bit) {
+    uint64_t start_byte = start_bit / 8;
+    uint64_t end_byte = end_bit / 8;
+
+    // Masks for the partial edge bytes (bit 0 is the msb)
+    uint8_t first_mask = 0xff >> (start_bit % 8);
+    uint8_t last_mask = 0xff << (7 - end_bit % 8);
+
+    if (start_byte == end_byte) {
+        return __builtin_popcount(buf[start_byte] & first_mask & last_mask);
+    }
+
+    uint64_t cnt = __builtin_popcount(buf[start_byte] & first_mask);
+    cnt += __builtin_popcount(buf[end_byte] & last_mask);
+    cnt += popcount_impl(buf + start_byte + 1, end_byte - start_byte - 1);
+    return cnt;
+}
+
+void bitmap_op(uint8_t op, uint8_t *dest, const uint8_t *src, size_t len) {
+    op_impl(op, dest, src, len);
+}
+
+int64_t bitmap_find_bit(const uint8_t *buf, uint64_t start_bit, uint64_t end_bit, uint8_t bit) {
+    // Partial first byte
+    uint64_t pos = start_bit;
+    for (; pos <= end_bit && pos % 8; pos++) {
+        if (get_bit(buf, pos) == bit) {
+            return pos;
+        }
+    }
+    if (pos > end_bit) {
+        return -1;
+    }
+
+    // Skip whole bytes that can not contain the bit (0x00 when looking for 1, 0xff when looking for 0)
+    uint64_t byte = pos / 8;
+    uint64_t full_end = (end_bit + 1) / 8;
+    byte += skip_impl(buf + byte, full_end - byte, bit ? 0x00 : 0xff);
+
+    // The bit is in the first non-skipped byte or in the partial last byte
+    for (pos = byte * 8; pos <= end_bit; pos++) {
+        if (get_bit(buf, pos) == bit) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+bool bitmap_pos_range(int64_t start, int64_t end, size_t len, bool byte_mode, uint64_t *start_bit, uint64_t *end_bit) {
+    int64_t units = byte_mode ? len : len * 8;
+    if (start < 0) {
+        start += units;
+    }
+    if (end < 0) {
+        end += units;
+    }
+    start = start < 0 ? 0 : start;
+    end = end < units ? end : units - 1;
+    if (start > end) {
+        return false;
+    }
+    *start_bit = byte_mode ? start * 8 : start;
+    *end_bit = byte_mode ? end * 8 + 7 : end;
+    return true;
+}
+
+int64_t bitmap_get_field(const uint8_t *buf, size_t len, uint64_t offset, uint8_t bits, bool is_signed) {
+    uint64_t byte = offset / 8;
+    uint8_t shift = offset % 8;
+    uint8_t nbytes = (shift + bits + 7) / 8; // at most 9
+
+    // Load the bytes covering the field as one big-endian number
+    unsigned __int128 acc = 0;
+    for (uint8_t i = 0; i < nbytes; i++) {
+        acc = (acc << 8) | (byte + i < len ? buf[byte + i] : 0);
+    }
+    uint64_t val = (uint64_t)(acc >> (nbytes * 8 - shift - bits)) & field_mask(bits);
+
+    // Sign extend
+    if (is_signed && bits < 64 && (val >> (bits - 1)) & 1) {
+        val |= ~field_mask(bits);
+    }
+    return (int64_t)val;
+}
+
+void bitmap_set_field(uint8_t *buf, uint64_t offset, uint8_t bits, uint64_t value) {
+    uint64_t byte = offset / 8;
+    uint8_t shift = offset % 8;
+    uint8_t nbytes = (shift + bits + 7) / 8;
+    uint8_t low = nbytes * 8 - shift - bits;
+
+    unsigned __int128 acc = 0;
+    for (uint8_t i = 0; i < nbytes; i++) {
+        acc = (acc << 8) | buf[byte + i];
+    }
+
+    // Replace the field's bits and store the bytes back
+    unsigned __int128 mask = (unsigned __int128)field_mask(bits) << low;
+    acc = (acc & ~mask) | (((unsigned __int128)(value & field_mask(bits))) << low);
+    for (int i = nbytes - 1; i >= 0; i--) {
+        buf[byte + i] = acc & 255;
+        acc >>= 8;
+    }
+}
+
+bool bitmap_field_add(int64_t value, int64_t incr, uint8_t bits, bool is_signed, uint8_t overflow, int64_t *res) {
+    __int128 min = is_signed ? -((__int128)1 << (bits - 1)) : 0;
+    __int128 max = is_signed ? ((__int128)1 << (bits - 1)) - 1 : ((__int128)1 << bits) - 1;
+    __int128 sum = (__int128)value + incr;
+
+    if (sum >= min && sum <= max) {
+        *res = (int64_t)sum;
+        return true;
+    }
+    if (overflow == BF_OVERFLOW_FAIL) {
+        return false;
+    }
+    if (overflow == BF_OVERFLOW_SAT) {
+        *res = (int64_t)(sum > max ? max : min);
+        return true;
+    }
+
+    // WRAP - keep the low `bits` bits and reinterpret them
+    uint64_t raw = (uint64_t)sum & field_mask(bits);
+    if (is_signed && bits < 64 && (raw >> (bits - 1)) & 1) {
+        raw |= ~field_mask(bits);
+    }
+    *res = (int64_t)raw;
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum BitOps {
+    BITOP_AND = 0,
+    BITOP_OR = 1,
+    BITOP_XOR = 2,
+    BITOP_NOT = 3
+};
+
+enum BitfieldOverflow {
+    BF_OVERFLOW_WRAP = 0,
+    BF_OVERFLOW_SAT = 1,
+    BF_OVERFLOW_FAIL = 2
+};
+
+// Bits are numbered from the msb of the first byte (bit 0 = buf[0] & 0x80), same as in SETBIT/GETBIT
+uint64_t bitmap_popcount(const uint8_t *buf, size_t len);
+uint64_t bitmap_count_range(const uint8_t *buf, uint64_t start_bit, uint64_t end_bit);
+
+// Position of the first bit equal to `bit` in [start_bit, end_bit] or -1 if there is none
+int64_t bitmap_find_bit(const uint8_t *buf, uint64_t start_bit, uint64_t end_bit, uint8_t bit);
+// The bits BITPOS searches in a bitmap of len bytes: start and end count bytes (or bits without byte_mode),
+// negative ones from the end. False if the range is empty
+bool bitmap_pos_range(int64_t start, int64_t end, size_t len, bool byte_mode, uint64_t *start_bit, uint64_t *end_bit);
+
+// Fields are `bits` wide (1..64) big-endian integers starting at bit `offset`. Bytes past len read as 0
+int64_t bitmap_get_field(const uint8_t *buf, size_t len, uint64_t offset, uint8_t bits, bool is_signed);
+void bitmap_set_field(uint8_t *buf, uint64_t offset, uint8_t bits, uint64_t value);
+
+// value + incr as a `bits` wide integer with BitfieldOverflow handling. Returns false only if the op must FAIL
+bool bitmap_field_add(int64_t value, int64_t incr, uint8_t bits, bool is_signed, uint8_t overflow, int64_t *res);
+
+// dest[i] = dest[i] <op> src[i] for i in [0, len). For BITOP_NOT dest[i] = ~src[i] (src may be dest)
+void bitmap_op(uint8_t op, uint8_t *dest, const uint8_t *src, size_t len);
+
+#endif
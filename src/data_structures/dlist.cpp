@@ -19,6 +19,10 @@ void dlist_deatach(DListNode *node) {
     if (next) {
         next->prev = prev;
     }
+
+    // Detaching the node again is a no-op
+    node->prev = NULL;
+    node->next = NULL;
 }
 
 void dlist_insert_before(DListNode *target, DListNode *node) {
@@ -79,7 +79,10 @@ uint32_t dstr_reserve(dstr **pstr, size_t add) {
         return STR_OK;
     }
     
-    str = (dstr*)realloc(str, str->size + add + 1);
+    str = (dstr*)realloc(str, sizeof(dstr) + str->size + add + 1);
+    if (!str) {
+        return STR_ERR_ALLOC_FAIL;
+    }
 
     str->free = add;
     *pstr = str;
@@ -98,11 +101,11 @@ uint32_t dstr_append(dstr **pstr, const char *toadd, size_t toadd_s) {
         size_t incr = dmin(MAX_STR_PREALOC, newlen);
 
         newlen += incr;
-        str->free = newlen - str->free;
         str = (dstr*)realloc(str, sizeof(dstr) + newlen + 1);
         if (!str) {
             return STR_ERR_ALLOC_FAIL;
         }
+        str->free = newlen - str->size;
     }
 
     memcpy(&str->buf[lpos], toadd, toadd_s);
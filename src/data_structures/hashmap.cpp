@@ -1,14 +1,18 @@
 #include <assert.h>
 #include <cstdlib>
+#include <new>
+#include <stdio.h>
 #include <string.h>
 #include "hashmap.h"
-#include "server.h"
 #include "zset.h"
+#include "roaring.h"
 #include "hyperloglog.h"
+#include "stream.h"
 #include "utils/common.h"
 
 const size_t MAX_LOAD_FACTOR = 8;
 const size_t REHASHING_WORK = 128;
+const size_t LOOKUP_BATCH = 16; // keys in flight in hm_lookup_many()
 
 static void h_init(HTab *htab, size_t n) {
     // Assert that n is a power of 2
@@ -25,6 +29,57 @@ static void hm_rehash(HMap *hmap) {
     hmap->migrate_pos = 0;
 }
 
+// Start of the embedded strings: in place of the collection fields for T_STR nodes, after the struct otherwise
+static char* hn_embed(HNode *node) {
+    return node->type == T_STR ? (char*)node + offsetof(HNode, list) : (char*)(node + 1);
+}
+
+static size_t key_len_size(uint8_t flags) {
+    return (size_t)1 << (flags & HN_KEY_LEN_MASK);
+}
+
+const char* hn_key(HNode *node, size_t *len) {
+    if (node->key) {
+        *len = node->key->size;
+        return node->key->buf;
+    }
+    char *p = hn_embed(node);
+    switch (node->flags & HN_KEY_LEN_MASK) {
+        case HN_KEY_LEN8:
+            *len = *(uint8_t*)p;
+            break;
+        case HN_KEY_LEN16: {
+            uint16_t l;
+            memcpy(&l, p, sizeof(l));
+            *len = l;
+            break;
+        }
+        default: {
+            uint32_t l;
+            memcpy(&l, p, sizeof(l));
+            *len = l;
+        }
+    }
+    return p + key_len_size(node->flags);
+}
+
+// The embedded value slot of a T_STR node: [len][cap][bytes]\0 right after the key
+static uint8_t* hn_val_slot(HNode *node) {
+    size_t klen;
+    const char *key = hn_key(node, &klen);
+    return (uint8_t*)key + klen + 1;
+}
+
+static bool hn_key_eq(HNode *a, HNode *b) {
+    if (a->hcode != b->hcode) {
+        return false;
+    }
+    size_t alen, blen;
+    const char *abuf = hn_key(a, &alen);
+    const char *bbuf = hn_key(b, &blen);
+    return alen == blen && !memcmp(abuf, bbuf, alen);
+}
+
 // Returns the &P->next where P is the previous node before `node`
 static HNode** ht_lookup(HTab *htab, HNode *node) {
     if (!htab->tab) {
@@ -36,7 +91,7 @@ static HNode** ht_lookup(HTab *htab, HNode *node) {
     int count = 0;
     while (*slot) {
         HNode *curr = *slot;
-        if (curr->hcode == node->hcode && !strcmp(node->key->buf, curr->key->buf)) {
+        if (hn_key_eq(curr, node)) {
             return slot;
         }
         slot = &curr->next;
@@ -44,19 +99,8 @@ static HNode** ht_lookup(HTab *htab, HNode *node) {
     return NULL;
 }
 
-static void hn_unlink_sync(HNode* hnode) {
-    if (hnode->type == T_ZSET) {
-        zset_clear(hnode->zset);
-    }
-    if (hnode->type == T_HSET) {
-        hm_clear(&hnode->hmap);
-    }
-}
-
-static void hn_del_wrapper(void *arg) {
-    hn_unlink_sync((HNode*)arg);
-}
-
+// Only takes the node out of the chain, the caller owns it afterwards. Rehashing migrates nodes
+// with this too, so it must never touch the node's value
 static HNode* ht_unlink(HTab* htab, HNode **from) {
     HNode *to_delete = *from;
     if (!to_delete) {
@@ -64,23 +108,6 @@ static HNode* ht_unlink(HTab* htab, HNode **from) {
     }
     *from = to_delete->next;
     htab->size--;
-
-    size_t size = 0;
-    if (to_delete->type == T_ZSET) {
-        size = std::max(size, hm_size(&to_delete->zset->hmap));
-    }
-    if (to_delete->type == T_HSET) {
-        size = std::max(size, hm_size(&to_delete->hmap));
-    }
-
-    const size_t LARGE_SIZE_TRESHOLD = 1000;
-    if (size >= LARGE_SIZE_TRESHOLD) {
-        threadpool_produce(&global_data.threadpool, &hn_del_wrapper, to_delete);
-    }
-    else {
-        hn_unlink_sync(to_delete);
-    }
-
     return to_delete;
 }
 
@@ -110,14 +137,14 @@ static void hm_rehash_help(HMap *hmap) {
     }
 }
 
-static bool h_foreach(HTab *htab, std::vector<dstr*> &arg) {
+static bool h_foreach(HTab *htab, std::vector<HNode*> &arg) {
     for (size_t i = 0; i <= htab->mask; i++) {
         if (!htab->tab) {
             continue;
         }
         HNode *curr = htab->tab[i];
         while (curr) {
-            arg.push_back(curr->key);
+            arg.push_back(curr);
             curr = curr->next;
         }
     }
@@ -133,24 +160,125 @@ HNode* hm_lookup(HMap *hmap, HNode* key) {
     return slot ? *slot : NULL;
 }
 
-uint8_t hm_delete(HMap* hmap, HNode* key, bool do_free) {
+static HNode* ht_find_key(HTab *htab, uint64_t hcode, const char *key, size_t len) {
+    if (!htab->tab) {
+        return NULL;
+    }
+    for (HNode *curr = htab->tab[hcode & htab->mask]; curr; curr = curr->next) {
+        size_t clen;
+        const char *ckey = hn_key(curr, &clen);
+        if (curr->hcode == hcode && clen == len && !memcmp(ckey, key, len)) {
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+HNode* hm_find_key(HMap *hmap, const char *key, size_t len) {
+    uint64_t hcode = str_hash((uint8_t*)key, len);
+    HNode *node = ht_find_key(&hmap->older, hcode, key, len);
+    return node ? node : ht_find_key(&hmap->newer, hcode, key, len);
+}
+
+void hm_insert_key(HMap *hmap, HNode *node, const char *key, size_t len) {
+    node->key = dstr_init(len);
+    dstr_append(&node->key, key, len);
+    node->hcode = str_hash((uint8_t*)key, len);
+    hm_insert(hmap, node);
+}
+
+void hm_remove_key(HMap *hmap, HNode *node) {
+    hm_pop(hmap, node);
+    free(node->key);
+    node->key = NULL;
+}
+
+static HNode* ht_head(HTab *htab, uint64_t hcode) {
+    return htab->tab ? htab->tab[hcode & htab->mask] : NULL;
+}
+
+void hm_lookup_many(HMap *hmap, HNode **keys, size_t n, HNode **out) {
+    HNode *curr[LOOKUP_BATCH];
+    bool in_older[LOOKUP_BATCH];
+
+    for (size_t from = 0; from < n; from += LOOKUP_BATCH) {
+        size_t cnt = dmin(n - from, LOOKUP_BATCH);
+        HNode **batch = keys + from;
+
+        for (size_t i = 0; i < cnt; i++) {
+            if (hmap->older.tab) {
+                __builtin_prefetch(&hmap->older.tab[batch[i]->hcode & hmap->older.mask]);
+            }
+            if (hmap->newer.tab) {
+                __builtin_prefetch(&hmap->newer.tab[batch[i]->hcode & hmap->newer.mask]);
+            }
+        }
+        for (size_t i = 0; i < cnt; i++) {
+            in_older[i] = hmap->older.tab != NULL;
+            curr[i] = in_older[i] ? ht_head(&hmap->older, batch[i]->hcode) : ht_head(&hmap->newer, batch[i]->hcode);
+            if (curr[i]) {
+                __builtin_prefetch(curr[i]);
+            }
+            out[from + i] = NULL;
+        }
+
+        // Walk all chains one node per round, so the miss on the next node of one chain overlaps
+        // with the misses of the others. Same order as hm_lookup(): older table first
+        size_t active = cnt;
+        while (active) {
+            active = 0;
+            for (size_t i = 0; i < cnt; i++) {
+                HNode *node = curr[i];
+                if (!node) {
+                    if (!in_older[i]) {
+                        continue;
+                    }
+                    in_older[i] = false;
+                    node = curr[i] = ht_head(&hmap->newer, batch[i]->hcode);
+                    if (!node) {
+                        continue;
+                    }
+                    __builtin_prefetch(node);
+                    active++;
+                    continue;
+                }
+                if (hn_key_eq(node, batch[i])) {
+                    out[from + i] = node;
+                    curr[i] = NULL;
+                    in_older[i] = false;
+                    continue;
+                }
+                curr[i] = node->next;
+                if (node->next) {
+                    __builtin_prefetch(node->next);
+                }
+                active++;
+            }
+        }
+    }
+}
+
+HNode* hm_pop(HMap* hmap, HNode* key) {
     HNode **slot = ht_lookup(&hmap->older, key);
     if (slot) {
-        HNode *del = ht_unlink(&hmap->older, slot);
-        if (do_free) {
-            free(del);
-        }
-        return 1;
+        return ht_unlink(&hmap->older, slot);
     }
     slot = ht_lookup(&hmap->newer, key);
     if (slot) {
-        HNode *del = ht_unlink(&hmap->newer, slot);
-        if (do_free) {
-            free(del);
-        }
-        return 1;
+        return ht_unlink(&hmap->newer, slot);
     }
-    return 0;
+    return NULL;
+}
+
+uint8_t hm_delete(HMap* hmap, HNode* key, bool do_free) {
+    HNode *del = hm_pop(hmap, key);
+    if (!del) {
+        return 0;
+    }
+    if (do_free) {
+        hn_free(del);
+    }
+    return 1;
 }
 
 void hm_insert(HMap* hmap, HNode* node) {
@@ -174,22 +302,271 @@ void hm_clear(HMap* hmap) {
     *hmap = HMap{};
 }
 
+static void ht_destroy(HTab *htab) {
+    for (size_t i = 0; htab->tab && i <= htab->mask; i++) {
+        HNode *curr = htab->tab[i];
+        while (curr) {
+            HNode *next = curr->next;
+            hn_free(curr);
+            curr = next;
+        }
+    }
+}
+
+void hm_destroy(HMap* hmap) {
+    ht_destroy(&hmap->older);
+    ht_destroy(&hmap->newer);
+    hm_clear(hmap);
+}
+
 size_t hm_size(HMap* hmap) {
     return hmap->newer.size + hmap->older.size;
 }
 
-void hm_keys(HMap* hmap, std::vector<dstr*> &arg) {
+void hm_keys(HMap* hmap, std::vector<HNode*> &arg) {
     h_foreach(&hmap->newer, arg);
     h_foreach(&hmap->older, arg);
 }
 
-HNode* new_node(dstr *key, uint32_t type) {
-    HNode *node = (HNode*)malloc(sizeof(HNode));
+static size_t rev_bits(size_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// Sets every bit above mask and adds 1 in reversed order: moves to the next bucket of a table
+// with mask + 1 buckets, and skips the buckets of bigger tables that map to the ones already done
+static size_t scan_next(size_t cursor, size_t mask) {
+    cursor |= ~mask;
+    return rev_bits(rev_bits(cursor) + 1);
+}
+
+static void ht_scan_bucket(HTab *htab, size_t pos, void (*f)(HNode*, void*), void *arg) {
+    for (HNode *curr = htab->tab[pos & htab->mask]; curr; curr = curr->next) {
+        f(curr, arg);
+    }
+}
+
+size_t hm_scan(HMap *hmap, size_t cursor, void (*f)(HNode*, void*), void *arg) {
+    HTab *small = &hmap->newer;
+    HTab *big = &hmap->older;
+    if (!big->tab) {
+        if (!small->tab) {
+            return 0;
+        }
+        ht_scan_bucket(small, cursor, f, arg);
+        return scan_next(cursor, small->mask);
+    }
+    if (small->mask > big->mask) {
+        HTab *tmp = small;
+        small = big;
+        big = tmp;
+    }
+
+    // Bucket i of the small table holds what the big table keeps in every bucket that ends in the
+    // bits of i, so visit all of those before moving on
+    ht_scan_bucket(small, cursor, f, arg);
+    do {
+        ht_scan_bucket(big, cursor, f, arg);
+        cursor = scan_next(cursor, big->mask);
+    } while (cursor & (small->mask ^ big->mask));
+    return cursor;
+}
+
+// Small integers are formatted once, GET on a counter then copies the reply straight from here
+struct SharedInts {
+    char str[SHARED_INTS][5];
+    uint8_t len[SHARED_INTS];
+
+    SharedInts() {
+        for (uint32_t i = 0; i < SHARED_INTS; i++) {
+            len[i] = snprintf(str[i], sizeof(str[i]), "%u", i);
+        }
+    }
+};
+static const SharedInts shared_ints;
+
+SharedBuf* shared_buf_alloc(size_t len) {
+    SharedBuf *buf = (SharedBuf*)malloc(sizeof(SharedBuf) + len);
+    new (&buf->refs) std::atomic<uint32_t>(1);
+    buf->len = len;
+    return buf;
+}
+
+void shared_buf_release(SharedBuf *buf) {
+    if (buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        free(buf);
+    }
+}
+
+static SharedBuf* val_buf(HNode *node) {
+    return (SharedBuf*)((uint8_t*)node->val - offsetof(SharedBuf, data));
+}
+
+static void drop_val(HNode *node) {
+    if (node->flags & HN_VAL_SHARED) {
+        shared_buf_release(val_buf(node));
+    }
+    else {
+        free(node->val);
+    }
+    node->val = NULL;
+    node->flags &= ~HN_VAL_SHARED;
+}
+
+static void set_shared_val(HNode *node, const char *buf, size_t len) {
+    bool in_place = (node->flags & HN_VAL_SHARED) && val_buf(node)->refs.load(std::memory_order_acquire) == 1 && len <= dstr_cap(node->val);
+    if (!in_place) {
+        drop_val(node);
+        SharedBuf *shared = shared_buf_alloc(offsetof(dstr, buf) + len + 1);
+        node->val = (dstr*)shared->data;
+        node->val->size = 0;
+        node->val->free = len;
+        node->flags |= HN_VAL_SHARED;
+    }
+
+    dstr *val = node->val;
+    val->free = dstr_cap(val) - len;
+    val->size = len;
+    memcpy(val->buf, buf, len);
+    val->buf[len] = '\0';
+    val_buf(node)->len = offsetof(dstr, buf) + len; // the terminator isn't sent
+}
+
+void hn_set_str(HNode *node, const char *buf, size_t len) {
+    int64_t ival;
+    if (str_to_int64(buf, len, &ival)) {
+        hn_set_int(node, ival);
+        return;
+    }
+
+    uint8_t *slot = hn_val_slot(node);
+    if ((node->flags & HN_VAL_ROOM) && len <= slot[1]) {
+        drop_val(node);
+        slot[0] = len;
+        memcpy(slot + 2, buf, len);
+        slot[2 + len] = '\0';
+        node->flags |= HN_VAL_EMBED;
+        return;
+    }
+    node->flags &= ~HN_VAL_EMBED;
+    if (len >= HN_SHARED_VAL_MIN) {
+        set_shared_val(node, buf, len);
+        return;
+    }
+    if (node->flags & HN_VAL_SHARED) {
+        drop_val(node);
+    }
+    if (!node->val) {
+        node->val = dstr_init(len);
+    }
+    dstr_assign(&node->val, buf, len);
+}
+
+void hn_set_int(HNode *node, int64_t ival) {
+    drop_val(node);
+    node->flags &= ~HN_VAL_EMBED;
+    node->ival = ival;
+}
+
+bool hn_is_int(HNode *node) {
+    return !node->val && !(node->flags & HN_VAL_EMBED);
+}
+
+SharedBuf* hn_shared_val(HNode *node) {
+    return node->flags & HN_VAL_SHARED ? val_buf(node) : NULL;
+}
+
+const char* hn_str(HNode *node, char *buf, size_t *len) {
+    if (node->val) {
+        *len = node->val->size;
+        return node->val->buf;
+    }
+    if (node->flags & HN_VAL_EMBED) {
+        uint8_t *slot = hn_val_slot(node);
+        *len = slot[0];
+        return (char*)slot + 2;
+    }
+    if (node->ival >= 0 && node->ival < SHARED_INTS) {
+        *len = shared_ints.len[node->ival];
+        return shared_ints.str[node->ival];
+    }
+    *len = snprintf(buf, HN_INT_BUF, "%lld", (long long)node->ival);
+    return buf;
+}
+
+// One allocation for the node, its key and val_cap bytes of embedded value (no slot if 0)
+static HNode* hn_alloc(dstr *key, uint32_t type, size_t val_cap) {
+    uint8_t flags = key->size <= UINT8_MAX ? HN_KEY_LEN8 : key->size <= UINT16_MAX ? HN_KEY_LEN16 : HN_KEY_LEN32;
+    size_t embed = key_len_size(flags) + key->size + 1;
+    size_t base = type == T_STR ? offsetof(HNode, list) : sizeof(HNode);
+    if (val_cap) {
+        // Round up to what malloc hands out anyway, the slack lets the value grow in place
+        size_t size = (base + embed + 2 + val_cap + 1 + 15) & ~(size_t)15;
+        val_cap = dmin(size - base - embed - 3, (size_t)HN_EMBED_VAL_MAX);
+        embed += 2 + val_cap + 1;
+        flags |= HN_VAL_ROOM;
+    }
+
+    HNode *node = (HNode*)malloc(base + embed);
     node->next = NULL;
-    node->key = dstr_init(key->size);
-    dstr_append(&node->key, key->buf, key->size);
     node->hcode = str_hash((uint8_t*)key->buf, key->size);
+    node->key = NULL;
+    node->heap_idx = -1;
     node->type = type;
+    node->flags = flags;
+    node->val = NULL;
+    node->ival = 0;
+    if (type != T_STR) {
+        // Empty collections, new_node() sets up the one of the type
+        node->list = DList();
+        node->hmap = HMap();
+        node->set = HMap();
+        node->zset = NULL;
+        node->bitmap = NULL;
+        node->roaring = NULL;
+        node->hll = NULL;
+        node->stream = NULL;
+    }
+
+    char *p = hn_embed(node);
+    uint8_t len8 = key->size;
+    uint16_t len16 = key->size;
+    uint32_t len32 = key->size;
+    switch (flags & HN_KEY_LEN_MASK) {
+        case HN_KEY_LEN8:
+            memcpy(p, &len8, sizeof(len8));
+            break;
+        case HN_KEY_LEN16:
+            memcpy(p, &len16, sizeof(len16));
+            break;
+        default:
+            memcpy(p, &len32, sizeof(len32));
+    }
+    p += key_len_size(flags);
+    memcpy(p, key->buf, key->size);
+    p[key->size] = '\0';
+    if (val_cap) {
+        uint8_t *slot = (uint8_t*)p + key->size + 1;
+        slot[0] = 0;
+        slot[1] = val_cap;
+        slot[2] = '\0';
+    }
+    return node;
+}
+
+HNode* new_str_node(dstr *key, const char *buf, size_t len) {
+    // Counters don't get a slot, they are unlikely to ever hold anything else
+    int64_t ival;
+    bool embed = len <= HN_EMBED_VAL_MAX && !str_to_int64(buf, len, &ival);
+    HNode *node = hn_alloc(key, T_STR, embed ? dmax(len, (size_t)1) : 0);
+    hn_set_str(node, buf, len);
+    return node;
+}
+
+HNode* new_node(dstr *key, uint32_t type) {
+    HNode *node = hn_alloc(key, type, 0);
     if (type == T_STR) {
         node->val = dstr_init(0);
     }
@@ -236,9 +613,50 @@ HNode* new_node(dstr *key, uint32_t type) {
     }
     if (type == T_BITMAP) {
         node->bitmap = dstr_init(0);
+        node->roaring = NULL;
     }
     if (type == T_HLL) {
+        node->hll = NULL;
         hll_init(&node->hll);
     }
+    if (type == T_STREAM) {
+        node->stream = stream_new();
+    }
     return node;
 }
+
+void hn_free(HNode *node) {
+    if (node->type == T_STR) {
+        drop_val(node);
+    }
+    if (node->type == T_ZSET) {
+        zset_clear(node->zset);
+        free(node->zset);
+    }
+    if (node->type == T_HSET) {
+        hm_destroy(&node->hmap);
+    }
+    if (node->type == T_LIST) {
+        DListNode *curr = node->list.head;
+        for (uint32_t i = 0; curr && i < node->list.size; i++) {
+            DListNode *next = curr->next;
+            free(curr->val);
+            free(curr);
+            curr = next;
+        }
+    }
+    if (node->type == T_SET) {
+        hm_destroy(&node->set);
+    }
+    if (node->type == T_BITMAP) {
+        free(node->bitmap);
+        roaring_free(node->roaring);
+    }
+    if (node->type == T_HLL) {
+        free(node->hll);
+    }
+    if (node->type == T_STREAM) {
+        stream_free(node->stream);
+    }
+    free(node);
+}
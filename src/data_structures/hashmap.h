@@ -1,14 +1,29 @@
 #ifndef HASHMAP_H
 #define HASHMAP_H
 
+#include <atomic>
 #include <stddef.h>
 #include <stdint.h>
 #include <vector>
 #include "dlist.h"
 #include "dstr.h"
+#include "utils/common.h"
 
 struct HNode;
 struct ZSet;
+struct Roaring;
+struct Stream;
+
+// Refcounted bytes, freed by the last reference: reply frames written to several connections, and long
+// T_STR values that replies send in place instead of copying them (hn_shared_val())
+struct SharedBuf {
+    std::atomic<uint32_t> refs; // a value's last reference may be dropped on the lazyfree thread
+    uint32_t len;
+    uint8_t data[];
+};
+
+SharedBuf* shared_buf_alloc(size_t len); // one reference, for the caller
+void shared_buf_release(SharedBuf *buf);
 
 struct HTab {
     HNode **tab = NULL;
@@ -25,27 +40,92 @@ struct HMap {
 struct HNode {
     HNode *next = NULL;
     uint64_t hcode = 0; // hash value
-    dstr *key = NULL;
-    uint32_t type = 100;
+    dstr *key = NULL; // only set on lookup keys and ZNode::h_node, stored nodes embed theirs (hn_key())
     size_t heap_idx = -1;
+    uint32_t type = 100;
+    uint8_t flags = 0; // HN_* bits
+
+    // T_STR value. val is NULL while the value is an integer or embedded, and lives in a SharedBuf
+    // with HN_VAL_SHARED, see hn_set_str()
+    dstr *val = NULL;
+    int64_t ival = 0;
 
-    // Possible values
+    // Value of the other types. T_STR nodes are allocated only up to here and keep their embedded
+    // strings in place of these fields, the other types have them after the struct
     DList list;
     HMap hmap;
     HMap set;
     ZSet *zset = NULL;
-    dstr *val = NULL;
     dstr *bitmap = NULL;
+    Roaring *roaring = NULL; // set instead of bitmap for sparse bitmaps
     dstr *hll = NULL;
+    Stream *stream = NULL;
+};
+
+// The key, and for T_STR nodes a short value, are stored in the node's own allocation:
+//   [key len][key bytes]\0[val len][val cap][val bytes]\0
+// The key length takes 1, 2 or 4 bytes (whatever fits, like the sds header types). Embedded values
+// are at most HN_EMBED_VAL_MAX long, so both of their fields are single bytes
+enum HNodeFlags {
+    HN_KEY_LEN8 = 0,
+    HN_KEY_LEN16 = 1,
+    HN_KEY_LEN32 = 2,
+    HN_KEY_LEN_MASK = 3,
+    HN_VAL_ROOM = 1 << 2, // the node has an embedded value slot
+    HN_VAL_EMBED = 1 << 3, // and the value currently lives in it
+    HN_VAL_SHARED = 1 << 4, // val is the data of a SharedBuf
 };
 
+#define HN_EMBED_VAL_MAX 64 // longer values get their own dstr
+#define HN_SHARED_VAL_MIN (16 << 10) // and from this long it's in a SharedBuf
+#define SHARED_INTS 10000 // 0..SHARED_INTS-1 are pre-formatted for hn_str()
+#define HN_INT_BUF 21 // fits any int64 with its sign and the terminator
 
 HNode* new_node(dstr *key, uint32_t type);
+HNode* new_str_node(dstr *key, const char *buf, size_t len); // T_STR node holding buf
+
+// Value of a T_STR key. Canonical 64-bit integers are stored unboxed in ival, so counters take no
+// dstr allocation. Other values go to the node's embedded slot if they fit in it, to val otherwise.
+// A long val is written in place only while no reply references it, else it gets a new buffer
+void hn_set_str(HNode *node, const char *buf, size_t len);
+void hn_set_int(HNode *node, int64_t ival);
+// The value's bytes, formatted into buf (HN_INT_BUF bytes) if it's an integer that isn't shared
+const char* hn_str(HNode *node, char *buf, size_t *len);
+bool hn_is_int(HNode *node); // the T_STR value is stored as an integer
+// The buffer of a value of at least HN_SHARED_VAL_MIN bytes, NULL for shorter ones. Its bytes start
+// at offsetof(dstr, buf) and end at len, a reply that takes a reference sends them without a copy
+SharedBuf* hn_shared_val(HNode *node);
+const char* hn_key(HNode *node, size_t *len);
+void hn_free(HNode *node); // frees the node with its key and value
 HNode* hm_lookup(HMap *hmap, HNode *key);
+// out[i] = hm_lookup(hmap, keys[i]). The buckets and first nodes of a whole batch are prefetched
+// before any of them is probed, so the cache misses of different keys overlap
+void hm_lookup_many(HMap *hmap, HNode **keys, size_t n, HNode **out);
 void hm_insert(HMap *hmap, HNode *node);
+HNode* hm_pop(HMap *hmap, HNode *key); // unlinks and returns the node, NULL if the key is missing
 uint8_t hm_delete(HMap *hmap, HNode *key, bool do_free);
-void hm_clear(HMap *hmap);
+void hm_clear(HMap *hmap); // frees the tables only
+void hm_destroy(HMap *hmap); // frees the tables and every node in them
 size_t hm_size(HMap *hmap);
-void hm_keys(HMap* hmap, std::vector<dstr*> &arg);
+void hm_keys(HMap* hmap, std::vector<HNode*> &arg); // read the keys with hn_key()
+
+// Entries of the server's bookkeeping maps (watched keys, pub/sub topics, blocked and tracked keys)
+// embed an HNode `node` whose node.key is the map's own copy of the key
+HNode* hm_find_key(HMap *hmap, const char *key, size_t len); // without building a lookup key
+void hm_insert_key(HMap *hmap, HNode *node, const char *key, size_t len); // copies the key into node.key
+void hm_remove_key(HMap *hmap, HNode *node); // unlinks node and frees its copy of the key
+
+// The entry of type T for key, NULL if there is none
+template <typename T>
+T* hm_find_entry(HMap *hmap, const char *key, size_t len) {
+    HNode *node = hm_find_key(hmap, key, len);
+    return node ? container_of(node, T, node) : NULL;
+}
+
+// Calls f for every node in the buckets `cursor` points to (in both tables while rehashing) and returns
+// the next cursor, 0 once the whole map was visited. The cursor is incremented from the high bit down,
+// so every node that stays in the map is visited at least once even if the tables grow between calls.
+// f must not change the map
+size_t hm_scan(HMap *hmap, size_t cursor, void (*f)(HNode *node, void *arg), void *arg);
 
 #endif
@@ -44,7 +44,7 @@ void heap_down(std::vector<HeapNode> &heap, size_t pos) {
 
         size_t next_pos = left_ch;
         if (right_ch < heap.size() && heap[right_ch].val < heap[left_ch].val) {
-            next_pos = left_ch;
+            next_pos = right_ch;
         }
 
         heap[pos] = heap[next_pos];
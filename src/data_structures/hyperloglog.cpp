@@ -1,13 +1,23 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <algorithm>
+#include <vector>
 #include "hyperloglog.h"
 #include "dstr.h"
 #include "utils/common.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HLL_X86 1
+#endif
+
+typedef void (*decode_fn)(const uint8_t *src, uint8_t *regs);
+typedef void (*max_fn)(uint8_t *dest, const uint8_t *src, size_t len);
+typedef double (*sum_fn)(const uint8_t *regs, uint32_t *zero_regs);
+
 // === GENERAL HELPER FUNCTIONS ===
 static uint8_t get_enc(dstr *hll) {
     return hll->buf[4];
@@ -81,14 +91,14 @@ static inline uint8_t get_reg(dstr *hll, uint32_t reg_no) {
     uint32_t b0 = 6 * reg_no / 8 + HLL_HEADER_SIZE_BYTES;
     uint8_t fb = 6 * reg_no % 8; // first bit idx in the byte (lsb = 0)
     
-    uint32_t buf0 = hll->buf[b0];
-    uint32_t buf1 = hll->buf[b0 + 1]; // wont overflow because there is '\0' at hll->size
+    uint32_t buf0 = (uint8_t)hll->buf[b0];
+    uint32_t buf1 = (uint8_t)hll->buf[b0 + 1]; // wont overflow because there is '\0' at hll->size
 
-    // Get the register at the 6 lsb + garbage at 2 msb
+    // Get the register at the 6 lsb + garbage above them
     uint32_t reg = (buf0 >> fb) | (buf1 << (8 - fb));
     
-    // Clamp the output to uint8_t 
-    return reg & UINT8_MAX;
+    // Clamp the output to the 6 register bits
+    return reg & 63;
 } 
 
 static inline void set_reg(dstr *hll, uint32_t reg_no, uint32_t value) {
@@ -121,43 +131,6 @@ static uint8_t add_dense(dstr **phll, uint32_t reg_no, uint8_t val) {
     return 0; 
 }
 
-static uint32_t cnt_zero_regs(dstr *hll) {
-    uint32_t zero_reg_cnt = 0;
-
-    if (get_enc(hll) == HLL_DENSE) {
-        for (int reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
-            uint8_t reg = get_reg(hll, reg_no);
-            if (!reg) {
-                zero_reg_cnt++;
-            }
-        }
-    }
-    else {
-        for (int fn = HLL_HEADER_SIZE_BYTES; fn < hll->size; fn++) {
-            uint8_t flag = hll->buf[fn];
-            if (iszero(flag)) {
-                zero_reg_cnt += zero_cnt(flag);
-            }
-            else if (!is_val(flag)) {
-                zero_reg_cnt += xzero_cnt(flag, hll->buf[++fn]);
-            }
-        }
-    }
-
-    return zero_reg_cnt;
-}
-
-static long double estimate_cnt_d(dstr *hll) {
-    long double sum = 0.0l;
-    for (int reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
-        uint8_t curr_reg = get_reg(hll, reg_no);
-        sum += 1.0l / (1ull << curr_reg);
-    }
-    
-    long double pref = BIAS_CORRECTION * REGISTER_CNT * REGISTER_CNT;
-    return pref * (1.0l / sum);
-}
-
 static void dense_init(dstr **target) {
     dstr *hll = dstr_init(HLL_HEADER_SIZE_BYTES + HLL_DENSE_SIZE_BYTES);
     
@@ -166,7 +139,7 @@ static void dense_init(dstr **target) {
 
     // Create the header
     memcpy(hll->buf, "HYLL", 4);
-    hll->buf[4] = HLL_DENSE;
+    set_enc(hll, HLL_DENSE);
     hll->buf[15] |= (1u << 7); // set the msb so the cached cardinality is invalid
     
     // This is not a typical string so the size is set and there are no free characters
@@ -177,6 +150,9 @@ static void dense_init(dstr **target) {
     *target = hll;
 }
 
+static void regs_decode(dstr *hll, uint8_t *regs);
+static void encode_regs(uint8_t *dest, const uint8_t *regs);
+
 static void densify(dstr **phll) {
     dstr *hll = *phll;
     if (get_enc(hll) == HLL_DENSE) {
@@ -185,36 +161,192 @@ static void densify(dstr **phll) {
     
     dstr *dhll = NULL;
     dense_init(&dhll);
-    
-    uint32_t reg_no = 0;
-    for (int flag_no = HLL_HEADER_SIZE_BYTES; flag_no < hll->size; flag_no++) {
-        uint32_t flag = hll->buf[flag_no];
-        uint32_t cnt = 0;
 
-        if (is_val(flag)) { 
-            uint8_t val = val_value(flag);
-            cnt = val_cnt(flag);
-            while (cnt--) {
-                set_reg(dhll, reg_no, val);
-                reg_no++;
-            }
+    // Expand the sparse flags to one byte per register and pack them
+    uint8_t regs[REGISTER_CNT];
+    regs_decode(hll, regs);
+    encode_regs((uint8_t*)dhll->buf + HLL_HEADER_SIZE_BYTES, regs);
+
+    free(*phll);
+    *phll = dhll;
+}
+
+// === REGISTER BLOCK KERNELS ===
+// Dense registers are packed lsb first, so every 3 bytes hold 4 registers:
+// v = b0 | b1 << 8 | b2 << 16 and register j = (v >> 6j) & 63.
+// The kernels below work on all registers unpacked to one byte each
+static void decode_scalar_n(const uint8_t *src, uint8_t *regs, uint32_t n) {
+    for (uint32_t i = 0; i < n; i += 4, src += 3) {
+        uint32_t v = src[0] | (src[1] << 8) | (src[2] << 16);
+        regs[i] = v & 63;
+        regs[i + 1] = (v >> 6) & 63;
+        regs[i + 2] = (v >> 12) & 63;
+        regs[i + 3] = (v >> 18) & 63;
+    }
+}
+
+static void decode_scalar(const uint8_t *src, uint8_t *regs) {
+    decode_scalar_n(src, regs, REGISTER_CNT);
+}
+
+static void max_scalar(uint8_t *dest, const uint8_t *src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        dest[i] = dmax(dest[i], src[i]);
+    }
+}
+
+static void encode_regs(uint8_t *dest, const uint8_t *regs) {
+    for (uint32_t i = 0; i < REGISTER_CNT; i += 4, dest += 3) {
+        uint32_t v = regs[i] | (regs[i + 1] << 6) | (regs[i + 2] << 12) | (regs[i + 3] << 18);
+        dest[0] = v & 255;
+        dest[1] = (v >> 8) & 255;
+        dest[2] = (v >> 16) & 255;
+    }
+}
+
+// 2^-k for every register value
+static const double pow2_neg[64] = {
+    0x1p-0,  0x1p-1,  0x1p-2,  0x1p-3,  0x1p-4,  0x1p-5,  0x1p-6,  0x1p-7,  0x1p-8,  0x1p-9,  0x1p-10,
+    0x1p-11, 0x1p-12, 0x1p-13, 0x1p-14, 0x1p-15, 0x1p-16, 0x1p-17, 0x1p-18, 0x1p-19, 0x1p-20, 0x1p-21,
+    0x1p-22, 0x1p-23, 0x1p-24, 0x1p-25, 0x1p-26, 0x1p-27, 0x1p-28, 0x1p-29, 0x1p-30, 0x1p-31, 0x1p-32,
+    0x1p-33, 0x1p-34, 0x1p-35, 0x1p-36, 0x1p-37, 0x1p-38, 0x1p-39, 0x1p-40, 0x1p-41, 0x1p-42, 0x1p-43,
+    0x1p-44, 0x1p-45, 0x1p-46, 0x1p-47, 0x1p-48, 0x1p-49, 0x1p-50, 0x1p-51, 0x1p-52, 0x1p-53, 0x1p-54,
+    0x1p-55, 0x1p-56, 0x1p-57, 0x1p-58, 0x1p-59, 0x1p-60, 0x1p-61, 0x1p-62, 0x1p-63,
+};
+
+// Harmonic sum of 2^-reg over all registers, also counts the zero registers
+static double sum_scalar(const uint8_t *regs, uint32_t *zero_regs) {
+    double sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    uint32_t zeros = 0;
+    for (uint32_t i = 0; i < REGISTER_CNT; i += 4) {
+        sum0 += pow2_neg[regs[i]];
+        sum1 += pow2_neg[regs[i + 1]];
+        sum2 += pow2_neg[regs[i + 2]];
+        sum3 += pow2_neg[regs[i + 3]];
+        zeros += !regs[i] + !regs[i + 1] + !regs[i + 2] + !regs[i + 3];
+    }
+    *zero_regs = zeros;
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+#ifdef HLL_X86
+__attribute__((target("avx2"))) static void decode_avx2(const uint8_t *src, uint8_t *regs) {
+    // Every 128 bit lane gets 12 bytes (16 registers), bytes 3k..3k+2 are spread into dword k
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                          0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i m0 = _mm256_set1_epi32(0x3f);
+    const __m256i m1 = _mm256_set1_epi32(0x3f00);
+    const __m256i m2 = _mm256_set1_epi32(0x3f0000);
+    const __m256i m3 = _mm256_set1_epi32(0x3f000000);
+
+    // The last block is left to the scalar loop, the 16 byte load of its upper half would read past the registers
+    uint32_t i = 0;
+    for (; i + 32 < REGISTER_CNT; i += 32, src += 24) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)src);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(src + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        v = _mm256_shuffle_epi8(v, shuf);
+
+        // Move register j of each dword to byte j
+        __m256i r01 = _mm256_or_si256(_mm256_and_si256(v, m0), _mm256_and_si256(_mm256_slli_epi32(v, 2), m1));
+        __m256i r23 = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi32(v, 4), m2),
+                                      _mm256_and_si256(_mm256_slli_epi32(v, 6), m3));
+        _mm256_storeu_si256((__m256i *)(regs + i), _mm256_or_si256(r01, r23));
+    }
+    decode_scalar_n(src, regs + i, REGISTER_CNT - i);
+}
+
+__attribute__((target("avx2"))) static void max_avx2(uint8_t *dest, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_max_epu8(a, b));
+    }
+    max_scalar(dest + i, src + i, len - i);
+}
+
+__attribute__((target("avx2,popcnt"))) static double sum_avx2(const uint8_t *regs, uint32_t *zero_regs) {
+    // Instead of a table lookup (a gather), 2^-k is built directly as a double with exponent 1023 - k
+    const __m256i bias = _mm256_set1_epi64x(1023);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256d acc[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+    uint32_t zeros = 0;
+
+    for (uint32_t i = 0; i < REGISTER_CNT; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(regs + i));
+        zeros += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero)));
+
+        for (uint32_t j = 0; j < 32; j += 4) {
+            int32_t four;
+            memcpy(&four, regs + i + j, 4);
+            __m256i k = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four));
+            __m256i bits = _mm256_slli_epi64(_mm256_sub_epi64(bias, k), 52);
+            acc[j / 4 % 4] = _mm256_add_pd(acc[j / 4 % 4], _mm256_castsi256_pd(bits));
         }
-        else if (is_zero(flag)) {
-            cnt = zero_cnt(flag);
+    }
+
+    __m256d total = _mm256_add_pd(_mm256_add_pd(acc[0], acc[1]), _mm256_add_pd(acc[2], acc[3]));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, total);
+    *zero_regs = zeros;
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+#endif
+
+// === DISPATCH ===
+static decode_fn resolve_decode() {
+#ifdef HLL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &decode_avx2;
+    }
+#endif
+    return &decode_scalar;
+}
+
+static max_fn resolve_max() {
+#ifdef HLL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &max_avx2;
+    }
+#endif
+    return &max_scalar;
+}
+
+static sum_fn resolve_sum() {
+#ifdef HLL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return &sum_avx2;
+    }
+#endif
+    return &sum_scalar;
+}
+
+static const decode_fn decode_impl = resolve_decode();
+static const max_fn max_impl = resolve_max();
+static const sum_fn sum_impl = resolve_sum();
+
+// === SPARSE HELPER FUNCTIONS ===
+static uint32_t cnt_zero_regs_s(dstr *hll) {
+    uint32_t zero_reg_cnt = 0;
+    for (size_t fn = HLL_HEADER_SIZE_BYTES; fn < hll->size; fn++) {
+        uint8_t flag = hll->buf[fn];
+        if (is_zero(flag)) {
+            zero_reg_cnt += zero_cnt(flag);
         }
-        else { // XZERO
-            cnt = xzero_cnt(flag, hll->buf[++flag_no]);
+        else if (!is_val(flag)) {
+            zero_reg_cnt += xzero_cnt(flag, hll->buf[++fn]);
         }
-        reg_no += cnt;
     }
-    free(*phll);
-    *phll = dhll;
+    return zero_reg_cnt;
 }
 
-// === SPARSE HELPER FUNCTIONS ===
 static long double estimate_cnt_s(dstr *hll) {
     long double sum = 0.0l;
-    for (int flag_no = HLL_HEADER_SIZE_BYTES; flag_no < hll->size; flag_no++) {
+    for (size_t flag_no = HLL_HEADER_SIZE_BYTES; flag_no < hll->size; flag_no++) {
         long double val = 1.0l;
         uint32_t flag = hll->buf[flag_no];
         uint32_t cnt = 0;
@@ -266,7 +398,7 @@ static uint8_t add_sparse(dstr **phll, uint32_t reg_no, uint8_t val) {
     uint8_t ixzero = 0;
     uint8_t *hll_end = (uint8_t*)hll->buf + hll->size;
 
-    for (int fn = HLL_HEADER_SIZE_BYTES; fn < hll->size; fn++) {
+    for (size_t fn = HLL_HEADER_SIZE_BYTES; fn < hll->size; fn++) {
         uint8_t flag = hll->buf[fn];
         curr = (uint8_t*)&hll->buf[fn];
         start = idx;
@@ -295,7 +427,7 @@ static uint8_t add_sparse(dstr **phll, uint32_t reg_no, uint8_t val) {
     }
 
     // Nothing changes - register at reg_no has a larger or equal value to val
-    if (ival && val_value(*curr) >= val) {
+    if (ival && val_value(*curr) > val) { // val was decremented above
         return 0;
     }
     
@@ -309,7 +441,7 @@ static uint8_t add_sparse(dstr **phll, uint32_t reg_no, uint8_t val) {
 
     // Replace the ZERO flag with count 1 with VAL flag with count 1
     if (izero && zero_cnt(*curr) == 1) {
-        *curr = (1u << 7) | (val << 2) | 1;
+        *curr = (1u << 7) | (val << 2); // count 1 is stored as 0
         invalidate_cache(hll);
         return 1;
     }
@@ -329,7 +461,7 @@ static uint8_t add_sparse(dstr **phll, uint32_t reg_no, uint8_t val) {
     uint8_t tmp[5] = {0, 0, 0, 0, 0};
     uint8_t *tp = tmp;
     if (ival) {
-        uint8_t pval = val_value(*curr);
+        uint8_t pval = val_value(*curr) - 1; // stored minus 1, like val
 
         // Split the PVAL (previous VAL)
         if (start != reg_no) {
@@ -351,7 +483,7 @@ static uint8_t add_sparse(dstr **phll, uint32_t reg_no, uint8_t val) {
         if (reg_no != start) {
             uint32_t count = reg_no - start - 1;
 
-            if (count > 64) { // set XZERO
+            if (count >= 64) { // set XZERO, a ZERO flag holds at most 64 (stored as 63)
                 *tp++ |= (1u << 6) | (count >> 8);
                 *tp++ |= count & 255;
             }
@@ -367,7 +499,7 @@ static uint8_t add_sparse(dstr **phll, uint32_t reg_no, uint8_t val) {
         if (reg_no != end) {
             uint32_t count = end - reg_no - 1;
 
-            if (count > 64) { // set XZERO
+            if (count >= 64) { // set XZERO, a ZERO flag holds at most 64 (stored as 63)
                 *tp++ |= (1u << 6) | (count >> 8);
                 *tp++ |= count & 255;
             }
@@ -413,7 +545,7 @@ static uint8_t add_sparse(dstr **phll, uint32_t reg_no, uint8_t val) {
                 if (len <= 4) {
                     p++;
                     *p &= 0;
-                    *p = (1u << 7) | (v1 << 2) | len;
+                    *p = (1u << 7) | ((v1 - 1) << 2) | (len - 1); // both are stored minus 1
                     p--;
 
                     memmove(p, p+1, hll_end - p);
@@ -437,7 +569,7 @@ void hll_init(dstr **hll_p) { // assumes hll not initialized (hll == NULL)
 
     // Create the header
     memcpy(hll->buf, "HYLL", 4);
-    hll->buf[4] = HLL_SPARSE;
+    set_enc(hll, HLL_SPARSE);
     hll->buf[15] |= (1u << 7); // set the msb so the cached cardinality is invalid
     
     // Set all registers to zero (XZERO FLAG)
@@ -453,12 +585,59 @@ void hll_init(dstr **hll_p) { // assumes hll not initialized (hll == NULL)
     *hll_p = hll;
 }
 
-// Helper for choosing the estimate helper function
-static long double estimate_cnt(dstr *hll) {
+// Small range correction and rounding of the raw estimate
+static uint64_t correct_estimate(long double estimate, uint32_t zero_regs) {
+    if (estimate <= 2.5l * REGISTER_CNT && zero_regs) {
+        estimate = logl((long double)REGISTER_CNT / zero_regs) * REGISTER_CNT;
+    }
+    return estimate + 0.5l; // 0.5l for rounding when casted to int
+}
+
+// Unpacks every register of a dense or sparse hll into one byte
+static void regs_decode(dstr *hll, uint8_t *regs) {
     if (get_enc(hll) == HLL_DENSE) {
-        return estimate_cnt_d(hll);
+        decode_impl((uint8_t*)hll->buf + HLL_HEADER_SIZE_BYTES, regs);
+        return;
+    }
+
+    uint32_t reg_no = 0;
+    for (size_t fn = HLL_HEADER_SIZE_BYTES; fn < hll->size && reg_no < REGISTER_CNT; fn++) {
+        uint8_t flag = hll->buf[fn];
+        uint8_t val = 0;
+        uint32_t cnt = 0;
+        if (is_val(flag)) {
+            val = val_value(flag);
+            cnt = val_cnt(flag);
+        }
+        else if (is_zero(flag)) {
+            cnt = zero_cnt(flag);
+        }
+        else { // XZERO
+            cnt = xzero_cnt(flag, hll->buf[++fn]);
+        }
+        cnt = dmin(cnt, REGISTER_CNT - reg_no);
+        memset(regs + reg_no, val, cnt);
+        reg_no += cnt;
+    }
+    memset(regs + reg_no, 0, REGISTER_CNT - reg_no);
+}
+
+static uint64_t regs_count(const uint8_t *regs) {
+    uint32_t zero_regs = 0;
+    long double sum = sum_impl(regs, &zero_regs);
+
+    long double pref = BIAS_CORRECTION * REGISTER_CNT * REGISTER_CNT;
+    return correct_estimate(pref * (1.0l / sum), zero_regs);
+}
+
+// Element-wise max of all registers of hlls[0..n) into regs
+static void regs_union(dstr **hlls, size_t n, uint8_t *regs) {
+    uint8_t tmp[REGISTER_CNT];
+    regs_decode(hlls[0], regs);
+    for (size_t i = 1; i < n; i++) {
+        regs_decode(hlls[i], tmp);
+        max_impl(regs, tmp, REGISTER_CNT);
     }
-    return estimate_cnt_s(hll);
 }
 
 uint64_t hll_count(dstr *hll) {
@@ -467,58 +646,112 @@ uint64_t hll_count(dstr *hll) {
         return get_cache(hll);
     }
 
-    long double estimate = estimate_cnt(hll);
+    uint64_t res = 0;
+    if (get_enc(hll) == HLL_DENSE) {
+        uint8_t regs[REGISTER_CNT];
+        decode_impl((uint8_t*)hll->buf + HLL_HEADER_SIZE_BYTES, regs);
+        res = regs_count(regs);
+    }
+    else {
+        // small range correction
+        long double estimate = estimate_cnt_s(hll);
+        uint32_t zero_regs = estimate <= 2.5l * REGISTER_CNT ? cnt_zero_regs_s(hll) : 0;
+        res = correct_estimate(estimate, zero_regs);
+    }
 
-    // small range correction
-    if (estimate <= 2.5l * REGISTER_CNT) {
-        uint32_t zero_regs = cnt_zero_regs(hll);
+    set_cache(hll, res);
+    return res;
+}
 
-        if (zero_regs) {
-            estimate = logl((long double)REGISTER_CNT / zero_regs) * REGISTER_CNT;
-        }
+uint64_t hll_count_union(dstr **hlls, size_t n) {
+    if (n == 1) {
+        return hll_count(hlls[0]);
     }
-    estimate += 0.5l; // 0.5l for rounding when casted to int
 
-    set_cache(hll, (uint64_t)estimate);
-    return estimate;
+    uint8_t regs[REGISTER_CNT];
+    regs_union(hlls, n, regs);
+    return regs_count(regs);
 }
 
-uint8_t hll_add(dstr **phll, dstr *val) {
-    dstr *hll = *phll;
+// Register number and rank (leading zeroes + 1 of the remaining hash bits) of an element
+static inline void hash_elem(dstr *val, uint32_t *reg_no, uint8_t *rank) {
     uint64_t hash = str_hash((uint8_t*)val->buf, val->size);
-    uint32_t reg_no = hash >> HLL_Q;
     uint64_t experimental = hash << HLL_P;
+    *reg_no = hash >> HLL_Q;
+    *rank = experimental ? dmin(__builtin_clzll(experimental) + 1, HLL_Q + 1) : HLL_Q + 1;
+}
 
-    // Count leading zeroes + 1
-    uint8_t zeroes = 1;
-    for (; zeroes <= HLL_Q; zeroes++) {
-        if (experimental & (1ull << 63)) {
-            break; // 1-bit found
-        }
-        experimental <<= 1;
-    }
-
-    uint8_t ret = get_enc(hll) == HLL_DENSE ? add_dense(phll, reg_no, zeroes) : add_sparse(phll, reg_no, zeroes);
-    hll = *phll;
-
-    if (get_enc(hll) == HLL_SPARSE && hll->size > HLL_SPARSE_MAX_BYTES) {
+static uint8_t add_reg(dstr **phll, uint32_t reg_no, uint8_t rank) {
+    uint8_t ret = get_enc(*phll) == HLL_DENSE ? add_dense(phll, reg_no, rank) : add_sparse(phll, reg_no, rank);
+    if (get_enc(*phll) == HLL_SPARSE && (*phll)->size > HLL_SPARSE_MAX_BYTES) {
         densify(phll);
     }
     return ret;
 }
 
-void hll_merge(dstr *dest, dstr *src) {
-    bool changed = false;
-    for (int reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
-        uint8_t reg1 = get_reg(dest, reg_no);
-        uint8_t reg2 = get_reg(src, reg_no);
-        if (reg1 < reg2) {
-            changed = true;
+uint8_t hll_add(dstr **phll, dstr *val) {
+    uint32_t reg_no = 0;
+    uint8_t rank = 0;
+    hash_elem(val, &reg_no, &rank);
+    return add_reg(phll, reg_no, rank);
+}
+
+uint8_t hll_add_batch(dstr **phll, dstr **vals, size_t n) {
+    // Hash everything first, the hashing loop has no dependency on the registers
+    std::vector<uint32_t> updates(n);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t reg_no = 0;
+        uint8_t rank = 0;
+        hash_elem(vals[i], &reg_no, &rank);
+        updates[i] = (reg_no << 8) | rank;
+    }
+
+    // Sparse hlls are updated per register, so only keep the largest rank of every register
+    if (get_enc(*phll) == HLL_SPARSE) {
+        std::sort(updates.begin(), updates.end());
+        size_t len = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (len && updates[len - 1] >> 8 == updates[i] >> 8) {
+                len--;
+            }
+            updates[len++] = updates[i];
+        }
+        updates.resize(len);
+    }
+
+    uint8_t changed = 0;
+    size_t i = 0;
+    for (; i < updates.size() && get_enc(*phll) == HLL_SPARSE; i++) {
+        changed |= add_reg(phll, updates[i] >> 8, updates[i] & 255);
+    }
+
+    // Dense updates write the registers directly and invalidate the cache once
+    dstr *hll = *phll;
+    for (; i < updates.size(); i++) {
+        uint32_t reg_no = updates[i] >> 8;
+        uint8_t rank = updates[i] & 255;
+        if (get_reg(hll, reg_no) < rank) {
+            set_reg(hll, reg_no, rank);
+            changed = 1;
         }
-        set_reg(dest, reg_no, dmax(reg1, reg2));
     }
     if (changed) {
-        invalidate_cache(dest);
+        invalidate_cache(*phll);
     }
+    return changed;
 }
 
+void hll_merge(dstr **pdest, dstr **srcs, size_t n) {
+    // All sources are read before dest is densified, dest may also be one of them
+    uint8_t regs[REGISTER_CNT];
+    uint8_t tmp[REGISTER_CNT];
+    regs_decode(*pdest, regs);
+    for (size_t i = 0; i < n; i++) {
+        regs_decode(srcs[i], tmp);
+        max_impl(regs, tmp, REGISTER_CNT);
+    }
+
+    densify(pdest);
+    encode_regs((uint8_t*)(*pdest)->buf + HLL_HEADER_SIZE_BYTES, regs);
+    invalidate_cache(*pdest);
+}
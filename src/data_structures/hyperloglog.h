@@ -1,6 +1,7 @@
 #ifndef HYPERLOGLOG_H
 #define HYPERLOGLOG_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "dstr.h"
 
@@ -20,7 +21,15 @@ enum HLLEncoding {
 
 void hll_init(dstr **phll);
 uint8_t hll_add(dstr **phll, dstr *val);
+
+// Adds n elements, returns 1 if any register changed
+uint8_t hll_add_batch(dstr **phll, dstr **vals, size_t n);
 uint64_t hll_count(dstr *hll);
-void hll_merge(dstr *hll1, dstr *hll2);
+
+// Estimated cardinality of the union of n hlls, the union itself is never built
+uint64_t hll_count_union(dstr **hlls, size_t n);
+
+// Registers of *pdest become the max of its own and the sources' registers. *pdest ends up dense
+void hll_merge(dstr **pdest, dstr **srcs, size_t n);
 
 #endif
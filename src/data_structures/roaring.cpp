@@ -0,0 +1,830 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "roaring.h"
+#include "bitmap.h"
+#include "utils/common.h"
+
+// === BITSET HELPERS ===
+static inline uint8_t bs_get(const uint8_t *bits, uint32_t v) {
+    return (bits[v / 8] >> (7 - v % 8)) & 1;
+}
+
+static inline void bs_set(uint8_t *bits, uint32_t v) {
+    bits[v / 8] |= 0x80 >> (v % 8);
+}
+
+static inline void bs_clear(uint8_t *bits, uint32_t v) {
+    bits[v / 8] &= ~(0x80 >> (v % 8));
+}
+
+// Sets bits [start, end], whole bytes with memset
+static void bs_set_range(uint8_t *bits, uint32_t start, uint32_t end) {
+    for (; start <= end && start % 8; start++) {
+        bs_set(bits, start);
+    }
+    uint32_t full_end = (end + 1) / 8;
+    if (start <= end && full_end > start / 8) {
+        memset(bits + start / 8, 0xff, full_end - start / 8);
+        start = full_end * 8;
+    }
+    for (; start <= end; start++) {
+        bs_set(bits, start);
+    }
+}
+
+// === CONTAINER HELPERS ===
+static inline uint32_t run_start(RContainer *c, uint32_t i) {
+    return c->vals[2 * i];
+}
+
+static inline uint32_t run_end(RContainer *c, uint32_t i) {
+    return c->vals[2 * i] + c->vals[2 * i + 1];
+}
+
+// Index of the last run that starts at or before v, -1 if there is none
+static int64_t run_find(RContainer *c, uint32_t v) {
+    int64_t lo = 0;
+    int64_t hi = (int64_t)c->len - 1;
+    int64_t ret = -1;
+    while (lo <= hi) {
+        int64_t mid = (lo + hi) / 2;
+        if (run_start(c, mid) <= v) {
+            ret = mid;
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return ret;
+}
+
+static size_t rc_bytes(RContainer *c) {
+    if (c->type == RC_BITSET) {
+        return RC_BITSET_BYTES;
+    }
+    return c->cap * (c->type == RC_RUN ? 4 : 2);
+}
+
+static void rc_free(RContainer *c) {
+    free(c->vals);
+    free(c->bits);
+    c->vals = NULL;
+    c->bits = NULL;
+    c->len = 0;
+    c->cap = 0;
+}
+
+// Makes room for cap values (RC_ARRAY) or runs (RC_RUN)
+static void rc_reserve(RContainer *c, uint32_t cap) {
+    if (c->cap >= cap) {
+        return;
+    }
+    uint32_t new_cap = dmax(dmax(cap, c->cap * 2), (uint32_t)4);
+    c->vals = (uint16_t *)realloc(c->vals, new_cap * (c->type == RC_RUN ? 4 : 2));
+    c->cap = new_cap;
+}
+
+static RContainer rc_copy(RContainer *c) {
+    RContainer copy = *c;
+    if (c->vals) {
+        size_t bytes = rc_bytes(c);
+        copy.vals = (uint16_t *)malloc(bytes);
+        memcpy(copy.vals, c->vals, bytes);
+    }
+    if (c->bits) {
+        copy.bits = (uint8_t *)malloc(RC_BITSET_BYTES);
+        memcpy(copy.bits, c->bits, RC_BITSET_BYTES);
+    }
+    return copy;
+}
+
+// Writes the container into a zeroed bitset
+static void rc_fill_bitset(RContainer *c, uint8_t *bits) {
+    if (c->type == RC_BITSET) {
+        memcpy(bits, c->bits, RC_BITSET_BYTES);
+    }
+    else if (c->type == RC_ARRAY) {
+        for (uint32_t i = 0; i < c->len; i++) {
+            bs_set(bits, c->vals[i]);
+        }
+    }
+    else {
+        for (uint32_t i = 0; i < c->len; i++) {
+            bs_set_range(bits, run_start(c, i), run_end(c, i));
+        }
+    }
+}
+
+static void rc_to_bitset(RContainer *c) {
+    uint8_t *bits = (uint8_t *)calloc(RC_BITSET_BYTES, 1);
+    rc_fill_bitset(c, bits);
+    rc_free(c);
+    c->bits = bits;
+    c->type = RC_BITSET;
+}
+
+// Requires card <= RC_ARRAY_MAX
+static void rc_to_array(RContainer *c) {
+    uint16_t *vals = (uint16_t *)malloc(dmax(c->card, (uint32_t)1) * 2);
+    uint32_t n = 0;
+    if (c->type == RC_BITSET) {
+        for (uint32_t i = 0; i < RC_BITSET_BYTES; i++) {
+            uint32_t byte = c->bits[i];
+            while (byte) {
+                uint32_t j = __builtin_clz(byte) - 24;
+                vals[n++] = i * 8 + j;
+                byte &= ~(0x80u >> j);
+            }
+        }
+    }
+    else if (c->type == RC_RUN) {
+        for (uint32_t i = 0; i < c->len; i++) {
+            for (uint32_t v = run_start(c, i); v <= run_end(c, i); v++) {
+                vals[n++] = v;
+            }
+        }
+    }
+    rc_free(c);
+    c->vals = vals;
+    c->len = n;
+    c->cap = dmax(n, (uint32_t)1);
+    c->type = RC_ARRAY;
+}
+
+static void rc_to_run(RContainer *c, uint32_t nruns) {
+    uint16_t *runs = (uint16_t *)malloc(dmax(nruns, (uint32_t)1) * 4);
+    uint32_t n = 0;
+    if (c->type == RC_ARRAY) {
+        for (uint32_t i = 0; i < c->len; i++) {
+            if (i && c->vals[i] == c->vals[i - 1] + 1) {
+                runs[2 * n - 1]++;
+                continue;
+            }
+            runs[2 * n] = c->vals[i];
+            runs[2 * n + 1] = 0;
+            n++;
+        }
+    }
+    else if (c->type == RC_BITSET) {
+        int64_t pos = 0;
+        while (pos < RC_BITS) {
+            int64_t start = bitmap_find_bit(c->bits, pos, RC_BITS - 1, 1);
+            if (start < 0) {
+                break;
+            }
+            int64_t end = bitmap_find_bit(c->bits, start, RC_BITS - 1, 0);
+            end = end < 0 ? RC_BITS - 1 : end - 1;
+            runs[2 * n] = start;
+            runs[2 * n + 1] = end - start;
+            n++;
+            pos = end + 1;
+        }
+    }
+    rc_free(c);
+    c->vals = runs;
+    c->len = n;
+    c->cap = dmax(n, (uint32_t)1);
+    c->type = RC_RUN;
+}
+
+static uint32_t rc_count_runs(RContainer *c) {
+    if (c->type == RC_RUN) {
+        return c->len;
+    }
+
+    uint32_t n = 0;
+    if (c->type == RC_ARRAY) {
+        for (uint32_t i = 0; i < c->len; i++) {
+            n += !i || c->vals[i] != c->vals[i - 1] + 1;
+        }
+        return n;
+    }
+
+    // A run starts at every set bit whose previous bit is clear. Words are loaded big-endian so the
+    // previous bit of a position is the next more significant one
+    uint64_t carry = 0;
+    for (uint32_t i = 0; i < RC_BITSET_BYTES; i += 8) {
+        uint64_t word;
+        memcpy(&word, c->bits + i, 8);
+        word = __builtin_bswap64(word);
+        n += __builtin_popcountll(word & ~((word >> 1) | (carry << 63)));
+        carry = word & 1;
+    }
+    return n;
+}
+
+// Re-encodes the container as the smallest of array / bitset / run
+static void rc_optimize(RContainer *c) {
+    uint32_t nruns = rc_count_runs(c);
+    size_t run_bytes = (size_t)nruns * 4;
+    size_t array_bytes = c->card <= RC_ARRAY_MAX ? (size_t)c->card * 2 : SIZE_MAX;
+
+    if (run_bytes < dmin(array_bytes, (size_t)RC_BITSET_BYTES)) {
+        if (c->type != RC_RUN) {
+            rc_to_run(c, nruns);
+        }
+    }
+    else if (array_bytes <= RC_BITSET_BYTES) {
+        if (c->type != RC_ARRAY) {
+            rc_to_array(c);
+        }
+    }
+    else if (c->type != RC_BITSET) {
+        rc_to_bitset(c);
+    }
+}
+
+// Run containers that got fragmented by single bit writes fall back to array / bitset
+static void rc_check_runs(RContainer *c) {
+    size_t other = c->card <= RC_ARRAY_MAX ? (size_t)c->card * 2 : RC_BITSET_BYTES;
+    if ((size_t)c->len * 4 > other) {
+        rc_optimize(c);
+    }
+}
+
+static uint8_t rc_get(RContainer *c, uint16_t v) {
+    if (c->type == RC_ARRAY) {
+        return std::binary_search(c->vals, c->vals + c->len, v);
+    }
+    if (c->type == RC_BITSET) {
+        return bs_get(c->bits, v);
+    }
+    int64_t i = run_find(c, v);
+    return i >= 0 && v <= run_end(c, i);
+}
+
+// Returns 1 if v was not in the container
+static uint8_t rc_add(RContainer *c, uint16_t v) {
+    if (c->type == RC_ARRAY) {
+        uint16_t *pos = std::lower_bound(c->vals, c->vals + c->len, v);
+        if (pos != c->vals + c->len && *pos == v) {
+            return 0;
+        }
+        if (c->card == RC_ARRAY_MAX) {
+            rc_to_bitset(c);
+            return rc_add(c, v);
+        }
+
+        size_t idx = pos - c->vals;
+        rc_reserve(c, c->len + 1);
+        memmove(&c->vals[idx + 1], &c->vals[idx], (c->len - idx) * 2);
+        c->vals[idx] = v;
+        c->len++;
+        c->card++;
+        return 1;
+    }
+
+    if (c->type == RC_BITSET) {
+        if (bs_get(c->bits, v)) {
+            return 0;
+        }
+        bs_set(c->bits, v);
+        c->card++;
+        return 1;
+    }
+
+    int64_t i = run_find(c, v);
+    if (i >= 0 && v <= run_end(c, i)) {
+        return 0;
+    }
+    bool ext_prev = i >= 0 && run_end(c, i) + 1 == v;
+    bool ext_next = i + 1 < c->len && run_start(c, i + 1) == (uint32_t)v + 1;
+
+    if (ext_prev && ext_next) {
+        // v fills the gap between two runs, merge them
+        c->vals[2 * i + 1] = run_end(c, i + 1) - run_start(c, i);
+        memmove(&c->vals[2 * (i + 1)], &c->vals[2 * (i + 2)], (c->len - i - 2) * 4);
+        c->len--;
+    }
+    else if (ext_prev) {
+        c->vals[2 * i + 1]++;
+    }
+    else if (ext_next) {
+        c->vals[2 * (i + 1)]--;
+        c->vals[2 * (i + 1) + 1]++;
+    }
+    else {
+        rc_reserve(c, c->len + 1);
+        memmove(&c->vals[2 * (i + 2)], &c->vals[2 * (i + 1)], (c->len - i - 1) * 4);
+        c->vals[2 * (i + 1)] = v;
+        c->vals[2 * (i + 1) + 1] = 0;
+        c->len++;
+    }
+    c->card++;
+    rc_check_runs(c);
+    return 1;
+}
+
+// Returns 1 if v was in the container
+static uint8_t rc_remove(RContainer *c, uint16_t v) {
+    if (c->type == RC_ARRAY) {
+        uint16_t *pos = std::lower_bound(c->vals, c->vals + c->len, v);
+        if (pos == c->vals + c->len || *pos != v) {
+            return 0;
+        }
+        size_t idx = pos - c->vals;
+        memmove(&c->vals[idx], &c->vals[idx + 1], (c->len - idx - 1) * 2);
+        c->len--;
+        c->card--;
+        return 1;
+    }
+
+    if (c->type == RC_BITSET) {
+        if (!bs_get(c->bits, v)) {
+            return 0;
+        }
+        bs_clear(c->bits, v);
+        c->card--;
+
+        // Half of RC_ARRAY_MAX so a container on the edge does not flip on every write
+        if (c->card <= RC_ARRAY_MAX / 2) {
+            rc_to_array(c);
+        }
+        return 1;
+    }
+
+    int64_t i = run_find(c, v);
+    if (i < 0 || v > run_end(c, i)) {
+        return 0;
+    }
+    uint32_t start = run_start(c, i);
+    uint32_t end = run_end(c, i);
+
+    if (start == end) {
+        memmove(&c->vals[2 * i], &c->vals[2 * (i + 1)], (c->len - i - 1) * 4);
+        c->len--;
+    }
+    else if (v == start) {
+        c->vals[2 * i]++;
+        c->vals[2 * i + 1]--;
+    }
+    else if (v == end) {
+        c->vals[2 * i + 1]--;
+    }
+    else {
+        // Split the run in two
+        rc_reserve(c, c->len + 1);
+        memmove(&c->vals[2 * (i + 2)], &c->vals[2 * (i + 1)], (c->len - i - 1) * 4);
+        c->vals[2 * i + 1] = v - 1 - start;
+        c->vals[2 * (i + 1)] = v + 1;
+        c->vals[2 * (i + 1) + 1] = end - v - 1;
+        c->len++;
+    }
+    c->card--;
+    rc_check_runs(c);
+    return 1;
+}
+
+static uint32_t rc_count_range(RContainer *c, uint32_t lo, uint32_t hi) {
+    if (c->type == RC_ARRAY) {
+        uint16_t *first = std::lower_bound(c->vals, c->vals + c->len, lo);
+        uint16_t *last = std::upper_bound(c->vals, c->vals + c->len, hi);
+        return last - first;
+    }
+    if (c->type == RC_BITSET) {
+        return bitmap_count_range(c->bits, lo, hi);
+    }
+
+    uint32_t cnt = 0;
+    int64_t i = dmax(run_find(c, lo), (int64_t)0);
+    for (; i < c->len && run_start(c, i) <= hi; i++) {
+        uint32_t start = dmax(run_start(c, i), lo);
+        uint32_t end = dmin(run_end(c, i), hi);
+        if (start <= end) {
+            cnt += end - start + 1;
+        }
+    }
+    return cnt;
+}
+
+// First set bit at or after lo, -1 if there is none
+static int64_t rc_next_set(RContainer *c, uint32_t lo) {
+    if (c->type == RC_ARRAY) {
+        uint16_t *pos = std::lower_bound(c->vals, c->vals + c->len, lo);
+        return pos == c->vals + c->len ? -1 : *pos;
+    }
+    if (c->type == RC_BITSET) {
+        return bitmap_find_bit(c->bits, lo, RC_BITS - 1, 1);
+    }
+
+    int64_t i = dmax(run_find(c, lo), (int64_t)0);
+    for (; i < c->len; i++) {
+        if (run_end(c, i) >= lo) {
+            return dmax(run_start(c, i), lo);
+        }
+    }
+    return -1;
+}
+
+// First clear bit at or after lo, -1 if there is none
+static int64_t rc_next_clear(RContainer *c, uint32_t lo) {
+    if (c->type == RC_ARRAY) {
+        uint16_t *pos = std::lower_bound(c->vals, c->vals + c->len, lo);
+        uint32_t v = lo;
+        for (; pos != c->vals + c->len && *pos == v; pos++) {
+            v++;
+        }
+        return v < RC_BITS ? (int64_t)v : -1;
+    }
+    if (c->type == RC_BITSET) {
+        return bitmap_find_bit(c->bits, lo, RC_BITS - 1, 0);
+    }
+
+    // Runs never touch each other, so the bit right after the covering run is clear
+    int64_t i = run_find(c, lo);
+    if (i < 0 || lo > run_end(c, i)) {
+        return lo;
+    }
+    uint32_t v = run_end(c, i) + 1;
+    return v < RC_BITS ? (int64_t)v : -1;
+}
+
+// c = a <op> b for AND / OR / XOR, returns false if the result is empty
+static bool rc_op(uint8_t op, RContainer *a, RContainer *b, RContainer *out) {
+    *out = RContainer{};
+    out->key = a->key;
+
+    if (a->type == RC_ARRAY && b->type == RC_ARRAY) {
+        // Sorted merge
+        uint16_t *vals = (uint16_t *)malloc(dmax(a->len + b->len, (uint32_t)1) * 2);
+        uint32_t i = 0, j = 0, n = 0;
+        while (i < a->len || j < b->len) {
+            if (j == b->len || (i < a->len && a->vals[i] < b->vals[j])) {
+                if (op != BITOP_AND) {
+                    vals[n++] = a->vals[i];
+                }
+                i++;
+            }
+            else if (i == a->len || b->vals[j] < a->vals[i]) {
+                if (op != BITOP_AND) {
+                    vals[n++] = b->vals[j];
+                }
+                j++;
+            }
+            else {
+                if (op != BITOP_XOR) {
+                    vals[n++] = a->vals[i];
+                }
+                i++;
+                j++;
+            }
+        }
+        out->type = RC_ARRAY;
+        out->vals = vals;
+        out->len = n;
+        out->cap = dmax(a->len + b->len, (uint32_t)1);
+        out->card = n;
+        if (n > RC_ARRAY_MAX) {
+            rc_to_bitset(out);
+        }
+    }
+    else {
+        // Everything else goes through the vectorized plain bitmap kernels
+        uint8_t *bits = (uint8_t *)calloc(RC_BITSET_BYTES, 1);
+        rc_fill_bitset(a, bits);
+
+        uint8_t *other = b->bits;
+        if (b->type != RC_BITSET) {
+            other = (uint8_t *)calloc(RC_BITSET_BYTES, 1);
+            rc_fill_bitset(b, other);
+        }
+        bitmap_op(op, bits, other, RC_BITSET_BYTES);
+        if (other != b->bits) {
+            free(other);
+        }
+
+        out->type = RC_BITSET;
+        out->bits = bits;
+        out->card = bitmap_popcount(bits, RC_BITSET_BYTES);
+    }
+
+    if (!out->card) {
+        rc_free(out);
+        return false;
+    }
+    rc_optimize(out);
+    return true;
+}
+
+// === ROARING HELPERS ===
+// Index of the container with `key` or the index where it would be inserted
+static size_t r_find(Roaring *r, uint32_t key) {
+    size_t lo = 0;
+    size_t hi = r->containers.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (r->containers[mid].key < key) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static RContainer* r_get(Roaring *r, uint32_t key) {
+    size_t idx = r_find(r, key);
+    if (idx < r->containers.size() && r->containers[idx].key == key) {
+        return &r->containers[idx];
+    }
+    return NULL;
+}
+
+static void r_recount_mem(Roaring *r) {
+    r->mem = 0;
+    for (RContainer &c : r->containers) {
+        r->mem += rc_bytes(&c);
+    }
+}
+
+static Roaring* r_copy(Roaring *r) {
+    Roaring *copy = roaring_init();
+    for (RContainer &c : r->containers) {
+        copy->containers.push_back(rc_copy(&c));
+    }
+    copy->size = r->size;
+    copy->mem = r->mem;
+    return copy;
+}
+
+static Roaring* r_op2(uint8_t op, Roaring *a, Roaring *b) {
+    Roaring *res = roaring_init();
+    size_t i = 0, j = 0;
+    size_t na = a->containers.size();
+    size_t nb = b->containers.size();
+
+    while (i < na || j < nb) {
+        if (j == nb || (i < na && a->containers[i].key < b->containers[j].key)) {
+            if (op != BITOP_AND) {
+                res->containers.push_back(rc_copy(&a->containers[i]));
+            }
+            i++;
+        }
+        else if (i == na || b->containers[j].key < a->containers[i].key) {
+            if (op != BITOP_AND) {
+                res->containers.push_back(rc_copy(&b->containers[j]));
+            }
+            j++;
+        }
+        else {
+            RContainer out;
+            if (rc_op(op, &a->containers[i], &b->containers[j], &out)) {
+                res->containers.push_back(out);
+            }
+            i++;
+            j++;
+        }
+    }
+    res->size = dmax(a->size, b->size);
+    return res;
+}
+
+static Roaring* r_not(Roaring *src) {
+    Roaring *res = roaring_init();
+    if (!src || !src->size) {
+        return res;
+    }
+    res->size = src->size;
+
+    uint64_t last_bit = src->size * 8 - 1;
+    uint32_t last_key = last_bit >> 16;
+    for (uint32_t key = 0; key <= last_key; key++) {
+        uint32_t hi = key == last_key ? last_bit & 0xffff : RC_BITS - 1;
+        RContainer *c = r_get(src, key);
+
+        // Missing container flips to a single run
+        RContainer out;
+        out.key = key;
+        if (!c) {
+            out.type = RC_RUN;
+            out.vals = (uint16_t *)malloc(4);
+            out.vals[0] = 0;
+            out.vals[1] = hi;
+            out.len = 1;
+            out.cap = 1;
+            out.card = hi + 1;
+            res->containers.push_back(out);
+            continue;
+        }
+
+        uint8_t *bits = (uint8_t *)calloc(RC_BITSET_BYTES, 1);
+        rc_fill_bitset(c, bits);
+        bitmap_op(BITOP_NOT, bits, bits, RC_BITSET_BYTES);
+
+        // Clear everything past the end of the bitmap
+        for (uint32_t v = hi + 1; v < RC_BITS && v % 8; v++) {
+            bs_clear(bits, v);
+        }
+        if (hi + 1 < RC_BITS) {
+            uint32_t from = (hi + 8) / 8;
+            memset(bits + from, 0, RC_BITSET_BYTES - from);
+        }
+
+        out.type = RC_BITSET;
+        out.bits = bits;
+        out.card = bitmap_popcount(bits, RC_BITSET_BYTES);
+        if (!out.card) {
+            rc_free(&out);
+            continue;
+        }
+        rc_optimize(&out);
+        res->containers.push_back(out);
+    }
+    return res;
+}
+
+// === API ===
+Roaring* roaring_init() {
+    return new Roaring();
+}
+
+void roaring_free(Roaring *r) {
+    if (!r) {
+        return;
+    }
+    for (RContainer &c : r->containers) {
+        rc_free(&c);
+    }
+    delete r;
+}
+
+size_t roaring_mem(Roaring *r) {
+    return sizeof(Roaring) + r->containers.capacity() * sizeof(RContainer) + r->mem;
+}
+
+uint8_t roaring_get(Roaring *r, uint32_t pos) {
+    RContainer *c = r_get(r, pos >> 16);
+    return c ? rc_get(c, pos & 0xffff) : 0;
+}
+
+uint8_t roaring_set(Roaring *r, uint32_t pos, uint8_t bit) {
+    r->size = dmax(r->size, (uint64_t)pos / 8 + 1);
+
+    uint16_t key = pos >> 16;
+    size_t idx = r_find(r, key);
+    if (idx == r->containers.size() || r->containers[idx].key != key) {
+        if (!bit) {
+            return 0;
+        }
+        RContainer c;
+        c.key = key;
+        r->containers.insert(r->containers.begin() + idx, c);
+    }
+
+    RContainer *c = &r->containers[idx];
+    size_t before = rc_bytes(c);
+    uint8_t changed = bit ? rc_add(c, pos & 0xffff) : rc_remove(c, pos & 0xffff);
+    r->mem = r->mem - before + rc_bytes(c);
+
+    if (!c->card) {
+        r->mem -= rc_bytes(c);
+        rc_free(c);
+        r->containers.erase(r->containers.begin() + idx);
+    }
+    return bit ? !changed : changed;
+}
+
+uint64_t roaring_count_range(Roaring *r, uint64_t start_bit, uint64_t end_bit) {
+    uint32_t first_key = start_bit >> 16;
+    uint32_t last_key = end_bit >> 16;
+
+    uint64_t cnt = 0;
+    for (size_t i = r_find(r, first_key); i < r->containers.size(); i++) {
+        RContainer *c = &r->containers[i];
+        if (c->key > last_key) {
+            break;
+        }
+        uint32_t lo = c->key == first_key ? start_bit & 0xffff : 0;
+        uint32_t hi = c->key == last_key ? end_bit & 0xffff : RC_BITS - 1;
+        cnt += (lo == 0 && hi == RC_BITS - 1) ? c->card : rc_count_range(c, lo, hi);
+    }
+    return cnt;
+}
+
+int64_t roaring_find_bit(Roaring *r, uint64_t start_bit, uint64_t end_bit, uint8_t bit) {
+    if (bit) {
+        for (size_t i = r_find(r, start_bit >> 16); i < r->containers.size(); i++) {
+            RContainer *c = &r->containers[i];
+            uint32_t lo = c->key == start_bit >> 16 ? start_bit & 0xffff : 0;
+            int64_t low = rc_next_set(c, lo);
+            if (low >= 0) {
+                int64_t pos = ((int64_t)c->key << 16) | low;
+                return pos <= (int64_t)end_bit ? pos : -1;
+            }
+        }
+        return -1;
+    }
+
+    // A position is clear unless its container has it set, so walk container by container
+    uint64_t pos = start_bit;
+    while (pos <= end_bit) {
+        RContainer *c = r_get(r, pos >> 16);
+        if (!c) {
+            return pos;
+        }
+        int64_t low = rc_next_clear(c, pos & 0xffff);
+        if (low >= 0) {
+            uint64_t found = ((uint64_t)c->key << 16) | low;
+            return found <= end_bit ? (int64_t)found : -1;
+        }
+        pos = ((pos >> 16) + 1) << 16;
+    }
+    return -1;
+}
+
+int64_t roaring_get_field(Roaring *r, uint64_t offset, uint8_t bits, bool is_signed) {
+    uint64_t val = 0;
+    for (uint8_t i = 0; i < bits; i++) {
+        val = (val << 1) | roaring_get(r, offset + i);
+    }
+    if (is_signed && bits < 64 && (val >> (bits - 1)) & 1) {
+        val |= ~((1ull << bits) - 1);
+    }
+    return (int64_t)val;
+}
+
+void roaring_set_field(Roaring *r, uint64_t offset, uint8_t bits, uint64_t value) {
+    for (uint8_t i = 0; i < bits; i++) {
+        roaring_set(r, offset + i, (value >> (bits - 1 - i)) & 1);
+    }
+}
+
+Roaring* roaring_op(uint8_t op, Roaring **srcs, size_t n) {
+    if (op == BITOP_NOT) {
+        Roaring *res = r_not(srcs[0]);
+        r_recount_mem(res);
+        return res;
+    }
+
+    Roaring empty;
+    Roaring *res = r_copy(srcs[0] ? srcs[0] : &empty);
+    for (size_t i = 1; i < n; i++) {
+        Roaring *next = r_op2(op, res, srcs[i] ? srcs[i] : &empty);
+        roaring_free(res);
+        res = next;
+    }
+    r_recount_mem(res);
+    return res;
+}
+
+Roaring* roaring_from_dense(const uint8_t *buf, size_t len) {
+    Roaring *r = roaring_init();
+    r->size = len;
+
+    for (size_t off = 0; off < len; off += RC_BITSET_BYTES) {
+        size_t chunk = dmin(len - off, (size_t)RC_BITSET_BYTES);
+        uint32_t card = bitmap_popcount(buf + off, chunk);
+        if (!card) {
+            continue;
+        }
+
+        RContainer c;
+        c.key = off / RC_BITSET_BYTES;
+        c.type = RC_BITSET;
+        c.bits = (uint8_t *)calloc(RC_BITSET_BYTES, 1);
+        memcpy(c.bits, buf + off, chunk);
+        c.card = card;
+        rc_optimize(&c);
+        r->containers.push_back(c);
+    }
+    r_recount_mem(r);
+    return r;
+}
+
+dstr* roaring_to_dense(Roaring *r) {
+    dstr *res = dstr_init(r->size);
+    dstr_resize(&res, r->size, '\0');
+    uint8_t *buf = (uint8_t *)res->buf;
+
+    for (RContainer &c : r->containers) {
+        uint64_t off = (uint64_t)c.key * RC_BITSET_BYTES;
+        if (c.type == RC_BITSET) {
+            memcpy(buf + off, c.bits, dmin(r->size - off, (uint64_t)RC_BITSET_BYTES));
+            continue;
+        }
+
+        // Array / run values are below r->size * 8, so they can be written straight into buf
+        uint8_t *bits = buf + off;
+        if (c.type == RC_ARRAY) {
+            for (uint32_t i = 0; i < c.len; i++) {
+                bs_set(bits, c.vals[i]);
+            }
+        }
+        else {
+            for (uint32_t i = 0; i < c.len; i++) {
+                bs_set_range(bits, run_start(&c, i), run_end(&c, i));
+            }
+        }
+    }
+    return res;
+}
+
+void roaring_optimize(Roaring *r) {
+    for (RContainer &c : r->containers) {
+        rc_optimize(&c);
+    }
+    r_recount_mem(r);
+}
@@ -0,0 +1,55 @@
+#ifndef ROARING_H
+#define ROARING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "dstr.h"
+
+#define RC_BITS 65536 // values per container (low 16 bits of a position)
+#define RC_BITSET_BYTES (RC_BITS / 8)
+#define RC_ARRAY_MAX 4096 // above this an array container is larger than a bitset
+
+enum RContainerTypes {
+    RC_ARRAY = 0,
+    RC_BITSET = 1,
+    RC_RUN = 2
+};
+
+struct RContainer {
+    uint16_t key = 0;  // high 16 bits of every position in the container
+    uint8_t type = RC_ARRAY;
+    uint32_t card = 0;  // number of set bits
+    uint32_t len = 0;  // RC_ARRAY: number of values, RC_RUN: number of runs
+    uint32_t cap = 0;
+    uint16_t *vals = NULL;  // RC_ARRAY: sorted values, RC_RUN: (start, length - 1) pairs
+    uint8_t *bits = NULL;  // RC_BITSET: RC_BITSET_BYTES bytes in the same bit order as a plain bitmap
+};
+
+// 32 bit roaring bitmap. Positions are bit positions of the equivalent plain (dstr) bitmap
+struct Roaring {
+    std::vector<RContainer> containers;  // sorted by key
+    uint64_t size = 0;  // length in bytes of the equivalent plain bitmap
+    size_t mem = 0;  // bytes held by the containers
+};
+
+Roaring* roaring_init();
+void roaring_free(Roaring *r);
+size_t roaring_mem(Roaring *r);
+
+uint8_t roaring_get(Roaring *r, uint32_t pos);
+uint8_t roaring_set(Roaring *r, uint32_t pos, uint8_t bit);  // returns the previous bit
+uint64_t roaring_count_range(Roaring *r, uint64_t start_bit, uint64_t end_bit);
+int64_t roaring_find_bit(Roaring *r, uint64_t start_bit, uint64_t end_bit, uint8_t bit);
+int64_t roaring_get_field(Roaring *r, uint64_t offset, uint8_t bits, bool is_signed);
+void roaring_set_field(Roaring *r, uint64_t offset, uint8_t bits, uint64_t value);
+
+// BitOps over n sources (NULL = empty bitmap), the result is a new roaring of size max(srcs[i]->size)
+Roaring* roaring_op(uint8_t op, Roaring **srcs, size_t n);
+
+// Conversions from / to the plain encoding. Containers are re-encoded to the smallest of the 3 types
+Roaring* roaring_from_dense(const uint8_t *buf, size_t len);
+dstr* roaring_to_dense(Roaring *r);
+void roaring_optimize(Roaring *r);
+
+#endif
@@ -0,0 +1,522 @@
+#include <cstdlib>
+#include <stdio.h>
+#include <string.h>
+#include "stream.h"
+
+enum StreamEntryFlags {
+    SE_SAME_FIELDS = 1 << 0, // only the values are stored, the fields are the master entry's
+};
+
+static void put_varint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t)v | 0x80);
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+static uint64_t get_varint(const uint8_t** pp) {
+    const uint8_t* p = *pp;
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    *pp = p;
+    return v;
+}
+
+static void put_str(std::vector<uint8_t>& out, const char* buf, size_t len) {
+    put_varint(out, len);
+    out.insert(out.end(), (const uint8_t*)buf, (const uint8_t*)buf + len);
+}
+
+static StreamField get_str(const uint8_t** pp) {
+    size_t len = get_varint(pp);
+    StreamField field = {(const char*)*pp, len};
+    *pp += len;
+    return field;
+}
+
+int stream_id_cmp(StreamID a, StreamID b) {
+    if (a.ms != b.ms) {
+        return a.ms < b.ms ? -1 : 1;
+    }
+    if (a.seq != b.seq) {
+        return a.seq < b.seq ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool parse_u64(const char* buf, size_t len, uint64_t* out) {
+    if (!len || len > 20) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] < '0' || buf[i] > '9') {
+            return false;
+        }
+        uint64_t digit = buf[i] - '0';
+        if (v > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+    }
+    *out = v;
+    return true;
+}
+
+bool stream_parse_id(const char* buf, size_t len, uint64_t missing_seq, StreamID* out) {
+    const char* dash = (const char*)memchr(buf, '-', len);
+    if (!dash) {
+        out->seq = missing_seq;
+        return parse_u64(buf, len, &out->ms);
+    }
+    return parse_u64(buf, dash - buf, &out->ms) && parse_u64(dash + 1, buf + len - dash - 1, &out->seq);
+}
+
+size_t stream_format_id(StreamID id, char* buf) {
+    return snprintf(buf, STREAM_ID_BUF, "%llu-%llu", (unsigned long long)id.ms, (unsigned long long)id.seq);
+}
+
+bool stream_id_incr(StreamID* id) {
+    if (id->seq != UINT64_MAX) {
+        id->seq++;
+        return true;
+    }
+    if (id->ms == UINT64_MAX) {
+        return false;
+    }
+    id->ms++;
+    id->seq = 0;
+    return true;
+}
+
+bool stream_id_decr(StreamID* id) {
+    if (id->seq) {
+        id->seq--;
+        return true;
+    }
+    if (!id->ms) {
+        return false;
+    }
+    id->ms--;
+    id->seq = UINT64_MAX;
+    return true;
+}
+
+static void id_key(StreamID id, uint8_t key[STREAM_KEY_LEN]) {
+    for (int i = 0; i < 8; i++) {
+        key[i] = id.ms >> (56 - 8 * i);
+        key[8 + i] = id.seq >> (56 - 8 * i);
+    }
+}
+
+// Radix tree
+
+static size_t kid_pos(StreamNode* node, uint8_t label) {
+    size_t pos = 0;
+    while (pos < node->labels.size() && node->labels[pos] < label) {
+        pos++;
+    }
+    return pos;
+}
+
+static void tree_insert(StreamNode* root, const uint8_t* key, StreamBlock* block) {
+    StreamNode* node = root;
+    size_t depth = 0;
+    while (true) {
+        size_t i = 0;
+        while (i < node->plen && node->prefix[i] == key[depth + i]) {
+            i++;
+        }
+
+        // The key leaves the compressed path: split it at the first different byte
+        if (i < node->plen) {
+            StreamNode* rest = new StreamNode();
+            rest->plen = node->plen - i - 1;
+            memcpy(rest->prefix, node->prefix + i + 1, rest->plen);
+            rest->labels.swap(node->labels);
+            rest->kids.swap(node->kids);
+            rest->block = node->block;
+            node->block = NULL;
+            node->labels.push_back(node->prefix[i]);
+            node->kids.push_back(rest);
+            node->plen = i;
+        }
+        depth += node->plen;
+        if (depth == STREAM_KEY_LEN) {
+            node->block = block;
+            return;
+        }
+
+        size_t pos = kid_pos(node, key[depth]);
+        if (pos == node->labels.size() || node->labels[pos] != key[depth]) {
+            StreamNode* leaf = new StreamNode();
+            leaf->plen = STREAM_KEY_LEN - depth - 1;
+            memcpy(leaf->prefix, key + depth + 1, leaf->plen);
+            leaf->block = block;
+            node->labels.insert(node->labels.begin() + pos, key[depth]);
+            node->kids.insert(node->kids.begin() + pos, leaf);
+            return;
+        }
+        node = node->kids[pos];
+        depth++;
+    }
+}
+
+static StreamBlock* tree_edge(StreamNode* node, bool last) {
+    while (!node->block) {
+        if (node->kids.empty()) {
+            return NULL;
+        }
+        node = last ? node->kids.back() : node->kids.front();
+    }
+    return node->block;
+}
+
+// The block with the greatest key <= key (le) or the smallest key >= key (!le)
+static StreamBlock* tree_seek(StreamNode* node, const uint8_t* key, size_t depth, bool le) {
+    int cmp = memcmp(node->prefix, key + depth, node->plen);
+    if (cmp) {
+        // The whole subtree is on one side of the key
+        return (cmp < 0) == le ? tree_edge(node, le) : NULL;
+    }
+    depth += node->plen;
+    if (depth == STREAM_KEY_LEN) {
+        return node->block;
+    }
+
+    size_t pos = kid_pos(node, key[depth]);
+    if (pos < node->labels.size() && node->labels[pos] == key[depth]) {
+        StreamBlock* found = tree_seek(node->kids[pos], key, depth + 1, le);
+        if (found) {
+            return found;
+        }
+        if (!le) {
+            pos++;
+        }
+    }
+    if (le) {
+        return pos ? tree_edge(node->kids[pos - 1], true) : NULL;
+    }
+    return pos < node->kids.size() ? tree_edge(node->kids[pos], false) : NULL;
+}
+
+static void tree_remove(StreamNode* root, const uint8_t* key) {
+    std::vector<StreamNode*> path = {root};
+    size_t depth = root->plen;
+    while (depth < STREAM_KEY_LEN) {
+        StreamNode* node = path.back();
+        size_t pos = kid_pos(node, key[depth]);
+        if (pos == node->labels.size() || node->labels[pos] != key[depth]) {
+            return;
+        }
+        StreamNode* kid = node->kids[pos];
+        path.push_back(kid);
+        depth += 1 + kid->plen;
+    }
+    path.back()->block = NULL;
+
+    // Free the nodes left empty, then merge a node left with a single kid into it
+    for (size_t i = path.size() - 1; i > 0; i--) {
+        StreamNode* node = path[i];
+        StreamNode* parent = path[i - 1];
+        if (node->block || !node->kids.empty()) {
+            break;
+        }
+        for (size_t pos = 0; pos < parent->kids.size(); pos++) {
+            if (parent->kids[pos] == node) {
+                parent->kids.erase(parent->kids.begin() + pos);
+                parent->labels.erase(parent->labels.begin() + pos);
+                break;
+            }
+        }
+        delete node;
+        path.pop_back();
+    }
+
+    StreamNode* node = path.back();
+    if (node == root || node->kids.size() != 1 || node->block) {
+        return;
+    }
+    StreamNode* kid = node->kids[0];
+    node->prefix[node->plen] = node->labels[0];
+    memcpy(node->prefix + node->plen + 1, kid->prefix, kid->plen);
+    node->plen += 1 + kid->plen;
+    node->labels.swap(kid->labels);
+    node->kids.swap(kid->kids);
+    node->block = kid->block;
+    delete kid;
+}
+
+static void tree_free(StreamNode* node) {
+    for (StreamNode* kid : node->kids) {
+        tree_free(kid);
+        delete kid;
+    }
+    if (node->block) {
+        free(node->block->data);
+        delete node->block;
+    }
+}
+
+static size_t tree_mem(StreamNode* node) {
+    size_t mem = node->labels.capacity() + node->kids.capacity() * sizeof(StreamNode*);
+    if (node->block) {
+        mem += sizeof(StreamBlock) + node->block->cap;
+    }
+    for (StreamNode* kid : node->kids) {
+        mem += sizeof(StreamNode) + tree_mem(kid);
+    }
+    return mem;
+}
+
+// Blocks
+
+static void master_fields(StreamBlock* block, std::vector<StreamField>& fields) {
+    fields.clear();
+    const uint8_t* p = block->data;
+    size_t n = get_varint(&p);
+    for (size_t i = 0; i < n; i++) {
+        fields.push_back(get_str(&p));
+    }
+}
+
+// Decodes the entry at *pp and moves *pp past it
+static void decode_entry(StreamBlock* block, std::vector<StreamField>& master, const uint8_t** pp, StreamEntry* e) {
+    const uint8_t* p = *pp;
+    uint8_t flags = *p++;
+    uint64_t ms_delta = get_varint(&p);
+    uint64_t seq = get_varint(&p);
+    e->id.ms = block->master.ms + ms_delta;
+    e->id.seq = ms_delta ? seq : block->master.seq + seq;
+
+    e->fields.clear();
+    if (flags & SE_SAME_FIELDS) {
+        for (StreamField& field : master) {
+            e->fields.push_back(field);
+            e->fields.push_back(get_str(&p));
+        }
+    }
+    else {
+        size_t n = get_varint(&p);
+        for (size_t i = 0; i < 2 * n; i++) {
+            e->fields.push_back(get_str(&p));
+        }
+    }
+    *pp = p;
+}
+
+static bool same_fields(std::vector<StreamField>& master, dstr** pairs, size_t n) {
+    if (master.size() * 2 != n) {
+        return false;
+    }
+    for (size_t i = 0; i < master.size(); i++) {
+        dstr* field = pairs[2 * i];
+        if (field->size != master[i].len || memcmp(field->buf, master[i].buf, field->size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void block_append(StreamBlock* block, const uint8_t* buf, size_t len) {
+    if (block->len + len > block->cap) {
+        block->cap = block->len + len > 2 * block->cap ? block->len + len : 2 * block->cap;
+        block->data = (uint8_t*)realloc(block->data, block->cap);
+    }
+    memcpy(block->data + block->len, buf, len);
+    block->len += len;
+}
+
+// A full block keeps no spare room
+static void block_shrink(StreamBlock* block) {
+    if (block->cap > block->len) {
+        block->data = (uint8_t*)realloc(block->data, block->len);
+        block->cap = block->len;
+    }
+}
+
+Stream* stream_new() {
+    return new Stream();
+}
+
+void stream_free(Stream* s) {
+    tree_free(&s->root);
+    delete s;
+}
+
+StreamID stream_next_id(Stream* s, uint64_t now_ms) {
+    if (now_ms > s->last_id.ms) {
+        return {now_ms, 0};
+    }
+    StreamID id = s->last_id;
+    stream_id_incr(&id);
+    return id;
+}
+
+void stream_append(Stream* s, StreamID id, dstr** pairs, size_t n) {
+    static std::vector<StreamField> master;
+    static std::vector<uint8_t> entry;
+
+    StreamBlock* block = s->tail;
+    if (block && (block->count >= STREAM_BLOCK_ENTRIES || block->len >= STREAM_BLOCK_BYTES)) {
+        block_shrink(block);
+        block = NULL;
+    }
+    if (!block) {
+        block = new StreamBlock();
+        block->master = id;
+        entry.clear();
+        put_varint(entry, n / 2);
+        for (size_t i = 0; i < n; i += 2) {
+            put_str(entry, pairs[i]->buf, pairs[i]->size);
+        }
+        block_append(block, entry.data(), entry.size());
+        block->fields_len = block->len;
+
+        uint8_t key[STREAM_KEY_LEN];
+        id_key(id, key);
+        tree_insert(&s->root, key, block);
+        s->tail = block;
+        s->blocks++;
+    }
+
+    master_fields(block, master);
+    bool same = same_fields(master, pairs, n);
+    uint64_t ms_delta = id.ms - block->master.ms;
+    entry.clear();
+    entry.push_back(same ? SE_SAME_FIELDS : 0);
+    put_varint(entry, ms_delta);
+    put_varint(entry, ms_delta ? id.seq : id.seq - block->master.seq);
+    if (!same) {
+        put_varint(entry, n / 2);
+    }
+    for (size_t i = same; i < n; i += 1 + same) {
+        put_str(entry, pairs[i]->buf, pairs[i]->size);
+    }
+    block_append(block, entry.data(), entry.size());
+    block->count++;
+    s->length++;
+    s->last_id = id;
+}
+
+uint64_t stream_trim(Stream* s, uint64_t maxlen, bool approx) {
+    static std::vector<StreamField> master;
+    uint64_t removed = 0;
+    uint8_t zero[STREAM_KEY_LEN] = {};
+    while (s->length > maxlen) {
+        StreamBlock* head = tree_seek(&s->root, zero, 0, false);
+        uint64_t extra = s->length - maxlen;
+        if (head->count <= extra) {
+            uint8_t key[STREAM_KEY_LEN];
+            id_key(head->master, key);
+            tree_remove(&s->root, key);
+            if (s->tail == head) {
+                s->tail = NULL;
+            }
+            s->length -= head->count;
+            s->blocks--;
+            removed += head->count;
+            free(head->data);
+            delete head;
+            continue;
+        }
+        if (approx) {
+            break;
+        }
+
+        // Cut the oldest entries out of the head block. Its master ID and fields stay, the entries
+        // left are still encoded against them
+        master_fields(head, master);
+        StreamEntry e;
+        const uint8_t* p = head->data + head->fields_len;
+        for (uint64_t i = 0; i < extra; i++) {
+            decode_entry(head, master, &p, &e);
+        }
+        size_t cut = p - (head->data + head->fields_len);
+        memmove(head->data + head->fields_len, p, head->len - head->fields_len - cut);
+        head->len -= cut;
+        head->count -= extra;
+        s->length -= extra;
+        removed += extra;
+    }
+    return removed;
+}
+
+size_t stream_range(Stream* s, StreamID start, StreamID end, size_t count, bool rev, StreamEntryFn fn, void* arg) {
+    static std::vector<StreamField> master;
+    static std::vector<const uint8_t*> offsets;
+    if (stream_id_cmp(start, end) > 0) {
+        return 0;
+    }
+
+    size_t visited = 0;
+    StreamEntry e;
+    uint8_t key[STREAM_KEY_LEN];
+    id_key(rev ? end : start, key);
+    StreamBlock* block = tree_seek(&s->root, key, 0, true);
+    if (!block && !rev) {
+        block = tree_seek(&s->root, key, 0, false);
+    }
+
+    while (block) {
+        master_fields(block, master);
+        const uint8_t* p = block->data + block->fields_len;
+        const uint8_t* end_p = block->data + block->len;
+        if (!rev) {
+            while (p < end_p) {
+                decode_entry(block, master, &p, &e);
+                if (stream_id_cmp(e.id, start) < 0) {
+                    continue;
+                }
+                if (stream_id_cmp(e.id, end) > 0) {
+                    return visited;
+                }
+                fn(&e, arg);
+                if (++visited == count) {
+                    return visited;
+                }
+            }
+        }
+        else {
+            // Entries can only be decoded forwards, so find where they start first
+            offsets.clear();
+            while (p < end_p) {
+                offsets.push_back(p);
+                decode_entry(block, master, &p, &e);
+            }
+            for (size_t i = offsets.size(); i-- > 0;) {
+                p = offsets[i];
+                decode_entry(block, master, &p, &e);
+                if (stream_id_cmp(e.id, end) > 0) {
+                    continue;
+                }
+                if (stream_id_cmp(e.id, start) < 0) {
+                    return visited;
+                }
+                fn(&e, arg);
+                if (++visited == count) {
+                    return visited;
+                }
+            }
+        }
+
+        StreamID next = block->master;
+        if (!(rev ? stream_id_decr(&next) : stream_id_incr(&next))) {
+            break;
+        }
+        id_key(next, key);
+        block = tree_seek(&s->root, key, 0, rev);
+    }
+    return visited;
+}
+
+size_t stream_mem(Stream* s) {
+    return sizeof(Stream) + tree_mem(&s->root);
+}
@@ -0,0 +1,87 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "dstr.h"
+
+// Append-only log of entries (field-value pairs) ordered by ID. Entries are packed into blocks:
+//   [master fields: count, (len, bytes)...] then per entry [flags][ms delta][seq][values]
+// with varint numbers, IDs delta-encoded against the block's first (master) ID, and the field names
+// left out of entries that have the same fields as the master entry. Blocks are the leaves of a radix
+// tree keyed by the big-endian master ID, so a range seek is one descent of at most 16 levels
+#define STREAM_BLOCK_BYTES 4096 // a block takes no more entries once it's this big
+#define STREAM_BLOCK_ENTRIES 128
+#define STREAM_KEY_LEN 16 // bytes of a radix tree key
+#define STREAM_ID_BUF 42 // fits "<ms>-<seq>" of any ID with the terminator
+
+struct StreamID {
+    uint64_t ms;
+    uint64_t seq;
+};
+
+struct StreamBlock {
+    StreamID master; // its radix tree key, every entry in the block has an ID >= it
+    uint32_t count = 0; // entries
+    uint32_t len = 0; // bytes used in data
+    uint32_t cap = 0;
+    uint32_t fields_len = 0; // bytes of the master field list at the start of data
+    uint8_t* data = NULL;
+};
+
+// Path compressed radix tree node. Keys all have STREAM_KEY_LEN bytes, so exactly the nodes at that
+// depth hold a block
+struct StreamNode {
+    uint8_t plen = 0; // bytes of the compressed path in front of the node's branches
+    uint8_t prefix[STREAM_KEY_LEN];
+    std::vector<uint8_t> labels; // sorted, labels[i] is the first byte under kids[i]
+    std::vector<StreamNode*> kids;
+    StreamBlock* block = NULL;
+};
+
+struct Stream {
+    StreamNode root;
+    StreamBlock* tail = NULL; // the block entries are appended to
+    StreamID last_id = {0, 0}; // of the last entry ever added, trimming doesn't change it
+    uint64_t length = 0;
+    uint64_t blocks = 0;
+};
+
+// A decoded entry. The strings point into the block and are only valid until the stream changes
+struct StreamField {
+    const char* buf;
+    size_t len;
+};
+
+struct StreamEntry {
+    StreamID id;
+    std::vector<StreamField> fields; // field, value, field, value...
+};
+
+typedef void (*StreamEntryFn)(StreamEntry* entry, void* arg);
+
+Stream* stream_new();
+void stream_free(Stream* s);
+
+int stream_id_cmp(StreamID a, StreamID b);
+// "<ms>-<seq>" or "<ms>", where the sequence is missing_seq. false if it isn't a valid ID
+bool stream_parse_id(const char* buf, size_t len, uint64_t missing_seq, StreamID* out);
+size_t stream_format_id(StreamID id, char* buf); // buf has STREAM_ID_BUF bytes
+bool stream_id_incr(StreamID* id); // false if it was the largest ID
+bool stream_id_decr(StreamID* id); // false if it was 0-0
+
+// The ID for "*": the current time, or the last ID's time with the next sequence if the clock is behind
+StreamID stream_next_id(Stream* s, uint64_t now_ms);
+// Appends an entry of n / 2 field-value pairs. id must be greater than last_id
+void stream_append(Stream* s, StreamID id, dstr** pairs, size_t n);
+// Removes the oldest entries until at most maxlen are left. Approximate trimming only drops whole
+// blocks, so up to a block more may stay. Returns the number of entries removed
+uint64_t stream_trim(Stream* s, uint64_t maxlen, bool approx);
+
+// Calls fn for the entries with start <= ID <= end, in ID order (reversed if rev), at most count of
+// them (0 for all). Returns the number of entries visited
+size_t stream_range(Stream* s, StreamID start, StreamID end, size_t count, bool rev, StreamEntryFn fn, void* arg);
+size_t stream_mem(Stream* s); // bytes held by the blocks and tree nodes
+
+#endif
@@ -2,29 +2,35 @@
 #include <cstdlib>
 #include <cstdio>
 #include "zset.h"
+#include "logger.h"
 #include "utils/common.h"
 
-
-static bool hcmp(HNode *node, HNode *keynode) {
-    ZNode *znode = container_of(node, ZNode, h_node);
-    if (znode->key->size != keynode->key->size) {
-        return false;
-    }
-    return memcmp(znode->key, keynode->key->buf, znode->key->size) == 0;
-}
-
 static ZNode* new_znode(double score, dstr *key) {
     ZNode *znode = (ZNode*)malloc(sizeof(ZNode));
     avl_init(&znode->avl_node);
-    znode->h_node = *new_node(key, T_STR);
-
     znode->score = score;
     znode->key = dstr_init(key->size);
     dstr_append(&znode->key, key->buf, key->size);
 
+    // h_node is part of the ZNode, so nothing is embedded in it and it shares the member dstr
+    HNode *hnode = &znode->h_node;
+    hnode->next = NULL;
+    hnode->hcode = str_hash((uint8_t*)key->buf, key->size);
+    hnode->key = znode->key;
+    hnode->heap_idx = -1;
+    hnode->type = T_STR;
+    hnode->flags = 0;
+    hnode->val = NULL;
+    hnode->ival = 0;
+
     return znode;
 }
 
+static void znode_free(ZNode *znode) {
+    free(znode->key);
+    free(znode);
+}
+
 static void del_avl_tree(AVLNode *node) {
     if (!node) {
         return;
@@ -35,7 +41,7 @@ static void del_avl_tree(AVLNode *node) {
     del_avl_tree(node->left);
     del_avl_tree(node->right);
 
-    free(n);
+    znode_free(n);
 }
 
 // true if the node is smaller than the {score, key} tuple
@@ -60,9 +66,10 @@ void zset_delete(ZSet *zset, ZNode *znode) {
     zset->avl_root = avl_del(&znode->avl_node);
     uint8_t deleted = hm_delete(&zset->hmap, &tmp, false);
     if (!deleted) {
-        printf("[zset] node not found\n");
+        log_warn("[zset]: node not found");
     }
-    free(znode);
+    free(tmp.key);
+    znode_free(znode);
 }
 
 // true if insert, false if update
@@ -109,6 +116,7 @@ ZNode* zset_lookup(ZSet* zset, dstr *key) {
 
     // Do a hashmap lookup
     HNode *hnode = hm_lookup(&zset->hmap, &tmp);
+    free(tmp.key);
     return hnode ? container_of(hnode, ZNode, h_node) : NULL;
 }
 
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <string.h>
+#include "latency.h"
+#include "utils/common.h"
+
+static double tick_ns = 1.0;
+static CmdStats cmdstats[CMDSTATS_SLOTS];
+
+uint32_t hist_bucket(uint64_t ns) {
+    if (ns < LAT_SUB_BUCKETS) {
+        return ns;
+    }
+    uint32_t exp = 63 - __builtin_clzll(ns);
+    if (exp >= LAT_MAX_BITS) {
+        return LAT_BUCKETS - 1;
+    }
+    uint32_t shift = exp - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB_BUCKETS + ((ns >> shift) & (LAT_SUB_BUCKETS - 1));
+}
+
+uint64_t hist_bucket_lower(uint32_t idx) {
+    if (idx < LAT_SUB_BUCKETS) {
+        return idx;
+    }
+    uint32_t shift = idx / LAT_SUB_BUCKETS - 1;
+    return (uint64_t)(LAT_SUB_BUCKETS + idx % LAT_SUB_BUCKETS) << shift;
+}
+
+uint64_t hist_bucket_upper(uint32_t idx) {
+    if (idx < LAT_SUB_BUCKETS) {
+        return idx;
+    }
+    uint32_t shift = idx / LAT_SUB_BUCKETS - 1;
+    return hist_bucket_lower(idx) + (1ull << shift) - 1;
+}
+
+void hist_record(LatencyHist* h, uint64_t ns) {
+    h->count++;
+    h->total_ns += ns;
+    h->max_ns = dmax(h->max_ns, ns);
+    h->buckets[hist_bucket(ns)]++;
+}
+
+uint64_t hist_percentile(LatencyHist* h, double p) {
+    if (!h->count) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    rank = dmax(rank, (uint64_t)1);
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return dmin(hist_bucket_upper(i), h->max_ns);
+        }
+    }
+    return h->max_ns;
+}
+
+void latency_init() {
+#ifdef LATENCY_TSC
+    // Count ticks over ~10 ms of wall clock
+    timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t tsc_start = __rdtsc();
+    uint64_t elapsed = 0;
+    while (elapsed < 10000000) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000000000ull + now.tv_nsec - start.tv_nsec;
+    }
+    uint64_t ticks = __rdtsc() - tsc_start;
+    tick_ns = ticks ? (double)elapsed / ticks : 1.0;
+#endif
+}
+
+uint64_t latency_ns(uint64_t ticks) {
+    return (uint64_t)(ticks * tick_ns);
+}
+
+// Linear probing over the command name. There are far fewer commands than slots, so the table
+// never fills up; a name that doesn't fit in CMDSTATS_NAME_LEN is not tracked
+static CmdStats* cmdstats_find(const char* name, bool create) {
+    size_t len = strlen(name);
+    if (len >= CMDSTATS_NAME_LEN) {
+        return NULL;
+    }
+
+    size_t pos = str_hash((const uint8_t*)name, len) & (CMDSTATS_SLOTS - 1);
+    for (size_t i = 0; i < CMDSTATS_SLOTS; i++) {
+        CmdStats* stats = &cmdstats[(pos + i) & (CMDSTATS_SLOTS - 1)];
+        if (!stats->name[0]) {
+            if (!create) {
+                return NULL;
+            }
+            memcpy(stats->name, name, len + 1);
+            return stats;
+        }
+        if (!strcmp(stats->name, name)) {
+            return stats;
+        }
+    }
+    return NULL;
+}
+
+void cmdstats_record(const char* name, uint64_t ns) {
+    CmdStats* stats = cmdstats_find(name, true);
+    if (stats) {
+        hist_record(&stats->hist, ns);
+    }
+}
+
+CmdStats* cmdstats_get(const char* name) {
+    return cmdstats_find(name, false);
+}
+
+void cmdstats_all(std::vector<CmdStats*>& out) {
+    for (CmdStats& stats : cmdstats) {
+        if (stats.name[0] && stats.hist.count) {
+            out.push_back(&stats);
+        }
+    }
+    std::sort(out.begin(), out.end(), [](CmdStats* a, CmdStats* b) { return strcmp(a->name, b->name) < 0; });
+}
+
+void cmdstats_reset() {
+    // Names stay so the probe chains remain valid
+    for (CmdStats& stats : cmdstats) {
+        stats.hist = LatencyHist{};
+    }
+}
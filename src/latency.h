@@ -0,0 +1,62 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LATENCY_TSC
+#endif
+
+// Log-linear (HDR style) histogram of nanoseconds. Values below LAT_SUB_BUCKETS get a bucket each,
+// every power of 2 above that is split into LAT_SUB_BUCKETS equal buckets (~6% relative error)
+#define LAT_SUB_BITS 4
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 40 // up to 2^40 ns (~18 minutes), anything longer lands in the last bucket
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+
+#define CMDSTATS_SLOTS 128 // open addressing table of commands, power of 2
+#define CMDSTATS_NAME_LEN 24
+
+struct LatencyHist {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t buckets[LAT_BUCKETS] = {};
+};
+
+struct CmdStats {
+    char name[CMDSTATS_NAME_LEN] = {};
+    LatencyHist hist;
+};
+
+uint32_t hist_bucket(uint64_t ns);
+uint64_t hist_bucket_lower(uint32_t idx);
+uint64_t hist_bucket_upper(uint32_t idx); // inclusive
+void hist_record(LatencyHist *h, uint64_t ns);
+uint64_t hist_percentile(LatencyHist *h, double p); // p in [0, 100], upper bound of the bucket that holds it
+
+// Cheap timestamps for the command hot path: rdtsc on x86 (invariant TSC), CLOCK_MONOTONIC elsewhere.
+// latency_init() measures the tick length once at startup
+void latency_init();
+uint64_t latency_ns(uint64_t ticks);
+
+static inline uint64_t latency_now() {
+#ifdef LATENCY_TSC
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Per command statistics, keyed by the lower case command name
+void cmdstats_record(const char *name, uint64_t ns);
+CmdStats* cmdstats_get(const char *name);
+void cmdstats_all(std::vector<CmdStats*> &out); // sorted by name
+void cmdstats_reset();
+
+#endif
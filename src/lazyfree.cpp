@@ -0,0 +1,83 @@
+#include <atomic>
+#include "lazyfree.h"
+#include "threadpool.h"
+#include "data_structures/roaring.h"
+#include "data_structures/stream.h"
+#include "data_structures/zset.h"
+#include "utils/common.h"
+
+// One worker, so big frees never compete with each other for the allocator. Until lazyfree_init()
+// (e.g. in tests) the pool has no workers and jobs run inline
+static ThreadPool reclaimer;
+static std::atomic<uint64_t> pending{0};
+
+static size_t bytes_cost(size_t bytes) {
+    return 1 + bytes / LAZYFREE_BYTES_PER_UNIT;
+}
+
+size_t lazyfree_cost(HNode* node) {
+    switch (node->type) {
+        case T_STR:
+            return node->val ? bytes_cost(node->val->size) : 1;
+        case T_ZSET:
+            return hm_size(&node->zset->hmap);
+        case T_HSET:
+            return hm_size(&node->hmap);
+        case T_LIST:
+            return node->list.size;
+        case T_SET:
+            return hm_size(&node->set);
+        case T_BITMAP:
+            return node->roaring ? node->roaring->containers.size() : bytes_cost(node->bitmap->size);
+        case T_HLL:
+            return bytes_cost(node->hll->size);
+        case T_STREAM:
+            return node->stream->blocks;
+        default:
+            return 1;
+    }
+}
+
+static void free_node_job(void* arg) {
+    hn_free((HNode*)arg);
+    pending.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static void free_hmap_job(void* arg) {
+    HMap* hmap = (HMap*)arg;
+    hm_destroy(hmap);
+    delete hmap;
+    pending.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void lazyfree_init() {
+    threadpool_init(&reclaimer, 1);
+}
+
+void lazyfree_shutdown() {
+    threadpool_shutdown(&reclaimer);
+}
+
+void lazyfree_node(HNode* node) {
+    if (lazyfree_cost(node) <= LAZYFREE_THRESHOLD) {
+        hn_free(node);
+        return;
+    }
+    pending.fetch_add(1, std::memory_order_relaxed);
+    threadpool_produce(&reclaimer, &free_node_job, node);
+}
+
+void lazyfree_hmap(HMap* hmap) {
+    if (hm_size(hmap) == 0) {
+        hm_clear(hmap);
+        return;
+    }
+    HMap* detached = new HMap(*hmap);
+    *hmap = HMap{};
+    pending.fetch_add(1, std::memory_order_relaxed);
+    threadpool_produce(&reclaimer, &free_hmap_job, detached);
+}
+
+uint64_t lazyfree_pending() {
+    return pending.load(std::memory_order_relaxed);
+}
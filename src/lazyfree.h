@@ -0,0 +1,29 @@
+#ifndef LAZYFREE_H
+#define LAZYFREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "data_structures/hashmap.h"
+
+// Values whose free costs more than this many units are handed to the reclaimer thread
+#define LAZYFREE_THRESHOLD 64
+// Single big allocations are unmapped page by page, one unit per this many bytes
+#define LAZYFREE_BYTES_PER_UNIT 65536
+
+void lazyfree_init();
+void lazyfree_shutdown(); // frees everything still queued and stops the reclaimer
+
+// Roughly the number of allocations freeing the node's value takes
+size_t lazyfree_cost(HNode *node);
+
+// The node must already be unlinked from every map and out of the TTL heap. Cheap nodes are freed
+// right away, expensive ones are owned by the reclaimer from here on
+void lazyfree_node(HNode *node);
+
+// Moves every node of hmap to the reclaimer and leaves hmap empty
+void lazyfree_hmap(HMap *hmap);
+
+// Objects handed to the reclaimer that are not freed yet
+uint64_t lazyfree_pending();
+
+#endif
@@ -0,0 +1,244 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "logger.h"
+#include "utils/common.h"
+
+std::atomic<int> log_level{LOG_INFO};
+
+static std::atomic<bool> running{false};
+static std::atomic<bool> stopping{false};
+static std::atomic<uint64_t> epoch{0};
+static std::atomic<uint64_t> rate_per_sec{LOG_RATE_PER_SEC};
+static std::atomic<uint64_t> rate_burst{LOG_RATE_BURST};
+static pthread_t writer;
+static FILE* out = NULL;
+
+// Rings are only added here when a thread logs for the first time, so the writer and the producers
+// practically never contend on the mutex
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<LogRing*> rings;
+
+static thread_local LogRing* my_ring = NULL;
+static thread_local uint64_t my_epoch = 0;
+
+static const char LEVEL_CHARS[] = {'D', 'I', 'W', 'E'};
+
+static uint64_t wall_ms() {
+    // Coarse clock is a plain memory read in the vDSO, the tick (1-4 ms) is plenty for logs
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// "[HH:MM:SS.mmm] L msg\n", returns the length written to buf
+static size_t format_record(char* buf, size_t cap, const LogRecord* rec) {
+    time_t secs = rec->ts_ms / 1000;
+    tm local;
+    localtime_r(&secs, &local);
+    int len = snprintf(buf, cap, "[%02d:%02d:%02d.%03u] %c %.*s\n", local.tm_hour, local.tm_min, local.tm_sec,
+                       (uint32_t)(rec->ts_ms % 1000), LEVEL_CHARS[rec->level], (int)rec->len, rec->msg);
+    return dmin((size_t)len, cap - 1);
+}
+
+static LogRing* thread_ring() {
+    uint64_t curr_epoch = epoch.load(std::memory_order_acquire);
+    if (my_ring && my_epoch == curr_epoch) {
+        return my_ring;
+    }
+
+    // First record of this thread since log_init(). An old ring was freed by log_shutdown()
+    LogRing* ring = new LogRing;
+    ring->tokens = rate_burst.load(std::memory_order_relaxed) * 1000;
+    ring->refill_ms = wall_ms();
+
+    pthread_mutex_lock(&registry_mutex);
+    rings.push_back(ring);
+    pthread_mutex_unlock(&registry_mutex);
+
+    my_ring = ring;
+    my_epoch = curr_epoch;
+    return ring;
+}
+
+static bool take_token(LogRing* ring, uint64_t now_ms) {
+    uint64_t burst = rate_burst.load(std::memory_order_relaxed) * 1000;
+    if (now_ms > ring->refill_ms) {
+        uint64_t refill = (now_ms - ring->refill_ms) * rate_per_sec.load(std::memory_order_relaxed);
+        ring->tokens = dmin(ring->tokens + refill, burst);
+    }
+    ring->refill_ms = now_ms;
+
+    if (ring->tokens < 1000) {
+        return false;
+    }
+    ring->tokens -= 1000;
+    return true;
+}
+
+void log_write(int level, const char* fmt, ...) {
+    level = dmin(dmax(level, (int)LOG_DEBUG), (int)LOG_ERROR);
+    va_list args;
+    va_start(args, fmt);
+
+    if (!running.load(std::memory_order_acquire)) {
+        LogRecord rec;
+        rec.ts_ms = wall_ms();
+        rec.level = level;
+        int len = vsnprintf(rec.msg, LOG_MSG_LEN, fmt, args);
+        rec.len = dmin((uint32_t)dmax(len, 0), (uint32_t)LOG_MSG_LEN - 1);
+
+        char buf[LOG_MSG_LEN + 32];
+        fwrite(buf, 1, format_record(buf, sizeof(buf), &rec), stdout);
+        va_end(args);
+        return;
+    }
+
+    LogRing* ring = thread_ring();
+    uint64_t now_ms = wall_ms();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (!take_token(ring, now_ms) || head - ring->tail.load(std::memory_order_acquire) == LOG_RING_SLOTS) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+
+    // The slot is ours until head moves past it
+    LogRecord* rec = &ring->records[head & (LOG_RING_SLOTS - 1)];
+    rec->ts_ms = now_ms;
+    rec->level = level;
+    int len = vsnprintf(rec->msg, LOG_MSG_LEN, fmt, args);
+    rec->len = dmin((uint32_t)dmax(len, 0), (uint32_t)LOG_MSG_LEN - 1);
+    va_end(args);
+
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Writes out every record queued so far, returns how many there were
+static size_t drain() {
+    std::vector<LogRing*> snapshot;
+    pthread_mutex_lock(&registry_mutex);
+    snapshot = rings;
+    pthread_mutex_unlock(&registry_mutex);
+
+    static char buf[1 << 16];
+    size_t used = 0;
+    size_t records = 0;
+    for (LogRing* ring : snapshot) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail < head; tail++) {
+            if (sizeof(buf) - used < LOG_MSG_LEN + 32) {
+                fwrite(buf, 1, used, out);
+                used = 0;
+            }
+            used += format_record(buf + used, sizeof(buf) - used, &ring->records[tail & (LOG_RING_SLOTS - 1)]);
+            records++;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+
+        uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+        if (dropped > ring->reported) {
+            LogRecord rec;
+            rec.ts_ms = wall_ms();
+            rec.level = LOG_WARN;
+            rec.len = snprintf(rec.msg, LOG_MSG_LEN, "[log]: dropped %llu messages",
+                               (unsigned long long)(dropped - ring->reported));
+            ring->reported = dropped;
+            if (sizeof(buf) - used < LOG_MSG_LEN + 32) {
+                fwrite(buf, 1, used, out);
+                used = 0;
+            }
+            used += format_record(buf + used, sizeof(buf) - used, &rec);
+        }
+    }
+
+    if (used) {
+        fwrite(buf, 1, used, out);
+        fflush(out);
+    }
+    return records;
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+    while (true) {
+        // Producers are done once stopping is set, so an empty pass after seeing it is the last one
+        bool stop = stopping.load(std::memory_order_acquire);
+        if (drain()) {
+            continue;
+        }
+        if (stop) {
+            break;
+        }
+        timespec ts = {0, LOG_FLUSH_US * 1000};
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+void log_init(const char* path) {
+    if (running.load()) {
+        return;
+    }
+    out = path ? fopen(path, "a") : stdout;
+    if (!out) {
+        out = stdout;
+        log_error("[log]: cannot open %s, logging to stdout", path);
+    }
+
+    epoch.fetch_add(1, std::memory_order_release);
+    stopping.store(false);
+    running.store(true, std::memory_order_release);
+    if (pthread_create(&writer, NULL, &writer_main, NULL) != 0) {
+        running.store(false);
+        if (out != stdout) {
+            fclose(out);
+        }
+        log_error("[log]: cannot start the writer thread, logging synchronously");
+    }
+}
+
+void log_shutdown() {
+    if (!running.load()) {
+        return;
+    }
+    running.store(false, std::memory_order_release);
+    stopping.store(true, std::memory_order_release);
+    pthread_join(writer, NULL);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    out = NULL;
+    for (LogRing* ring : rings) {
+        delete ring;
+    }
+    rings.clear();
+}
+
+void log_set_level(int level) {
+    log_level.store(level, std::memory_order_relaxed);
+}
+
+int log_get_level() {
+    return log_level.load(std::memory_order_relaxed);
+}
+
+void log_set_rate(uint64_t per_sec, uint64_t burst) {
+    rate_per_sec.store(per_sec, std::memory_order_relaxed);
+    rate_burst.store(burst, std::memory_order_relaxed);
+}
+
+uint64_t log_dropped() {
+    uint64_t dropped = 0;
+    pthread_mutex_lock(&registry_mutex);
+    for (LogRing* ring : rings) {
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return dropped;
+}
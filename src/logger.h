@@ -0,0 +1,74 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+enum LogLevel {
+    LOG_DEBUG = 0,
+    LOG_INFO = 1,
+    LOG_WARN = 2,
+    LOG_ERROR = 3
+};
+
+// Calls below this level are compiled out, arguments included (-DLOG_MIN_LEVEL=0 for debug logs)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+
+#define LOG_MSG_LEN 240 // longer messages are truncated
+#define LOG_RING_SLOTS 1024 // records per thread, power of 2. A full ring drops new records
+#define LOG_RATE_PER_SEC 2000 // default records per second per thread, on top of the burst
+#define LOG_RATE_BURST 2000
+#define LOG_FLUSH_US 2000 // how long the writer sleeps when every ring is empty
+
+struct LogRecord {
+    uint64_t ts_ms; // wall clock
+    uint32_t len;
+    uint8_t level;
+    char msg[LOG_MSG_LEN];
+};
+
+// Single producer (the owning thread), single consumer (the writer thread)
+struct LogRing {
+    alignas(64) std::atomic<uint64_t> head{0}; // next record to write
+    alignas(64) std::atomic<uint64_t> tail{0}; // next record to flush
+    std::atomic<uint64_t> dropped{0}; // ring full or rate limited
+    uint64_t reported = 0; // drops already written out, writer only
+
+    // Token bucket, producer only. Tokens are scaled by 1000 so the refill is exact in ms
+    uint64_t tokens = 0;
+    uint64_t refill_ms = 0;
+
+    LogRecord records[LOG_RING_SLOTS];
+};
+
+// Starts the writer thread. Records go to path (appended), or stdout when path is NULL. Until then
+// and after log_shutdown() every call is written synchronously to stdout
+void log_init(const char *path);
+// Writes out everything queued and stops the writer. No other thread may log while it runs
+void log_shutdown();
+
+void log_set_level(int level);
+int log_get_level();
+void log_set_rate(uint64_t per_sec, uint64_t burst); // per thread
+uint64_t log_dropped(); // over every ring of the current log_init()
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+extern std::atomic<int> log_level;
+
+#define log_at(level, ...)                                                                  \
+do {                                                                                        \
+    if ((level) >= LOG_MIN_LEVEL && (level) >= log_level.load(std::memory_order_relaxed)) { \
+        log_write((level), __VA_ARGS__);                                                    \
+    }                                                                                       \
+} while (0)
+
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+
+#endif
@@ -1,29 +1,73 @@
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "buffer_funcs.h"
 #include "out_helpers.h"
 
 void out_arr(Conn* conn, uint32_t len) {
+    if (out_full(conn)) {
+        return;
+    }
     buf_append_u8(conn->outgoing, TAG_ARR);
     buf_append_u32(conn->outgoing, len);
 }
 
 void out_int(Conn* conn, uint32_t nr) {
+    if (out_full(conn)) {
+        return;
+    }
     buf_append_u8(conn->outgoing, TAG_INT);
     buf_append_u32(conn->outgoing, nr);
 }
 
+void out_int64(Conn* conn, int64_t nr) {
+    if (out_full(conn)) {
+        return;
+    }
+    buf_append_u8(conn->outgoing, TAG_INT64);
+    buf_append_i64(conn->outgoing, nr);
+}
+
 void out_double(Conn* conn, double dbl) {
+    if (out_full(conn)) {
+        return;
+    }
     buf_append_u8(conn->outgoing, TAG_DOUBLE);
     buf_append_double(conn->outgoing, dbl);
 }
 
 void out_str(Conn* conn, const char* str, uint32_t size) {
+    if (out_full(conn)) {
+        return;
+    }
     buf_append_u8(conn->outgoing, TAG_STR);
     buf_append_u32(conn->outgoing, size);
     buf_append(conn->outgoing, (uint8_t*)str, size);
 }
 
+void out_hn_str(Conn* conn, HNode* node) {
+    SharedBuf* shared = hn_shared_val(node);
+    if (out_full(conn)) {
+        return;
+    }
+    if (!shared || conn->fd < 0 || conn->in_multi) {
+        char buf[HN_INT_BUF];
+        size_t len;
+        const char* val = hn_str(node, buf, &len);
+        out_str(conn, val, len);
+        return;
+    }
+
+    // Everything queued so far is before the end of outgoing, so the chunk goes last
+    uint32_t pos = offsetof(dstr, buf);
+    buf_append_u8(conn->outgoing, TAG_STR);
+    buf_append_u32(conn->outgoing, shared->len - pos);
+    shared->refs.fetch_add(1, std::memory_order_relaxed);
+    conn->out_chunk_bytes += shared->len - pos;
+    conn->out_chunks.push_back({shared, pos, conn->out_base + conn->outgoing.size()});
+}
+
 void out_not_found(Conn* conn) {
     buf_rem_last_res_code(conn->outgoing);
     buf_append_u32(conn->outgoing, RES_NX);
@@ -44,6 +88,9 @@ void out_err(Conn* conn, const char* err_mes) {
 }
 
 void out_null(Conn* conn) {
+    if (out_full(conn)) {
+        return;
+    }
     buf_append_u8(conn->outgoing, TAG_NULL);
 }
 
@@ -52,3 +99,111 @@ size_t out_unknown_arr(Conn* conn) {
     buf_append_u32(conn->outgoing, 0); // to be updated
     return conn->outgoing.size() - 4;
 }
+
+SharedBuf* shared_buf_new(const std::vector<uint8_t>& frame) {
+    SharedBuf* buf = shared_buf_alloc(frame.size());
+    memcpy(buf->data, frame.data(), frame.size());
+    return buf;
+}
+
+void out_shared(Conn* conn, SharedBuf* buf) {
+    buf->refs.fetch_add(1, std::memory_order_relaxed);
+    conn->out_chunk_bytes += buf->len;
+    uint64_t at = conn->reply_at != UINT64_MAX ? conn->reply_at : conn->out_base + conn->outgoing.size();
+    // Before the values the reply being built references already
+    auto it = conn->out_chunks.end();
+    while (it != conn->out_chunks.begin() && (it - 1)->at > at) {
+        it--;
+    }
+    conn->out_chunks.insert(it, {buf, 0, at});
+}
+
+bool out_full(Conn* conn) {
+    return out_pending_bytes(conn) > conn->out_cap;
+}
+
+bool out_reply_failed(const std::vector<uint8_t>& out, size_t status) {
+    if (status + 4 > out.size()) {
+        return false;
+    }
+    uint32_t code = 0;
+    memcpy(&code, &out[status], 4);
+    return code == RES_ERR;
+}
+
+size_t out_value_size(const uint8_t* p) {
+    uint32_t len = 0;
+    switch (*p) {
+        case TAG_INT:
+            return 1 + 4;
+        case TAG_INT64:
+        case TAG_DOUBLE:
+            return 1 + 8;
+        case TAG_STR:
+        case TAG_ERROR:
+            memcpy(&len, p + 1, 4);
+            return 1 + 4 + len;
+        case TAG_ARR: {
+            memcpy(&len, p + 1, 4);
+            size_t size = 1 + 4;
+            for (uint32_t i = 0; i < len; i++) {
+                size += out_value_size(p + size);
+            }
+            return size;
+        }
+        default:
+            return 1;
+    }
+}
+
+size_t out_reply_len(Conn* conn, size_t start) {
+    size_t len = conn->outgoing.size() - start;
+    uint64_t reply_at = conn->out_base + start;
+    for (auto it = conn->out_chunks.rbegin(); it != conn->out_chunks.rend() && it->at > reply_at; it++) {
+        len += it->buf->len - it->pos;
+    }
+    return len;
+}
+
+void out_truncate(Conn* conn, size_t len) {
+    while (!conn->out_chunks.empty() && conn->out_chunks.back().at > conn->out_base + len) {
+        OutChunk& chunk = conn->out_chunks.back();
+        conn->out_chunk_bytes -= chunk.buf->len - chunk.pos;
+        shared_buf_release(chunk.buf);
+        conn->out_chunks.pop_back();
+    }
+    conn->outgoing.resize(len);
+}
+
+void out_clear(Conn* conn) {
+    for (OutChunk& chunk : conn->out_chunks) {
+        shared_buf_release(chunk.buf);
+    }
+    conn->out_chunks.clear();
+    conn->out_chunk_bytes = 0;
+    conn->out_base += conn->outgoing.size();
+    conn->outgoing.clear();
+}
+
+bool out_pending(Conn* conn) {
+    return !conn->outgoing.empty() || !conn->out_chunks.empty();
+}
+
+size_t out_pending_bytes(Conn* conn) {
+    return conn->outgoing.size() + conn->out_chunk_bytes;
+}
+
+bool out_over_limit(Conn* conn, const OutLimit* limit, uint64_t now_ms) {
+    size_t pending = out_pending_bytes(conn);
+    if (limit->hard && pending > limit->hard) {
+        return true;
+    }
+    if (!limit->soft || pending <= limit->soft) {
+        conn->out_soft_since_ms = UINT64_MAX;
+        return false;
+    }
+    if (conn->out_soft_since_ms == UINT64_MAX) {
+        conn->out_soft_since_ms = now_ms;
+    }
+    return now_ms - conn->out_soft_since_ms >= limit->soft_ms;
+}
@@ -10,7 +10,8 @@ enum Tags {
     TAG_ARR = 2,
     TAG_NULL = 3,
     TAG_ERROR = 4,
-    TAG_DOUBLE = 5
+    TAG_DOUBLE = 5,
+    TAG_INT64 = 6
 };
 
 // Response status codes
@@ -18,15 +19,48 @@ enum ResponseStatusCodes {
     RES_OK = 0,
     RES_ERR = 1, // error
     RES_NX = 2,  // key not found
+    RES_PUSH = 3, // not a reply: a frame the server sent on its own (pub/sub message)
 };
 
 void out_arr(Conn* conn, uint32_t len);
 void out_int(Conn* conn, uint32_t nr);
+void out_int64(Conn* conn, int64_t nr);
 void out_double(Conn* conn, double dbl);
 void out_str(Conn* conn, const char* str, uint32_t size);
+// The value of a T_STR node (a string key or a hash field). A long value is referenced instead of
+// copied, unless the reply is read back from outgoing (scripts and EXEC)
+void out_hn_str(Conn* conn, HNode* node);
 void out_not_found(Conn* conn);
 void out_err(Conn* conn, const char* err_mes);
 size_t out_unknown_arr(Conn* conn);
 void out_null(Conn* conn);
 
+// Frames shared between connections. A new buffer holds one reference for its creator
+SharedBuf* shared_buf_new(const std::vector<uint8_t>& frame);
+void out_shared(Conn* conn, SharedBuf* buf); // queues buf after everything conn has pending
+// Bytes of the reply that starts at outgoing[start], with the values it references
+size_t out_reply_len(Conn* conn, size_t start);
+// The reply being built is over Conn::out_cap: the value helpers above add nothing more, so arrays may
+// lack elements, and the server drops the reply
+bool out_full(Conn* conn);
+// The reply whose status is at out[status] is an error (out_err() rewrote it). False if the status
+// isn't there
+bool out_reply_failed(const std::vector<uint8_t>& out, size_t status);
+size_t out_value_size(const uint8_t* p); // of the encoded value at p, which is known to be well formed
+void out_truncate(Conn* conn, size_t len); // drops outgoing from len on and the values referenced there
+void out_clear(Conn* conn); // drops all pending output
+bool out_pending(Conn* conn);
+size_t out_pending_bytes(Conn* conn); // outgoing and the unwritten bytes of the chunks
+
+// Output buffer limits of a class of connections, like Redis' client-output-buffer-limit. 0 for none
+struct OutLimit {
+    size_t hard; // over this the connection is closed right away
+    size_t soft; // and over this once it stayed above for soft_ms
+    uint64_t soft_ms;
+};
+
+// Whether conn's pending output broke limit at now_ms. Remembers when it went over the soft limit and
+// forgets it as soon as the output is back under
+bool out_over_limit(Conn* conn, const OutLimit* limit, uint64_t now_ms);
+
 #endif
@@ -0,0 +1,207 @@
+#include <cstdlib>
+#include <string.h>
+#include "pubsub.h"
+#include "out_helpers.h"
+#include "utils/common.h"
+#include "utils/glob.h"
+
+static size_t literal_prefix(dstr* pattern) {
+    size_t len = strcspn(pattern->buf, "*?[\\");
+    return len < pattern->size ? len : pattern->size;
+}
+
+static PatternNode* pattern_kid(PatternNode* node, uint8_t label) {
+    for (size_t i = 0; i < node->labels.size(); i++) {
+        if (node->labels[i] == label) {
+            return node->kids[i];
+        }
+    }
+    return NULL;
+}
+
+static void pattern_insert(PatternNode* root, Topic* topic) {
+    dstr* pattern = topic->node.key;
+    size_t len = literal_prefix(pattern);
+    PatternNode* node = root;
+    for (size_t i = 0; i < len; i++) {
+        PatternNode* kid = pattern_kid(node, pattern->buf[i]);
+        if (!kid) {
+            kid = new PatternNode();
+            node->labels.push_back(pattern->buf[i]);
+            node->kids.push_back(kid);
+        }
+        node = kid;
+    }
+    node->topics.push_back(topic);
+}
+
+// Takes the pattern out of its node and frees the nodes that are left without patterns or kids
+static void pattern_remove(PatternNode* root, Topic* topic) {
+    dstr* pattern = topic->node.key;
+    size_t len = literal_prefix(pattern);
+    std::vector<PatternNode*> path = {root};
+    for (size_t i = 0; i < len; i++) {
+        path.push_back(pattern_kid(path.back(), pattern->buf[i]));
+    }
+
+    std::vector<Topic*>& topics = path.back()->topics;
+    for (size_t i = 0; i < topics.size(); i++) {
+        if (topics[i] == topic) {
+            topics[i] = topics.back();
+            topics.pop_back();
+            break;
+        }
+    }
+
+    for (size_t depth = len; depth > 0; depth--) {
+        PatternNode* node = path[depth];
+        if (!node->topics.empty() || !node->kids.empty()) {
+            break;
+        }
+        PatternNode* parent = path[depth - 1];
+        for (size_t i = 0; i < parent->kids.size(); i++) {
+            if (parent->kids[i] == node) {
+                parent->kids[i] = parent->kids.back();
+                parent->kids.pop_back();
+                parent->labels[i] = parent->labels.back();
+                parent->labels.pop_back();
+                break;
+            }
+        }
+        delete node;
+    }
+}
+
+size_t pubsub_subscribe(PubSub* ps, Conn* conn, dstr* name, bool pattern) {
+    HMap* map = pattern ? &ps->patterns : &ps->channels;
+    Topic* topic = hm_find_entry<Topic>(map, name->buf, name->size);
+    if (!topic) {
+        topic = new Topic();
+        topic->pattern = pattern;
+        hm_insert_key(map, &topic->node, name->buf, name->size);
+        if (pattern) {
+            pattern_insert(&ps->pattern_root, topic);
+        }
+    }
+
+    for (Subscription* sub : conn->subscriptions) {
+        if (sub->topic == topic) {
+            return conn->subscriptions.size();
+        }
+    }
+    Subscription* sub = new Subscription{conn, topic, topic->subs.size()};
+    topic->subs.push_back(sub);
+    conn->subscriptions.push_back(sub);
+    return conn->subscriptions.size();
+}
+
+static void drop_sub(PubSub* ps, Subscription* sub) {
+    Topic* topic = sub->topic;
+    topic->subs[sub->idx] = topic->subs.back();
+    topic->subs[sub->idx]->idx = sub->idx;
+    topic->subs.pop_back();
+    delete sub;
+    if (!topic->subs.empty()) {
+        return;
+    }
+
+    if (topic->pattern) {
+        pattern_remove(&ps->pattern_root, topic);
+    }
+    hm_remove_key(topic->pattern ? &ps->patterns : &ps->channels, &topic->node);
+    delete topic;
+}
+
+size_t pubsub_unsubscribe(PubSub* ps, Conn* conn, dstr* name, bool pattern) {
+    std::vector<Subscription*>& subs = conn->subscriptions;
+    for (size_t i = 0; i < subs.size(); i++) {
+        Topic* topic = subs[i]->topic;
+        if (topic->pattern != pattern || topic->node.key->size != name->size ||
+            memcmp(topic->node.key->buf, name->buf, name->size)) {
+            continue;
+        }
+        drop_sub(ps, subs[i]);
+        subs.erase(subs.begin() + i);
+        break;
+    }
+    return subs.size();
+}
+
+void pubsub_unsubscribe_all(PubSub* ps, Conn* conn) {
+    for (Subscription* sub : conn->subscriptions) {
+        drop_sub(ps, sub);
+    }
+    conn->subscriptions.clear();
+}
+
+// Frames are written straight into a SharedBuf of their final size
+static uint8_t* put_u8(uint8_t* at, uint8_t val) {
+    *at = val;
+    return at + 1;
+}
+
+static uint8_t* put_u32(uint8_t* at, uint32_t val) {
+    memcpy(at, &val, 4);
+    return at + 4;
+}
+
+static uint8_t* put_str(uint8_t* at, const char* str, uint32_t len) {
+    at = put_u8(at, TAG_STR);
+    at = put_u32(at, len);
+    memcpy(at, str, len);
+    return at + len;
+}
+
+// [len][arr][RES_PUSH] "message" channel message, or "pmessage" pattern channel message
+static SharedBuf* message_frame(dstr* pattern, dstr* channel, dstr* message) {
+    size_t len = 4 + 5 + 5 + 5 + (pattern ? 8 + 5 + pattern->size : 7) + 5 + channel->size + 5 + message->size;
+    SharedBuf* buf = shared_buf_alloc(len);
+    uint8_t* at = put_u32(buf->data, len - 4);
+    at = put_u8(at, TAG_ARR);
+    at = put_u32(at, 2);
+    at = put_u8(at, TAG_INT);
+    at = put_u32(at, RES_PUSH);
+    if (pattern) {
+        at = put_str(at, "pmessage", 8);
+        at = put_str(at, pattern->buf, pattern->size);
+    }
+    else {
+        at = put_str(at, "message", 7);
+    }
+    at = put_str(at, channel->buf, channel->size);
+    put_str(at, message->buf, message->size);
+    return buf;
+}
+
+static size_t deliver(Topic* topic, SharedBuf* buf) {
+    for (Subscription* sub : topic->subs) {
+        out_shared(sub->conn, buf);
+    }
+    shared_buf_release(buf);
+    return topic->subs.size();
+}
+
+size_t pubsub_publish(PubSub* ps, dstr* channel, dstr* message) {
+    size_t receivers = 0;
+    Topic* topic = hm_find_entry<Topic>(&ps->channels, channel->buf, channel->size);
+    if (topic) {
+        receivers += deliver(topic, message_frame(NULL, channel, message));
+    }
+
+    // Only the patterns whose literal prefix is a prefix of the channel can match it
+    PatternNode* node = &ps->pattern_root;
+    for (size_t depth = 0; node; depth++) {
+        for (Topic* pattern : node->topics) {
+            dstr* pat = pattern->node.key;
+            if (glob_match(pat->buf, pat->size, channel->buf, channel->size)) {
+                receivers += deliver(pattern, message_frame(pat, channel, message));
+            }
+        }
+        node = depth < channel->size ? pattern_kid(node, channel->buf[depth]) : NULL;
+    }
+    return receivers;
+}
+
+size_t pubsub_size(PubSub* ps) {
+    return hm_size(&ps->channels) + hm_size(&ps->patterns);
+}
@@ -0,0 +1,55 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "server.h"
+
+// Pub/Sub channels and patterns. A published message is framed once per channel (and once per
+// matching pattern) into a SharedBuf that every receiver's output queue references, so a fan-out
+// to n subscribers costs n queue entries, not n copies of the message.
+
+struct Subscription;
+
+// A channel or pattern with at least one subscriber, freed with the last one
+struct Topic {
+    HNode node; // node.key is the map's own copy of the name
+    bool pattern = false;
+    std::vector<Subscription*> subs;
+};
+
+// Links a connection to a topic. idx is its place in Topic::subs, so unsubscribing a connection
+// doesn't scan the other subscribers of a busy channel
+struct Subscription {
+    Conn* conn;
+    Topic* topic;
+    size_t idx;
+};
+
+// Patterns are indexed by their literal prefix (the part before the first *, ?, [ or \). A publish
+// walks the channel name down the trie and only glob-matches the patterns on that path
+struct PatternNode {
+    std::vector<uint8_t> labels; // labels[i] is the next char of the prefix for kids[i]
+    std::vector<PatternNode*> kids;
+    std::vector<Topic*> topics; // patterns whose prefix ends here
+};
+
+struct PubSub {
+    HMap channels;
+    HMap patterns;
+    PatternNode pattern_root;
+};
+
+// Both return the number of channels and patterns conn is subscribed to afterwards. Subscribing
+// twice and unsubscribing from something conn isn't subscribed to are no-ops
+size_t pubsub_subscribe(PubSub* ps, Conn* conn, dstr* name, bool pattern);
+size_t pubsub_unsubscribe(PubSub* ps, Conn* conn, dstr* name, bool pattern);
+void pubsub_unsubscribe_all(PubSub* ps, Conn* conn); // when the conn closes
+
+// Queues the message to the subscribers of the channel and of every pattern that matches it,
+// returns the number of messages queued
+size_t pubsub_publish(PubSub* ps, dstr* channel, dstr* message);
+size_t pubsub_size(PubSub* ps); // channels and patterns with subscribers
+
+#endif
@@ -0,0 +1,370 @@
+// Load generator for the server, in the spirit of redis-benchmark. Every connection keeps `pipeline`
+// requests in flight and sends the next one as soon as a reply comes back.
+//   ./redis_bench [-h host] [-p port] [-c connections] [-n requests] [-P pipeline] [-d value_bytes]
+//                 [-r keyspace] [--dist uniform|zipf] [--zipf-s s] [--mix get:50,set:50] [--seed n]
+//                 [--format table|json]
+// --mix takes any of get, set, zadd, lpush and pfadd with their weights. json is for scripts like
+// tests/perf_harness.py
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "redis_client.h"
+#include "latency.h"
+#include "out_helpers.h"
+
+enum BenchCmd {
+    B_GET = 0,
+    B_SET = 1,
+    B_ZADD = 2,
+    B_LPUSH = 3,
+    B_PFADD = 4,
+    B_CMDS = 5
+};
+
+static const char* bench_names[B_CMDS] = {"get", "set", "zadd", "lpush", "pfadd"};
+
+struct BenchConfig {
+    const char* host = "127.0.0.1";
+    uint16_t port = 8000;
+    uint32_t conns = 4;
+    uint64_t requests = 100000;
+    uint32_t pipeline = 1;
+    size_t value_size = 32;
+    uint32_t keyspace = 100000;
+    bool zipf = false;
+    double zipf_s = 0.99;
+    uint32_t weights[B_CMDS] = {50, 50, 0, 0, 0};
+    uint64_t seed = 1;
+    bool json = false;
+};
+
+struct InFlight {
+    uint64_t start; // latency_now() ticks
+    uint8_t cmd;
+};
+
+struct BenchConn {
+    ClientConn client;
+    std::deque<InFlight> in_flight; // replies come back in the order the requests went out
+};
+
+static BenchConfig cfg;
+static std::vector<double> zipf_cdf;
+static uint32_t weight_total = 0;
+static std::string value;
+static uint64_t rng_state;
+
+static uint64_t issued = 0;
+static uint64_t completed = 0;
+static LatencyHist hists[B_CMDS];
+static LatencyHist all_hist;
+static uint64_t errors[B_CMDS];
+
+static uint64_t next_rand() {
+    // splitmix64
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Rank k (0 based) is picked with probability proportional to 1 / (k + 1)^s
+static void zipf_init() {
+    zipf_cdf.resize(cfg.keyspace);
+    double sum = 0;
+    for (uint32_t k = 0; k < cfg.keyspace; k++) {
+        sum += 1.0 / pow(k + 1, cfg.zipf_s);
+        zipf_cdf[k] = sum;
+    }
+    for (double& p : zipf_cdf) {
+        p /= sum;
+    }
+}
+
+static uint32_t next_key() {
+    if (!cfg.zipf) {
+        return next_rand() % cfg.keyspace;
+    }
+    double u = (next_rand() >> 11) * (1.0 / (1ull << 53));
+    size_t k = std::lower_bound(zipf_cdf.begin(), zipf_cdf.end(), u) - zipf_cdf.begin();
+    return std::min(k, zipf_cdf.size() - 1);
+}
+
+static uint8_t next_cmd() {
+    uint32_t r = next_rand() % weight_total;
+    uint8_t cmd = 0;
+    while (r >= cfg.weights[cmd]) {
+        r -= cfg.weights[cmd++];
+    }
+    return cmd;
+}
+
+static void on_reply(ClientReply* reply, void* arg);
+
+static void send_one(BenchConn* bc) {
+    char key[32];
+    char arg2[32];
+    char arg3[32];
+    uint8_t cmd = next_cmd();
+    uint32_t k = next_key();
+    const char* argv[4] = {bench_names[cmd], key, arg2, arg3};
+    size_t lens[4] = {strlen(bench_names[cmd]), 0, 0, 0};
+    size_t argc = 2;
+
+    switch (cmd) {
+        case B_GET:
+            lens[1] = snprintf(key, sizeof(key), "key:%012u", k);
+            break;
+        case B_SET:
+            lens[1] = snprintf(key, sizeof(key), "key:%012u", k);
+            argv[2] = value.data();
+            lens[2] = value.size();
+            argc = 3;
+            break;
+        case B_ZADD:
+            lens[1] = snprintf(key, sizeof(key), "zset:%012u", k);
+            lens[2] = snprintf(arg2, sizeof(arg2), "%u", (uint32_t)(next_rand() % 1000000));
+            lens[3] = snprintf(arg3, sizeof(arg3), "member:%u", (uint32_t)(next_rand() % cfg.keyspace));
+            argc = 4;
+            break;
+        case B_LPUSH:
+            lens[1] = snprintf(key, sizeof(key), "list:%012u", k);
+            argv[2] = value.data();
+            lens[2] = value.size();
+            argc = 3;
+            break;
+        default:
+            lens[1] = snprintf(key, sizeof(key), "hll:%012u", k);
+            lens[2] = snprintf(arg2, sizeof(arg2), "element:%llu", (unsigned long long)next_rand());
+            argc = 3;
+    }
+
+    bc->in_flight.push_back({latency_now(), cmd});
+    client_send(&bc->client, argv, lens, argc, &on_reply, bc);
+    issued++;
+}
+
+static void on_reply(ClientReply* reply, void* arg) {
+    BenchConn* bc = (BenchConn*)arg;
+    InFlight req = bc->in_flight.front();
+    bc->in_flight.pop_front();
+
+    uint64_t ns = latency_ns(latency_now() - req.start);
+    hist_record(&hists[req.cmd], ns);
+    hist_record(&all_hist, ns);
+    errors[req.cmd] += reply->code == RES_ERR;
+    completed++;
+
+    if (issued < cfg.requests) {
+        send_one(bc);
+    }
+}
+
+static bool parse_mix(const char* mix) {
+    memset(cfg.weights, 0, sizeof(cfg.weights));
+    std::string s(mix);
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        end = end == std::string::npos ? s.size() : end;
+        std::string item = s.substr(pos, end - pos);
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        uint32_t weight = colon == std::string::npos ? 1 : atoi(item.c_str() + colon + 1);
+
+        uint8_t cmd = 0;
+        while (cmd < B_CMDS && name != bench_names[cmd]) {
+            cmd++;
+        }
+        if (cmd == B_CMDS) {
+            fprintf(stderr, "unknown command in --mix: %s\n", name.c_str());
+            return false;
+        }
+        cfg.weights[cmd] = weight;
+        pos = end + 1;
+    }
+    return true;
+}
+
+static bool parse_args(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char* opt = argv[i];
+        if (i + 1 == argc) {
+            fprintf(stderr, "missing value for %s\n", opt);
+            return false;
+        }
+        const char* val = argv[++i];
+        if (!strcmp(opt, "-h")) {
+            cfg.host = val;
+        }
+        else if (!strcmp(opt, "-p")) {
+            cfg.port = atoi(val);
+        }
+        else if (!strcmp(opt, "-c")) {
+            cfg.conns = atoi(val);
+        }
+        else if (!strcmp(opt, "-n")) {
+            cfg.requests = strtoull(val, NULL, 10);
+        }
+        else if (!strcmp(opt, "-P")) {
+            cfg.pipeline = atoi(val);
+        }
+        else if (!strcmp(opt, "-d")) {
+            cfg.value_size = strtoull(val, NULL, 10);
+        }
+        else if (!strcmp(opt, "-r")) {
+            cfg.keyspace = atoi(val);
+        }
+        else if (!strcmp(opt, "--dist")) {
+            cfg.zipf = !strcmp(val, "zipf");
+            if (!cfg.zipf && strcmp(val, "uniform")) {
+                fprintf(stderr, "--dist is uniform or zipf\n");
+                return false;
+            }
+        }
+        else if (!strcmp(opt, "--zipf-s")) {
+            cfg.zipf_s = atof(val);
+        }
+        else if (!strcmp(opt, "--mix")) {
+            if (!parse_mix(val)) {
+                return false;
+            }
+        }
+        else if (!strcmp(opt, "--seed")) {
+            cfg.seed = strtoull(val, NULL, 10);
+        }
+        else if (!strcmp(opt, "--format")) {
+            cfg.json = !strcmp(val, "json");
+            if (!cfg.json && strcmp(val, "table")) {
+                fprintf(stderr, "--format is table or json\n");
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", opt);
+            return false;
+        }
+    }
+
+    for (uint32_t w : cfg.weights) {
+        weight_total += w;
+    }
+    if (!cfg.conns || !cfg.pipeline || !cfg.keyspace || !weight_total) {
+        fprintf(stderr, "connections, pipeline, keyspace and the mix weights must be positive\n");
+        return false;
+    }
+    return true;
+}
+
+static double us(uint64_t ns) {
+    return ns / 1000.0;
+}
+
+static void print_row(const char* name, LatencyHist* h, uint64_t errs, double secs) {
+    printf("%-8s %10llu %12.0f %9.1f %9.1f %9.1f %9.1f %8llu\n", name, (unsigned long long)h->count,
+           h->count / secs, us(hist_percentile(h, 50)), us(hist_percentile(h, 99)), us(hist_percentile(h, 99.9)),
+           us(h->max_ns), (unsigned long long)errs);
+}
+
+static void print_table(double secs) {
+    printf("%llu requests, %u connections, pipeline %u, %zu byte values, %u keys (", (unsigned long long)cfg.requests,
+           cfg.conns, cfg.pipeline, cfg.value_size, cfg.keyspace);
+    if (cfg.zipf) {
+        printf("zipf %.2f)\n", cfg.zipf_s);
+    }
+    else {
+        printf("uniform)\n");
+    }
+    printf("%.0f requests/sec in %.2f s\n\n", cfg.requests / secs, secs);
+    printf("%-8s %10s %12s %9s %9s %9s %9s %8s\n", "command", "requests", "ops/sec", "p50 us", "p99 us", "p999 us",
+           "max us", "errors");
+    uint64_t total_errors = 0;
+    for (uint8_t cmd = 0; cmd < B_CMDS; cmd++) {
+        total_errors += errors[cmd];
+        if (hists[cmd].count) {
+            print_row(bench_names[cmd], &hists[cmd], errors[cmd], secs);
+        }
+    }
+    print_row("all", &all_hist, total_errors, secs);
+}
+
+static void print_json_hist(const char* name, LatencyHist* h, uint64_t errs, double secs, bool last) {
+    printf("    \"%s\": {\"requests\": %llu, \"ops_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+           "\"p999_us\": %.1f, \"max_us\": %.1f, \"errors\": %llu}%s\n",
+           name, (unsigned long long)h->count, h->count / secs, us(hist_percentile(h, 50)), us(hist_percentile(h, 99)),
+           us(hist_percentile(h, 99.9)), us(h->max_ns), (unsigned long long)errs, last ? "" : ",");
+}
+
+static void print_json(double secs) {
+    printf("{\n  \"requests\": %llu,\n  \"connections\": %u,\n  \"pipeline\": %u,\n  \"value_size\": %zu,\n"
+           "  \"keyspace\": %u,\n  \"dist\": \"%s\",\n  \"seconds\": %.4f,\n  \"commands\": {\n",
+           (unsigned long long)cfg.requests, cfg.conns, cfg.pipeline, cfg.value_size, cfg.keyspace,
+           cfg.zipf ? "zipf" : "uniform", secs);
+    uint64_t total_errors = 0;
+    for (uint8_t cmd = 0; cmd < B_CMDS; cmd++) {
+        total_errors += errors[cmd];
+        if (hists[cmd].count) {
+            print_json_hist(bench_names[cmd], &hists[cmd], errors[cmd], secs, false);
+        }
+    }
+    print_json_hist("all", &all_hist, total_errors, secs, true);
+    printf("  }\n}\n");
+}
+
+int main(int argc, char** argv) {
+    if (!parse_args(argc, argv)) {
+        return 1;
+    }
+    latency_init();
+    rng_state = cfg.seed;
+    value.assign(cfg.value_size, 'x');
+    if (cfg.zipf) {
+        zipf_init();
+    }
+
+    std::vector<BenchConn> conns(cfg.conns);
+    std::vector<ClientConn*> clients;
+    for (BenchConn& bc : conns) {
+        if (client_connect(&bc.client, cfg.host, cfg.port)) {
+            fprintf(stderr, "can't connect to %s:%u\n", cfg.host, cfg.port);
+            return 1;
+        }
+        clients.push_back(&bc.client);
+    }
+
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < cfg.pipeline; i++) {
+        for (BenchConn& bc : conns) {
+            if (issued < cfg.requests) {
+                send_one(&bc);
+            }
+        }
+    }
+    while (completed < cfg.requests) {
+        if (client_poll(clients.data(), clients.size(), 1000) < 0) {
+            fprintf(stderr, "connection lost after %llu replies\n", (unsigned long long)completed);
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (cfg.json) {
+        print_json(secs);
+    }
+    else {
+        print_table(secs);
+    }
+
+    for (BenchConn& bc : conns) {
+        client_close(&bc.client);
+    }
+    return 0;
+}
@@ -0,0 +1,334 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "redis_client.h"
+#include "buffer_funcs.h"
+#include "out_helpers.h"
+
+int client_connect(ClientConn* c, const char* host, uint16_t port) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        return -1;
+    }
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1) {
+        return -1;
+    }
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        client_close(c);
+        return -1;
+    }
+
+    // Small pipelined requests must not wait for Nagle
+    int val = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    c->broken = false;
+    return 0;
+}
+
+void client_close(ClientConn* c) {
+    if (c->fd != -1) {
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->outgoing.clear();
+    c->incoming.clear();
+    c->pending.clear();
+}
+
+int client_send(ClientConn* c, const char* const* argv, const size_t* lens, size_t argc, ClientCallback cb,
+                void* arg) {
+    // Same layout the server parses: an array of strings behind the total length
+    size_t total = 5;
+    for (size_t i = 0; i < argc; i++) {
+        total += 5 + lens[i];
+    }
+    if (total > CLIENT_MAX_MESSAGE_LEN) {
+        return -1;
+    }
+
+    buf_append_u32(c->outgoing, total);
+    buf_append_u8(c->outgoing, TAG_ARR);
+    buf_append_u32(c->outgoing, argc);
+    for (size_t i = 0; i < argc; i++) {
+        buf_append_u8(c->outgoing, TAG_STR);
+        buf_append_u32(c->outgoing, lens[i]);
+        buf_append(c->outgoing, (const uint8_t*)argv[i], lens[i]);
+    }
+    c->pending.push_back({cb, arg});
+    return 0;
+}
+
+int client_send_cmd(ClientConn* c, std::vector<dstr*>& cmd, ClientCallback cb, void* arg) {
+    std::vector<const char*> argv(cmd.size());
+    std::vector<size_t> lens(cmd.size());
+    for (size_t i = 0; i < cmd.size(); i++) {
+        argv[i] = cmd[i]->buf;
+        lens[i] = cmd[i]->size;
+    }
+    return client_send(c, argv.data(), lens.data(), cmd.size(), cb, arg);
+}
+
+static bool parse_value(const uint8_t** pp, const uint8_t* end, ClientValue* val) {
+    const uint8_t* p = *pp;
+    if (p >= end) {
+        return false;
+    }
+    val->tag = *p++;
+
+    uint32_t u32 = 0;
+    int64_t i64 = 0;
+    switch (val->tag) {
+        case TAG_NULL:
+            break;
+        case TAG_INT:
+            if (end - p < 4) {
+                return false;
+            }
+            memcpy(&u32, p, 4);
+            val->num = (int32_t)u32;
+            p += 4;
+            break;
+        case TAG_INT64:
+            if (end - p < 8) {
+                return false;
+            }
+            memcpy(&i64, p, 8);
+            val->num = i64;
+            p += 8;
+            break;
+        case TAG_DOUBLE:
+            if (end - p < 8) {
+                return false;
+            }
+            memcpy(&val->dbl, p, 8);
+            p += 8;
+            break;
+        case TAG_STR:
+        case TAG_ERROR:
+            if (end - p < 4) {
+                return false;
+            }
+            memcpy(&u32, p, 4);
+            p += 4;
+            if ((size_t)(end - p) < u32) {
+                return false;
+            }
+            val->str.assign((const char*)p, u32);
+            p += u32;
+            break;
+        case TAG_ARR:
+            if (end - p < 4) {
+                return false;
+            }
+            memcpy(&u32, p, 4);
+            p += 4;
+            // Every element takes at least its tag, so a bigger count can only be garbage
+            if ((size_t)(end - p) < u32) {
+                return false;
+            }
+            val->arr.resize(u32);
+            for (ClientValue& elem : val->arr) {
+                if (!parse_value(&p, end, &elem)) {
+                    return false;
+                }
+            }
+            break;
+        default:
+            return false;
+    }
+    *pp = p;
+    return true;
+}
+
+int64_t client_parse_reply(const uint8_t* buf, size_t len, ClientReply* out) {
+    if (len < 4) {
+        return 0;
+    }
+    uint32_t total = 0;
+    memcpy(&total, buf, 4);
+    if (total > CLIENT_MAX_MESSAGE_LEN) {
+        return -1;
+    }
+    if (len < 4 + (size_t)total) {
+        return 0;
+    }
+
+    // [arr of 2][int status] and then the values up to the end of the frame
+    const uint8_t* p = buf + 4;
+    const uint8_t* end = p + total;
+    if (total < 10 || p[0] != TAG_ARR || p[5] != TAG_INT) {
+        return -1;
+    }
+    memcpy(&out->code, p + 6, 4);
+    p += 10;
+
+    size_t cnt = 0;
+    while (p < end) {
+        if (cnt == out->values.size()) {
+            out->values.emplace_back();
+        }
+        if (!parse_value(&p, end, &out->values[cnt++])) {
+            return -1;
+        }
+    }
+    out->values.resize(cnt);
+    return 4 + (int64_t)total;
+}
+
+// Runs the callbacks of the complete replies in data and returns how many bytes they took, -1 if
+// the stream is broken
+static int64_t dispatch(ClientConn* c, const uint8_t* data, size_t len, int* handled) {
+    size_t used = 0;
+    while (true) {
+        int64_t n = client_parse_reply(data + used, len - used, &c->reply);
+        if (n == 0) {
+            return used;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (c->reply.code == RES_PUSH) {
+            used += n;
+            if (c->on_push) {
+                c->on_push(&c->reply, c->push_arg);
+            }
+            (*handled)++;
+            continue;
+        }
+        if (c->pending.empty()) {
+            return -1;
+        }
+        used += n;
+
+        // Popped first so the callback can queue the next request
+        ClientPending pending = c->pending.front();
+        c->pending.pop_front();
+        if (pending.cb) {
+            pending.cb(&c->reply, pending.arg);
+        }
+        (*handled)++;
+    }
+}
+
+static void client_write(ClientConn* c) {
+    if (c->outgoing.empty()) {
+        return;
+    }
+    // A server that went away shows up as an error here instead of killing the process with SIGPIPE
+    ssize_t rv = send(c->fd, c->outgoing.data(), c->outgoing.size(), MSG_NOSIGNAL);
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (rv <= 0) {
+        c->broken = true;
+        return;
+    }
+    buf_consume(c->outgoing, rv);
+}
+
+static int client_read(ClientConn* c) {
+    static thread_local uint8_t chunk[CLIENT_READ_CHUNK];
+    ssize_t rv = read(c->fd, chunk, sizeof(chunk));
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (rv <= 0) {
+        c->broken = true;
+        return 0;
+    }
+
+    // Usually the previous read ended on a reply boundary, then replies are parsed straight from the
+    // chunk and only a partial one at its end is kept
+    int handled = 0;
+    if (c->incoming.empty()) {
+        int64_t used = dispatch(c, chunk, rv, &handled);
+        if (used < 0) {
+            c->broken = true;
+            return handled;
+        }
+        c->incoming.assign(chunk + used, chunk + rv);
+        return handled;
+    }
+    buf_append(c->incoming, chunk, rv);
+    int64_t used = dispatch(c, c->incoming.data(), c->incoming.size(), &handled);
+    if (used < 0) {
+        c->broken = true;
+        return handled;
+    }
+    buf_consume(c->incoming, used);
+    return handled;
+}
+
+int client_poll(ClientConn** conns, size_t n, int timeout_ms) {
+    static thread_local std::vector<struct pollfd> pfds;
+    pfds.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        // The socket buffer almost always has room, so don't spend a poll() round on finding that out
+        client_write(conns[i]);
+        if (conns[i]->broken) {
+            return -1;
+        }
+        pfds[i].fd = conns[i]->fd;
+        pfds[i].events = POLLIN | (conns[i]->outgoing.empty() ? 0 : POLLOUT);
+        pfds[i].revents = 0;
+    }
+
+    int rv = poll(pfds.data(), n, timeout_ms);
+    if (rv < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int handled = 0;
+    for (size_t i = 0; i < n && rv > 0; i++) {
+        ClientConn* c = conns[i];
+        if (pfds[i].revents & POLLOUT) {
+            client_write(c);
+        }
+        if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            handled += client_read(c);
+        }
+        if (c->broken) {
+            return -1;
+        }
+    }
+    return handled;
+}
+
+struct CallResult {
+    ClientReply* out;
+    bool done;
+};
+
+static void call_done(ClientReply* reply, void* arg) {
+    CallResult* res = (CallResult*)arg;
+    res->out->code = reply->code;
+    res->out->values = reply->values;
+    res->done = true;
+}
+
+int client_call(ClientConn* c, std::vector<dstr*>& cmd, ClientReply* out) {
+    CallResult res = {out, false};
+    if (client_send_cmd(c, cmd, &call_done, &res)) {
+        return -1;
+    }
+    ClientConn* conns[] = {c};
+    while (!res.done) {
+        if (client_poll(conns, 1, -1) < 0) {
+            // The callback still points at res, the conn can't be used anymore
+            client_close(c);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef REDIS_CLIENT_H
+#define REDIS_CLIENT_H
+
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "data_structures/dstr.h"
+
+#define CLIENT_READ_CHUNK (64 << 10) // bytes asked for per read()
+#define CLIENT_MAX_MESSAGE_LEN (32 << 20) // same limit as the server
+
+// One decoded value of a reply
+struct ClientValue {
+    uint8_t tag = 0; // TAG_*
+    int64_t num = 0; // TAG_INT and TAG_INT64
+    double dbl = 0; // TAG_DOUBLE
+    std::string str; // TAG_STR and TAG_ERROR
+    std::vector<ClientValue> arr; // TAG_ARR
+};
+
+struct ClientReply {
+    uint32_t code = 0; // RES_* status
+    std::vector<ClientValue> values; // usually one, none for commands that only send the status
+};
+
+// Called once per request, in the order the requests were sent. The reply is only valid during the call
+typedef void (*ClientCallback)(ClientReply* reply, void* arg);
+
+struct ClientPending {
+    ClientCallback cb;
+    void* arg;
+};
+
+struct ClientConn {
+    int fd = -1;
+    bool broken = false; // read/write failed or the server sent garbage, the conn can only be closed
+    std::vector<uint8_t> outgoing; // encoded requests not written yet
+    std::vector<uint8_t> incoming; // bytes of replies not complete yet
+    std::deque<ClientPending> pending; // callbacks of queued and in flight requests
+    ClientReply reply; // reused for every reply
+    // Gets the frames the server sends without a request (RES_PUSH, pub/sub messages). They are
+    // dropped if it's NULL
+    ClientCallback on_push = NULL;
+    void* push_arg = NULL;
+};
+
+// 0 on success. The socket is non-blocking, all I/O goes through client_poll()
+int client_connect(ClientConn* c, const char* host, uint16_t port);
+void client_close(ClientConn* c); // pending callbacks are dropped
+
+// Queues a request, -1 if it's longer than the server accepts. Any number can be queued before their
+// replies arrive (pipelining), they are written by the next client_poll()
+int client_send(ClientConn* c, const char* const* argv, const size_t* lens, size_t argc, ClientCallback cb,
+                void* arg);
+int client_send_cmd(ClientConn* c, std::vector<dstr*>& cmd, ClientCallback cb, void* arg);
+
+// Writes queued requests and dispatches the replies that arrived on any of the connections, waiting
+// at most timeout_ms (-1 forever) for one of them to be ready. Returns the number of callbacks run,
+// -1 if a connection broke
+int client_poll(ClientConn** conns, size_t n, int timeout_ms);
+
+// Blocking request: sends cmd after everything already queued and waits for its reply. 0 on success
+int client_call(ClientConn* c, std::vector<dstr*>& cmd, ClientReply* out);
+
+// Decodes one framed reply from buf: the number of bytes it took, 0 if buf doesn't hold all of it
+// yet, -1 if it's malformed
+int64_t client_parse_reply(const uint8_t* buf, size_t len, ClientReply* out);
+
+#endif
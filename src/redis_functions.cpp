@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <cstdlib>
+#include <ctype.h>
+#include <math.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <cstdio>
 #include "redis_functions.h"
@@ -7,11 +11,19 @@
 #include "data_structures/hashmap.h"
 #include "data_structures/heap.h"
 #include "data_structures/zset.h"
+#include "data_structures/bitmap.h"
+#include "data_structures/roaring.h"
+#include "data_structures/stream.h"
 #include "dstr.h"
 #include "out_helpers.h"
 #include "server.h"
+#include "blocking.h"
 #include "hyperloglog.h"
+#include "lazyfree.h"
+#include "latency.h"
+#include "slowlog.h"
 #include "utils/common.h"
+#include "utils/glob.h"
 
 static const ZSet empty;
 
@@ -29,6 +41,14 @@ static ZSet* find_zset(HMap* hmap, dstr* key) {
     return node->type == T_ZSET ? node->zset : NULL;
 }
 
+// Lookup without copying the key - hm_lookup only reads tmp.key and tmp.hcode
+static HNode* find_node(HMap* hmap, dstr* key) {
+    HNode tmp;
+    tmp.key = key;
+    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
+    return hm_lookup(hmap, &tmp);
+}
+
 static uint8_t validate_hmnode(Conn* conn, HNode* hm_node, uint32_t type) {
     if (!hm_node) {
         out_err(conn, "key does not exist");
@@ -41,24 +61,49 @@ static uint8_t validate_hmnode(Conn* conn, HNode* hm_node, uint32_t type) {
     return SUCCESS;
 }
 
+// Looks up cmd[from], cmd[from + step], ... in one hm_lookup_many() batch. nodes[i] is the node of the
+// i-th of those keys, NULL if it doesn't exist
+static void find_nodes(HMap* hmap, std::vector<dstr*>& cmd, size_t from, size_t step, std::vector<HNode*>& nodes) {
+    size_t n = (cmd.size() - from + step - 1) / step;
+    std::vector<HNode> tmp(n);
+    std::vector<HNode*> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        dstr* key = cmd[from + i * step];
+        tmp[i].key = key;
+        tmp[i].hcode = str_hash((uint8_t*)key->buf, key->size);
+        keys[i] = &tmp[i];
+    }
+    nodes.resize(n);
+    hm_lookup_many(hmap, keys.data(), n, nodes.data());
+}
+
+// node is the existing key or NULL. A key of another type is replaced, like in Redis
+static void set_str(HNode* node, dstr* key, dstr* val) {
+    if (node && node->type == T_STR) {
+        hn_set_str(node, val->buf, val->size);
+        return;
+    }
+    if (node) {
+        db_delete(node);
+    }
+    hm_insert(&global_data.db, new_str_node(key, val->buf, val->size));
+}
+
 uint8_t do_get(Conn* conn, std::vector<dstr*>& cmd) {
     // ARGS
     dstr* key = cmd[1];
 
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
-
-    HNode* node = hm_lookup(&global_data.db, &tmp);
+    HNode* node = find_node(&global_data.db, key);
     if (!node) {
         out_not_found(conn);
         return NOT_FOUND;
     }
-    else {
-        out_str(conn, node->val->buf, node->val->size);
-        return SUCCESS;
+    if (node->type != T_STR) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return INCORRECT_TYPE;
     }
+    out_hn_str(conn, node);
+    return SUCCESS;
 }
 
 uint8_t do_set(Conn* conn, std::vector<dstr*>& cmd) {
@@ -66,62 +111,485 @@ uint8_t do_set(Conn* conn, std::vector<dstr*>& cmd) {
     dstr* key = cmd[1];
     dstr* val = cmd[2];
 
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
+    set_str(find_node(&global_data.db, key), key, val);
+    buf_append_u8(conn->outgoing, TAG_NULL);
+    return SUCCESS;
+}
+
+/*
+ * SYNTAX: MGET key [key ...]
+ * Returns the value of every key in order, null for keys that don't exist or don't hold a string
+ */
+uint8_t do_mget(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    std::vector<HNode*> nodes;
+    find_nodes(&global_data.db, cmd, 1, 1, nodes);
+
+    out_arr(conn, nodes.size());
+    for (HNode* node : nodes) {
+        if (node && node->type == T_STR) {
+            out_hn_str(conn, node);
+        }
+        else {
+            out_null(conn);
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * SYNTAX: MSET key value [key value ...] | MSETNX key value [key value ...]
+ * MSET sets every key. MSETNX sets them only if none of them exists and returns 1 if it did, 0 if not
+ */
+uint8_t do_mset(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    bool nx = !strcmp(cmd[0]->buf, "msetnx");
+    if (cmd.size() % 2 == 0) {
+        out_err(conn, "wrong number of arguments");
+        return SIZE_ERR;
+    }
+
+    std::vector<HNode*> nodes;
+    find_nodes(&global_data.db, cmd, 1, 2, nodes);
+    if (nx) {
+        for (HNode* node : nodes) {
+            if (node) {
+                out_int(conn, 0);
+                return SUCCESS;
+            }
+        }
+    }
+
+    bool inserted = false;
+    bool replaced = false;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        dstr* key = cmd[1 + 2 * i];
+        HNode* node = nodes[i];
+
+        // The batch was looked up before any change. A key repeated in the command may have been
+        // inserted by now, or replaced if it held another type
+        if ((!node && inserted) || replaced) {
+            node = find_node(&global_data.db, key);
+        }
+        inserted |= !node;
+        replaced |= node && node->type != T_STR;
+        set_str(node, key, cmd[2 + 2 * i]);
+    }
+
+    if (nx) {
+        out_int(conn, 1);
+    }
+    else {
+        out_null(conn);
+    }
+    return SUCCESS;
+}
+
+// Current value of a counter: 0 if the key doesn't exist, false (with the error sent) if it can't be one
+static bool counter_value(Conn* conn, HNode* node, int64_t* val) {
+    *val = 0;
+    if (!node) {
+        return true;
+    }
+    if (node->type != T_STR) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return false;
+    }
+    if (hn_is_int(node)) {
+        *val = node->ival;
+        return true;
+    }
+    size_t len;
+    const char* str = hn_str(node, NULL, &len);
+    if (!str_to_int64(str, len, val)) {
+        out_err(conn, "value is not an integer or out of range");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * SYNTAX: INCR key | DECR key | INCRBY key increment | DECRBY key decrement
+ * Adds to the integer stored at key (0 if it doesn't exist) and returns the new value. Counters are
+ * stored unboxed, so they never allocate once the key exists
+ */
+uint8_t do_incr(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+    bool decr = cmd[0]->buf[0] == 'd';
+
+    int64_t by = 1;
+    if (cmd.size() == 3 && !str_to_int64(cmd[2]->buf, cmd[2]->size, &by)) {
+        out_err(conn, "value is not an integer or out of range");
+        return INCORRECT_TYPE;
+    }
+    if (decr && by == INT64_MIN) {
+        out_err(conn, "decrement would overflow");
+        return OUT_OF_RANGE;
+    }
+    by = decr ? -by : by;
+
+    HNode* node = find_node(&global_data.db, key);
+    int64_t val;
+    if (!counter_value(conn, node, &val)) {
+        return INCORRECT_TYPE;
+    }
+    if (__builtin_add_overflow(val, by, &val)) {
+        out_err(conn, "increment or decrement would overflow");
+        return OUT_OF_RANGE;
+    }
 
-    HNode* node = hm_lookup(&global_data.db, &tmp);
     if (node) {
-        dstr_assign(&node->val, val->buf, val->size);
+        hn_set_int(node, val);
     }
     else {
-        HNode* hm_node = new_node(key, T_STR);
-        dstr_append(&hm_node->val, val->buf, val->size);
-        hm_insert(&global_data.db, hm_node);
+        node = new_str_node(key, "0", 1);
+        hn_set_int(node, val);
+        hm_insert(&global_data.db, node);
     }
-    buf_append_u8(conn->outgoing, TAG_NULL);
+    out_int64(conn, val);
     return SUCCESS;
 }
 
+/*
+ * SYNTAX: INCRBYFLOAT key increment
+ * Adds a float to the number stored at key (0 if it doesn't exist) and returns the new value as a
+ * string. Whole results are stored as integers again
+ */
+uint8_t do_incrbyfloat(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+    dstr* incr = cmd[2];
+
+    char* end;
+    long double by = strtold(incr->buf, &end);
+    if (end == incr->buf || *end || isspace(incr->buf[0]) || isnan(by) || isinf(by)) {
+        out_err(conn, "value is not a valid float");
+        return INCORRECT_TYPE;
+    }
+
+    HNode* node = find_node(&global_data.db, key);
+    if (node && node->type != T_STR) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return INCORRECT_TYPE;
+    }
+    long double val = 0;
+    if (node && !hn_is_int(node)) {
+        // Both encodings keep the terminator, so strtold() can read the value in place
+        size_t len;
+        const char* str = hn_str(node, NULL, &len);
+        val = strtold(str, &end);
+        if (end == str || *end || isspace(str[0]) || isnan(val) || isinf(val)) {
+            out_err(conn, "value is not a valid float");
+            return INCORRECT_TYPE;
+        }
+    }
+    else if (node) {
+        val = node->ival;
+    }
+
+    val += by;
+    if (isnan(val) || isinf(val)) {
+        out_err(conn, "increment would produce NaN or Infinity");
+        return OUT_OF_RANGE;
+    }
+
+    // 17 decimals without an exponent and with trailing zeros cut, the same text Redis stores
+    char buf[5120];
+    int len = snprintf(buf, sizeof(buf), "%.17Lf", val);
+    if (strchr(buf, '.')) {
+        while (buf[len - 1] == '0') {
+            len--;
+        }
+        if (buf[len - 1] == '.') {
+            len--;
+        }
+    }
+    buf[len] = 0;
+
+    if (node) {
+        hn_set_str(node, buf, len);
+    }
+    else {
+        hm_insert(&global_data.db, new_str_node(key, buf, len));
+    }
+    out_str(conn, buf, len);
+    return SUCCESS;
+}
 
+/*
+ * SYNTAX: DEL key [key ...] | UNLINK key [key ...]
+ * Deletes the keys and returns how many of them existed. Values that are expensive to free are
+ * released on the reclaimer thread (expiry does the same), so the two commands are the same
+ */
 uint8_t do_del(Conn* conn, std::vector<dstr*>& cmd) {
     // ARGS
-    dstr* key = cmd[1];
+    std::vector<HNode*> nodes;
+    find_nodes(&global_data.db, cmd, 1, 1, nodes);
 
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)tmp.key->buf, tmp.key->size);
+    // A key given twice is deleted once
+    nodes.erase(std::remove(nodes.begin(), nodes.end(), (HNode*)NULL), nodes.end());
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    for (HNode* node : nodes) {
+        db_delete(node);
+    }
+    out_int(conn, nodes.size());
+    return SUCCESS;
+}
 
-    uint8_t deleted = hm_delete(&global_data.db, &tmp, true);
-    if (!deleted) {
-        out_err(conn, "node does not exist");
-        return NOT_FOUND;
+uint8_t do_unlink(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_del(conn, cmd);
+}
+
+/*
+ * SYNTAX: EXISTS key [key ...]
+ * Returns how many of the keys exist, a key given twice is counted twice
+ */
+uint8_t do_exists(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    std::vector<HNode*> nodes;
+    find_nodes(&global_data.db, cmd, 1, 1, nodes);
+
+    uint32_t found = 0;
+    for (HNode* node : nodes) {
+        found += node != NULL;
     }
+    out_int(conn, found);
+    return SUCCESS;
+}
 
-    buf_append_u8(conn->outgoing, TAG_NULL);
+/*
+ * SYNTAX: FLUSHDB | FLUSHALL [ASYNC | SYNC]
+ * There is a single database so both commands empty it. ASYNC hands the whole keyspace to the
+ * reclaimer thread, SYNC (the default) frees it before replying
+ */
+uint8_t do_flushall(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    bool async = false;
+    if (cmd.size() == 2) {
+        if (!strcasecmp(cmd[1]->buf, "async")) {
+            async = true;
+        }
+        else if (strcasecmp(cmd[1]->buf, "sync")) {
+            out_err(conn, "syntax error");
+            return INCORRECT_TYPE;
+        }
+    }
+
+    // Every key is going away, the TTL heap doesn't need to be fixed up one entry at a time
+    global_data.ttl_heap.clear();
+    if (async) {
+        lazyfree_hmap(&global_data.db);
+    }
+    else {
+        hm_destroy(&global_data.db);
+    }
+    out_null(conn);
     return SUCCESS;
 }
 
 uint8_t do_keys(Conn* conn) {
-    std::vector<dstr*> keys;
+    std::vector<HNode*> keys;
     hm_keys(&global_data.db, keys);
 
     out_arr(conn, keys.size());
-    for (dstr* key : keys) {
-        out_str(conn, key->buf, key->size);
+    for (HNode* node : keys) {
+        size_t len;
+        const char* key = hn_key(node, &len);
+        out_str(conn, key, len);
+    }
+    return SUCCESS;
+}
+
+enum ScanKind {
+    SCAN_DB = 0,
+    SCAN_HASH = 1,
+    SCAN_SET = 2,
+    SCAN_ZSET = 3
+};
+
+struct ScanOpts {
+    dstr* pattern = NULL;
+    uint64_t count = 10;
+    int64_t type = -1;
+};
+
+static const char* type_name(uint32_t type) {
+    switch (type) {
+        case T_STR:
+            return "string";
+        case T_ZSET:
+            return "zset";
+        case T_HSET:
+            return "hash";
+        case T_LIST:
+            return "list";
+        case T_SET:
+            return "set";
+        case T_BITMAP:
+            return "bitmap";
+        case T_HLL:
+            return "hyperloglog";
+        case T_STREAM:
+            return "stream";
+        default:
+            return "none";
+    }
+}
+
+// [MATCH pattern] [COUNT count] [TYPE type] starting at cmd[from], TYPE only for SCAN
+static uint8_t parse_scan_opts(Conn* conn, std::vector<dstr*>& cmd, size_t from, bool with_type, ScanOpts* opts) {
+    for (size_t i = from; i < cmd.size(); i += 2) {
+        if (i + 1 >= cmd.size()) {
+            out_err(conn, "syntax error");
+            return INCORRECT_TYPE;
+        }
+        const char* opt = cmd[i]->buf;
+        dstr* val = cmd[i + 1];
+        if (!strcasecmp(opt, "match")) {
+            opts->pattern = val;
+        }
+        else if (!strcasecmp(opt, "count")) {
+            char* end;
+            long long count = strtoll(val->buf, &end, 10);
+            if (end == val->buf || *end || count < 1) {
+                out_err(conn, "COUNT must be a positive integer");
+                return INCORRECT_TYPE;
+            }
+            opts->count = count;
+        }
+        else if (with_type && !strcasecmp(opt, "type")) {
+            opts->type = -2; // no such type, matches nothing
+            for (uint32_t type = T_STR; type <= T_STREAM; type++) {
+                if (!strcasecmp(val->buf, type_name(type))) {
+                    opts->type = type;
+                }
+            }
+        }
+        else {
+            out_err(conn, "syntax error");
+            return INCORRECT_TYPE;
+        }
+    }
+    return SUCCESS;
+}
+
+static void scan_collect(HNode* node, void* arg) {
+    ((std::vector<HNode*>*)arg)->push_back(node);
+}
+
+// Advances the cursor until count nodes were seen or the map ends. Empty buckets count too (10 per
+// requested node), so a sparse table can't turn one call into a full walk
+static size_t scan_map(HMap* hmap, size_t cursor, uint64_t count, std::vector<HNode*>& nodes) {
+    uint64_t steps = count * 10;
+    do {
+        cursor = hm_scan(hmap, cursor, &scan_collect, &nodes);
+    } while (cursor && nodes.size() < count && --steps);
+    return cursor;
+}
+
+static uint8_t scan_reply(Conn* conn, HMap* hmap, dstr* cursor_arg, ScanOpts* opts, ScanKind kind) {
+    char* end;
+    size_t cursor = strtoull(cursor_arg->buf, &end, 10);
+    if (end == cursor_arg->buf || *end) {
+        out_err(conn, "invalid cursor");
+        return INCORRECT_TYPE;
+    }
+
+    std::vector<HNode*> nodes;
+    if (hmap) {
+        cursor = scan_map(hmap, cursor, opts->count, nodes);
+    }
+    else {
+        cursor = 0;
+    }
+
+    // Filters run on what was visited, like in Redis a call may return nothing with a non-zero cursor
+    size_t kept = 0;
+    for (HNode* node : nodes) {
+        size_t len;
+        const char* key = hn_key(node, &len);
+        bool keep = !opts->pattern || glob_match(opts->pattern->buf, opts->pattern->size, key, len);
+        keep = keep && (opts->type == -1 || opts->type == node->type);
+        if (keep) {
+            nodes[kept++] = node;
+        }
+    }
+    nodes.resize(kept);
+
+    char cursor_buf[32];
+    int cursor_len = snprintf(cursor_buf, sizeof(cursor_buf), "%zu", cursor);
+    out_arr(conn, 2);
+    out_str(conn, cursor_buf, cursor_len);
+    out_arr(conn, kind == SCAN_HASH || kind == SCAN_ZSET ? 2 * nodes.size() : nodes.size());
+    for (HNode* node : nodes) {
+        if (kind == SCAN_ZSET) {
+            ZNode* znode = container_of(node, ZNode, h_node);
+            out_str(conn, znode->key->buf, znode->key->size);
+            out_double(conn, znode->score);
+            continue;
+        }
+        size_t len;
+        const char* key = hn_key(node, &len);
+        out_str(conn, key, len);
+        if (kind == SCAN_HASH) {
+            out_hn_str(conn, node);
+        }
     }
     return SUCCESS;
 }
 
+/*
+ * SYNTAX: SCAN <cursor> [MATCH <pattern>] [COUNT <count>] [TYPE <type>]
+ * Returns [next cursor, [keys...]]. Start with cursor 0 and call again with the returned cursor until
+ * it is 0. Keys that exist for the whole iteration are returned at least once
+ */
+uint8_t do_scan(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    ScanOpts opts;
+    uint8_t err = parse_scan_opts(conn, cmd, 2, true, &opts);
+    if (err) {
+        return err;
+    }
+    return scan_reply(conn, &global_data.db, cmd[1], &opts, SCAN_DB);
+}
+
+/*
+ * SYNTAX: HSCAN | SSCAN | ZSCAN <key> <cursor> [MATCH <pattern>] [COUNT <count>]
+ * Same as SCAN over the fields of a hash ([field, value, ...]), the members of a set or the members
+ * of a sorted set ([member, score, ...]). A missing key is an empty collection
+ */
+uint8_t do_collection_scan(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+    ScanOpts opts;
+    uint8_t err = parse_scan_opts(conn, cmd, 3, false, &opts);
+    if (err) {
+        return err;
+    }
+
+    ScanKind kind = cmd[0]->buf[0] == 'h' ? SCAN_HASH : cmd[0]->buf[0] == 's' ? SCAN_SET : SCAN_ZSET;
+    uint32_t types[] = {0, T_HSET, T_SET, T_ZSET};
+    HNode* node = find_node(&global_data.db, key);
+    if (node && node->type != types[kind]) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return INCORRECT_TYPE;
+    }
+
+    HMap* hmap = NULL;
+    if (node) {
+        hmap = kind == SCAN_HASH ? &node->hmap : kind == SCAN_SET ? &node->set : &node->zset->hmap;
+    }
+    return scan_reply(conn, hmap, cmd[2], &opts, kind);
+}
+
 // Adds 1 if node was inserted, 0 if node was updated (this key existed in the set already)
 uint8_t do_zadd(Conn* conn, std::vector<dstr*>& cmd) {
     // ARGS
     dstr* key = cmd[1];
     double score = strtod(cmd[2]->buf, NULL);
     dstr* member = cmd[3];
-    printf("score: %f, member: %s\n", score, member->buf);
 
     // Find the zset
     HNode tmp;
@@ -250,23 +718,24 @@ uint8_t do_expire(Conn* conn, std::vector<dstr*>& cmd) {
     return SUCCESS;
 }
 
-uint8_t do_ttl(Conn* conn, std::vector<dstr*>& cmd, std::vector<HeapNode>& heap, uint32_t curr_ms) {
+uint8_t do_ttl(Conn* conn, std::vector<dstr*>& cmd, std::vector<HeapNode>& heap, uint64_t curr_ms) {
     // ARGS
     dstr* key = cmd[1];
 
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
-
-    HNode* hnode = hm_lookup(&global_data.db, &tmp);
+    HNode* hnode = find_node(&global_data.db, key);
     if (!hnode) {
         out_null(conn);
         return SUCCESS;
     }
 
-    uint32_t ttl = (heap[hnode->heap_idx].val - curr_ms) / 1000;
-    out_int(conn, ttl);
+    if (hnode->heap_idx >= heap.size()) {
+        out_int64(conn, -1);
+        return SUCCESS;
+    }
+
+    // A key past its deadline that the timers haven't removed yet has 0 seconds left
+    uint64_t expires_ms = heap[hnode->heap_idx].val;
+    out_int64(conn, expires_ms > curr_ms ? (int64_t)((expires_ms - curr_ms) / 1000) : 0);
     return SUCCESS;
 }
 
@@ -315,25 +784,17 @@ uint8_t do_hset(Conn* conn, std::vector<dstr*>& cmd) {
     }
 
     // Find the key node in the entry hashmap
-    HNode hm_tmp;
-    tmp.key = dstr_init(field->size);
-    dstr_append(&tmp.key, field->buf, field->size);
-    hm_tmp.hcode = str_hash((uint8_t*)field->buf, field->size);
-    HNode* node = hm_lookup(&hm_node->hmap, &hm_tmp);
+    HNode* node = find_node(&hm_node->hmap, field);
 
     if (node) {
         if (node->type != T_STR) {
             out_err(conn, "[hset] node is not of type STR");
             return INCORRECT_TYPE;
         }
-        node->val = dstr_init(value->size);
-        dstr_append(&node->val, value->buf, value->size);
+        hn_set_str(node, value->buf, value->size);
     }
     else {
-        HNode* set_node = new_node(field, T_STR);
-        set_node->val = dstr_init(value->size);
-        dstr_append(&set_node->val, value->buf, value->size);
-        hm_insert(&hm_node->hmap, set_node);
+        hm_insert(&hm_node->hmap, new_str_node(field, value->buf, value->size));
     }
     out_null(conn);
     return SUCCESS;
@@ -369,7 +830,7 @@ uint8_t do_hget(Conn* conn, std::vector<dstr*>& cmd) {
     HNode* node = hm_lookup(&hm_node->hmap, &hm_tmp);
 
     if (node && node->type == T_STR) {
-        out_str(conn, node->val->buf, node->val->size);
+        out_hn_str(conn, node);
         return SUCCESS;
     }
     out_null(conn);
@@ -411,7 +872,7 @@ uint8_t do_hdel(Conn* conn, std::vector<dstr*>& cmd) {
 
     // Delete hmap entry if it's hmap is empty
     if (hm_size(&hm_node->hmap) == 0) {
-        hm_delete(&global_data.db, hm_node, true);
+        db_delete(hm_node);
     }
     out_null(conn);
     return SUCCESS;
@@ -431,36 +892,34 @@ uint8_t do_hgetall(Conn* conn, std::vector<dstr*>& cmd) {
         out_null(conn);
         return SUCCESS;
     }
+    if (hm_node->type != T_HSET) {
+        out_err(conn, "keyspace key is not of type hashmap");
+        return INCORRECT_TYPE;
+    }
 
-    std::vector<dstr*> keys;
+    std::vector<HNode*> keys;
     hm_keys(&hm_node->hmap, keys);
 
     out_arr(conn, keys.size());
-    for (dstr* key : keys) {
-        out_str(conn, key->buf, key->size);
+    for (HNode* node : keys) {
+        size_t len;
+        const char* field = hn_key(node, &len);
+        out_str(conn, field, len);
     }
     return SUCCESS;
 }
 
-uint8_t do_push(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
-    // ARGS
-    dstr* key = cmd[1];
-    dstr* value = cmd[2];
-
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
-
-    HNode* hm_node = hm_lookup(&global_data.db, &tmp);
+// Copies value onto the list at key, creating it. A client blocked on the empty list (BLPOP) takes
+// the value instead and the list stays as it is. Returns the length the list has with value in it
+static uint32_t list_push(HNode* hm_node, dstr* key, dstr* value, uint8_t side) {
+    uint32_t size = hm_node ? hm_node->list.size : 0;
+    if (!size && hand_to_waiter(key, value)) {
+        return 1;
+    }
     if (!hm_node) {
         hm_node = new_node(key, T_LIST);
         hm_insert(&global_data.db, hm_node);
     }
-    if (hm_node->type != T_LIST) {
-        out_err(conn, "node with the provided key exists and is not of type LIST");
-        return INCORRECT_TYPE;
-    }
 
     DListNode* new_node = (DListNode*)malloc(sizeof(DListNode));
     new_node->prev = NULL;
@@ -477,30 +936,57 @@ uint8_t do_push(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
         dlist_insert_before(hm_node->list.head, new_node);
         hm_node->list.head = new_node;
     }
-    else if (side == LLIST_SIDE_RIGHT) {
+    else {
         dlist_insert_after(hm_node->list.tail, new_node);
         hm_node->list.tail = new_node;
     }
+    signal_key_ready(key);
+    return ++hm_node->list.size;
+}
+
+// Unlinks the head or tail of a non-empty list, the caller frees the value and the node
+static DListNode* list_pop(HNode* hm_node, uint8_t side) {
+    DListNode* node = side == LLIST_SIDE_LEFT ? hm_node->list.head : hm_node->list.tail;
+    if (side == LLIST_SIDE_LEFT) {
+        if (node->next) {
+            node->next->prev = NULL;
+        }
+        hm_node->list.head = node->next;
+    }
     else {
-        out_err(conn, "internal error (do_push() side != 0 or 1)");
-        return INTERNAL_ERR;
+        if (node->prev) {
+            node->prev->next = NULL;
+        }
+        hm_node->list.tail = node->prev;
     }
-
-    out_int(conn, ++hm_node->list.size);
-    return SUCCESS;
+    hm_node->list.size--;
+    return node;
 }
 
-uint8_t do_pop(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
+uint8_t do_push(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
     // ARGS
     dstr* key = cmd[1];
     dstr* value = cmd[2];
 
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
-
-    HNode* hm_node = hm_lookup(&global_data.db, &tmp);
+    if (side != LLIST_SIDE_LEFT && side != LLIST_SIDE_RIGHT) {
+        out_err(conn, "internal error (do_push() side != 0 or 1)");
+        return INTERNAL_ERR;
+    }
+    HNode* hm_node = find_node(&global_data.db, key);
+    if (hm_node && hm_node->type != T_LIST) {
+        out_err(conn, "node with the provided key exists and is not of type LIST");
+        return INCORRECT_TYPE;
+    }
+
+    out_int(conn, list_push(hm_node, key, value, side));
+    return SUCCESS;
+}
+
+uint8_t do_pop(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
+    // ARGS
+    dstr* key = cmd[1];
+
+    HNode* hm_node = find_node(&global_data.db, key);
     if (!hm_node) {
         out_err(conn, "key does not exist in the database");
         return NOT_FOUND;
@@ -509,6 +995,10 @@ uint8_t do_pop(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
         out_err(conn, "node with the provided key exists and is not of type LIST");
         return INCORRECT_TYPE;
     }
+    if (side != LLIST_SIDE_LEFT && side != LLIST_SIDE_RIGHT) {
+        out_err(conn, "internal error (do_pop() side not in [0 or 1])");
+        return INTERNAL_ERR;
+    }
 
     int32_t size = cmd.size() > 2 ? strtol(cmd[2]->buf, NULL, 10) : 1;
     size = dmin(size, hm_node->list.size);
@@ -519,29 +1009,152 @@ uint8_t do_pop(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
 
     out_arr(conn, size);
     while (size--) {
-        DListNode* node = side == LLIST_SIDE_LEFT ? hm_node->list.head : hm_node->list.tail;
+        DListNode* node = list_pop(hm_node, side);
         dstr* val = (dstr*)node->val;
         out_str(conn, val->buf, val->size);
+        free(val);
+        free(node);
+    }
+    return SUCCESS;
+}
 
-        if (side == LLIST_SIDE_LEFT) {
-            if (node->next) {
-                node->next->prev = NULL;
-            }
-            hm_node->list.head = node->next;
+// Seconds as a double, like the Redis blocking commands take them. 0 waits for ever
+static bool parse_block_timeout(dstr* arg, uint64_t* out_ms) {
+    char* end;
+    double secs = strtod(arg->buf, &end);
+    if (end == arg->buf || *end || !(secs >= 0) || secs > 1e12) {
+        return false;
+    }
+    *out_ms = (uint64_t)ceil(secs * 1000);
+    return true;
+}
+
+/*
+ *  BLPOP key [key ...] timeout | BRPOP key [key ...] timeout
+ *
+ *  Pops from the first non-empty list and returns [key, element]. If all are empty it waits until
+ *  one gets an element, which is handed over directly by the push, at most timeout seconds (0 for
+ *  ever), and returns null on timeout. Inside MULTI and scripts it never waits.
+ */
+uint8_t do_bpop(Conn* conn, std::vector<dstr*>& cmd, uint8_t side) {
+    // ARGS
+    size_t nkeys = cmd.size() - 2;
+    dstr** keys = cmd.data() + 1;
+
+    // Woken by a push that handed the element over
+    if (conn->blocked && conn->blocked->handoff) {
+        dstr* key = conn->blocked->handoff_key;
+        dstr* value = conn->blocked->handoff;
+        out_arr(conn, 2);
+        out_str(conn, key->buf, key->size);
+        out_str(conn, value->buf, value->size);
+        return SUCCESS;
+    }
+
+    uint64_t timeout_ms;
+    if (!parse_block_timeout(cmd.back(), &timeout_ms)) {
+        out_err(conn, "timeout is not a float or out of range");
+        return INCORRECT_TYPE;
+    }
+
+    std::vector<HNode*> nodes;
+    find_nodes(&global_data.db, cmd, 1, 1, nodes);
+    for (size_t i = 0; i < nkeys; i++) {
+        if (nodes[i] && nodes[i]->type != T_LIST) {
+            out_err(conn, "node with the provided key exists and is not of type LIST");
+            return INCORRECT_TYPE;
         }
-        else if (side == LLIST_SIDE_RIGHT) {
-            if (node->prev) {
-                node->prev->next = NULL;
-            }
-            hm_node->list.tail = node->prev;
+    }
+    for (size_t i = 0; i < nkeys; i++) {
+        if (nodes[i] && nodes[i]->list.size) {
+            DListNode* node = list_pop(nodes[i], side);
+            dstr* val = (dstr*)node->val;
+            out_arr(conn, 2);
+            out_str(conn, keys[i]->buf, keys[i]->size);
+            out_str(conn, val->buf, val->size);
+            free(val);
+            free(node);
+            return SUCCESS;
         }
-        else {
-            out_err(conn, "internal error (do_pop() side not in [0 or 1])");
+    }
+
+    if (!block_on(conn, keys, nkeys, timeout_ms, true)) {
+        out_null(conn);
+    }
+    return SUCCESS;
+}
+
+static bool parse_side(dstr* arg, uint8_t* side) {
+    if (!strcasecmp(arg->buf, "left")) {
+        *side = LLIST_SIDE_LEFT;
+    }
+    else if (!strcasecmp(arg->buf, "right")) {
+        *side = LLIST_SIDE_RIGHT;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ *  BLMOVE source destination LEFT|RIGHT LEFT|RIGHT timeout
+ *
+ *  Pops an element from one side of source, pushes it to a side of destination and returns it. Waits
+ *  like BLPOP while source is empty. An element pushed to a waiting source goes straight to destination
+ */
+uint8_t do_blmove(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* src_key = cmd[1];
+    dstr* dst_key = cmd[2];
+
+    uint8_t from, to;
+    uint64_t timeout_ms;
+    if (!parse_side(cmd[3], &from) || !parse_side(cmd[4], &to)) {
+        out_err(conn, "syntax error");
+        return INCORRECT_TYPE;
+    }
+    if (!parse_block_timeout(cmd[5], &timeout_ms)) {
+        out_err(conn, "timeout is not a float or out of range");
+        return INCORRECT_TYPE;
+    }
+
+    HNode* src = find_node(&global_data.db, src_key);
+    HNode* dst = find_node(&global_data.db, dst_key);
+    bool wrong_type = (src && src->type != T_LIST) || (dst && dst->type != T_LIST);
+
+    // Woken by a push that handed the element over
+    if (conn->blocked && conn->blocked->handoff) {
+        dstr* value = conn->blocked->handoff;
+        if (wrong_type) {
+            // Destination changed type while waiting: the element goes back to source (or its next waiter)
+            conn->blocked->takes_pushes = false;
+            list_push(src, src_key, value, from);
+            out_err(conn, "node with the provided key exists and is not of type LIST");
+            return INCORRECT_TYPE;
         }
+        list_push(dst, dst_key, value, to);
+        out_str(conn, value->buf, value->size);
+        return SUCCESS;
+    }
+    if (wrong_type) {
+        out_err(conn, "node with the provided key exists and is not of type LIST");
+        return INCORRECT_TYPE;
+    }
 
-        hm_node->list.size--;
-        free(node);
+    if (!src || !src->list.size) {
+        if (!block_on(conn, &src_key, 1, timeout_ms, true)) {
+            out_null(conn);
+        }
+        return SUCCESS;
     }
+
+    DListNode* node = list_pop(src, from);
+    dstr* val = (dstr*)node->val;
+    list_push(dst, dst_key, val, to);
+    out_str(conn, val->buf, val->size);
+    free(val);
+    free(node);
     return SUCCESS;
 }
 
@@ -626,8 +1239,8 @@ uint8_t do_sadd(Conn* conn, std::vector<dstr*>& cmd) {
         return INCORRECT_TYPE;
     }
 
-    // Add a hnode without value - key will be the value
-    HNode* in_node = new_node(value, T_STR);
+    // The member is the node's key, its value stays empty (embedded, so no extra allocation)
+    HNode* in_node = new_str_node(value, "", 0);
     hm_insert(&hm_node->set, in_node);
     return SUCCESS;
 }
@@ -681,11 +1294,13 @@ uint8_t do_smembers(Conn* conn, std::vector<dstr*>& cmd) {
         return INCORRECT_TYPE;
     }
 
-    std::vector<dstr*> keys;
+    std::vector<HNode*> keys;
     hm_keys(&hm_node->set, keys);
     out_arr(conn, keys.size());
-    for (dstr* key : keys) {
-        out_str(conn, key->buf, key->size);
+    for (HNode* node : keys) {
+        size_t len;
+        const char* member = hn_key(node, &len);
+        out_str(conn, member, len);
     }
     return SUCCESS;
 }
@@ -714,6 +1329,49 @@ uint8_t do_scard(Conn* conn, std::vector<dstr*>& cmd) {
     return SUCCESS;
 }
 
+// Bitmaps start out plain (node->bitmap). A write that grows a sparse bitmap by at least
+// ROARING_MIN_BYTES switches it to the roaring encoding (node->roaring), and it goes back to plain
+// once the roaring encoding stops being the smaller one
+#define ROARING_MIN_BYTES 4096
+
+static size_t bitmap_len(HNode* node) {
+    return node->roaring ? node->roaring->size : node->bitmap->size;
+}
+
+static void bitmap_to_roaring(HNode* node) {
+    node->roaring = roaring_from_dense((uint8_t*)node->bitmap->buf, node->bitmap->size);
+    free(node->bitmap);
+    node->bitmap = NULL;
+}
+
+static void bitmap_to_dense(HNode* node) {
+    node->bitmap = roaring_to_dense(node->roaring);
+    roaring_free(node->roaring);
+    node->roaring = NULL;
+}
+
+// Called before a plain bitmap grows to new_size bytes with at most `ones` new set bits
+static void bitmap_prepare_grow(HNode* node, size_t new_size, uint64_t ones) {
+    size_t size = node->bitmap->size;
+    if (node->roaring || new_size < size + ROARING_MIN_BYTES) {
+        return;
+    }
+
+    // Worst case every set bit ends up in its own container
+    uint64_t cnt = bitmap_popcount((uint8_t*)node->bitmap->buf, size) + ones;
+    uint64_t est = sizeof(Roaring) + cnt * (sizeof(RContainer) + 2);
+    if (est * 2 < new_size) {
+        bitmap_to_roaring(node);
+    }
+}
+
+// Called after a write to a roaring bitmap
+static void bitmap_fix_encoding(HNode* node) {
+    if (node->roaring && roaring_mem(node->roaring) > node->roaring->size) {
+        bitmap_to_dense(node);
+    }
+}
+
 uint8_t do_setbit(Conn* conn, std::vector<dstr*>& cmd) {
     // ARGS
     dstr* key = cmd[1];
@@ -745,7 +1403,16 @@ uint8_t do_setbit(Conn* conn, std::vector<dstr*>& cmd) {
         out_err(conn, "bit has to be 0 or 1");
         return INCORRECT_TYPE;
     }
-    int64_t byte_idx = bit_idx / 8;
+    size_t byte_idx = bit_idx / 8;
+    uint8_t bit = bit_value->buf[0] - '0';
+    if (!hm_node->roaring && byte_idx >= hm_node->bitmap->size) {
+        bitmap_prepare_grow(hm_node, byte_idx + 1, bit);
+    }
+    if (hm_node->roaring) {
+        out_int(conn, roaring_set(hm_node->roaring, bit_idx, bit));
+        bitmap_fix_encoding(hm_node);
+        return SUCCESS;
+    }
     bit_idx = 7 - (bit_idx % 8);
 
     // Extend the bitmap if necessary
@@ -764,7 +1431,7 @@ uint8_t do_setbit(Conn* conn, std::vector<dstr*>& cmd) {
     out_int(conn, prev);
 
     // Set the bit
-    if (!strcmp(bit_value->buf, "1")) {
+    if (bit) {
         byte |= (1u << bit_idx);
     }
     else {
@@ -791,10 +1458,14 @@ uint8_t do_getbit(Conn* conn, std::vector<dstr*>& cmd) {
     }
 
     int64_t bit_idx = strtol(bit_pos->buf, NULL, 10);
-    if (bit_idx < 0 || bit_idx / 8 >= hm_node->bitmap->size) {
+    if (bit_idx < 0 || (size_t)bit_idx / 8 >= bitmap_len(hm_node)) {
         out_err(conn, "index outside of range");
         return OUT_OF_RANGE;
     }
+    if (hm_node->roaring) {
+        out_int(conn, roaring_get(hm_node->roaring, bit_idx));
+        return SUCCESS;
+    }
     uint32_t byte_idx = bit_idx / 8;
     bit_idx = 7 - (bit_idx % 8);
 
@@ -809,7 +1480,11 @@ uint8_t do_bitcount(Conn* conn, std::vector<dstr*>& cmd) {
     dstr* key = cmd[1];
     int64_t start = cmd.size() > 2 ? strtol(cmd[2]->buf, NULL, 10) : 0;
     int64_t end = cmd.size() > 3 ? strtol(cmd[3]->buf, NULL, 10) : -1;
-    bool is_byte_mode = cmd.size() == 5 && !strcmp(cmd[4]->buf, "BYTE");
+    bool is_byte_mode = cmd.size() == 5 && !strcasecmp(cmd[4]->buf, "byte");
+    if (cmd.size() == 5 && !is_byte_mode && strcasecmp(cmd[4]->buf, "bit")) {
+        out_err(conn, "syntax error");
+        return INCORRECT_TYPE;
+    }
 
     HNode tmp;
     tmp.key = dstr_init(key->size);
@@ -822,66 +1497,426 @@ uint8_t do_bitcount(Conn* conn, std::vector<dstr*>& cmd) {
         return invalid;
     }
 
-    size_t ret = 0;
-    if (is_byte_mode) {
-        if (start < 0) {
-            start += hm_node->bitmap->size;
+    int64_t len = is_byte_mode ? bitmap_len(hm_node) : bitmap_len(hm_node) * 8;
+    if (start < 0) {
+        start += len;
+    }
+    if (end < 0) {
+        end += len;
+    }
+    start = std::max(start, (int64_t)0);
+    end = std::min(end, len - 1);
+
+    uint64_t ret = 0;
+    if (start <= end && hm_node->roaring) {
+        ret = is_byte_mode ? roaring_count_range(hm_node->roaring, start * 8, end * 8 + 7)
+                           : roaring_count_range(hm_node->roaring, start, end);
+    }
+    else if (start <= end) {
+        uint8_t* buf = (uint8_t*)hm_node->bitmap->buf;
+        ret = is_byte_mode ? bitmap_popcount(buf + start, end - start + 1) : bitmap_count_range(buf, start, end);
+    }
+    out_int(conn, ret);
+    return SUCCESS;
+}
+
+uint8_t do_bitop(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* op_name = cmd[1];
+    dstr* dest_key = cmd[2];
+
+    uint8_t op = 0;
+    if (!strcasecmp(op_name->buf, "and")) {
+        op = BITOP_AND;
+    }
+    else if (!strcasecmp(op_name->buf, "or")) {
+        op = BITOP_OR;
+    }
+    else if (!strcasecmp(op_name->buf, "xor")) {
+        op = BITOP_XOR;
+    }
+    else if (!strcasecmp(op_name->buf, "not")) {
+        op = BITOP_NOT;
+    }
+    else {
+        out_err(conn, "operation must be AND, OR, XOR or NOT");
+        return INCORRECT_TYPE;
+    }
+    if (op == BITOP_NOT && cmd.size() != 4) {
+        out_err(conn, "BITOP NOT takes exactly one source key");
+        return SIZE_ERR;
+    }
+
+    // Collect the sources, a missing key is an empty bitmap (NULL)
+    std::vector<HNode*> nodes;
+    size_t max_len = 0;
+    bool has_roaring = false;
+    for (size_t i = 3; i < cmd.size(); i++) {
+        HNode* hm_node = find_node(&global_data.db, cmd[i]);
+        if (hm_node && hm_node->type != T_BITMAP) {
+            out_err(conn, "key already exists in database but is not of type BITMAP");
+            return INCORRECT_TYPE;
+        }
+        nodes.push_back(hm_node);
+        max_len = std::max(max_len, hm_node ? bitmap_len(hm_node) : 0);
+        has_roaring |= hm_node && hm_node->roaring;
+    }
+
+    HNode* dest = find_node(&global_data.db, dest_key);
+    if (dest && dest->type != T_BITMAP) {
+        out_err(conn, "key already exists in database but is not of type BITMAP");
+        return INCORRECT_TYPE;
+    }
+    if (!dest && max_len == 0) {
+        out_int(conn, 0);
+        return SUCCESS;
+    }
+
+    // Sparse sources keep the result sparse: plain sources are converted for the duration of the op
+    if (has_roaring) {
+        std::vector<Roaring*> srcs;
+        std::vector<Roaring*> tmp;
+        for (HNode* hm_node : nodes) {
+            if (hm_node && !hm_node->roaring) {
+                tmp.push_back(roaring_from_dense((uint8_t*)hm_node->bitmap->buf, hm_node->bitmap->size));
+            }
+            srcs.push_back(!hm_node ? NULL : hm_node->roaring ? hm_node->roaring : tmp.back());
+        }
+        Roaring* res = roaring_op(op, srcs.data(), srcs.size());
+        for (Roaring* r : tmp) {
+            roaring_free(r);
+        }
+
+        if (!dest) {
+            dest = new_node(dest_key, T_BITMAP);
+            hm_insert(&global_data.db, dest);
+        }
+        free(dest->bitmap);
+        roaring_free(dest->roaring);
+        dest->bitmap = NULL;
+        dest->roaring = res;
+        bitmap_fix_encoding(dest);
+
+        out_int(conn, max_len);
+        return SUCCESS;
+    }
+
+    std::vector<dstr*> srcs;
+    for (HNode* hm_node : nodes) {
+        srcs.push_back(hm_node ? hm_node->bitmap : NULL);
+    }
+
+    // Build the result in a new string because dest can also be one of the sources.
+    // Shorter sources are treated as zero-padded up to max_len
+    dstr* res = dstr_init(max_len);
+    dstr_resize(&res, max_len, '\0');
+    uint8_t* rbuf = (uint8_t*)res->buf;
+    if (srcs[0]) {
+        memcpy(rbuf, srcs[0]->buf, srcs[0]->size);
+    }
+
+    if (op == BITOP_NOT) {
+        bitmap_op(BITOP_NOT, rbuf, rbuf, max_len);
+    }
+    for (size_t i = 1; i < srcs.size(); i++) {
+        size_t src_len = srcs[i] ? srcs[i]->size : 0;
+        if (src_len) {
+            bitmap_op(op, rbuf, (uint8_t*)srcs[i]->buf, src_len);
+        }
+        if (op == BITOP_AND) {
+            memset(rbuf + src_len, 0, max_len - src_len);
+        }
+    }
+
+    if (!dest) {
+        dest = new_node(dest_key, T_BITMAP);
+        hm_insert(&global_data.db, dest);
+    }
+    free(dest->bitmap);
+    roaring_free(dest->roaring);
+    dest->bitmap = res;
+    dest->roaring = NULL;
+
+    out_int(conn, max_len);
+    return SUCCESS;
+}
+
+uint8_t do_bitpos(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+    dstr* bit_value = cmd[2];
+    int64_t start = cmd.size() > 3 ? strtol(cmd[3]->buf, NULL, 10) : 0;
+    int64_t end = cmd.size() > 4 ? strtol(cmd[4]->buf, NULL, 10) : -1;
+    bool is_byte_mode = cmd.size() == 6 && !strcasecmp(cmd[5]->buf, "byte");
+    if (cmd.size() == 6 && !is_byte_mode && strcasecmp(cmd[5]->buf, "bit")) {
+        out_err(conn, "syntax error");
+        return INCORRECT_TYPE;
+    }
+
+    if (strcmp(bit_value->buf, "0") && strcmp(bit_value->buf, "1")) {
+        out_err(conn, "bit has to be 0 or 1");
+        return INCORRECT_TYPE;
+    }
+    uint8_t bit = bit_value->buf[0] - '0';
+
+    HNode* hm_node = find_node(&global_data.db, key);
+    uint8_t invalid = validate_hmnode(conn, hm_node, T_BITMAP);
+    if (invalid) {
+        return invalid;
+    }
+
+    // An empty range has no bits at all, not even the padding below
+    uint64_t start_bit, end_bit;
+    if (!bitmap_pos_range(start, end, bitmap_len(hm_node), is_byte_mode, &start_bit, &end_bit)) {
+        out_int64(conn, -1);
+        return SUCCESS;
+    }
+    int64_t pos = hm_node->roaring ? roaring_find_bit(hm_node->roaring, start_bit, end_bit, bit)
+                                   : bitmap_find_bit((uint8_t*)hm_node->bitmap->buf, start_bit, end_bit, bit);
+
+    // Without an explicit end the bitmap is considered to be padded with 0-bits on the right
+    if (pos == -1 && bit == 0 && cmd.size() <= 4) {
+        pos = bitmap_len(hm_node) * 8;
+    }
+    out_int64(conn, pos);
+    return SUCCESS;
+}
+
+enum BitfieldOps {
+    BITFIELD_GET = 0,
+    BITFIELD_SET = 1,
+    BITFIELD_INCRBY = 2
+};
+
+struct BitfieldOp {
+    uint8_t op;  // BITFIELD_GET / BITFIELD_SET / BITFIELD_INCRBY
+    uint8_t bits;
+    bool is_signed;
+    uint8_t overflow;  // BitfieldOverflow active when this op was parsed
+    uint64_t offset;
+    int64_t arg;  // value for SET, increment for INCRBY
+};
+
+// Parses i<bits> / u<bits>. Signed fields can be up to 64 bits, unsigned up to 63 (so they fit in an int64)
+static bool parse_bitfield_type(dstr* type, uint8_t* bits, bool* is_signed) {
+    char c = type->buf[0];
+    if (c != 'i' && c != 'I' && c != 'u' && c != 'U') {
+        return false;
+    }
+    char* endp = NULL;
+    long val = strtol(type->buf + 1, &endp, 10);
+    *is_signed = c == 'i' || c == 'I';
+    if (endp == type->buf + 1 || *endp || val < 1 || val > (*is_signed ? 64 : 63)) {
+        return false;
+    }
+    *bits = val;
+    return true;
+}
+
+// Parses an offset in bits or #N meaning N * bits
+static bool parse_bitfield_offset(dstr* offset, uint8_t bits, uint64_t* res) {
+    bool multiply = offset->buf[0] == '#';
+    const char* start = offset->buf + multiply;
+    char* endp = NULL;
+    long long val = strtoll(start, &endp, 10);
+    if (endp == start || *endp || val < 0) {
+        return false;
+    }
+    // Checked before the multiply, a big enough #N would wrap to a small offset
+    if (multiply && (uint64_t)val > UINT32_MAX / bits) {
+        return false;
+    }
+
+    uint64_t bit_offset = multiply ? (uint64_t)val * bits : (uint64_t)val;
+    if (bit_offset + bits - 1 > UINT32_MAX) {
+        return false;
+    }
+    *res = bit_offset;
+    return true;
+}
+
+/*
+ *  BITFIELD key [GET type offset] [SET type offset value] [INCRBY type offset increment]
+ *               [OVERFLOW WRAP|SAT|FAIL] ...
+ *
+ *  All subcommands are validated before any of them runs. Returns an array with one element per
+ *  GET/SET/INCRBY: the read value, the previous value for SET, the new value for INCRBY or NULL if
+ *  OVERFLOW FAIL prevented the write.
+ */
+uint8_t do_bitfield(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+
+    // Parse the subcommands
+    std::vector<BitfieldOp> ops;
+    uint8_t overflow = BF_OVERFLOW_WRAP;
+    bool has_write = false;
+    uint64_t max_byte = 0;
+    for (size_t i = 2; i < cmd.size();) {
+        const char* name = cmd[i]->buf;
+        if (!strcasecmp(name, "overflow") && i + 1 < cmd.size()) {
+            if (!strcasecmp(cmd[i + 1]->buf, "wrap")) {
+                overflow = BF_OVERFLOW_WRAP;
+            }
+            else if (!strcasecmp(cmd[i + 1]->buf, "sat")) {
+                overflow = BF_OVERFLOW_SAT;
+            }
+            else if (!strcasecmp(cmd[i + 1]->buf, "fail")) {
+                overflow = BF_OVERFLOW_FAIL;
+            }
+            else {
+                out_err(conn, "overflow must be WRAP, SAT or FAIL");
+                return INCORRECT_TYPE;
+            }
+            i += 2;
+            continue;
+        }
+
+        BitfieldOp op = {};
+        size_t argc = 0;
+        if (!strcasecmp(name, "get")) {
+            op.op = BITFIELD_GET;
+            argc = 3;
+        }
+        else if (!strcasecmp(name, "set")) {
+            op.op = BITFIELD_SET;
+            argc = 4;
         }
-        if (end < 0) {
-            end += hm_node->bitmap->size;
+        else if (!strcasecmp(name, "incrby")) {
+            op.op = BITFIELD_INCRBY;
+            argc = 4;
+        }
+        if (!argc || i + argc > cmd.size()) {
+            out_err(conn, "syntax error");
+            return INCORRECT_TYPE;
+        }
+        if (!parse_bitfield_type(cmd[i + 1], &op.bits, &op.is_signed)) {
+            out_err(conn, "invalid bitfield type, use i1..i64 or u1..u63");
+            return INCORRECT_TYPE;
+        }
+        if (!parse_bitfield_offset(cmd[i + 2], op.bits, &op.offset)) {
+            out_err(conn, "bit offset is not an integer or out of range");
+            return OUT_OF_RANGE;
+        }
+        if (argc == 4) {
+            char* endp = NULL;
+            op.arg = strtoll(cmd[i + 3]->buf, &endp, 10);
+            if (endp == cmd[i + 3]->buf || *endp) {
+                out_err(conn, "value is not an integer");
+                return INCORRECT_TYPE;
+            }
+            has_write = true;
+            max_byte = std::max(max_byte, (op.offset + op.bits - 1) / 8);
+        }
+        op.overflow = overflow;
+        ops.push_back(op);
+        i += argc;
+    }
+
+    HNode* hm_node = find_node(&global_data.db, key);
+    if (hm_node && hm_node->type != T_BITMAP) {
+        out_err(conn, "key already exists in database but is not of type BITMAP");
+        return INCORRECT_TYPE;
+    }
+    if (!hm_node && has_write) {
+        hm_node = new_node(key, T_BITMAP);
+        hm_insert(&global_data.db, hm_node);
+    }
+
+    if (has_write && !hm_node->roaring && max_byte >= hm_node->bitmap->size) {
+        bitmap_prepare_grow(hm_node, max_byte + 1, 64 * ops.size());
+    }
+    if (hm_node && hm_node->roaring) {
+        Roaring* r = hm_node->roaring;
+        if (has_write) {
+            r->size = std::max(r->size, max_byte + 1);
         }
-        end = std::min(end, (int64_t)hm_node->bitmap->size - 1);
 
-        for (int64_t byte_idx = start; byte_idx <= end; byte_idx++) {
-            uint8_t byte = hm_node->bitmap->buf[byte_idx];
-            while (byte) {
-                ret += (byte & 1);
-                byte >>= 1;
+        out_arr(conn, ops.size());
+        for (BitfieldOp& op : ops) {
+            int64_t old = roaring_get_field(r, op.offset, op.bits, op.is_signed);
+            if (op.op == BITFIELD_GET) {
+                out_int64(conn, old);
+                continue;
             }
+
+            int64_t res = 0;
+            bool ok = op.op == BITFIELD_SET
+                          ? bitmap_field_add(op.arg, 0, op.bits, op.is_signed, op.overflow, &res)
+                          : bitmap_field_add(old, op.arg, op.bits, op.is_signed, op.overflow, &res);
+            if (!ok) {
+                out_null(conn);
+                continue;
+            }
+            roaring_set_field(r, op.offset, op.bits, (uint64_t)res);
+            out_int64(conn, op.op == BITFIELD_SET ? old : res);
         }
+        bitmap_fix_encoding(hm_node);
+        return SUCCESS;
     }
-    else {
-        size_t bit_count = hm_node->bitmap->size * 8;
-        if (start < 0) {
-            start += bit_count;
+
+    // Grow once for all writes
+    if (has_write && max_byte >= hm_node->bitmap->size) {
+        uint8_t err = dstr_resize(&hm_node->bitmap, max_byte + 1, '\0');
+        if (err) {
+            out_err(conn, "bitmap resize failed");
+            return INTERNAL_ERR;
         }
-        if (end < 0) {
-            end += bit_count;
+    }
+
+    out_arr(conn, ops.size());
+    for (BitfieldOp& op : ops) {
+        uint8_t* buf = hm_node ? (uint8_t*)hm_node->bitmap->buf : NULL;
+        size_t len = hm_node ? hm_node->bitmap->size : 0;
+        int64_t old = bitmap_get_field(buf, len, op.offset, op.bits, op.is_signed);
+        if (op.op == BITFIELD_GET) {
+            out_int64(conn, old);
+            continue;
         }
-        end = std::min(end, (int64_t)bit_count - 1);
 
-        for (int64_t bit_pos = start; bit_pos <= end; bit_pos++) {
-            int64_t byte_idx = bit_pos / 8;
-            int64_t bit_idx = 7 - (bit_pos % 8);
-            ret += (hm_node->bitmap->buf[byte_idx] >> bit_idx) & 1;
+        int64_t res = 0;
+        bool ok = op.op == BITFIELD_SET
+                      ? bitmap_field_add(op.arg, 0, op.bits, op.is_signed, op.overflow, &res)
+                      : bitmap_field_add(old, op.arg, op.bits, op.is_signed, op.overflow, &res);
+        if (!ok) {
+            out_null(conn);
+            continue;
         }
+        bitmap_set_field(buf, op.offset, op.bits, (uint64_t)res);
+        out_int64(conn, op.op == BITFIELD_SET ? old : res);
     }
-    out_int(conn, ret);
     return SUCCESS;
 }
 
+/*
+ *  PFADD key [element ...]
+ *
+ *  Returns 1 if any register changed or the key was created, 0 otherwise.
+ */
 uint8_t do_pfadd(Conn* conn, std::vector<dstr*>& cmd) {
     // ARGS
     dstr* key = cmd[1];
-    dstr* val = cmd[2];
 
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
-
-    HNode* hm_node = hm_lookup(&global_data.db, &tmp);
+    HNode* hm_node = find_node(&global_data.db, key);
+    bool created = false;
     if (!hm_node) {
         hm_node = new_node(key, T_HLL);
         hm_insert(&global_data.db, hm_node);
+        created = true;
     }
     if (hm_node->type != T_HLL) {
-        out_err(conn, "wrong type");
+        out_err(conn, "key already exists in database but is not the correct type");
         return INCORRECT_TYPE;
     }
 
-    uint8_t is_added = hll_add(&hm_node->hll, val);
-    out_int(conn, is_added);
+    uint8_t is_added = 0;
+    if (cmd.size() == 3) {
+        is_added = hll_add(&hm_node->hll, cmd[2]);
+    }
+    else if (cmd.size() > 3) {
+        is_added = hll_add_batch(&hm_node->hll, cmd.data() + 2, cmd.size() - 2);
+    }
+    out_int(conn, is_added || created);
     return SUCCESS;
 }
 
@@ -889,20 +1924,578 @@ uint8_t do_pfcount(Conn* conn, std::vector<dstr*>& cmd) {
     // ARGS
     dstr* key = cmd[1];
 
-    HNode tmp;
-    tmp.key = dstr_init(key->size);
-    dstr_append(&tmp.key, key->buf, key->size);
-    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
+    if (cmd.size() == 2) {
+        HNode* hm_node = find_node(&global_data.db, key);
+        uint8_t invalid = validate_hmnode(conn, hm_node, T_HLL);
+        if (invalid) {
+            return invalid;
+        }
 
-    HNode* hm_node = hm_lookup(&global_data.db, &tmp);
-    uint8_t invalid = validate_hmnode(conn, hm_node, T_HLL);
-    if (invalid) {
-        return invalid;
+        uint64_t count = hll_count(hm_node->hll);
+        out_int(conn, count);
+        return SUCCESS;
     }
 
-    uint64_t count = hll_count(hm_node->hll);
+    // Count of the union of all keys, missing keys are empty
+    std::vector<dstr*> hlls;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        HNode* hm_node = find_node(&global_data.db, cmd[i]);
+        if (!hm_node) {
+            continue;
+        }
+        if (hm_node->type != T_HLL) {
+            out_err(conn, "key already exists in database but is not the correct type");
+            return INCORRECT_TYPE;
+        }
+        hlls.push_back(hm_node->hll);
+    }
+
+    uint64_t count = hlls.empty() ? 0 : hll_count_union(hlls.data(), hlls.size());
     out_int(conn, count);
     return SUCCESS;
 }
 
-uint8_t do_pfmerge(Conn* conn, std::vector<dstr*>& cmd) {}
+/*
+ *  PFMERGE destkey [sourcekey ...]
+ *
+ *  destkey becomes the union of itself and the source keys. It is created if it does not exist
+ *  and missing source keys are skipped.
+ */
+uint8_t do_pfmerge(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* dest_key = cmd[1];
+
+    std::vector<dstr*> srcs;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        HNode* hm_node = find_node(&global_data.db, cmd[i]);
+        if (!hm_node) {
+            continue;
+        }
+        if (hm_node->type != T_HLL) {
+            out_err(conn, "key already exists in database but is not the correct type");
+            return INCORRECT_TYPE;
+        }
+        srcs.push_back(hm_node->hll);
+    }
+
+    HNode* dest = find_node(&global_data.db, dest_key);
+    if (dest && dest->type != T_HLL) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return INCORRECT_TYPE;
+    }
+    if (!dest) {
+        dest = new_node(dest_key, T_HLL);
+        hm_insert(&global_data.db, dest);
+    }
+
+    hll_merge(&dest->hll, srcs.data(), srcs.size());
+    out_null(conn);
+    return SUCCESS;
+}
+
+static void out_stream_entry(StreamEntry* e, void* arg) {
+    Conn* conn = (Conn*)arg;
+    char id[STREAM_ID_BUF];
+    out_arr(conn, 2);
+    out_str(conn, id, stream_format_id(e->id, id));
+    out_arr(conn, e->fields.size());
+    for (StreamField& field : e->fields) {
+        out_str(conn, field.buf, field.len);
+    }
+}
+
+// Entries with start <= ID <= end as an array of [id, [field, value, ...]]
+static void out_stream_range(Conn* conn, Stream* s, StreamID start, StreamID end, size_t count, bool rev) {
+    size_t arr_pos = out_unknown_arr(conn);
+    uint32_t n = stream_range(s, start, end, count, rev, &out_stream_entry, conn);
+    memcpy(&conn->outgoing[arr_pos], &n, 4);
+}
+
+static bool parse_count(dstr* arg, uint64_t* out) {
+    int64_t count;
+    if (!str_to_int64(arg->buf, arg->size, &count) || count < 0) {
+        return false;
+    }
+    *out = count;
+    return true;
+}
+
+/*
+ *  XADD key [NOMKSTREAM] [MAXLEN [=|~] count] <* | id> field value [field value ...]
+ *
+ *  Appends an entry and returns its ID. * takes the current time in ms (the next sequence if the clock is
+ *  behind the last entry), <ms>-* the next sequence of a given time. MAXLEN trims the oldest entries
+ *  after the append, ~ only drops whole blocks, which is cheaper and keeps a few more.
+ */
+uint8_t do_xadd(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+
+    bool nomkstream = false;
+    bool trim = false;
+    bool approx = false;
+    uint64_t maxlen = 0;
+    size_t i = 2;
+    for (; i < cmd.size(); i++) {
+        const char* opt = cmd[i]->buf;
+        if (!strcasecmp(opt, "nomkstream")) {
+            nomkstream = true;
+        }
+        else if (!strcasecmp(opt, "maxlen") && i + 1 < cmd.size()) {
+            trim = true;
+            if (!strcmp(cmd[i + 1]->buf, "~") || !strcmp(cmd[i + 1]->buf, "=")) {
+                approx = cmd[++i]->buf[0] == '~';
+            }
+            if (i + 1 >= cmd.size() || !parse_count(cmd[++i], &maxlen)) {
+                out_err(conn, "MAXLEN must be a non-negative integer");
+                return INCORRECT_TYPE;
+            }
+        }
+        else {
+            break;
+        }
+    }
+    if (i + 3 > cmd.size() || (cmd.size() - i - 1) % 2) {
+        out_err(conn, "wrong number of arguments");
+        return SIZE_ERR;
+    }
+
+    HNode* hm_node = find_node(&global_data.db, key);
+    if (hm_node && hm_node->type != T_STREAM) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return INCORRECT_TYPE;
+    }
+    if (!hm_node && nomkstream) {
+        out_not_found(conn);
+        return NOT_FOUND;
+    }
+    Stream* stream = hm_node ? hm_node->stream : NULL;
+    StreamID last = stream ? stream->last_id : StreamID{0, 0};
+
+    // The ID: *, <ms>-* or an explicit one that must be greater than the last
+    dstr* id_arg = cmd[i];
+    StreamID id;
+    if (!strcmp(id_arg->buf, "*")) {
+        id = stream ? stream_next_id(stream, get_curr_ms()) : StreamID{get_curr_ms(), 0};
+        if (!id.ms && !id.seq) {
+            id.seq = 1;
+        }
+    }
+    else if (id_arg->size > 2 && !strcmp(id_arg->buf + id_arg->size - 2, "-*")) {
+        if (!stream_parse_id(id_arg->buf, id_arg->size - 2, 0, &id)) {
+            out_err(conn, "invalid stream ID");
+            return INCORRECT_TYPE;
+        }
+        if (id.ms == last.ms && !stream_id_incr(&(id = last))) {
+            out_err(conn, "the stream has exhausted the last possible ID");
+            return OUT_OF_RANGE;
+        }
+        if (!id.ms && !id.seq) {
+            id.seq = 1;
+        }
+    }
+    else if (!stream_parse_id(id_arg->buf, id_arg->size, 0, &id)) {
+        out_err(conn, "invalid stream ID");
+        return INCORRECT_TYPE;
+    }
+    if (!id.ms && !id.seq) {
+        out_err(conn, "the ID specified in XADD must be greater than 0-0");
+        return INCORRECT_TYPE;
+    }
+    if (stream_id_cmp(id, last) <= 0) {
+        out_err(conn, "the ID specified in XADD is equal or smaller than the target stream top item");
+        return INCORRECT_TYPE;
+    }
+
+    if (!hm_node) {
+        hm_node = new_node(key, T_STREAM);
+        hm_insert(&global_data.db, hm_node);
+        stream = hm_node->stream;
+    }
+    stream_append(stream, id, cmd.data() + i + 1, cmd.size() - i - 1);
+    if (trim) {
+        stream_trim(stream, maxlen, approx);
+    }
+    signal_key_ready(key);
+
+    char buf[STREAM_ID_BUF];
+    out_str(conn, buf, stream_format_id(id, buf));
+    return SUCCESS;
+}
+
+/*
+ *  XLEN key
+ */
+uint8_t do_xlen(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+
+    HNode* hm_node = find_node(&global_data.db, key);
+    if (hm_node && hm_node->type != T_STREAM) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return INCORRECT_TYPE;
+    }
+    out_int64(conn, hm_node ? hm_node->stream->length : 0);
+    return SUCCESS;
+}
+
+// - and + are the smallest and largest IDs, a missing sequence is 0 for a start and the largest for an
+// end, and ( makes the bound exclusive
+static bool parse_range_id(dstr* arg, bool is_end, StreamID* out) {
+    if (!strcmp(arg->buf, "-")) {
+        *out = {0, 0};
+        return true;
+    }
+    if (!strcmp(arg->buf, "+")) {
+        *out = {UINT64_MAX, UINT64_MAX};
+        return true;
+    }
+    bool exclusive = arg->buf[0] == '(';
+    if (!stream_parse_id(arg->buf + exclusive, arg->size - exclusive, is_end ? UINT64_MAX : 0, out)) {
+        return false;
+    }
+    if (exclusive) {
+        return is_end ? stream_id_decr(out) : stream_id_incr(out);
+    }
+    return true;
+}
+
+/*
+ *  XRANGE key start end [COUNT count] | XREVRANGE key end start [COUNT count]
+ *
+ *  Returns the entries between the two IDs (both included) as [id, [field, value, ...]] pairs, oldest first
+ *  for XRANGE and newest first for XREVRANGE.
+ */
+uint8_t do_xrange(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* key = cmd[1];
+    bool rev = !strcmp(cmd[0]->buf, "xrevrange");
+
+    StreamID start, end;
+    uint64_t count = 0;
+    bool valid = parse_range_id(cmd[rev ? 3 : 2], false, &start) && parse_range_id(cmd[rev ? 2 : 3], true, &end);
+    if (cmd.size() == 6 && (strcasecmp(cmd[4]->buf, "count") || !parse_count(cmd[5], &count))) {
+        out_err(conn, "syntax error");
+        return INCORRECT_TYPE;
+    }
+    if (cmd.size() != 4 && cmd.size() != 6) {
+        out_err(conn, "syntax error");
+        return INCORRECT_TYPE;
+    }
+
+    HNode* hm_node = find_node(&global_data.db, key);
+    if (hm_node && hm_node->type != T_STREAM) {
+        out_err(conn, "key already exists in database but is not the correct type");
+        return INCORRECT_TYPE;
+    }
+    if (!hm_node || !valid || (cmd.size() == 6 && !count)) {
+        // An exclusive bound past the end of the ID space selects nothing, like an empty stream
+        out_arr(conn, 0);
+        return SUCCESS;
+    }
+    out_stream_range(conn, hm_node->stream, start, end, count, rev);
+    return SUCCESS;
+}
+
+/*
+ *  XREAD [COUNT count] [BLOCK ms] STREAMS key [key ...] id [id ...]
+ *
+ *  Returns [key, entries] for every stream that has entries after its ID, null if none has. $ is the
+ *  stream's last ID. With BLOCK it waits until one of the streams gets an entry, at most ms (0 for
+ *  ever), and returns null on timeout. Inside MULTI and scripts it never waits.
+ */
+uint8_t do_xread(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    uint64_t count = 0;
+    bool block = false;
+    uint64_t timeout_ms = 0;
+    size_t i = 1;
+    for (; i < cmd.size(); i += 2) {
+        const char* opt = cmd[i]->buf;
+        if (!strcasecmp(opt, "streams")) {
+            break;
+        }
+        bool valid = i + 1 < cmd.size();
+        if (!strcasecmp(opt, "count")) {
+            valid = valid && parse_count(cmd[i + 1], &count);
+        }
+        else if (!strcasecmp(opt, "block")) {
+            block = true;
+            valid = valid && parse_count(cmd[i + 1], &timeout_ms);
+        }
+        else {
+            valid = false;
+        }
+        if (!valid) {
+            out_err(conn, "syntax error");
+            return INCORRECT_TYPE;
+        }
+    }
+    size_t nkeys = (cmd.size() - i - 1) / 2;
+    if (i >= cmd.size() || !nkeys || (cmd.size() - i - 1) % 2) {
+        out_err(conn, "unbalanced XREAD list of streams: for each stream key an ID must be specified");
+        return SIZE_ERR;
+    }
+    dstr** keys = cmd.data() + i + 1;
+    dstr** ids = keys + nkeys;
+
+    std::vector<HNode*> nodes;
+    find_nodes(&global_data.db, cmd, i + 1, 1, nodes);
+    nodes.resize(nkeys);
+    std::vector<StreamID> after(nkeys);
+    for (size_t k = 0; k < nkeys; k++) {
+        if (nodes[k] && nodes[k]->type != T_STREAM) {
+            out_err(conn, "key already exists in database but is not the correct type");
+            return INCORRECT_TYPE;
+        }
+        if (!strcmp(ids[k]->buf, "$")) {
+            after[k] = nodes[k] ? nodes[k]->stream->last_id : StreamID{0, 0};
+
+            // A blocked XREAD runs again later, $ has to keep meaning the last ID of now
+            char buf[STREAM_ID_BUF];
+            size_t len = stream_format_id(after[k], buf);
+            free(ids[k]);
+            ids[k] = dstr_init(len);
+            dstr_append(&ids[k], buf, len);
+        }
+        else if (!stream_parse_id(ids[k]->buf, ids[k]->size, 0, &after[k])) {
+            out_err(conn, "invalid stream ID");
+            return INCORRECT_TYPE;
+        }
+    }
+
+    // Streams that have entries after their ID
+    std::vector<size_t> ready;
+    for (size_t k = 0; k < nkeys; k++) {
+        // Trimming only drops the oldest entries, the last ID is always the newest entry's
+        if (nodes[k] && nodes[k]->stream->length && stream_id_cmp(nodes[k]->stream->last_id, after[k]) > 0) {
+            ready.push_back(k);
+        }
+    }
+    if (ready.empty()) {
+        if (!block || !block_on(conn, keys, nkeys, timeout_ms, false)) {
+            out_null(conn);
+        }
+        return SUCCESS;
+    }
+
+    out_arr(conn, ready.size());
+    for (size_t k : ready) {
+        StreamID from = after[k];
+        stream_id_incr(&from);
+        out_arr(conn, 2);
+        out_str(conn, keys[k]->buf, keys[k]->size);
+        out_stream_range(conn, nodes[k]->stream, from, {UINT64_MAX, UINT64_MAX}, count, false);
+    }
+    return SUCCESS;
+}
+
+static void info_commandstats(dstr** pres) {
+    const char* header = "# Commandstats\r\n";
+    dstr_append(pres, header, strlen(header));
+
+    std::vector<CmdStats*> all;
+    cmdstats_all(all);
+    char line[256];
+    for (CmdStats* stats : all) {
+        LatencyHist* h = &stats->hist;
+        int len = snprintf(line, sizeof(line),
+                           "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,p50=%.3f,p99=%.3f,p99.9=%.3f\r\n",
+                           stats->name, (unsigned long long)h->count, (unsigned long long)(h->total_ns / 1000),
+                           h->total_ns / 1000.0 / h->count, hist_percentile(h, 50) / 1000.0,
+                           hist_percentile(h, 99) / 1000.0, hist_percentile(h, 99.9) / 1000.0);
+        dstr_append(pres, line, dmin((size_t)len, sizeof(line) - 1));
+    }
+}
+
+/*
+ * SYNTAX: INFO [section]
+ * commandstats is the only section so far, INFO, INFO all and INFO everything return it too
+ */
+uint8_t do_info(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    const char* section = cmd.size() > 1 ? cmd[1]->buf : "all";
+    bool all = !strcasecmp(section, "all") || !strcasecmp(section, "everything");
+
+    dstr* res = dstr_init(256);
+    if (all || !strcasecmp(section, "commandstats")) {
+        info_commandstats(&res);
+    }
+    out_str(conn, res->buf, res->size);
+    free(res);
+    return SUCCESS;
+}
+
+// Same layout as Redis: power of 2 microsecond buckets with cumulative counts, from the first
+// bucket that has any calls up to the last one
+static void out_latency_hist(Conn* conn, CmdStats* stats) {
+    LatencyHist* h = &stats->hist;
+    uint64_t counts[64] = {};
+    uint32_t first = 63;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < LAT_BUCKETS; i++) {
+        if (!h->buckets[i]) {
+            continue;
+        }
+        uint64_t usec = (hist_bucket_upper(i) + 999) / 1000;
+        uint32_t b = usec <= 1 ? 0 : 64 - __builtin_clzll(usec - 1);
+        counts[b] += h->buckets[i];
+        first = dmin(first, b);
+        last = dmax(last, b);
+    }
+
+    out_str(conn, stats->name, strlen(stats->name));
+    out_arr(conn, 4);
+    out_str(conn, "calls", 5);
+    out_int64(conn, h->count);
+    out_str(conn, "histogram_usec", 14);
+    out_arr(conn, 2 * (last - first + 1));
+    uint64_t cumulative = 0;
+    for (uint32_t b = first; b <= last; b++) {
+        cumulative += counts[b];
+        out_int64(conn, 1ll << b);
+        out_int64(conn, cumulative);
+    }
+}
+
+/*
+ * SYNTAX: LATENCY HISTOGRAM [command ...] | LATENCY RESET
+ * HISTOGRAM returns [command, [calls, n, histogram_usec, [usec, calls <= usec, ...]], ...] for the given
+ * commands (all called commands by default). RESET clears every histogram
+ */
+uint8_t do_latency(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    const char* sub = cmd[1]->buf;
+
+    if (!strcasecmp(sub, "reset")) {
+        cmdstats_reset();
+        out_null(conn);
+        return SUCCESS;
+    }
+    if (strcasecmp(sub, "histogram")) {
+        out_err(conn, "unknown subcommand");
+        return INCORRECT_TYPE;
+    }
+
+    std::vector<CmdStats*> stats;
+    if (cmd.size() == 2) {
+        cmdstats_all(stats);
+    }
+    for (size_t i = 2; i < cmd.size(); i++) {
+        // Names are stored lower case, the same way the dispatcher sees them
+        for (char* p = cmd[i]->buf; *p; p++) {
+            *p = tolower(*p);
+        }
+        CmdStats* found = cmdstats_get(cmd[i]->buf);
+        if (found && found->hist.count) {
+            stats.push_back(found);
+        }
+    }
+
+    out_arr(conn, 2 * stats.size());
+    for (CmdStats* s : stats) {
+        out_latency_hist(conn, s);
+    }
+    return SUCCESS;
+}
+
+static void out_slowlog_entry(Conn* conn, SlowlogEntry* entry) {
+    bool cut = entry->argc > entry->stored;
+    out_arr(conn, 5);
+    out_int64(conn, entry->id);
+    out_int64(conn, entry->timestamp);
+    out_int64(conn, entry->duration_us);
+
+    // Same markers as Redis for what didn't fit
+    char arg[SLOWLOG_MAX_ARG_LEN + 32];
+    out_arr(conn, entry->stored + cut);
+    for (uint32_t i = 0; i < entry->stored; i++) {
+        uint32_t size = entry->arg_size[i];
+        if (size <= SLOWLOG_MAX_ARG_LEN) {
+            out_str(conn, entry->argv[i], size);
+            continue;
+        }
+        int len = snprintf(arg, sizeof(arg), "%.*s... (%u more bytes)", SLOWLOG_MAX_ARG_LEN, entry->argv[i],
+                           size - SLOWLOG_MAX_ARG_LEN);
+        out_str(conn, arg, len);
+    }
+    if (cut) {
+        int len = snprintf(arg, sizeof(arg), "... (%u more arguments)", entry->argc - entry->stored);
+        out_str(conn, arg, len);
+    }
+    out_int(conn, entry->fd);
+}
+
+/*
+ * SYNTAX: SLOWLOG GET [count] | SLOWLOG LEN | SLOWLOG RESET
+ * GET returns the newest count entries (10 by default, a count past the log length returns all) as
+ * [id, unix time, duration in usec, [args...], client fd]
+ */
+uint8_t do_slowlog(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    const char* sub = cmd[1]->buf;
+
+    if (!strcasecmp(sub, "len") && cmd.size() == 2) {
+        out_int(conn, slowlog_len());
+        return SUCCESS;
+    }
+    if (!strcasecmp(sub, "reset") && cmd.size() == 2) {
+        slowlog_reset();
+        out_null(conn);
+        return SUCCESS;
+    }
+    if (strcasecmp(sub, "get") || cmd.size() > 3) {
+        out_err(conn, "unknown subcommand");
+        return INCORRECT_TYPE;
+    }
+
+    int64_t count = 10;
+    if (cmd.size() == 3 && (!str_to_int64(cmd[2]->buf, cmd[2]->size, &count) || count < 0)) {
+        out_err(conn, "value is not an integer or out of range");
+        return INCORRECT_TYPE;
+    }
+    std::vector<SlowlogEntry*> entries;
+    slowlog_get(entries, count);
+    out_arr(conn, entries.size());
+    for (SlowlogEntry* entry : entries) {
+        out_slowlog_entry(conn, entry);
+    }
+    return SUCCESS;
+}
+
+/*
+ * SYNTAX: CONFIG GET <parameter> | CONFIG SET <parameter> <value>
+ * Supported parameters: slowlog-log-slower-than (microseconds, negative disables the slow log)
+ */
+uint8_t do_config(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    const char* sub = cmd[1]->buf;
+    const char* param = cmd[2]->buf;
+
+    if (strcasecmp(param, "slowlog-log-slower-than")) {
+        out_err(conn, "unknown parameter");
+        return NOT_FOUND;
+    }
+
+    if (!strcasecmp(sub, "get") && cmd.size() == 3) {
+        char val[32];
+        int len = snprintf(val, sizeof(val), "%lld", (long long)slowlog_get_threshold());
+        out_arr(conn, 2);
+        out_str(conn, param, strlen(param));
+        out_str(conn, val, len);
+        return SUCCESS;
+    }
+    if (!strcasecmp(sub, "set") && cmd.size() == 4) {
+        char* end;
+        long long us = strtoll(cmd[3]->buf, &end, 10);
+        if (end == cmd[3]->buf || *end) {
+            out_err(conn, "value is not an integer");
+            return INCORRECT_TYPE;
+        }
+        slowlog_set_threshold(us);
+        out_null(conn);
+        return SUCCESS;
+    }
+    out_err(conn, "syntax error");
+    return INCORRECT_TYPE;
+}
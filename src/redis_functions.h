@@ -22,7 +22,16 @@ enum RETURN_VALS {
 uint8_t do_get(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_set(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_del(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_exists(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_mget(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_mset(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_incr(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_incrbyfloat(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_keys(Conn* conn);
+uint8_t do_unlink(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_flushall(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_scan(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_collection_scan(Conn* conn, std::vector<dstr*>& cmd);
 
 // Sorted set functions
 uint8_t do_zadd(Conn* conn, std::vector<dstr*>& cmd);
@@ -32,7 +41,7 @@ uint8_t do_zrangequery(Conn* conn, std::vector<dstr*>& cmd);
 
 // TLL functions
 uint8_t do_expire(Conn* conn, std::vector<dstr*>& cmd);
-uint8_t do_ttl(Conn* conn, std::vector<dstr*>& cmd, std::vector<HeapNode>& heap, uint32_t curr_ms);
+uint8_t do_ttl(Conn* conn, std::vector<dstr*>& cmd, std::vector<HeapNode>& heap, uint64_t curr_ms);
 uint8_t do_persist(Conn* conn, std::vector<dstr*>& cmd);
 
 // Hashmap functions
@@ -44,6 +53,8 @@ uint8_t do_hdel(Conn* conn, std::vector<dstr*>& cmd);
 // Linked list functions
 uint8_t do_push(Conn* conn, std::vector<dstr*>& cmd, uint8_t side);
 uint8_t do_pop(Conn* conn, std::vector<dstr*>& cmd, uint8_t side);
+uint8_t do_bpop(Conn* conn, std::vector<dstr*>& cmd, uint8_t side);
+uint8_t do_blmove(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_lrange(Conn* conn, std::vector<dstr*>& cmd);
 
 // Hashset functions
@@ -56,10 +67,25 @@ uint8_t do_scard(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_setbit(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_getbit(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_bitcount(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_bitop(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_bitpos(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_bitfield(Conn* conn, std::vector<dstr*>& cmd);
 
 // HyperLogLog functions
 uint8_t do_pfadd(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_pfcount(Conn* conn, std::vector<dstr*>& cmd);
 uint8_t do_pfmerge(Conn* conn, std::vector<dstr*>& cmd);
 
+// Stream functions
+uint8_t do_xadd(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_xlen(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_xrange(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_xread(Conn* conn, std::vector<dstr*>& cmd);
+
+// Introspection functions
+uint8_t do_info(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_latency(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_slowlog(Conn* conn, std::vector<dstr*>& cmd);
+uint8_t do_config(Conn* conn, std::vector<dstr*>& cmd);
+
 #endif
@@ -0,0 +1,1357 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "script.h"
+#include "redis_client.h"
+#include "out_helpers.h"
+#include "data_structures/hashmap.h"
+#include "utils/common.h"
+#include "utils/sha1.h"
+
+enum OpCode {
+    OP_CONST, // push consts[arg]
+    OP_NIL,
+    OP_TRUE,
+    OP_FALSE,
+    OP_GET_LOCAL, // push locals[arg]
+    OP_SET_LOCAL, // pop into locals[arg]
+    OP_SET_INDEX, // pop value and index, locals[arg][index] = value
+    OP_INDEX, // pop index and array, push the element
+    OP_INDEX_LOCAL, // pop index, push locals[arg][index] without copying the array
+    OP_LEN,
+    OP_LEN_LOCAL, // push #locals[arg]
+    OP_ARRAY, // pop arg values into a new array
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_NEG,
+    OP_CONCAT,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_NOT,
+    OP_JMP, // to arg
+    OP_JMP_IF_FALSE, // pop, jump to arg if it's false or nil
+    OP_AND, // jump to arg keeping the top if it's false or nil, pop it otherwise
+    OP_OR, // jump to arg keeping the top if it's true, pop it otherwise
+    OP_POP,
+    OP_CALL, // redis.call() with arg arguments
+    OP_PCALL,
+    OP_TONUMBER,
+    OP_TOSTRING,
+    OP_FOR_TEST, // push whether the loop variable locals[arg] is still within locals[arg + 1] (limit) by locals[arg + 2] (step)
+    OP_RETURN, // pop the result
+};
+
+struct Instr {
+    uint8_t op;
+    int32_t arg;
+    uint32_t line; // for error messages
+};
+
+struct Script {
+    HNode node; // in the cache, node.key is the hex SHA-1
+    std::vector<Instr> code;
+    std::vector<ScriptValue> consts;
+    uint32_t nlocals = 0;
+};
+
+// COMPILER
+// Recursive descent straight to bytecode. After the first error everything only unwinds
+
+enum TokenKind {
+    TK_EOF,
+    TK_NAME,
+    TK_NUMBER,
+    TK_STR,
+    TK_SYM, // punctuation and keywords, compared by text
+};
+
+struct Token {
+    uint8_t kind = TK_EOF;
+    std::string text; // the name, symbol, number or unescaped string
+    uint32_t line = 1;
+};
+
+struct Compiler {
+    const char* p;
+    const char* end;
+    uint32_t line = 1;
+    Token tok;
+    Script* script;
+    std::vector<std::string> locals; // names in scope, the index is the slot. KEYS and ARGV are 0 and 1
+    std::vector<std::vector<size_t>> breaks; // pending break jumps of the loops being compiled
+    uint32_t depth = 0; // parse_expr(), parse_unary() and parse_block() calls in progress
+    bool failed = false;
+    std::string err;
+};
+
+static const char* keywords[] = {"and", "break", "do", "else", "elseif", "end", "false", "for", "if",
+                                 "local", "nil", "not", "or", "return", "then", "true", "while"};
+
+static void compile_error(Compiler* c, const char* msg) {
+    if (c->failed) {
+        return;
+    }
+    c->failed = true;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "line %u: %s", c->tok.line, msg);
+    c->err = buf;
+}
+
+static void next_token(Compiler* c) {
+    Token& t = c->tok;
+    t.text.clear();
+
+    // Whitespace and -- comments
+    while (c->p < c->end) {
+        if (*c->p == '\n') {
+            c->line++;
+            c->p++;
+        }
+        else if (isspace((unsigned char)*c->p)) {
+            c->p++;
+        }
+        else if (*c->p == '-' && c->p + 1 < c->end && c->p[1] == '-') {
+            while (c->p < c->end && *c->p != '\n') {
+                c->p++;
+            }
+        }
+        else {
+            break;
+        }
+    }
+    t.line = c->line;
+    if (c->p >= c->end) {
+        t.kind = TK_EOF;
+        return;
+    }
+
+    char ch = *c->p;
+    if (isalpha((unsigned char)ch) || ch == '_') {
+        const char* start = c->p;
+        while (c->p < c->end && (isalnum((unsigned char)*c->p) || *c->p == '_')) {
+            c->p++;
+        }
+        t.text.assign(start, c->p - start);
+        t.kind = TK_NAME;
+        for (const char* kw : keywords) {
+            if (t.text == kw) {
+                t.kind = TK_SYM;
+            }
+        }
+        return;
+    }
+    if (isdigit((unsigned char)ch) || (ch == '.' && c->p + 1 < c->end && isdigit((unsigned char)c->p[1]))) {
+        const char* start = c->p;
+        while (c->p < c->end && (isalnum((unsigned char)*c->p) || *c->p == '.' ||
+                                 ((*c->p == '-' || *c->p == '+') && (c->p[-1] == 'e' || c->p[-1] == 'E')))) {
+            c->p++;
+        }
+        t.text.assign(start, c->p - start);
+        t.kind = TK_NUMBER;
+        return;
+    }
+    if (ch == '"' || ch == '\'') {
+        c->p++;
+        while (c->p < c->end && *c->p != ch && *c->p != '\n') {
+            char cur = *c->p++;
+            if (cur == '\\' && c->p < c->end) {
+                char esc = *c->p++;
+                cur = esc == 'n' ? '\n' : esc == 't' ? '\t' : esc == 'r' ? '\r' : esc == '0' ? '\0' : esc;
+            }
+            t.text.push_back(cur);
+        }
+        if (c->p >= c->end || *c->p != ch) {
+            t.kind = TK_EOF;
+            compile_error(c, "unfinished string");
+            return;
+        }
+        c->p++;
+        t.kind = TK_STR;
+        return;
+    }
+
+    static const char* two_char[] = {"==", "~=", "<=", ">=", ".."};
+    t.kind = TK_SYM;
+    for (const char* sym : two_char) {
+        if (c->p + 1 < c->end && c->p[0] == sym[0] && c->p[1] == sym[1]) {
+            t.text.assign(sym, 2);
+            c->p += 2;
+            return;
+        }
+    }
+    if (!strchr("()[]{},.#+-*/%<>=;", ch)) {
+        compile_error(c, "unexpected character");
+        t.kind = TK_EOF;
+        return;
+    }
+    t.text.assign(1, ch);
+    c->p++;
+}
+
+static bool is_sym(Compiler* c, const char* sym) {
+    return c->tok.kind == TK_SYM && c->tok.text == sym;
+}
+
+static bool accept(Compiler* c, const char* sym) {
+    if (!is_sym(c, sym)) {
+        return false;
+    }
+    next_token(c);
+    return true;
+}
+
+static void expect(Compiler* c, const char* sym) {
+    if (accept(c, sym)) {
+        return;
+    }
+    char buf[64];
+    snprintf(buf, sizeof(buf), "'%s' expected", sym);
+    compile_error(c, buf);
+}
+
+// Whether the token after the current one is sym
+static bool peek_is(Compiler* c, const char* sym) {
+    const char* p = c->p;
+    uint32_t line = c->line;
+    Token tok = c->tok;
+    next_token(c);
+    bool res = is_sym(c, sym);
+    c->p = p;
+    c->line = line;
+    c->tok = tok;
+    return res;
+}
+
+static size_t emit(Compiler* c, uint8_t op, int32_t arg = 0) {
+    c->script->code.push_back({op, arg, c->tok.line});
+    return c->script->code.size() - 1;
+}
+
+static void patch(Compiler* c, size_t at) {
+    c->script->code[at].arg = c->script->code.size();
+}
+
+static void emit_const(Compiler* c, ScriptValue& val) {
+    c->script->consts.push_back(val);
+    emit(c, OP_CONST, c->script->consts.size() - 1);
+}
+
+static int find_local(Compiler* c, const std::string& name) {
+    for (int i = c->locals.size() - 1; i >= 0; i--) {
+        if (c->locals[i] == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int declare_local(Compiler* c, const std::string& name) {
+    if (c->locals.size() >= SCRIPT_MAX_LOCALS) {
+        compile_error(c, "too many local variables");
+        return 0;
+    }
+    c->locals.push_back(name);
+    c->script->nlocals = dmax(c->script->nlocals, (uint32_t)c->locals.size());
+    return c->locals.size() - 1;
+}
+
+static void parse_expr(Compiler* c);
+static void parse_block(Compiler* c);
+
+// Every recursion of the compiler goes through one of these, so deep nesting is an error instead of
+// a stack overflow. A false return must not be followed by leave()
+static bool enter(Compiler* c) {
+    if (c->depth >= SCRIPT_MAX_DEPTH) {
+        compile_error(c, "expression or block nested too deep");
+        return false;
+    }
+    c->depth++;
+    return true;
+}
+
+static void leave(Compiler* c) {
+    c->depth--;
+}
+
+// Arguments of a call up to the closing parenthesis, returns how many there were
+static int32_t parse_args(Compiler* c) {
+    expect(c, "(");
+    int32_t argc = 0;
+    if (!is_sym(c, ")")) {
+        do {
+            parse_expr(c);
+            argc++;
+        } while (accept(c, ",") && !c->failed);
+    }
+    expect(c, ")");
+    return argc;
+}
+
+static void parse_number(Compiler* c) {
+    ScriptValue val;
+    const std::string& text = c->tok.text;
+    char* end = NULL;
+    if (str_to_int64(text.data(), text.size(), &val.num)) {
+        val.type = SV_INT;
+    }
+    else {
+        val.dbl = strtod(text.c_str(), &end);
+        val.type = SV_DOUBLE;
+        if (*end) {
+            compile_error(c, "malformed number");
+        }
+    }
+    emit_const(c, val);
+    next_token(c);
+}
+
+static void parse_primary(Compiler* c) {
+    Token& t = c->tok;
+    if (t.kind == TK_NUMBER) {
+        parse_number(c);
+        return;
+    }
+    if (t.kind == TK_STR) {
+        ScriptValue val;
+        val.type = SV_STR;
+        val.str = t.text;
+        emit_const(c, val);
+        next_token(c);
+        return;
+    }
+    if (accept(c, "nil")) {
+        emit(c, OP_NIL);
+        return;
+    }
+    if (accept(c, "true")) {
+        emit(c, OP_TRUE);
+        return;
+    }
+    if (accept(c, "false")) {
+        emit(c, OP_FALSE);
+        return;
+    }
+    if (accept(c, "(")) {
+        parse_expr(c);
+        expect(c, ")");
+        return;
+    }
+    if (accept(c, "{")) {
+        int32_t n = 0;
+        if (!is_sym(c, "}")) {
+            do {
+                parse_expr(c);
+                n++;
+            } while (accept(c, ",") && !is_sym(c, "}") && !c->failed);
+        }
+        expect(c, "}");
+        emit(c, OP_ARRAY, n);
+        return;
+    }
+    if (t.kind != TK_NAME) {
+        compile_error(c, "unexpected symbol");
+        return;
+    }
+
+    std::string name = t.text;
+    int slot = find_local(c, name);
+    next_token(c);
+    if (slot >= 0 && accept(c, "[")) {
+        parse_expr(c);
+        expect(c, "]");
+        emit(c, OP_INDEX_LOCAL, slot);
+    }
+    else if (slot >= 0) {
+        emit(c, OP_GET_LOCAL, slot);
+    }
+    else if (name == "redis") {
+        expect(c, ".");
+        bool pcall = c->tok.kind == TK_NAME && c->tok.text == "pcall";
+        if (c->tok.kind != TK_NAME || (c->tok.text != "call" && !pcall)) {
+            compile_error(c, "only redis.call() and redis.pcall() exist");
+            return;
+        }
+        next_token(c);
+        emit(c, pcall ? OP_PCALL : OP_CALL, parse_args(c));
+    }
+    else if (name == "tonumber" || name == "tostring") {
+        if (parse_args(c) != 1) {
+            compile_error(c, "tonumber() and tostring() take one argument");
+        }
+        emit(c, name == "tonumber" ? OP_TONUMBER : OP_TOSTRING);
+    }
+    else {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "unknown variable '%.64s' (only locals exist)", name.c_str());
+        compile_error(c, buf);
+    }
+}
+
+static void parse_postfix(Compiler* c) {
+    parse_primary(c);
+    while (!c->failed && accept(c, "[")) {
+        parse_expr(c);
+        expect(c, "]");
+        emit(c, OP_INDEX);
+    }
+}
+
+static void parse_unary(Compiler* c) {
+    if (!enter(c)) {
+        return;
+    }
+    if (accept(c, "not")) {
+        parse_unary(c);
+        emit(c, OP_NOT);
+    }
+    else if (accept(c, "-")) {
+        parse_unary(c);
+        emit(c, OP_NEG);
+    }
+    else if (accept(c, "#")) {
+        int slot = c->tok.kind == TK_NAME ? find_local(c, c->tok.text) : -1;
+        if (slot >= 0 && !peek_is(c, "[")) {
+            next_token(c);
+            emit(c, OP_LEN_LOCAL, slot);
+        }
+        else {
+            parse_unary(c);
+            emit(c, OP_LEN);
+        }
+    }
+    else {
+        parse_postfix(c);
+    }
+    leave(c);
+}
+
+static void parse_mul(Compiler* c) {
+    parse_unary(c);
+    while (!c->failed) {
+        uint8_t op = is_sym(c, "*") ? OP_MUL : is_sym(c, "/") ? OP_DIV : is_sym(c, "%") ? OP_MOD : OP_RETURN;
+        if (op == OP_RETURN) {
+            return;
+        }
+        next_token(c);
+        parse_unary(c);
+        emit(c, op);
+    }
+}
+
+static void parse_add(Compiler* c) {
+    parse_mul(c);
+    while (!c->failed) {
+        uint8_t op = is_sym(c, "+") ? OP_ADD : is_sym(c, "-") ? OP_SUB : OP_RETURN;
+        if (op == OP_RETURN) {
+            return;
+        }
+        next_token(c);
+        parse_mul(c);
+        emit(c, op);
+    }
+}
+
+// .. is right associative
+static void parse_concat(Compiler* c) {
+    parse_add(c);
+    if (!c->failed && accept(c, "..")) {
+        parse_concat(c);
+        emit(c, OP_CONCAT);
+    }
+}
+
+static void parse_compare(Compiler* c) {
+    static const char* syms[] = {"==", "~=", "<", "<=", ">", ">="};
+    static const uint8_t ops[] = {OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE};
+    parse_concat(c);
+    while (!c->failed) {
+        int found = -1;
+        for (int i = 0; i < 6; i++) {
+            if (is_sym(c, syms[i])) {
+                found = i;
+            }
+        }
+        if (found < 0) {
+            return;
+        }
+        next_token(c);
+        parse_concat(c);
+        emit(c, ops[found]);
+    }
+}
+
+static void parse_and(Compiler* c) {
+    parse_compare(c);
+    while (!c->failed && accept(c, "and")) {
+        size_t jump = emit(c, OP_AND);
+        parse_compare(c);
+        patch(c, jump);
+    }
+}
+
+static void parse_expr(Compiler* c) {
+    if (!enter(c)) {
+        return;
+    }
+    parse_and(c);
+    while (!c->failed && accept(c, "or")) {
+        size_t jump = emit(c, OP_OR);
+        parse_and(c);
+        patch(c, jump);
+    }
+    leave(c);
+}
+
+static bool block_end(Compiler* c) {
+    return c->tok.kind == TK_EOF || is_sym(c, "end") || is_sym(c, "else") || is_sym(c, "elseif");
+}
+
+static void parse_if(Compiler* c) {
+    std::vector<size_t> to_end;
+    do {
+        parse_expr(c);
+        expect(c, "then");
+        size_t skip = emit(c, OP_JMP_IF_FALSE);
+        parse_block(c);
+        if (is_sym(c, "elseif") || is_sym(c, "else")) {
+            to_end.push_back(emit(c, OP_JMP));
+        }
+        patch(c, skip);
+    } while (!c->failed && accept(c, "elseif"));
+
+    if (accept(c, "else")) {
+        parse_block(c);
+    }
+    expect(c, "end");
+    for (size_t jump : to_end) {
+        patch(c, jump);
+    }
+}
+
+static void end_loop(Compiler* c) {
+    for (size_t jump : c->breaks.back()) {
+        patch(c, jump);
+    }
+    c->breaks.pop_back();
+}
+
+static void parse_while(Compiler* c) {
+    size_t start = c->script->code.size();
+    parse_expr(c);
+    expect(c, "do");
+    size_t exit = emit(c, OP_JMP_IF_FALSE);
+    c->breaks.emplace_back();
+    parse_block(c);
+    expect(c, "end");
+    emit(c, OP_JMP, start);
+    patch(c, exit);
+    end_loop(c);
+}
+
+// for v = start, limit [, step] do ... end. v, limit and step take three consecutive slots
+static void parse_for(Compiler* c) {
+    if (c->tok.kind != TK_NAME) {
+        compile_error(c, "loop variable expected");
+        return;
+    }
+    std::string name = c->tok.text;
+    next_token(c);
+    expect(c, "=");
+    parse_expr(c);
+    expect(c, ",");
+    parse_expr(c);
+    if (accept(c, ",")) {
+        parse_expr(c);
+    }
+    else {
+        ScriptValue one;
+        one.type = SV_INT;
+        one.num = 1;
+        emit_const(c, one);
+    }
+    expect(c, "do");
+
+    size_t scope = c->locals.size();
+    int var = declare_local(c, name);
+    declare_local(c, "(for limit)");
+    declare_local(c, "(for step)");
+    emit(c, OP_SET_LOCAL, var + 2);
+    emit(c, OP_SET_LOCAL, var + 1);
+    emit(c, OP_SET_LOCAL, var);
+
+    size_t start = emit(c, OP_FOR_TEST, var);
+    size_t exit = emit(c, OP_JMP_IF_FALSE);
+    c->breaks.emplace_back();
+    parse_block(c);
+    expect(c, "end");
+    emit(c, OP_GET_LOCAL, var);
+    emit(c, OP_GET_LOCAL, var + 2);
+    emit(c, OP_ADD);
+    emit(c, OP_SET_LOCAL, var);
+    emit(c, OP_JMP, start);
+    patch(c, exit);
+    end_loop(c);
+    c->locals.resize(scope);
+}
+
+static void parse_statement(Compiler* c) {
+    if (accept(c, ";")) {
+        return;
+    }
+    if (accept(c, "local")) {
+        if (c->tok.kind != TK_NAME) {
+            compile_error(c, "variable name expected");
+            return;
+        }
+        std::string name = c->tok.text;
+        next_token(c);
+        if (accept(c, "=")) {
+            parse_expr(c);
+        }
+        else {
+            emit(c, OP_NIL);
+        }
+        // Declared after the value, so `local x = x` reads the outer x
+        emit(c, OP_SET_LOCAL, declare_local(c, name));
+        return;
+    }
+    if (accept(c, "if")) {
+        parse_if(c);
+        return;
+    }
+    if (accept(c, "while")) {
+        parse_while(c);
+        return;
+    }
+    if (accept(c, "for")) {
+        parse_for(c);
+        return;
+    }
+    if (accept(c, "break")) {
+        if (c->breaks.empty()) {
+            compile_error(c, "break outside a loop");
+            return;
+        }
+        c->breaks.back().push_back(emit(c, OP_JMP));
+        return;
+    }
+    if (accept(c, "return")) {
+        if (block_end(c) || is_sym(c, ";")) {
+            emit(c, OP_NIL);
+        }
+        else {
+            parse_expr(c);
+        }
+        emit(c, OP_RETURN);
+        return;
+    }
+
+    // Assignment to a local (x = v, x[i] = v) or a call whose result is dropped
+    int slot = c->tok.kind == TK_NAME ? find_local(c, c->tok.text) : -1;
+    if (slot < 0) {
+        parse_expr(c);
+        emit(c, OP_POP);
+        return;
+    }
+    next_token(c);
+    if (accept(c, "[")) {
+        parse_expr(c);
+        expect(c, "]");
+        expect(c, "=");
+        parse_expr(c);
+        emit(c, OP_SET_INDEX, slot);
+        return;
+    }
+    expect(c, "=");
+    parse_expr(c);
+    emit(c, OP_SET_LOCAL, slot);
+}
+
+static void parse_block(Compiler* c) {
+    if (!enter(c)) {
+        return;
+    }
+    size_t scope = c->locals.size();
+    while (!c->failed && !block_end(c)) {
+        parse_statement(c);
+    }
+    c->locals.resize(scope);
+    leave(c);
+}
+
+Script* script_compile(const char* src, size_t len, std::string& err) {
+    Script* script = new Script();
+    Compiler c;
+    c.p = src;
+    c.end = src + len;
+    c.script = script;
+    declare_local(&c, "KEYS");
+    declare_local(&c, "ARGV");
+    next_token(&c);
+    parse_block(&c);
+    if (!c.failed && c.tok.kind != TK_EOF) {
+        compile_error(&c, "'<eof>' expected");
+    }
+    if (c.failed) {
+        err = c.err;
+        delete script;
+        return NULL;
+    }
+    emit(&c, OP_NIL);
+    emit(&c, OP_RETURN);
+    return script;
+}
+
+void script_free(Script* script) {
+    free(script->node.key);
+    delete script;
+}
+
+// VM
+
+static bool truthy(const ScriptValue& v) {
+    return v.type != SV_NIL && !(v.type == SV_BOOL && !v.num);
+}
+
+static const char* type_name(const ScriptValue& v) {
+    static const char* names[] = {"nil", "boolean", "number", "number", "string", "array", "error"};
+    return names[v.type];
+}
+
+// Numbers and numeric strings, like Lua's coercion
+static bool to_number(const ScriptValue& v, ScriptValue* out) {
+    if (v.type == SV_INT || v.type == SV_DOUBLE) {
+        out->type = v.type;
+        out->num = v.num;
+        out->dbl = v.dbl;
+        return true;
+    }
+    if (v.type != SV_STR || v.str.empty()) {
+        return false;
+    }
+    if (str_to_int64(v.str.data(), v.str.size(), &out->num)) {
+        out->type = SV_INT;
+        return true;
+    }
+    char* end = NULL;
+    out->dbl = strtod(v.str.c_str(), &end);
+    out->type = SV_DOUBLE;
+    return *end == '\0' && !isspace((unsigned char)v.str[0]);
+}
+
+static double as_double(const ScriptValue& v) {
+    return v.type == SV_INT ? (double)v.num : v.dbl;
+}
+
+static void format_number(const ScriptValue& v, std::string& out) {
+    char buf[32];
+    int len = v.type == SV_INT ? snprintf(buf, sizeof(buf), "%lld", (long long)v.num)
+                               : snprintf(buf, sizeof(buf), "%.17g", v.dbl);
+    out.assign(buf, len);
+}
+
+static void set_int(ScriptValue& v, int64_t num) {
+    v.type = SV_INT;
+    v.num = num;
+}
+
+static void set_double(ScriptValue& v, double dbl) {
+    v.type = SV_DOUBLE;
+    v.dbl = dbl;
+}
+
+static void set_bool(ScriptValue& v, bool b) {
+    v.type = SV_BOOL;
+    v.num = b;
+    v.str.clear();
+    v.arr.clear();
+}
+
+// a = a op b for + - * / %, false if they aren't numbers
+static bool arith(uint8_t op, ScriptValue& a, const ScriptValue& b, std::string& err) {
+    ScriptValue x, y;
+    if (!to_number(a, &x) || !to_number(b, &y)) {
+        err = std::string("attempt to perform arithmetic on a ") + type_name(to_number(a, &x) ? b : a) + " value";
+        return false;
+    }
+    a.str.clear();
+
+    int64_t res;
+    if (x.type == SV_INT && y.type == SV_INT && op != OP_DIV) {
+        // Overflowing integers continue as doubles
+        if (op == OP_ADD && !__builtin_add_overflow(x.num, y.num, &res)) {
+            set_int(a, res);
+            return true;
+        }
+        if (op == OP_SUB && !__builtin_sub_overflow(x.num, y.num, &res)) {
+            set_int(a, res);
+            return true;
+        }
+        if (op == OP_MUL && !__builtin_mul_overflow(x.num, y.num, &res)) {
+            set_int(a, res);
+            return true;
+        }
+        if (op == OP_MOD) {
+            if (!y.num) {
+                err = "attempt to perform 'n%0'";
+                return false;
+            }
+            // Floored like Lua, the result takes the sign of the divisor
+            res = y.num == -1 ? 0 : x.num % y.num;
+            if (res && (res ^ y.num) < 0) {
+                res += y.num;
+            }
+            set_int(a, res);
+            return true;
+        }
+    }
+
+    double dx = as_double(x), dy = as_double(y);
+    switch (op) {
+        case OP_ADD:
+            set_double(a, dx + dy);
+            break;
+        case OP_SUB:
+            set_double(a, dx - dy);
+            break;
+        case OP_MUL:
+            set_double(a, dx * dy);
+            break;
+        case OP_DIV:
+            set_double(a, dx / dy);
+            break;
+        default:
+            set_double(a, dx - floor(dx / dy) * dy);
+    }
+    return true;
+}
+
+static bool values_equal(const ScriptValue& a, const ScriptValue& b) {
+    bool a_num = a.type == SV_INT || a.type == SV_DOUBLE;
+    bool b_num = b.type == SV_INT || b.type == SV_DOUBLE;
+    if (a_num && b_num) {
+        return a.type == SV_INT && b.type == SV_INT ? a.num == b.num : as_double(a) == as_double(b);
+    }
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+        case SV_NIL:
+            return true;
+        case SV_BOOL:
+            return a.num == b.num;
+        case SV_STR:
+        case SV_ERR:
+            return a.str == b.str;
+        default:
+            if (a.arr.size() != b.arr.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < a.arr.size(); i++) {
+                if (!values_equal(a.arr[i], b.arr[i])) {
+                    return false;
+                }
+            }
+            return true;
+    }
+}
+
+// <0, 0 or >0 into *res, false if the values can't be ordered
+static bool compare(const ScriptValue& a, const ScriptValue& b, int* res, std::string& err) {
+    bool a_num = a.type == SV_INT || a.type == SV_DOUBLE;
+    bool b_num = b.type == SV_INT || b.type == SV_DOUBLE;
+    if (a_num && b_num) {
+        if (a.type == SV_INT && b.type == SV_INT) {
+            *res = (a.num > b.num) - (a.num < b.num);
+        }
+        else {
+            *res = (as_double(a) > as_double(b)) - (as_double(a) < as_double(b));
+        }
+        return true;
+    }
+    if (a.type == SV_STR && b.type == SV_STR) {
+        *res = a.str.compare(b.str);
+        return true;
+    }
+    err = std::string("attempt to compare ") + type_name(a) + " with " + type_name(b);
+    return false;
+}
+
+// Array index, 1 based. -1 if idx isn't an integer
+static int64_t array_index(const ScriptValue& idx) {
+    if (idx.type == SV_INT) {
+        return idx.num;
+    }
+    if (idx.type == SV_DOUBLE && idx.dbl == floor(idx.dbl) && fabs(idx.dbl) < 9e15) {
+        return (int64_t)idx.dbl;
+    }
+    return -1;
+}
+
+static void from_client_value(ClientValue& cv, ScriptValue& out) {
+    out.str.clear();
+    out.arr.clear();
+    switch (cv.tag) {
+        case TAG_INT:
+        case TAG_INT64:
+            set_int(out, cv.num);
+            break;
+        case TAG_DOUBLE:
+            set_double(out, cv.dbl);
+            break;
+        case TAG_STR:
+            out.type = SV_STR;
+            out.str.swap(cv.str);
+            break;
+        case TAG_ERROR:
+            out.type = SV_ERR;
+            out.str.swap(cv.str);
+            break;
+        case TAG_ARR:
+            out.type = SV_ARR;
+            out.arr.resize(cv.arr.size());
+            for (size_t i = 0; i < cv.arr.size(); i++) {
+                from_client_value(cv.arr[i], out.arr[i]);
+            }
+            break;
+        default:
+            out.type = SV_NIL;
+    }
+}
+
+struct ScriptCallState {
+    std::vector<dstr*> cmd;
+    std::vector<uint8_t> frame;
+    ClientReply reply;
+};
+
+// redis.call() with the argc values on top of the stack, they are replaced by the result. false if
+// the script must stop with err
+static bool run_call(std::vector<ScriptValue>& stack, int32_t argc, bool pcall, ScriptCallFn call, void* arg,
+                     ScriptCallState& st, std::string& err) {
+    if (argc == 0) {
+        err = "redis.call() needs at least the command name";
+        return false;
+    }
+    size_t base = stack.size() - argc;
+    st.cmd.clear();
+    bool ok = true;
+    std::string num;
+    for (size_t i = base; i < stack.size() && ok; i++) {
+        ScriptValue& v = stack[i];
+        const std::string* s = &v.str;
+        if (v.type == SV_INT || v.type == SV_DOUBLE) {
+            format_number(v, num);
+            s = &num;
+        }
+        else if (v.type != SV_STR) {
+            err = "command arguments must be strings or numbers";
+            ok = false;
+            break;
+        }
+        dstr* d = dstr_init(s->size());
+        dstr_append(&d, s->data(), s->size());
+        st.cmd.push_back(d);
+    }
+
+    if (ok) {
+        st.frame.clear();
+        call(st.cmd, st.frame, arg);
+        if (client_parse_reply(st.frame.data(), st.frame.size(), &st.reply) <= 0) {
+            err = "malformed reply";
+            ok = false;
+        }
+    }
+    for (dstr* d : st.cmd) {
+        free(d);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    stack.resize(base + 1);
+    ScriptValue& res = stack[base];
+    std::vector<ClientValue>& vals = st.reply.values;
+    if (st.reply.code == RES_ERR) {
+        std::string msg = vals.empty() ? "error" : vals[0].str;
+        if (!pcall) {
+            err = msg;
+            return false;
+        }
+        res.type = SV_ERR;
+        res.str = msg;
+        res.arr.clear();
+    }
+    else if (vals.empty()) {
+        set_bool(res, true);
+    }
+    else if (vals.size() == 1) {
+        from_client_value(vals[0], res);
+    }
+    else {
+        res.type = SV_ARR;
+        res.str.clear();
+        res.arr.resize(vals.size());
+        for (size_t i = 0; i < vals.size(); i++) {
+            from_client_value(vals[i], res.arr[i]);
+        }
+    }
+    return true;
+}
+
+static void str_array(std::vector<dstr*>& strs, ScriptValue& out) {
+    out.type = SV_ARR;
+    out.arr.resize(strs.size());
+    for (size_t i = 0; i < strs.size(); i++) {
+        out.arr[i].type = SV_STR;
+        out.arr[i].str.assign(strs[i]->buf, strs[i]->size);
+    }
+}
+
+bool script_run(Script* script, std::vector<dstr*>& keys, std::vector<dstr*>& argv, ScriptCallFn call, void* arg,
+                ScriptValue* result, std::string& err) {
+    std::vector<ScriptValue> stack;
+    stack.reserve(16);
+    std::vector<ScriptValue> locals(script->nlocals);
+    str_array(keys, locals[0]);
+    str_array(argv, locals[1]);
+    ScriptCallState st;
+
+    const Instr* code = script->code.data();
+    size_t pc = 0;
+    uint64_t steps = 0;
+    std::string msg;
+    int cmp = 0;
+
+    while (true) {
+        const Instr& in = code[pc++];
+        if (++steps > SCRIPT_MAX_STEPS) {
+            msg = "script exceeded the instruction limit";
+            break;
+        }
+        if (stack.size() >= SCRIPT_MAX_STACK) {
+            msg = "stack overflow";
+            break;
+        }
+
+        switch (in.op) {
+            case OP_CONST:
+                stack.push_back(script->consts[in.arg]);
+                continue;
+            case OP_NIL:
+                stack.emplace_back();
+                continue;
+            case OP_TRUE:
+            case OP_FALSE:
+                stack.emplace_back();
+                set_bool(stack.back(), in.op == OP_TRUE);
+                continue;
+            case OP_GET_LOCAL:
+                stack.push_back(locals[in.arg]);
+                continue;
+            case OP_SET_LOCAL:
+                locals[in.arg] = std::move(stack.back());
+                stack.pop_back();
+                continue;
+            case OP_SET_INDEX: {
+                ScriptValue& target = locals[in.arg];
+                int64_t idx = array_index(stack[stack.size() - 2]);
+                if (target.type != SV_ARR) {
+                    msg = std::string("attempt to index a ") + type_name(target) + " value";
+                    break;
+                }
+                if (idx < 1 || idx > (int64_t)target.arr.size() + 1) {
+                    msg = "array index out of range (arrays can only grow by appending)";
+                    break;
+                }
+                if (idx == (int64_t)target.arr.size() + 1) {
+                    target.arr.emplace_back();
+                }
+                target.arr[idx - 1] = std::move(stack.back());
+                stack.resize(stack.size() - 2);
+                continue;
+            }
+            case OP_INDEX: {
+                ScriptValue& arr = stack[stack.size() - 2];
+                if (arr.type != SV_ARR) {
+                    msg = std::string("attempt to index a ") + type_name(arr) + " value";
+                    break;
+                }
+                int64_t idx = array_index(stack.back());
+                ScriptValue elem;
+                if (idx >= 1 && idx <= (int64_t)arr.arr.size()) {
+                    elem = std::move(arr.arr[idx - 1]);
+                }
+                stack.pop_back();
+                stack.back() = std::move(elem);
+                continue;
+            }
+            case OP_INDEX_LOCAL: {
+                ScriptValue& arr = locals[in.arg];
+                if (arr.type != SV_ARR) {
+                    msg = std::string("attempt to index a ") + type_name(arr) + " value";
+                    break;
+                }
+                int64_t idx = array_index(stack.back());
+                if (idx >= 1 && idx <= (int64_t)arr.arr.size()) {
+                    stack.back() = arr.arr[idx - 1];
+                }
+                else {
+                    stack.back() = ScriptValue();
+                }
+                continue;
+            }
+            case OP_LEN_LOCAL: {
+                ScriptValue& v = locals[in.arg];
+                if (v.type != SV_STR && v.type != SV_ARR) {
+                    msg = std::string("attempt to get length of a ") + type_name(v) + " value";
+                    break;
+                }
+                stack.emplace_back();
+                set_int(stack.back(), v.type == SV_STR ? v.str.size() : v.arr.size());
+                continue;
+            }
+            case OP_LEN: {
+                ScriptValue& v = stack.back();
+                if (v.type == SV_STR) {
+                    size_t len = v.str.size();
+                    v.str.clear();
+                    set_int(v, len);
+                    continue;
+                }
+                if (v.type == SV_ARR) {
+                    size_t len = v.arr.size();
+                    v.arr.clear();
+                    set_int(v, len);
+                    continue;
+                }
+                msg = std::string("attempt to get length of a ") + type_name(v) + " value";
+                break;
+            }
+            case OP_ARRAY: {
+                ScriptValue arr;
+                arr.type = SV_ARR;
+                arr.arr.reserve(in.arg);
+                for (size_t i = stack.size() - in.arg; i < stack.size(); i++) {
+                    arr.arr.push_back(std::move(stack[i]));
+                }
+                stack.resize(stack.size() - in.arg);
+                stack.push_back(std::move(arr));
+                continue;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+                if (!arith(in.op, stack[stack.size() - 2], stack.back(), msg)) {
+                    break;
+                }
+                stack.pop_back();
+                continue;
+            case OP_NEG: {
+                ScriptValue& v = stack.back();
+                ScriptValue n;
+                if (!to_number(v, &n)) {
+                    msg = std::string("attempt to perform arithmetic on a ") + type_name(v) + " value";
+                    break;
+                }
+                v.str.clear();
+                if (n.type == SV_INT && n.num != INT64_MIN) {
+                    set_int(v, -n.num);
+                }
+                else {
+                    set_double(v, -as_double(n));
+                }
+                continue;
+            }
+            case OP_CONCAT: {
+                ScriptValue& a = stack[stack.size() - 2];
+                ScriptValue& b = stack.back();
+                bool ok = true;
+                for (ScriptValue* v : {&a, &b}) {
+                    if (v->type == SV_INT || v->type == SV_DOUBLE) {
+                        format_number(*v, v->str);
+                    }
+                    else if (v->type != SV_STR) {
+                        msg = std::string("attempt to concatenate a ") + type_name(*v) + " value";
+                        ok = false;
+                    }
+                }
+                if (!ok) {
+                    break;
+                }
+                a.type = SV_STR;
+                a.str += b.str;
+                stack.pop_back();
+                continue;
+            }
+            case OP_EQ:
+            case OP_NE: {
+                bool eq = values_equal(stack[stack.size() - 2], stack.back());
+                stack.pop_back();
+                set_bool(stack.back(), in.op == OP_EQ ? eq : !eq);
+                continue;
+            }
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE: {
+                if (!compare(stack[stack.size() - 2], stack.back(), &cmp, msg)) {
+                    break;
+                }
+                bool res = in.op == OP_LT ? cmp < 0 : in.op == OP_LE ? cmp <= 0 : in.op == OP_GT ? cmp > 0 : cmp >= 0;
+                stack.pop_back();
+                set_bool(stack.back(), res);
+                continue;
+            }
+            case OP_NOT:
+                set_bool(stack.back(), !truthy(stack.back()));
+                continue;
+            case OP_JMP:
+                pc = in.arg;
+                continue;
+            case OP_JMP_IF_FALSE:
+                if (!truthy(stack.back())) {
+                    pc = in.arg;
+                }
+                stack.pop_back();
+                continue;
+            case OP_AND:
+            case OP_OR:
+                if (truthy(stack.back()) == (in.op == OP_OR)) {
+                    pc = in.arg;
+                }
+                else {
+                    stack.pop_back();
+                }
+                continue;
+            case OP_POP:
+                stack.pop_back();
+                continue;
+            case OP_CALL:
+            case OP_PCALL:
+                if (!run_call(stack, in.arg, in.op == OP_PCALL, call, arg, st, msg)) {
+                    break;
+                }
+                continue;
+            case OP_TONUMBER: {
+                ScriptValue n;
+                ScriptValue& v = stack.back();
+                if (!to_number(v, &n)) {
+                    v = ScriptValue();
+                    continue;
+                }
+                v.str.clear();
+                v.type = n.type;
+                v.num = n.num;
+                v.dbl = n.dbl;
+                continue;
+            }
+            case OP_TOSTRING: {
+                ScriptValue& v = stack.back();
+                if (v.type == SV_INT || v.type == SV_DOUBLE) {
+                    format_number(v, v.str);
+                }
+                else if (v.type == SV_NIL || v.type == SV_BOOL || v.type == SV_ARR) {
+                    v.str = v.type == SV_NIL ? "nil" : v.type == SV_ARR ? "array" : v.num ? "true" : "false";
+                    v.arr.clear();
+                }
+                v.type = SV_STR;
+                continue;
+            }
+            case OP_FOR_TEST: {
+                ScriptValue& var = locals[in.arg];
+                ScriptValue& limit = locals[in.arg + 1];
+                ScriptValue& step = locals[in.arg + 2];
+                bool numbers = true;
+                for (ScriptValue* v : {&var, &limit, &step}) {
+                    numbers = numbers && (v->type == SV_INT || v->type == SV_DOUBLE);
+                }
+                if (!numbers || as_double(step) == 0) {
+                    msg = "'for' start, limit and step must be numbers and step can't be 0";
+                    break;
+                }
+                stack.emplace_back();
+                int cmp_res;
+                compare(var, limit, &cmp_res, msg);
+                set_bool(stack.back(), as_double(step) > 0 ? cmp_res <= 0 : cmp_res >= 0);
+                continue;
+            }
+            default: // OP_RETURN
+                *result = std::move(stack.back());
+                return true;
+        }
+
+        // Only errors get here
+        char line[32];
+        snprintf(line, sizeof(line), "line %u: ", in.line);
+        err = line + msg;
+        return false;
+    }
+    err = msg;
+    return false;
+}
+
+// CACHE
+
+static HMap scripts;
+
+static Script* cache_find(const char* sha, size_t len) {
+    if (len != 40) {
+        return NULL;
+    }
+    HNode tmp;
+    tmp.key = dstr_init(len);
+    for (size_t i = 0; i < len; i++) {
+        char lower = tolower((unsigned char)sha[i]);
+        dstr_append(&tmp.key, &lower, 1);
+    }
+    tmp.hcode = str_hash((uint8_t*)tmp.key->buf, len);
+    HNode* node = hm_lookup(&scripts, &tmp);
+    free(tmp.key);
+    return node ? container_of(node, Script, node) : NULL;
+}
+
+Script* script_cache_get(const char* sha, size_t len) {
+    return cache_find(sha, len);
+}
+
+Script* script_cache_load(const char* src, size_t len, char sha[41], std::string& err) {
+    sha1_hex(src, len, sha);
+    Script* script = cache_find(sha, 40);
+    if (script) {
+        return script;
+    }
+    script = script_compile(src, len, err);
+    if (!script) {
+        return NULL;
+    }
+    script->node.key = dstr_init(40);
+    dstr_append(&script->node.key, sha, 40);
+    script->node.hcode = str_hash((uint8_t*)sha, 40);
+    hm_insert(&scripts, &script->node);
+    return script;
+}
+
+void script_cache_flush() {
+    std::vector<HNode*> nodes;
+    hm_keys(&scripts, nodes);
+    for (HNode* node : nodes) {
+        script_free(container_of(node, Script, node));
+    }
+    hm_clear(&scripts);
+}
+
+size_t script_cache_size() {
+    return hm_size(&scripts);
+}
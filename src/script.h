@@ -0,0 +1,64 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "data_structures/dstr.h"
+
+// Server-side scripts (EVAL). The language is a small subset of Lua:
+//   local x = redis.call('get', KEYS[1])       -- also redis.pcall(), which returns errors as values
+//   if not x then x = 0 end                    -- if/elseif/else, while, numeric for, break, return
+//   x = tonumber(x) + tonumber(ARGV[1])        -- tonumber(), tostring(), #, .., arithmetic
+//   return {x, 'done'}                         -- arrays are values, t[#t + 1] = v appends
+// Only locals exist, there are no globals, functions or tables with keys. A script is compiled
+// once into bytecode for a stack VM and cached by the SHA-1 of its source.
+
+#define SCRIPT_MAX_STEPS 50000000 // instructions per run before the script is stopped
+#define SCRIPT_MAX_STACK 1024
+#define SCRIPT_MAX_LOCALS 200
+#define SCRIPT_MAX_DEPTH 200 // nested expressions and blocks, the compiler recurses on each
+
+enum ScriptType {
+    SV_NIL = 0,
+    SV_BOOL = 1,
+    SV_INT = 2,
+    SV_DOUBLE = 3,
+    SV_STR = 4,
+    SV_ARR = 5,
+    SV_ERR = 6, // what redis.pcall() returns for an error reply, str is the message
+};
+
+struct ScriptValue {
+    uint8_t type = SV_NIL;
+    int64_t num = 0; // SV_INT, SV_BOOL
+    double dbl = 0; // SV_DOUBLE
+    std::string str; // SV_STR, SV_ERR
+    std::vector<ScriptValue> arr; // SV_ARR
+};
+
+struct Script;
+
+// Runs one command for redis.call() and leaves its reply frame, framed the same way as on the
+// wire, in out
+typedef void (*ScriptCallFn)(std::vector<dstr*>& cmd, std::vector<uint8_t>& out, void* arg);
+
+// NULL with the message in err if the source doesn't compile
+Script* script_compile(const char* src, size_t len, std::string& err);
+void script_free(Script* script);
+
+// Runs the script against keys and argv. false with the message in err if it raised an error, a
+// redis.call() that failed included
+bool script_run(Script* script, std::vector<dstr*>& keys, std::vector<dstr*>& argv, ScriptCallFn call, void* arg,
+                ScriptValue* result, std::string& err);
+
+// Cache of compiled scripts by the hex SHA-1 of their source
+Script* script_cache_get(const char* sha, size_t len); // NULL if it isn't loaded
+// Compiles and caches the script unless it already is, sha gets its 40 hex digits. NULL on a
+// compile error
+Script* script_cache_load(const char* src, size_t len, char sha[41], std::string& err);
+void script_cache_flush();
+size_t script_cache_size();
+
+#endif
@@ -4,11 +4,15 @@
 #include <stdio.h>
 #include <poll.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <netinet/ip.h>
 #include <vector>
+#include <algorithm>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include "server.h"
 #include "data_structures/dlist.h"
@@ -19,6 +23,15 @@
 #include "out_helpers.h"
 #include "utils/common.h"
 #include "threadpool.h"
+#include "lazyfree.h"
+#include "latency.h"
+#include "logger.h"
+#include "slowlog.h"
+#include "tblock.h"
+#include "script.h"
+#include "pubsub.h"
+#include "blocking.h"
+#include "tracking.h"
 
 GlobalData global_data;
 const size_t MAX_MESSAGE_LEN = 32 << 20;
@@ -26,10 +39,46 @@ const uint32_t MAX_TTL_TASKS = 200;
 const uint64_t IDLE_TIMEOUT_MS = 100 * 1000;
 const uint64_t READ_TIMEOUT_MS = 10 * 1000;
 const uint64_t WRITE_TIMEOUT_MS = 5 * 1000;
+const int MAX_WRITE_IOVS = 256; // iovecs per writev() in handle_write()
+const size_t OUT_BACKPRESSURE = 4 << 20; // pending output over which a pipeline waits for the client to read
+
+// Subscribers are limited apart from normal connections: the server queues them messages without
+// them asking, and one that doesn't read would keep every message ever published
+enum OutClass {
+    OUT_NORMAL = 0,
+    OUT_PUBSUB = 1,
+};
+static const OutLimit OUT_LIMITS[] = {
+    {512 << 20, 128 << 20, 60 * 1000}, // OUT_NORMAL
+    {32 << 20, 8 << 20, 60 * 1000}, // OUT_PUBSUB
+};
+
+static const OutLimit* out_limit(Conn* conn) {
+    return &OUT_LIMITS[conn->subscriptions.empty() ? OUT_NORMAL : OUT_PUBSUB];
+}
+
+// The pending output is dropped right away, the conn is closed once its events are handled
+static void drop_over_limit(Conn* conn) {
+    log_warn("[server]: Closing conn %d, %zu bytes of output are over its limit", conn->fd,
+             out_pending_bytes(conn));
+    out_clear(conn);
+    conn->want_close = true;
+}
 
+static PubSub pubsub;
+static Blocking blocking;
+static Tracking tracking;
+
+// Fatal errors in main(). The background threads are stopped before main() returns, so the message
+// is written and nothing runs on while the statics are destroyed
 static void error(int fd, const char* mes) {
-    close(fd);
-    printf("[server]: %s\n", mes);
+    if (fd >= 0) {
+        close(fd);
+    }
+    log_error("[server]: %s", mes);
+    lazyfree_shutdown();
+    threadpool_shutdown(&global_data.threadpool);
+    log_shutdown();
 }
 
 static void fd_set_non_blocking(int fd) {
@@ -40,13 +89,19 @@ uint64_t get_curr_ms() {
     struct timespec tv = {0, 0};
     int err = clock_gettime(CLOCK_MONOTONIC, &tv);
     if (err) {
-        printf("[server]: error in get_curr_ms\n");
+        log_error("[server]: error in get_curr_ms");
         return 0;
     }
     return tv.tv_sec * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
 static void close_conn(Conn* conn) {
+    tb_end(conn);
+    unwatch_all(&global_data.watched_keys, conn);
+    pubsub_unsubscribe_all(&pubsub, conn);
+    unblock_conn(&blocking, conn);
+    tracking_off(&tracking, conn);
+    out_clear(conn);
     close(conn->fd);
     global_data.fd_to_conn[conn->fd] = NULL;
     dlist_deatach(&conn->idle_timeout);
@@ -67,7 +122,7 @@ static void process_timers() {
             break;
         }
 
-        printf("[server]: Closing conn %d because of idle timeout\n", conn->fd);
+        log_info("[server]: Closing conn %d because of idle timeout", conn->fd);
         close_conn(conn);
     }
 
@@ -80,7 +135,7 @@ static void process_timers() {
             break;
         }
 
-        printf("[server]: Closing conn %d because of read timeout\n", conn->fd);
+        log_info("[server]: Closing conn %d because of read timeout", conn->fd);
         close_conn(conn);
     }
 
@@ -93,7 +148,7 @@ static void process_timers() {
             break;
         }
 
-        printf("[server]: Closing conn %d because of write timeout\n", conn->fd);
+        log_info("[server]: Closing conn %d because of write timeout", conn->fd);
         close_conn(conn);
     }
 
@@ -101,8 +156,7 @@ static void process_timers() {
     size_t curr_iterations = 0;
     while (!global_data.ttl_heap.empty() && global_data.ttl_heap[0].val < curr_ms) {
         HNode* hnode = container_of(global_data.ttl_heap[0].pos_ref, HNode, heap_idx);
-        rem_ttl(hnode);
-        uint8_t deleted = hm_delete(&global_data.db, hnode, true);
+        db_delete(hnode);
 
         if (curr_iterations++ >= MAX_TTL_TASKS) {
             break;
@@ -111,6 +165,12 @@ static void process_timers() {
 }
 
 void set_ttl(HNode* node, uint64_t ttl) {
+    if (node->heap_idx < global_data.ttl_heap.size()) {
+        global_data.ttl_heap[node->heap_idx].val = get_curr_ms() + ttl;
+        heap_fix(global_data.ttl_heap, node->heap_idx);
+        return;
+    }
+
     HeapNode hn;
     hn.val = get_curr_ms() + ttl;
     hn.pos_ref = &node->heap_idx;
@@ -120,7 +180,8 @@ void set_ttl(HNode* node, uint64_t ttl) {
 }
 
 void rem_ttl(HNode* node) {
-    if (node->heap_idx < 0 || node->heap_idx >= global_data.ttl_heap.size()) {
+    // Not in the heap: heap_idx is the (size_t)-1 sentinel, past any heap size
+    if (node->heap_idx >= global_data.ttl_heap.size()) {
         return;
     }
 
@@ -131,25 +192,40 @@ void rem_ttl(HNode* node) {
     if (node->heap_idx < global_data.ttl_heap.size()) {
         heap_fix(global_data.ttl_heap, node->heap_idx);
     }
+    node->heap_idx = -1;
+}
+
+void db_delete(HNode* node) {
+    // Expiring keys have no command to touch them in touch_keys()
+    size_t len;
+    const char* key = hn_key(node, &len);
+    watch_touch(&global_data.watched_keys, key, len);
+    tracking_invalidate(&tracking, key, len, NULL);
+
+    rem_ttl(node);
+    hm_pop(&global_data.db, node);
+    lazyfree_node(node);
 }
 
 static uint64_t next_timer_ms() {
-    if (dlist_empty(&global_data.idle_list)) {
-        return (int64_t)IDLE_TIMEOUT_MS;
-    }
     uint64_t curr = get_curr_ms();
+    uint64_t conn_timeout = curr + IDLE_TIMEOUT_MS;
 
     // Get the smallest timer from the sockets
-    Conn* conn = container_of(global_data.idle_list.next, Conn, idle_timeout);
-    uint64_t conn_timeout = conn->last_active_ms + IDLE_TIMEOUT_MS;
+    if (!dlist_empty(&global_data.idle_list)) {
+        Conn* conn = container_of(global_data.idle_list.next, Conn, idle_timeout);
+        conn_timeout = dmin(conn_timeout, conn->last_active_ms + IDLE_TIMEOUT_MS);
+    }
 
-    // Check if there is a smaller entry timeout
+    // Check if there is a smaller entry or blocking timeout
     if (!global_data.ttl_heap.empty()) {
         conn_timeout = dmin(conn_timeout, global_data.ttl_heap[0].val);
     }
+    if (!blocking.timeouts.empty()) {
+        conn_timeout = dmin(conn_timeout, blocking.timeouts[0].val);
+    }
 
-    uint64_t poll_timout = conn_timeout - curr;
-    return dmax((uint64_t)0, poll_timout);
+    return conn_timeout > curr ? conn_timeout - curr : 0;
 }
 
 static size_t parse_cmd(uint8_t* buf, std::vector<dstr*>& cmd) {
@@ -179,99 +255,301 @@ static size_t parse_cmd(uint8_t* buf, std::vector<dstr*>& cmd) {
     return nstr;
 }
 
-static void out_buffer(Conn* conn, std::vector<dstr*>& cmd) {
-    // Convert the command to lower case
-    char* p = cmd[0]->buf;
-    for (; *p; p++)
-        *p = tolower(*p);
+// Handlers that don't take the plain (conn, cmd) arguments
+static uint8_t cmd_keys(Conn* conn, std::vector<dstr*>&) {
+    return do_keys(conn);
+}
+
+static uint8_t cmd_ttl(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_ttl(conn, cmd, global_data.ttl_heap, get_curr_ms());
+}
+
+static uint8_t cmd_lpush(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_push(conn, cmd, LLIST_SIDE_LEFT);
+}
+
+static uint8_t cmd_rpush(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_push(conn, cmd, LLIST_SIDE_RIGHT);
+}
+
+static uint8_t cmd_lpop(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_pop(conn, cmd, LLIST_SIDE_LEFT);
+}
+
+static uint8_t cmd_rpop(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_pop(conn, cmd, LLIST_SIDE_RIGHT);
+}
+
+static uint8_t cmd_blpop(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_bpop(conn, cmd, LLIST_SIDE_LEFT);
+}
 
+static uint8_t cmd_brpop(Conn* conn, std::vector<dstr*>& cmd) {
+    return do_bpop(conn, cmd, LLIST_SIDE_RIGHT);
+}
+
+static uint8_t do_eval(Conn* conn, std::vector<dstr*>& cmd);
+static uint8_t do_script(Conn* conn, std::vector<dstr*>& cmd);
+static uint8_t do_subscribe(Conn* conn, std::vector<dstr*>& cmd);
+static uint8_t do_unsubscribe(Conn* conn, std::vector<dstr*>& cmd);
+static uint8_t do_publish(Conn* conn, std::vector<dstr*>& cmd);
+static uint8_t do_client(Conn* conn, std::vector<dstr*>& cmd);
+
+// name, min args, max args, handler, flags, first key, key step
+static const CmdSpec commands[] = {
     // GLOBAL DATABASE
-    if (cmd.size() == 2 && !strcmp(cmd[0]->buf, "get"))
-        do_get(conn, cmd);
-    else if (cmd.size() == 3 && !strcmp(cmd[0]->buf, "set"))
-        do_set(conn, cmd);
-    else if (cmd.size() == 2 && !strcmp(cmd[0]->buf, "del"))
-        do_del(conn, cmd);
-    else if (cmd.size() == 1 && !strcmp(cmd[0]->buf, "keys"))
-        do_keys(conn);
+    {"get", 2, 2, do_get, 0, 1, 0},
+    {"set", 3, 3, do_set, CMD_WRITE, 1, 0},
+    {"del", 2, -1, do_del, CMD_WRITE, 1, 1},
+    {"exists", 2, -1, do_exists, 0, 1, 1},
+    {"mget", 2, -1, do_mget, 0, 1, 1},
+    {"mset", 3, -1, do_mset, CMD_WRITE, 1, 2},
+    {"msetnx", 3, -1, do_mset, CMD_WRITE, 1, 2},
+    {"incr", 2, 2, do_incr, CMD_WRITE, 1, 0},
+    {"decr", 2, 2, do_incr, CMD_WRITE, 1, 0},
+    {"incrby", 3, 3, do_incr, CMD_WRITE, 1, 0},
+    {"decrby", 3, 3, do_incr, CMD_WRITE, 1, 0},
+    {"incrbyfloat", 3, 3, do_incrbyfloat, CMD_WRITE, 1, 0},
+    {"keys", 1, 1, cmd_keys, 0, 0, 0},
+    {"scan", 2, -1, do_scan, 0, 0, 0},
+    {"hscan", 3, -1, do_collection_scan, 0, 0, 0},
+    {"sscan", 3, -1, do_collection_scan, 0, 0, 0},
+    {"zscan", 3, -1, do_collection_scan, 0, 0, 0},
+    {"unlink", 2, -1, do_unlink, CMD_WRITE, 1, 1},
+    {"flushdb", 1, 2, do_flushall, CMD_WRITE | CMD_FLUSH, 0, 0},
+    {"flushall", 1, 2, do_flushall, CMD_WRITE | CMD_FLUSH, 0, 0},
 
     // HASHMAP
-    else if (cmd.size() >= 4 && (cmd.size() & 1) == 0 && !strcmp(cmd[0]->buf, "hset"))
-        do_hset(conn, cmd);
-    else if (cmd.size() == 3 && !strcmp(cmd[0]->buf, "hget"))
-        do_hget(conn, cmd);
-    else if (cmd.size() == 2 && !strcmp(cmd[0]->buf, "hgetall"))
-        do_hgetall(conn, cmd);
-    else if (cmd.size() >= 3 && !strcmp(cmd[0]->buf, "hdel"))
-        do_hdel(conn, cmd);
+    {"hset", 4, -1, do_hset, CMD_WRITE | CMD_PAIRS, 1, 0},
+    {"hget", 3, 3, do_hget, 0, 1, 0},
+    {"hgetall", 2, 2, do_hgetall, 0, 1, 0},
+    {"hdel", 3, -1, do_hdel, CMD_WRITE, 1, 0},
 
     // TIME TO LIVE
-    else if (cmd.size() == 3 && !strcmp(cmd[0]->buf, "expire"))
-        do_expire(conn, cmd);
-    else if (cmd.size() == 2 && !strcmp(cmd[0]->buf, "ttl"))
-        do_ttl(conn, cmd, global_data.ttl_heap, get_curr_ms());
-    else if (cmd.size() == 2 && !strcmp(cmd[0]->buf, "persist"))
-        do_persist(conn, cmd);
+    {"expire", 3, 3, do_expire, CMD_WRITE, 1, 0},
+    {"ttl", 2, 2, cmd_ttl, 0, 1, 0},
+    {"persist", 2, 2, do_persist, CMD_WRITE, 1, 0},
 
     // SORTED SET
-    else if (cmd.size() == 4 && !strcmp(cmd[0]->buf, "zadd"))
-        do_zadd(conn, cmd);
-    else if (cmd.size() == 3 && !strcmp(cmd[0]->buf, "zscore"))
-        do_zscore(conn, cmd);
-    else if (cmd.size() == 3 && !strcmp(cmd[0]->buf, "zrem"))
-        do_zrem(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "zquery"))
-        do_zrangequery(conn, cmd);
+    {"zadd", 4, 4, do_zadd, CMD_WRITE, 1, 0},
+    {"zscore", 3, 3, do_zscore, 0, 1, 0},
+    {"zrem", 3, 3, do_zrem, CMD_WRITE, 1, 0},
+    {"zquery", 4, 6, do_zrangequery, 0, 0, 0},
 
     // LINKED LIST
-    else if (!strcmp(cmd[0]->buf, "lpush") && cmd.size() == 3)
-        do_push(conn, cmd, LLIST_SIDE_LEFT);
-    else if (!strcmp(cmd[0]->buf, "rpush") && cmd.size() == 3)
-        do_push(conn, cmd, LLIST_SIDE_RIGHT);
-    else if (!strcmp(cmd[0]->buf, "lpop") && cmd.size() >= 2)
-        do_pop(conn, cmd, LLIST_SIDE_LEFT);
-    else if (!strcmp(cmd[0]->buf, "rpop") && cmd.size() >= 2)
-        do_pop(conn, cmd, LLIST_SIDE_RIGHT);
-    else if (!strcmp(cmd[0]->buf, "lrange") && cmd.size() == 4)
-        do_lrange(conn, cmd);
+    {"lpush", 3, 3, cmd_lpush, CMD_WRITE, 1, 0},
+    {"rpush", 3, 3, cmd_rpush, CMD_WRITE, 1, 0},
+    {"lpop", 2, -1, cmd_lpop, CMD_WRITE, 1, 0},
+    {"rpop", 2, -1, cmd_rpop, CMD_WRITE, 1, 0},
+    {"blpop", 3, -1, cmd_blpop, CMD_WRITE, 1, 1, -2},
+    {"brpop", 3, -1, cmd_brpop, CMD_WRITE, 1, 1, -2},
+    {"blmove", 6, 6, do_blmove, CMD_WRITE, 1, 1, 2},
+    {"lrange", 4, 4, do_lrange, 0, 1, 0},
 
     // HASHSET
-    else if (!strcmp(cmd[0]->buf, "sadd"))
-        do_sadd(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "srem"))
-        do_srem(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "smembers"))
-        do_smembers(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "scard"))
-        do_scard(conn, cmd);
+    {"sadd", 3, 3, do_sadd, CMD_WRITE, 1, 0},
+    {"srem", 3, 3, do_srem, CMD_WRITE, 1, 0},
+    {"smembers", 2, 2, do_smembers, 0, 1, 0},
+    {"scard", 2, 2, do_scard, 0, 1, 0},
 
     // BITMAP
-    else if (!strcmp(cmd[0]->buf, "setbit"))
-        do_setbit(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "getbit"))
-        do_getbit(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "bitcount"))
-        do_bitcount(conn, cmd);
+    {"setbit", 4, 4, do_setbit, CMD_WRITE, 1, 0},
+    {"getbit", 3, 3, do_getbit, 0, 1, 0},
+    {"bitcount", 2, 5, do_bitcount, 0, 1, 0},
+    {"bitop", 4, -1, do_bitop, CMD_WRITE, 2, 0},
+    {"bitpos", 3, 6, do_bitpos, 0, 1, 0},
+    {"bitfield", 2, -1, do_bitfield, CMD_WRITE, 1, 0},
 
     // HYPERLOGLOG
-    else if (!strcmp(cmd[0]->buf, "pfadd"))
-        do_pfadd(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "pfcount"))
-        do_pfcount(conn, cmd);
-    else if (!strcmp(cmd[0]->buf, "pfmerge"))
-        do_pfmerge(conn, cmd);
-
-    // TODO: IMPLEMENT
-    else if (!strcmp(cmd[0]->buf, "multi"))
-        return;
-    else if (!strcmp(cmd[0]->buf, "exec"))
-        return;
-    else if (!strcmp(cmd[0]->buf, "watch"))
+    {"pfadd", 2, -1, do_pfadd, CMD_WRITE, 1, 0},
+    {"pfcount", 2, -1, do_pfcount, 0, 1, 1},
+    {"pfmerge", 2, -1, do_pfmerge, CMD_WRITE, 1, 0},
+
+    // STREAMS
+    {"xadd", 5, -1, do_xadd, CMD_WRITE, 1, 0},
+    {"xlen", 2, 2, do_xlen, 0, 1, 0},
+    {"xrange", 4, 6, do_xrange, 0, 1, 0},
+    {"xrevrange", 4, 6, do_xrange, 0, 1, 0},
+    {"xread", 4, -1, do_xread, 0, 0, 0},
+
+    // SCRIPTING (the commands a script calls touch their keys)
+    {"eval", 3, -1, do_eval, CMD_NOSCRIPT, 0, 0},
+    {"evalsha", 3, -1, do_eval, CMD_NOSCRIPT, 0, 0},
+    {"script", 2, -1, do_script, CMD_NOSCRIPT, 0, 0},
+
+    // PUB/SUB
+    {"subscribe", 2, -1, do_subscribe, CMD_NOSCRIPT, 0, 0},
+    {"psubscribe", 2, -1, do_subscribe, CMD_NOSCRIPT, 0, 0},
+    {"unsubscribe", 1, -1, do_unsubscribe, CMD_NOSCRIPT, 0, 0},
+    {"punsubscribe", 1, -1, do_unsubscribe, CMD_NOSCRIPT, 0, 0},
+    {"publish", 3, 3, do_publish, 0, 0, 0},
+
+    // CLIENT SIDE CACHING
+    {"client", 2, -1, do_client, CMD_NOSCRIPT, 0, 0},
+
+    // INTROSPECTION
+    {"info", 1, 2, do_info, 0, 0, 0},
+    {"latency", 2, -1, do_latency, 0, 0, 0},
+    {"slowlog", 2, -1, do_slowlog, 0, 0, 0},
+    {"config", 3, -1, do_config, 0, 0, 0},
+};
+
+// NULL with the error already in the reply if the name or the number of arguments is wrong
+static const CmdSpec* lookup_cmd(Conn* conn, std::vector<dstr*>& cmd) {
+    for (const CmdSpec& spec : commands) {
+        if (strcmp(cmd[0]->buf, spec.name)) {
+            continue;
+        }
+        int argc = cmd.size();
+        if (argc < spec.min_args || (spec.max_args != -1 && argc > spec.max_args) ||
+            ((spec.flags & CMD_PAIRS) && (argc & 1))) {
+            out_err(conn, "wrong number of arguments");
+            return NULL;
+        }
+        return &spec;
+    }
+    out_err(conn, "unknown command");
+    return NULL;
+}
+
+// Bumps the WATCH versions of the keys the command wrote and invalidates them in client side caches.
+// The keys a tracking connection reads are remembered for that instead
+static void touch_keys(Conn* conn, const CmdSpec* spec, std::vector<dstr*>& cmd) {
+    bool write = spec->flags & CMD_WRITE;
+    if (!spec->first_key || (!write && !conn->tracking)) {
+        if (spec->flags & CMD_FLUSH) {
+            watch_touch_all(&global_data.watched_keys);
+            tracking_invalidate_all(&tracking);
+        }
         return;
-    else if (!strcmp(cmd[0]->buf, "discard"))
+    }
+
+    bool watched = hm_size(&global_data.watched_keys);
+    int last_key = spec->last_key ? spec->last_key : -1;
+    size_t last = last_key > 0 ? last_key : cmd.size() + last_key;
+    for (size_t i = spec->first_key; i <= last && i < cmd.size(); i += spec->key_step) {
+        if (!write) {
+            tracking_read(&tracking, conn, cmd[i]->buf, cmd[i]->size);
+        }
+        else {
+            if (watched) {
+                watch_touch(&global_data.watched_keys, cmd[i]->buf, cmd[i]->size);
+            }
+            tracking_invalidate(&tracking, cmd[i]->buf, cmd[i]->size, conn);
+        }
+        if (!spec->key_step) {
+            break;
+        }
+    }
+}
+
+/*
+ * SYNTAX: EXEC
+ * Runs the queued commands back to back into the EXEC reply, which is an array with one
+ * [status, values...] array per command. Null if a watched key was written since WATCH
+ */
+static void do_exec(Conn* conn) {
+    if (!conn->in_multi) {
+        out_err(conn, "EXEC without MULTI");
         return;
-    else
-        out_err(conn, "unknown command");
+    }
+
+    TB* tb = conn->tb;
+    if (!tb->alive) {
+        out_err(conn, "transaction discarded because of previous errors");
+    }
+    else if (watch_dirty(conn)) {
+        out_null(conn);
+    }
+    else {
+        tb_exec(conn, touch_keys);
+    }
+    tb_end(conn);
+    unwatch_all(&global_data.watched_keys, conn);
+}
+
+// MULTI, EXEC, DISCARD, WATCH and UNWATCH. Returns false for other commands
+static bool tx_command(Conn* conn, std::vector<dstr*>& cmd) {
+    const char* name = cmd[0]->buf;
+    if (!strcmp(name, "multi")) {
+        if (conn->in_multi) {
+            out_err(conn, "MULTI calls can not be nested");
+            return true;
+        }
+        tb_begin(conn);
+        out_null(conn);
+    }
+    else if (!strcmp(name, "exec")) {
+        do_exec(conn);
+    }
+    else if (!strcmp(name, "discard")) {
+        if (!conn->in_multi) {
+            out_err(conn, "DISCARD without MULTI");
+            return true;
+        }
+        tb_end(conn);
+        unwatch_all(&global_data.watched_keys, conn);
+        out_null(conn);
+    }
+    else if (!strcmp(name, "watch")) {
+        if (cmd.size() < 2) {
+            out_err(conn, "wrong number of arguments");
+        }
+        else if (conn->in_multi) {
+            out_err(conn, "WATCH inside MULTI is not allowed");
+        }
+        else {
+            for (size_t i = 1; i < cmd.size(); i++) {
+                watch_key(&global_data.watched_keys, conn, cmd[i]);
+            }
+            out_null(conn);
+        }
+    }
+    else if (!strcmp(name, "unwatch")) {
+        unwatch_all(&global_data.watched_keys, conn);
+        out_null(conn);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Returns false for unknown and queued commands, which are not timed
+static bool out_buffer(Conn* conn, std::vector<dstr*>& cmd) {
+    // Convert the command to lower case
+    char* p = cmd[0]->buf;
+    for (; *p; p++)
+        *p = tolower(*p);
+
+    if (tx_command(conn, cmd)) {
+        return true;
+    }
+
+    const CmdSpec* spec = lookup_cmd(conn, cmd);
+    if (!spec) {
+        // A command that can't be queued makes EXEC fail, like in Redis
+        if (conn->in_multi) {
+            conn->tb->alive = false;
+        }
+        return false;
+    }
+    if (conn->in_multi) {
+        tb_queue(conn, spec, cmd);
+        out_str(conn, "QUEUED", 6);
+        return false;
+    }
+
+    // A command that blocked wrote nothing yet, its keys are touched when it runs again
+    size_t status = conn->outgoing.size() - 4;
+    spec->handler(conn, cmd);
+    if (!conn->blocked && !out_reply_failed(conn->outgoing, status)) {
+        touch_keys(conn, spec, cmd);
+    }
+    if (conn->blocked && !conn->blocked->spec) {
+        conn->blocked->spec = spec;
+    }
+    return true;
 }
 
 static void before_res_build(std::vector<uint8_t>& out, uint32_t& header) {
@@ -286,17 +564,306 @@ static void before_res_build(std::vector<uint8_t>& out, uint32_t& header) {
     buf_append_u32(out, RES_OK);
 }
 
-static void after_res_build(std::vector<uint8_t>& out, uint32_t& header) {
-    // Add the header
-    size_t mes_len = out.size() - header - 4;
+static void after_res_build(Conn* conn, uint32_t& header) {
+    // Add the header, the values the reply references count too
+    size_t mes_len = out_reply_len(conn, header) - 4;
     if (mes_len > MAX_MESSAGE_LEN) {
-        printf("[server]: Message too long\n");
-        return;
+        // Too long for the client to take, an error replaces it
+        log_warn("[server]: Message too long (%zu bytes)", mes_len);
+        out_truncate(conn, header);
+        before_res_build(conn->outgoing, header);
+        out_err(conn, "reply is too long");
+        mes_len = out_reply_len(conn, header) - 4;
+    }
+    memcpy(&conn->outgoing[header], &mes_len, 4);
+}
+
+// Commands called by scripts reply here instead of to the client
+static Conn script_conn;
+
+// arg is the connection that runs the script, its reads and writes are tracked as its own
+static void script_call(std::vector<dstr*>& cmd, std::vector<uint8_t>& out, void* arg) {
+    script_conn.outgoing.clear();
+    uint32_t header_pos = 0;
+    before_res_build(script_conn.outgoing, header_pos);
+
+    for (char* p = cmd[0]->buf; *p; p++)
+        *p = tolower(*p);
+    const CmdSpec* spec = lookup_cmd(&script_conn, cmd);
+    if (spec && (spec->flags & CMD_NOSCRIPT)) {
+        out_err(&script_conn, "command not allowed from scripts");
     }
-    memcpy(&out[header], &mes_len, 4);
+    else if (spec) {
+        spec->handler(&script_conn, cmd);
+        if (!out_reply_failed(script_conn.outgoing, header_pos + 10)) {
+            touch_keys((Conn*)arg, spec, cmd);
+        }
+    }
+
+    after_res_build(&script_conn, header_pos);
+    out.swap(script_conn.outgoing);
 }
 
-static bool try_one_req(Conn* conn) {
+// nil and false are null, true is 1, like Redis converts Lua values
+static void out_script_value(Conn* conn, ScriptValue& val, bool top) {
+    switch (val.type) {
+        case SV_BOOL:
+            if (val.num) {
+                out_int64(conn, 1);
+            }
+            else {
+                out_null(conn);
+            }
+            break;
+        case SV_INT:
+            out_int64(conn, val.num);
+            break;
+        case SV_DOUBLE:
+            out_double(conn, val.dbl);
+            break;
+        case SV_STR:
+            out_str(conn, val.str.data(), val.str.size());
+            break;
+        case SV_ERR:
+            if (top) {
+                out_err(conn, val.str.c_str());
+                break;
+            }
+            buf_append_u8(conn->outgoing, TAG_ERROR);
+            buf_append_u32(conn->outgoing, val.str.size());
+            buf_append(conn->outgoing, (uint8_t*)val.str.data(), val.str.size());
+            break;
+        case SV_ARR:
+            out_arr(conn, val.arr.size());
+            for (ScriptValue& elem : val.arr) {
+                out_script_value(conn, elem, false);
+            }
+            break;
+        default:
+            out_null(conn);
+    }
+}
+
+/*
+ * SYNTAX: EVAL script numkeys [key ...] [arg ...] | EVALSHA sha1 numkeys [key ...] [arg ...]
+ * Runs the script (see script.h) with KEYS and ARGV. Nothing else runs in between, the compiled
+ * script is cached by the SHA-1 of its source
+ */
+static uint8_t do_eval(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    dstr* source = cmd[1];
+    int64_t numkeys = 0;
+    if (!str_to_int64(cmd[2]->buf, cmd[2]->size, &numkeys) || numkeys < 0 || numkeys > (int64_t)cmd.size() - 3) {
+        out_err(conn, "number of keys can't be negative or greater than the number of arguments");
+        return OUT_OF_RANGE;
+    }
+
+    Script* script;
+    std::string err;
+    if (!strcmp(cmd[0]->buf, "evalsha")) {
+        script = script_cache_get(source->buf, source->size);
+        if (!script) {
+            out_err(conn, "NOSCRIPT no matching script, use EVAL");
+            return NOT_FOUND;
+        }
+    }
+    else {
+        char sha[41];
+        script = script_cache_load(source->buf, source->size, sha, err);
+        if (!script) {
+            out_err(conn, ("error compiling script: " + err).c_str());
+            return INCORRECT_TYPE;
+        }
+    }
+
+    std::vector<dstr*> keys(cmd.begin() + 3, cmd.begin() + 3 + numkeys);
+    std::vector<dstr*> argv(cmd.begin() + 3 + numkeys, cmd.end());
+    ScriptValue result;
+    if (!script_run(script, keys, argv, script_call, conn, &result, err)) {
+        out_err(conn, ("error running script: " + err).c_str());
+        return INTERNAL_ERR;
+    }
+    out_script_value(conn, result, true);
+    return SUCCESS;
+}
+
+/*
+ * SYNTAX: SCRIPT LOAD script | SCRIPT EXISTS sha1 [sha1 ...] | SCRIPT FLUSH
+ */
+static uint8_t do_script(Conn* conn, std::vector<dstr*>& cmd) {
+    // ARGS
+    const char* sub = cmd[1]->buf;
+
+    if (!strcasecmp(sub, "load") && cmd.size() == 3) {
+        char sha[41];
+        std::string err;
+        if (!script_cache_load(cmd[2]->buf, cmd[2]->size, sha, err)) {
+            out_err(conn, ("error compiling script: " + err).c_str());
+            return INCORRECT_TYPE;
+        }
+        out_str(conn, sha, 40);
+        return SUCCESS;
+    }
+    if (!strcasecmp(sub, "exists") && cmd.size() >= 3) {
+        out_arr(conn, cmd.size() - 2);
+        for (size_t i = 2; i < cmd.size(); i++) {
+            out_int(conn, script_cache_get(cmd[i]->buf, cmd[i]->size) != NULL);
+        }
+        return SUCCESS;
+    }
+    if (!strcasecmp(sub, "flush") && cmd.size() <= 3) {
+        script_cache_flush();
+        out_null(conn);
+        return SUCCESS;
+    }
+    out_err(conn, "unknown subcommand");
+    return INCORRECT_TYPE;
+}
+
+static void out_subscription(Conn* conn, const char* kind, dstr* name, size_t count) {
+    out_arr(conn, 3);
+    out_str(conn, kind, strlen(kind));
+    if (name) {
+        out_str(conn, name->buf, name->size);
+    }
+    else {
+        out_null(conn);
+    }
+    out_int64(conn, count);
+}
+
+// Subscribed and blocked connections wait for messages (data) as long as they like
+static bool waits_for_server(Conn* conn) {
+    return !conn->subscriptions.empty() || conn->blocked;
+}
+
+static void stop_conn_timers(Conn* conn) {
+    dlist_deatach(&conn->idle_timeout);
+    dlist_deatach(&conn->read_timeout);
+}
+
+/*
+ * SYNTAX: SUBSCRIBE channel [channel ...] | PSUBSCRIBE pattern [pattern ...]
+ * Replies [subscribe, channel, count] for each channel, count being the number of channels and
+ * patterns the connection is subscribed to after it
+ */
+static uint8_t do_subscribe(Conn* conn, std::vector<dstr*>& cmd) {
+    bool pattern = cmd[0]->buf[0] == 'p';
+    for (size_t i = 1; i < cmd.size(); i++) {
+        size_t count = pubsub_subscribe(&pubsub, conn, cmd[i], pattern);
+        out_subscription(conn, pattern ? "psubscribe" : "subscribe", cmd[i], count);
+    }
+    stop_conn_timers(conn);
+    return SUCCESS;
+}
+
+/*
+ * SYNTAX: UNSUBSCRIBE [channel ...] | PUNSUBSCRIBE [pattern ...]
+ * Without arguments unsubscribes from all channels (patterns)
+ */
+static uint8_t do_unsubscribe(Conn* conn, std::vector<dstr*>& cmd) {
+    bool pattern = cmd[0]->buf[0] == 'p';
+    const char* kind = pattern ? "punsubscribe" : "unsubscribe";
+    if (cmd.size() > 1) {
+        for (size_t i = 1; i < cmd.size(); i++) {
+            out_subscription(conn, kind, cmd[i], pubsub_unsubscribe(&pubsub, conn, cmd[i], pattern));
+        }
+        return SUCCESS;
+    }
+
+    std::vector<dstr*> names;
+    for (Subscription* sub : conn->subscriptions) {
+        if (sub->topic->pattern == pattern) {
+            dstr* name = sub->topic->node.key;
+            dstr* copy = dstr_init(name->size);
+            dstr_append(&copy, name->buf, name->size);
+            names.push_back(copy);
+        }
+    }
+    if (names.empty()) {
+        out_subscription(conn, kind, NULL, conn->subscriptions.size());
+    }
+    for (dstr* name : names) {
+        out_subscription(conn, kind, name, pubsub_unsubscribe(&pubsub, conn, name, pattern));
+        free(name);
+    }
+    return SUCCESS;
+}
+
+/*
+ * SYNTAX: PUBLISH channel message
+ * Returns the number of subscribers the message was queued to
+ */
+static uint8_t do_publish(Conn* conn, std::vector<dstr*>& cmd) {
+    out_int64(conn, pubsub_publish(&pubsub, cmd[1], cmd[2]));
+    return SUCCESS;
+}
+
+/*
+ * SYNTAX: CLIENT TRACKING ON [BCAST] [PREFIX prefix ...] [NOLOOP] | CLIENT TRACKING OFF
+ * With tracking on, the connection gets an ["invalidate", [key]] push when a key it read is written
+ * (or expires), after which it has to read the key again to be told about the next write. BCAST sends
+ * the invalidations of every key starting with one of the prefixes (all keys without PREFIX) without
+ * remembering reads. NOLOOP leaves out the connection's own writes
+ */
+static uint8_t do_client(Conn* conn, std::vector<dstr*>& cmd) {
+    if (strcasecmp(cmd[1]->buf, "tracking") || cmd.size() < 3) {
+        out_err(conn, "unknown subcommand");
+        return INCORRECT_TYPE;
+    }
+    if (!strcasecmp(cmd[2]->buf, "off") && cmd.size() == 3) {
+        tracking_off(&tracking, conn);
+        out_null(conn);
+        return SUCCESS;
+    }
+    if (strcasecmp(cmd[2]->buf, "on")) {
+        out_err(conn, "syntax error");
+        return INCORRECT_TYPE;
+    }
+
+    uint8_t flags = 0;
+    std::vector<dstr*> prefixes;
+    for (size_t i = 3; i < cmd.size(); i++) {
+        const char* opt = cmd[i]->buf;
+        if (!strcasecmp(opt, "bcast")) {
+            flags |= TRACK_BCAST;
+        }
+        else if (!strcasecmp(opt, "noloop")) {
+            flags |= TRACK_NOLOOP;
+        }
+        else if (!strcasecmp(opt, "prefix") && i + 1 < cmd.size()) {
+            prefixes.push_back(cmd[++i]);
+        }
+        else {
+            out_err(conn, "syntax error");
+            return INCORRECT_TYPE;
+        }
+    }
+    if (!prefixes.empty() && !(flags & TRACK_BCAST)) {
+        out_err(conn, "PREFIX option requires BCAST mode to be enabled");
+        return INCORRECT_TYPE;
+    }
+
+    tracking_on(&tracking, conn, flags, prefixes.data(), prefixes.size());
+    out_null(conn);
+    return SUCCESS;
+}
+
+// `ts` is the timestamp of the end of the previous request in this read (or of the read itself), so
+// every request takes a single clock read and its time includes parsing it. Slow commands are also
+// captured in the slow log, with the fd of the client that sent them
+static bool try_one_req(Conn* conn, uint64_t* ts) {
+    if (conn->want_close) {
+        return false;
+    }
+    if (conn->blocked) {
+        // The rest of the pipeline waits for the blocked command
+        return false;
+    }
+    if (out_pending_bytes(conn) > OUT_BACKPRESSURE) {
+        // And for the client to read what it has, handle_write() goes on with it
+        return false;
+    }
     if (conn->incoming.size() < 4) {
         // we need to read - we do not even know the message size
         return false;
@@ -315,27 +882,183 @@ static bool try_one_req(Conn* conn) {
     std::vector<dstr*> cmd;
     parse_cmd(&conn->incoming[4], cmd);
 
-    // Log the query
-    printf("[server]: Token from the client: ");
-    for (dstr* token : cmd) {
-        printf("%s ", token->buf);
-    }
-    printf("\n");
+    log_debug("[server]: %s with %zu args from conn %d", cmd.empty() ? "" : cmd[0]->buf, cmd.size(), conn->fd);
+
+    // A reply stops growing once it's over MAX_MESSAGE_LEN or the output over its hard limit, it
+    // can't be sent either way (see after_res_build())
+    const OutLimit* limit = out_limit(conn);
+    size_t hard = limit->hard ? limit->hard : SIZE_MAX;
+    conn->out_cap = std::min(hard, out_pending_bytes(conn) + 4 + MAX_MESSAGE_LEN);
 
     // Add the first tags that will always be there
     uint32_t header_pos = 0;
     before_res_build(conn->outgoing, header_pos);
+    conn->reply_at = conn->out_base + header_pos;
 
     // Create the output buffer. Each build starts with the status code
-    out_buffer(conn, cmd);
+    bool known = out_buffer(conn, cmd);
+    conn->reply_at = UINT64_MAX;
+    conn->out_cap = SIZE_MAX;
+    uint64_t now = latency_now();
+    if (known) {
+        uint64_t ns = latency_ns(now - *ts);
+        cmdstats_record(cmd[0]->buf, ns);
+        slowlog_record(conn->fd, cmd, ns / 1000);
+    }
+    *ts = now;
 
-    // Add the total length and clean up the incoming buffer
-    after_res_build(conn->outgoing, header_pos);
+    // A blocked command keeps its arguments to run again and replies once it's served
+    bool over = false;
+    if (conn->blocked) {
+        conn->blocked->argv.swap(cmd);
+        out_truncate(conn, header_pos);
+    }
+    else {
+        // Checked after every reply, a pipeline can't queue more than the limit in one read
+        over = hard < SIZE_MAX && out_pending_bytes(conn) > hard;
+        if (!over) {
+            after_res_build(conn, header_pos);
+            over = out_over_limit(conn, limit, get_curr_ms());
+        }
+    }
+
+    // Queued commands took their arguments with them
+    for (dstr* arg : cmd) {
+        free(arg);
+    }
+
+    // Clean up the incoming buffer
     buf_consume(conn->incoming, 4 + total_len);
 
+    if (over) {
+        drop_over_limit(conn);
+        return false;
+    }
+    return true;
+}
+
+bool block_on(Conn* conn, dstr** keys, size_t n, uint64_t timeout_ms, bool takes_pushes) {
+    if (conn->blocked) {
+        // Run again by serve_blocked() and still nothing to reply
+        conn->blocked->rearmed = true;
+        return true;
+    }
+    if (conn->fd < 0 || conn->in_multi) {
+        return false;
+    }
+    block_conn(&blocking, conn, keys, n, timeout_ms ? get_curr_ms() + timeout_ms : 0);
+    conn->blocked->takes_pushes = takes_pushes;
+    stop_conn_timers(conn);
     return true;
 }
 
+void signal_key_ready(dstr* key) {
+    block_signal(&blocking, key->buf, key->size);
+}
+
+// Connections whose blocked command replied, their pipelines run in serve_blocked(). Not right away:
+// they may be woken by a command of another connection that is still running
+static std::vector<Conn*> resumed;
+
+// The blocked command is done, the connection goes on with its timers and later its pipeline
+static void resume_conn(Conn* conn) {
+    unblock_conn(&blocking, conn);
+    conn->last_active_ms = get_curr_ms();
+    dlist_deatach(&conn->idle_timeout);
+    if (!waits_for_server(conn)) {
+        dlist_insert_before(&global_data.idle_list, &conn->idle_timeout);
+    }
+    if (!conn->want_write) {
+        conn->last_read_ms = get_curr_ms();
+        dlist_deatach(&conn->read_timeout);
+        dlist_insert_before(&global_data.read_list, &conn->read_timeout);
+    }
+    resumed.push_back(conn);
+}
+
+// Runs the blocked command again into a new reply. False if it still found nothing and blocked again,
+// then there is no reply
+static bool run_blocked(Conn* conn) {
+    BlockState* state = conn->blocked;
+    uint32_t header_pos = 0;
+    before_res_build(conn->outgoing, header_pos);
+    conn->reply_at = conn->out_base + header_pos;
+    state->rearmed = false;
+    size_t status = conn->outgoing.size() - 4;
+    state->spec->handler(conn, state->argv);
+    if (!state->rearmed && !out_reply_failed(conn->outgoing, status)) {
+        touch_keys(conn, state->spec, state->argv);
+    }
+    conn->reply_at = UINT64_MAX;
+
+    if (state->rearmed) {
+        out_truncate(conn, header_pos);
+        return false;
+    }
+    after_res_build(conn, header_pos);
+    resume_conn(conn);
+    return true;
+}
+
+bool hand_to_waiter(dstr* key, dstr* value) {
+    BlockedKey* bk = block_find(&blocking, key->buf, key->size);
+    if (!bk) {
+        return false;
+    }
+    for (Conn* conn : bk->waiters) {
+        BlockState* state = conn->blocked;
+        // One running with a handed element already (BLMOVE l l) gets the next one through the list
+        if (state->spec && state->takes_pushes && !state->handoff) {
+            state->handoff_key = key;
+            state->handoff = value;
+            run_blocked(conn);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs the commands blocked on keys that got data, first blocked first, and then the pipelines of
+// the connections that got their reply. A command that still finds nothing (another waiter took the
+// data) blocks again and keeps its place. The poll loop writes the replies
+static void serve_blocked() {
+    std::vector<BlockedKey*> keys;
+    std::vector<Conn*> conns;
+    while (!blocking.ready.empty() || !resumed.empty()) {
+        block_take_ready(&blocking, keys);
+        for (BlockedKey* bk : keys) {
+            conns.assign(bk->waiters.begin(), bk->waiters.end());
+            for (Conn* conn : conns) {
+                // Not served through another key already
+                if (conn->blocked && conn->blocked->spec) {
+                    run_blocked(conn);
+                }
+            }
+            block_done(&blocking, bk);
+        }
+
+        conns.swap(resumed);
+        resumed.clear();
+        for (Conn* conn : conns) {
+            uint64_t ts = latency_now();
+            while (try_one_req(conn, &ts)) {}
+        }
+    }
+}
+
+// Blocked commands reply null once their timeout passes
+static void expire_blocked() {
+    uint64_t curr_ms = get_curr_ms();
+    while (Conn* conn = block_expired(&blocking, curr_ms)) {
+        uint32_t header_pos = 0;
+        before_res_build(conn->outgoing, header_pos);
+        out_null(conn);
+        after_res_build(conn, header_pos);
+        resume_conn(conn);
+    }
+    serve_blocked();
+}
+
 static Conn* handle_accept(int fd) {
     struct sockaddr_in client_addr = {};
     socklen_t addrlen = sizeof(client_addr);
@@ -359,6 +1082,15 @@ static Conn* handle_accept(int fd) {
     return conn;
 }
 
+// The conn has output: stop reading until it's written
+static void start_write(Conn* conn) {
+    conn->want_read = false;
+    conn->want_write = true;
+    dlist_deatach(&conn->read_timeout);
+    dlist_insert_before(&global_data.write_list, &conn->write_timeout);
+    conn->last_write_ms = get_curr_ms();
+}
+
 static void handle_read(Conn* conn) {
     uint8_t rbuf[64 * 1024];
     int rv = read(conn->fd, rbuf, sizeof(rbuf));
@@ -372,20 +1104,65 @@ static void handle_read(Conn* conn) {
     }
 
     buf_append(conn->incoming, rbuf, (size_t)rv);
-    while (try_one_req(conn)) {}
+    uint64_t ts = latency_now();
+    while (try_one_req(conn, &ts)) {}
     conn->last_read_ms = get_curr_ms();
+    serve_blocked();
 
-    if (conn->outgoing.size() > 0) {
-        conn->want_read = false;
-        conn->want_write = true;
-        dlist_deatach(&conn->read_timeout);
-        dlist_insert_before(&global_data.write_list, &conn->write_timeout);
-        conn->last_write_ms = get_curr_ms();
+    // POLLIN comes while writing too (see main()), the conn is then on the write list already
+    if (out_pending(conn) && !conn->want_write) {
+        start_write(conn);
+    }
+}
+
+// Writes Conn::outgoing with the shared frames and long values spliced in at their places, as one writev()
+static ssize_t write_out(Conn* conn) {
+    struct iovec iov[MAX_WRITE_IOVS];
+    int n = 0;
+    size_t pos = 0; // in outgoing
+    size_t i = 0;
+    for (; i < conn->out_chunks.size() && n + 2 <= MAX_WRITE_IOVS; i++) {
+        OutChunk& chunk = conn->out_chunks[i];
+        size_t at = chunk.at - conn->out_base;
+        if (at > pos) {
+            iov[n++] = {&conn->outgoing[pos], at - pos};
+            pos = at;
+        }
+        iov[n++] = {chunk.buf->data + chunk.pos, chunk.buf->len - chunk.pos};
+    }
+    if (i == conn->out_chunks.size() && pos < conn->outgoing.size() && n < MAX_WRITE_IOVS) {
+        iov[n++] = {&conn->outgoing[pos], conn->outgoing.size() - pos};
+    }
+    return writev(conn->fd, iov, n);
+}
+
+// Drops the first `written` bytes of the output, in the order write_out() sent them
+static void consume_out(Conn* conn, size_t written) {
+    size_t out_done = 0;
+    while (written) {
+        if (!conn->out_chunks.empty() && conn->out_chunks.front().at == conn->out_base + out_done) {
+            OutChunk& chunk = conn->out_chunks.front();
+            size_t len = dmin((size_t)(chunk.buf->len - chunk.pos), written);
+            chunk.pos += len;
+            conn->out_chunk_bytes -= len;
+            written -= len;
+            if (chunk.pos == chunk.buf->len) {
+                shared_buf_release(chunk.buf);
+                conn->out_chunks.pop_front();
+            }
+            continue;
+        }
+        size_t end = conn->out_chunks.empty() ? conn->outgoing.size() : conn->out_chunks.front().at - conn->out_base;
+        size_t len = dmin(end - out_done, written);
+        out_done += len;
+        written -= len;
     }
+    buf_consume(conn->outgoing, out_done);
+    conn->out_base += out_done;
 }
 
 static void handle_write(Conn* conn) {
-    int rv = write(conn->fd, conn->outgoing.data(), conn->outgoing.size());
+    ssize_t rv = write_out(conn);
     if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         return;
     }
@@ -394,21 +1171,40 @@ static void handle_write(Conn* conn) {
         dlist_deatach(&conn->write_timeout);
         return;
     }
-    buf_consume(conn->outgoing, rv);
+    consume_out(conn, rv);
     conn->last_write_ms = get_curr_ms();
 
-    if (conn->outgoing.size() == 0) {
+    // A pipeline stopped by OUT_BACKPRESSURE goes on once the client caught up
+    if (!conn->incoming.empty() && out_pending_bytes(conn) <= OUT_BACKPRESSURE) {
+        uint64_t ts = latency_now();
+        while (try_one_req(conn, &ts)) {}
+        serve_blocked();
+    }
+
+    if (!out_pending(conn)) {
         conn->want_read = true;
         conn->want_write = false;
         dlist_deatach(&conn->write_timeout);
-        dlist_insert_before(&global_data.read_list, &conn->read_timeout);
+        if (!waits_for_server(conn)) {
+            dlist_insert_before(&global_data.read_list, &conn->read_timeout);
+        }
         conn->last_read_ms = get_curr_ms();
     }
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // ./redis_server [port], so a benchmark run can have its own instance next to a running one
+    uint16_t port = argc > 1 ? atoi(argv[1]) : 8000;
+    if (!port) {
+        fprintf(stderr, "usage: %s [port]\n", argv[0]);
+        return -1;
+    }
+
     // Initialize global data
+    log_init(NULL);
     threadpool_init(&global_data.threadpool, 8);
+    lazyfree_init();
+    latency_init();
     dlist_init(&global_data.idle_list);
     dlist_init(&global_data.read_list);
     dlist_init(&global_data.write_list);
@@ -416,7 +1212,7 @@ int main() {
     // Create
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd == -1) {
-        printf("Error creating the socket\n");
+        error(fd, "Error creating the socket");
         return -1;
     }
     int val = 1;
@@ -426,17 +1222,17 @@ int main() {
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(0);
-    addr.sin_port = htons(8000);
+    addr.sin_port = htons(port);
     int err = bind(fd, (struct sockaddr*)&addr, (socklen_t)sizeof(addr));
     if (err) {
-        error(fd, "[server]: Error binding the socket\n");
+        error(fd, "Error binding the socket");
         return -1;
     }
 
     // Listen
     err = listen(fd, SOMAXCONN);
     if (err) {
-        error(fd, "Error listening to the socket\n");
+        error(fd, "Error listening to the socket");
         return -1;
     }
 
@@ -447,17 +1243,35 @@ int main() {
         struct pollfd pfd = {fd, POLLIN, 0};
         poll_args.push_back(pfd);
 
+        uint64_t now_ms = get_curr_ms();
         for (Conn* conn : global_data.fd_to_conn) {
             if (!conn) {
                 continue;
             }
 
-            // Create poll() args for the current connection
-            struct pollfd pfd = {conn->fd, POLLIN, 0};
+            // Published messages and blocked commands' replies add output outside of the conn's own reads.
+            // A conn dropped while another one ran has no events to be closed with
+            if (!conn->want_close && out_over_limit(conn, out_limit(conn), now_ms)) {
+                drop_over_limit(conn);
+            }
+            if (conn->want_close) {
+                close_conn(conn);
+                continue;
+            }
+
+            // Published messages are queued to subscribers that may be waiting for input
+            if (!conn->want_write && out_pending(conn)) {
+                start_write(conn);
+            }
+
+            // Create poll() args for the current connection. Requests are read ahead while the replies
+            // are written, unless there's too much output: then they wait in the socket and TCP slows
+            // the client down
+            struct pollfd pfd = {conn->fd, 0, 0};
             if (conn->want_write) {
                 pfd.events |= POLLOUT;
             }
-            if (conn->want_read) {
+            if (conn->want_read || out_pending_bytes(conn) <= OUT_BACKPRESSURE) {
                 pfd.events |= POLLIN;
             }
             poll_args.push_back(pfd);
@@ -500,7 +1314,9 @@ int main() {
             Conn* conn = global_data.fd_to_conn[poll_args[i].fd];
             conn->last_active_ms = get_curr_ms();
             dlist_deatach(&conn->idle_timeout);
-            dlist_insert_before(&global_data.idle_list, &conn->idle_timeout);
+            if (!waits_for_server(conn)) {
+                dlist_insert_before(&global_data.idle_list, &conn->idle_timeout);
+            }
 
             if (ready & POLLIN) {
                 handle_read(conn);
@@ -508,10 +1324,11 @@ int main() {
             if (ready & POLLOUT) {
                 handle_write(conn);
             }
-            if ((ready & POLLERR) && conn->want_close) {
+            if ((ready & POLLERR) || conn->want_close) {
                 close_conn(conn);
             }
         }
         process_timers();
+        expire_blocked();
     }
 }
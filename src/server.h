@@ -1,19 +1,62 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <deque>
 #include "data_structures/dlist.h"
 #include "threadpool.h"
 #include "data_structures/hashmap.h"
 #include "data_structures/heap.h"
 
+struct Conn;
+struct WatchedKey;
+struct Subscription;
+struct BlockState;
+struct TrackingClient;
+typedef uint8_t (*CmdHandler)(Conn* conn, std::vector<dstr*>& cmd);
+
+enum CmdFlags {
+    CMD_WRITE = 1 << 0, // its keys are touched for WATCH and client side caches after it runs
+    CMD_FLUSH = 1 << 1, // touches every key
+    CMD_PAIRS = 1 << 2, // the arguments after the key come in pairs (HSET)
+    CMD_NOSCRIPT = 1 << 3, // can't be called from a script
+};
+
+// One entry of the command table in server.cpp
+struct CmdSpec {
+    const char* name;
+    int min_args; // including the name
+    int max_args; // -1 for no limit
+    CmdHandler handler;
+    uint8_t flags; // CMD_*
+    uint8_t first_key; // its keys: cmd[first_key], cmd[first_key + key_step], ..., 0 if not listed. Written
+                       // keys are touched for WATCH and invalidated, read keys are tracked (CLIENT TRACKING)
+    uint8_t key_step; // 0 if there is only cmd[first_key]
+    int8_t last_key = 0; // the last key with a key_step, negative counts from the end. 0 (left out) is the last argument
+};
+
+// A command queued by MULTI, already looked up and checked, so EXEC only calls it
 struct Command {
-    int argc;
-    int* argv;
+    const CmdSpec* spec;
+    std::vector<dstr*> argv;
 };
 
 struct TB {
-    bool alive = true;
-    Command* commands;
+    bool alive = true; // false once a command failed to queue, EXEC then runs nothing
+    std::vector<Command> commands;
+};
+
+struct WatchRef {
+    WatchedKey* key;
+    uint64_t version; // WatchedKey::version when WATCH ran
+};
+
+// A shared frame or a long value in a connection's output. It goes out after the first
+// `at - Conn::out_base` bytes of Conn::outgoing, so it keeps its place among the replies without
+// being copied there. Chunks are in the order of at
+struct OutChunk {
+    SharedBuf* buf;
+    uint32_t pos; // bytes of buf already written
+    uint64_t at;
 };
 
 struct Conn {
@@ -26,8 +69,18 @@ struct Conn {
 
     std::vector<uint8_t> incoming; // data for the app to process
     std::vector<uint8_t> outgoing; // responses
+    std::deque<OutChunk> out_chunks; // shared frames (pub/sub messages) and long values in between them
+    uint64_t out_base = 0; // bytes of outgoing written so far
+    uint64_t reply_at = UINT64_MAX; // while a reply is built its start, frames queued meanwhile go before it
+    size_t out_chunk_bytes = 0; // unwritten bytes of out_chunks
+    uint64_t out_soft_since_ms = UINT64_MAX; // since when the output is over its soft limit, see out_over_limit()
+    size_t out_cap = SIZE_MAX; // the reply being built stops growing once the output is over this
 
-    TB* tb = NULL;
+    TB* tb = NULL; // set while in_multi
+    std::vector<WatchRef> watching;
+    std::vector<Subscription*> subscriptions; // channels and patterns, see pubsub.h
+    BlockState* blocked = NULL; // set while waiting for a key (XREAD BLOCK), see blocking.h
+    TrackingClient* tracking = NULL; // CLIENT TRACKING, see tracking.h
     DListNode idle_timeout;
     DListNode read_timeout;
     DListNode write_timeout;
@@ -38,7 +91,7 @@ struct Conn {
 
 struct GlobalData {
     HMap db;
-    HMap watched_keys; // key: linked list of watcher fd's
+    HMap watched_keys; // WatchedKey nodes, see tblock.h
     DListNode alive_conns;
     DListNode idle_list;
     DListNode read_list;
@@ -52,5 +105,12 @@ extern GlobalData global_data;
 uint64_t get_curr_ms();
 void set_ttl(HNode* node, uint64_t ttl);
 void rem_ttl(HNode* node);
+void db_delete(HNode* node); // removes the key and its TTL, big values are freed in the background
+// Parks conn until one of the keys gets data, then its command runs again. False where a command
+// can't wait (scripts, MULTI), the handler then replies as if the timeout passed. A command that
+// takes_pushes is run with the element instead when a push finds it waiting, see BlockState
+bool block_on(Conn* conn, dstr** keys, size_t n, uint64_t timeout_ms, bool takes_pushes);
+void signal_key_ready(dstr* key); // wakes the connections blocked on key
+bool hand_to_waiter(dstr* key, dstr* value); // false if no list pop waits on key
 
 #endif
@@ -0,0 +1,54 @@
+#include <string.h>
+#include <time.h>
+#include "slowlog.h"
+#include "utils/common.h"
+
+static SlowlogEntry slow_entries[SLOWLOG_LEN];
+static uint64_t slow_next_id = 0;
+static size_t slow_len = 0;
+static int64_t slow_threshold_us = SLOWLOG_DEFAULT_THRESHOLD_US;
+
+void slowlog_set_threshold(int64_t us) {
+    slow_threshold_us = us;
+}
+
+int64_t slowlog_get_threshold() {
+    return slow_threshold_us;
+}
+
+bool slowlog_record(int fd, std::vector<dstr*>& cmd, uint64_t duration_us) {
+    if (slow_threshold_us < 0 || duration_us < (uint64_t)slow_threshold_us) {
+        return false;
+    }
+
+    SlowlogEntry* entry = &slow_entries[slow_next_id % SLOWLOG_LEN];
+    entry->id = slow_next_id++;
+    entry->timestamp = time(NULL);
+    entry->duration_us = duration_us;
+    entry->fd = fd;
+    entry->argc = cmd.size();
+
+    // With too many args the last slot is left for "... (N more arguments)"
+    entry->stored = cmd.size() > SLOWLOG_MAX_ARGC ? SLOWLOG_MAX_ARGC - 1 : cmd.size();
+    for (uint32_t i = 0; i < entry->stored; i++) {
+        entry->arg_size[i] = cmd[i]->size;
+        memcpy(entry->argv[i], cmd[i]->buf, dmin(cmd[i]->size, (size_t)SLOWLOG_MAX_ARG_LEN));
+    }
+    slow_len = dmin(slow_len + 1, (size_t)SLOWLOG_LEN);
+    return true;
+}
+
+void slowlog_get(std::vector<SlowlogEntry*>& out, size_t count) {
+    count = dmin(count, slow_len);
+    for (size_t i = 1; i <= count; i++) {
+        out.push_back(&slow_entries[(slow_next_id - i) % SLOWLOG_LEN]);
+    }
+}
+
+size_t slowlog_len() {
+    return slow_len;
+}
+
+void slowlog_reset() {
+    slow_len = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "data_structures/dstr.h"
+
+#define SLOWLOG_LEN 128 // entries kept, the oldest one is overwritten
+#define SLOWLOG_MAX_ARGC 32 // args kept per entry, the last slot says how many were left out
+#define SLOWLOG_MAX_ARG_LEN 128 // bytes kept per arg
+#define SLOWLOG_DEFAULT_THRESHOLD_US 10000
+
+// Everything lives inline, so recording an entry never allocates
+struct SlowlogEntry {
+    uint64_t id;
+    int64_t timestamp; // unix seconds
+    uint64_t duration_us;
+    int fd; // client connection
+    uint32_t argc; // of the command
+    uint32_t stored; // args in argv, at most SLOWLOG_MAX_ARGC
+    uint32_t arg_size[SLOWLOG_MAX_ARGC]; // full length of each stored arg
+    char argv[SLOWLOG_MAX_ARGC][SLOWLOG_MAX_ARG_LEN];
+};
+
+// Commands taking at least threshold microseconds are logged, negative disables the log
+void slowlog_set_threshold(int64_t us);
+int64_t slowlog_get_threshold();
+
+// true if the command was slow enough to be logged
+bool slowlog_record(int fd, std::vector<dstr*> &cmd, uint64_t duration_us);
+
+// Up to count entries, newest first
+void slowlog_get(std::vector<SlowlogEntry*> &out, size_t count);
+size_t slowlog_len();
+void slowlog_reset(); // ids keep growing
+
+#endif
@@ -1,2 +1,119 @@
 #include <cstdlib>
+#include <string.h>
 #include "tblock.h"
+#include "buffer_funcs.h"
+#include "latency.h"
+#include "out_helpers.h"
+#include "utils/common.h"
+
+void tb_begin(Conn* conn) {
+    conn->in_multi = true;
+    conn->tb = new TB();
+}
+
+void tb_queue(Conn* conn, const CmdSpec* spec, std::vector<dstr*>& cmd) {
+    conn->tb->commands.emplace_back();
+    Command& queued = conn->tb->commands.back();
+    queued.spec = spec;
+    queued.argv.swap(cmd);
+}
+
+void tb_exec(Conn* conn, void (*touch)(Conn* conn, const CmdSpec* spec, std::vector<dstr*>& cmd)) {
+    std::vector<uint8_t>& out = conn->outgoing;
+    out_arr(conn, conn->tb->commands.size());
+    for (Command& queued : conn->tb->commands) {
+        // The handler sees the same [.., status] tail as at the top level, so out_err() and
+        // out_not_found() can still replace the status. Written past out_cap too, it's read back below
+        size_t start = out.size();
+        buf_append_u8(out, TAG_ARR);
+        buf_append_u32(out, 0);
+        buf_append_u8(out, TAG_INT);
+        buf_append_u32(out, RES_OK);
+        uint64_t ts = latency_now();
+        queued.spec->handler(conn, queued.argv);
+        cmdstats_record(queued.spec->name, latency_ns(latency_now() - ts));
+        if (!out_reply_failed(out, start + 6)) {
+            touch(conn, queued.spec, queued.argv);
+        }
+
+        // A full reply may have arrays without their elements, it's dropped anyway
+        if (out_full(conn)) {
+            continue;
+        }
+        uint32_t count = 0;
+        for (size_t pos = start + 5; pos < out.size(); pos += out_value_size(&out[pos])) {
+            count++;
+        }
+        memcpy(&out[start + 1], &count, 4);
+    }
+}
+
+void tb_end(Conn* conn) {
+    if (!conn->tb) {
+        return;
+    }
+    for (Command& queued : conn->tb->commands) {
+        for (dstr* arg : queued.argv) {
+            free(arg);
+        }
+    }
+    delete conn->tb;
+    conn->tb = NULL;
+    conn->in_multi = false;
+}
+
+void watch_key(HMap* watched, Conn* conn, dstr* key) {
+    WatchedKey* wk = hm_find_entry<WatchedKey>(watched, key->buf, key->size);
+    if (!wk) {
+        wk = new WatchedKey();
+        hm_insert_key(watched, &wk->node, key->buf, key->size);
+    }
+
+    // Watching a key twice keeps the version of the first WATCH
+    for (WatchRef& ref : conn->watching) {
+        if (ref.key == wk) {
+            return;
+        }
+    }
+    wk->watchers++;
+    conn->watching.push_back({wk, wk->version});
+}
+
+void watch_touch(HMap* watched, const char* key, size_t len) {
+    if (!hm_size(watched)) {
+        return;
+    }
+    WatchedKey* wk = hm_find_entry<WatchedKey>(watched, key, len);
+    if (wk) {
+        wk->version++;
+    }
+}
+
+void watch_touch_all(HMap* watched) {
+    std::vector<HNode*> nodes;
+    hm_keys(watched, nodes);
+    for (HNode* node : nodes) {
+        container_of(node, WatchedKey, node)->version++;
+    }
+}
+
+bool watch_dirty(Conn* conn) {
+    for (WatchRef& ref : conn->watching) {
+        if (ref.key->version != ref.version) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void unwatch_all(HMap* watched, Conn* conn) {
+    for (WatchRef& ref : conn->watching) {
+        WatchedKey* wk = ref.key;
+        if (--wk->watchers) {
+            continue;
+        }
+        hm_remove_key(watched, &wk->node);
+        delete wk;
+    }
+    conn->watching.clear();
+}
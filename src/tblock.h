@@ -1,6 +1,37 @@
 #ifndef TBLOCK_H
 #define TBLOCK_H
 
-#define TB_ARG_INIT_SIZE 64
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "server.h"
+
+// Transaction blocks (MULTI ... EXEC) and WATCH. Commands are looked up and checked by the server,
+// which owns the command table, and queued with their handler.
+
+// A key that at least one connection WATCHes. A write only bumps the version, so it costs one
+// lookup however many connections watch the key, and EXEC compares the version with the one
+// its connection saw at WATCH time
+struct WatchedKey {
+    HNode node; // node.key is the map's own copy of the key
+    uint64_t version = 0;
+    uint32_t watchers = 0; // the entry is freed with the last one
+};
+
+void tb_begin(Conn* conn); // MULTI
+// Queues a command that was already looked up and checked, the command keeps the argument strings
+void tb_queue(Conn* conn, const CmdSpec* spec, std::vector<dstr*>& cmd);
+// Runs the queued commands into the EXEC reply, an array with one [status, values...] array per
+// command. All of them run even once the reply is over Conn::out_cap, it's dropped then. touch is
+// called for every command that didn't reply with an error
+void tb_exec(Conn* conn, void (*touch)(Conn* conn, const CmdSpec* spec, std::vector<dstr*>& cmd));
+void tb_end(Conn* conn); // after EXEC or DISCARD, or when the conn closes
+
+void watch_key(HMap* watched, Conn* conn, dstr* key);
+// The key was written (or deleted, or expired). Nothing but a size check while no key is watched
+void watch_touch(HMap* watched, const char* key, size_t len);
+void watch_touch_all(HMap* watched); // every key is gone (FLUSHALL)
+bool watch_dirty(Conn* conn); // one of the keys conn watches was touched since WATCH
+void unwatch_all(HMap* watched, Conn* conn);
 
 #endif
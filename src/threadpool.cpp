@@ -1,52 +1,399 @@
 #include <cstdio>
+#include <sched.h>
 #include "threadpool.h"
+#include "logger.h"
 
-static void* work(void* arg) {
-    ThreadPool* tp = (ThreadPool*)arg;
+// Worker running on the current thread, NULL for the event loop and other outside threads
+static thread_local TPWorker* curr_worker = NULL;
+
+static void inject_init(TPInjectQueue* q, size_t cap) {
+    q->cells = new TPCell[cap];
+    q->mask = cap - 1;
+    for (size_t i = 0; i < cap; i++) {
+        q->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+static bool inject_push(TPInjectQueue* q, ThreadPoolTask* task) {
+    size_t pos = q->tail.load(std::memory_order_relaxed);
+    TPCell* cell;
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (q->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return false; // full, the consumer of the previous lap has not freed this cell yet
+        }
+        else {
+            pos = q->tail.load(std::memory_order_relaxed);
+        }
+    }
+    cell->task = task;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
 
+static ThreadPoolTask* inject_pop(TPInjectQueue* q) {
+    size_t pos = q->head.load(std::memory_order_relaxed);
+    TPCell* cell;
     while (true) {
-        // Wait for something
+        cell = &q->cells[pos & q->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (q->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return NULL; // empty
+        }
+        else {
+            pos = q->head.load(std::memory_order_relaxed);
+        }
+    }
+    ThreadPoolTask* task = cell->task;
+    cell->seq.store(pos + q->mask + 1, std::memory_order_release);
+    return task;
+}
+
+static TPDequeBuf* deque_buf_new(int64_t cap) {
+    TPDequeBuf* buf = new TPDequeBuf;
+    buf->cap = cap;
+    buf->slots = new std::atomic<ThreadPoolTask*>[cap];
+    return buf;
+}
+
+static void deque_init(TPDeque* d, int64_t cap) {
+    d->buf.store(deque_buf_new(cap), std::memory_order_relaxed);
+}
+
+static void deque_free(TPDeque* d) {
+    d->retired.push_back(d->buf.load(std::memory_order_relaxed));
+    for (TPDequeBuf* buf : d->retired) {
+        delete[] buf->slots;
+        delete buf;
+    }
+    d->retired.clear();
+}
+
+// Owner only
+static void deque_push(TPDeque* d, ThreadPoolTask* task) {
+    int64_t b = d->bottom.load(std::memory_order_relaxed);
+    int64_t t = d->top.load(std::memory_order_acquire);
+    TPDequeBuf* buf = d->buf.load(std::memory_order_relaxed);
+
+    if (b - t > buf->cap - 1) {
+        TPDequeBuf* grown = deque_buf_new(buf->cap * 2);
+        for (int64_t i = t; i < b; i++) {
+            grown->slots[i & (grown->cap - 1)].store(buf->slots[i & (buf->cap - 1)].load(std::memory_order_relaxed),
+                                                     std::memory_order_relaxed);
+        }
+        d->retired.push_back(buf);
+        d->buf.store(grown, std::memory_order_release);
+        buf = grown;
+    }
+    buf->slots[b & (buf->cap - 1)].store(task, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    d->bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+// Owner only, takes the most recently pushed task
+static ThreadPoolTask* deque_pop(TPDeque* d) {
+    int64_t b = d->bottom.load(std::memory_order_relaxed) - 1;
+    TPDequeBuf* buf = d->buf.load(std::memory_order_relaxed);
+    d->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = d->top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        d->bottom.store(b + 1, std::memory_order_relaxed);
+        return NULL;
+    }
+    ThreadPoolTask* task = buf->slots[b & (buf->cap - 1)].load(std::memory_order_relaxed);
+    if (t == b) {
+        // Last task, race the thieves for it
+        if (!d->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            task = NULL;
+        }
+        d->bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+// Any thread, takes the oldest task. Returns NULL when empty or when another thief won the race
+static ThreadPoolTask* deque_steal(TPDeque* d) {
+    int64_t t = d->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = d->bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+
+    TPDequeBuf* buf = d->buf.load(std::memory_order_acquire);
+    ThreadPoolTask* task = buf->slots[t & (buf->cap - 1)].load(std::memory_order_relaxed);
+    if (!d->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+// Finished tasks are recycled through a second MPMC ring, cheaper than a malloc / cross-thread free per task
+static void task_release(ThreadPool* tp, ThreadPoolTask* task) {
+    if (task->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (!tp->free_tasks.cells || !inject_push(&tp->free_tasks, task)) {
+            delete task;
+        }
+    }
+}
+
+static void run_task(ThreadPool* tp, ThreadPoolTask* task) {
+    task->f(task->arg);
+    task->done.store(1, std::memory_order_seq_cst);
+    if (task->waited.load(std::memory_order_seq_cst)) {
         pthread_mutex_lock(&tp->mutex);
-        while (tp->queue.empty()) {
-            pthread_cond_wait(&tp->cond, &tp->mutex);
+        pthread_cond_broadcast(&tp->done_cond);
+        pthread_mutex_unlock(&tp->mutex);
+    }
+    task_release(tp, task);
+}
+
+static ThreadPoolTask* steal(TPWorker* w) {
+    ThreadPool* tp = w->tp;
+    size_t n = tp->workers.size();
+
+    // xorshift, only used to spread thieves over different victims
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    size_t start = w->rng % n;
+    for (size_t i = 0; i < n; i++) {
+        TPWorker* victim = tp->workers[(start + i) % n];
+        if (victim == w) {
+            continue;
         }
+        ThreadPoolTask* task = deque_steal(&victim->deque);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
 
-        // If something is in the queue, execute
-        ThreadPoolWork work = tp->queue.front();
-        tp->queue.pop();
+// Own deque first (hot in cache, LIFO), then new work from outside, then other workers
+static ThreadPoolTask* find_task(TPWorker* w) {
+    ThreadPool* tp = w->tp;
+    ThreadPoolTask* task = deque_pop(&w->deque);
+    if (!task) {
+        task = inject_pop(&tp->inject);
+    }
+    if (!task) {
+        task = steal(w);
+    }
+    if (task) {
+        tp->pending.fetch_sub(1, std::memory_order_seq_cst);
+    }
+    return task;
+}
 
+static void wake_worker(ThreadPool* tp) {
+    // Pairs with the sleepers / pending check in park(): either the producer sees the sleeper or the
+    // sleeper sees the new task
+    tp->pending.fetch_add(1, std::memory_order_seq_cst);
+    if (tp->sleepers.load(std::memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&tp->mutex);
+        // Each sleeper is woken once, producers don't keep signalling workers that are already waking up
+        if (tp->sleepers.load(std::memory_order_relaxed) > 0) {
+            tp->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            tp->wakeups++;
+            pthread_cond_signal(&tp->cond);
+        }
+        pthread_mutex_unlock(&tp->mutex);
+    }
+}
+
+static void park(ThreadPool* tp) {
+    pthread_mutex_lock(&tp->mutex);
+    tp->sleepers.fetch_add(1, std::memory_order_seq_cst);
+    if (tp->pending.load(std::memory_order_seq_cst) > 0 || tp->stopping.load(std::memory_order_seq_cst)) {
+        tp->sleepers.fetch_sub(1, std::memory_order_seq_cst);
         pthread_mutex_unlock(&tp->mutex);
-        work.f(work.arg);
+        return;
+    }
+
+    while (tp->wakeups == 0 && !tp->stopping.load(std::memory_order_seq_cst)) {
+        pthread_cond_wait(&tp->cond, &tp->mutex);
+    }
+    if (tp->wakeups > 0) {
+        tp->wakeups--; // the producer already took us off sleepers
+    }
+    else {
+        tp->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+    pthread_mutex_unlock(&tp->mutex);
+}
+
+static void* work(void* arg) {
+    TPWorker* w = (TPWorker*)arg;
+    ThreadPool* tp = w->tp;
+    curr_worker = w;
+
+    while (true) {
+        ThreadPoolTask* task = find_task(w);
+        if (task) {
+            run_task(tp, task);
+            continue;
+        }
+        if (tp->pending.load(std::memory_order_seq_cst) > 0) {
+            // A task is being pushed or is in a deque we lost the race for
+            sched_yield();
+            continue;
+        }
+        if (tp->stopping.load(std::memory_order_seq_cst)) {
+            break;
+        }
+        park(tp);
     }
+    return NULL;
 }
 
 void threadpool_init(ThreadPool* tp, uint32_t thread_cnt) {
     int err = pthread_mutex_init(&tp->mutex, NULL);
     if (err != 0) {
-        printf("Error in threadpool_init, mutex initialization\n");
+        log_error("[threadpool]: Error in threadpool_init, mutex initialization");
         return;
     }
     err = pthread_cond_init(&tp->cond, NULL);
     if (err != 0) {
-        printf("Error in threadpool_init, condition initialization\n");
+        log_error("[threadpool]: Error in threadpool_init, condition initialization");
+        return;
+    }
+    err = pthread_cond_init(&tp->done_cond, NULL);
+    if (err != 0) {
+        log_error("[threadpool]: Error in threadpool_init, condition initialization");
         return;
     }
+    inject_init(&tp->inject, TP_INJECT_CAP);
+    inject_init(&tp->free_tasks, TP_INJECT_CAP);
+    tp->stopping.store(false);
 
-    tp->threads.resize(thread_cnt);
+    // Every worker has to exist before any of them starts stealing
+    tp->workers.resize(thread_cnt);
     for (size_t i = 0; i < thread_cnt; i++) {
-        err = pthread_create(&tp->threads[i], NULL, &work, tp);
+        tp->workers[i] = new TPWorker;
+        tp->workers[i]->tp = tp;
+        tp->workers[i]->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        deque_init(&tp->workers[i]->deque, TP_DEQUE_CAP);
+    }
+    for (size_t i = 0; i < thread_cnt; i++) {
+        err = pthread_create(&tp->workers[i]->thread, NULL, &work, tp->workers[i]);
         if (err != 0) {
-            printf("Error in threadpool_init, thread initialization\n");
+            log_error("[threadpool]: Error in threadpool_init, thread initialization");
             return;
         }
     }
 }
 
+static void enqueue(ThreadPool* tp, ThreadPoolTask* task) {
+    if (tp->stopping.load(std::memory_order_relaxed) || tp->workers.empty()) {
+        run_task(tp, task);
+        return;
+    }
+
+    // Tasks spawned by a task stay on that worker, the rest goes through the injection queue
+    if (curr_worker && curr_worker->tp == tp) {
+        deque_push(&curr_worker->deque, task);
+    }
+    else {
+        while (!inject_push(&tp->inject, task)) {
+            // Full, the producer helps with the oldest task instead of queueing more
+            ThreadPoolTask* oldest = inject_pop(&tp->inject);
+            if (oldest) {
+                tp->pending.fetch_sub(1, std::memory_order_seq_cst);
+                run_task(tp, oldest);
+            }
+        }
+    }
+    wake_worker(tp);
+}
+
+static ThreadPoolTask* task_new(ThreadPool* tp, void (*f)(void*), void* arg, uint8_t refs) {
+    ThreadPoolTask* task = tp->free_tasks.cells ? inject_pop(&tp->free_tasks) : NULL;
+    if (!task) {
+        task = new ThreadPoolTask;
+    }
+    task->done.store(0, std::memory_order_relaxed);
+    task->waited.store(0, std::memory_order_relaxed);
+    task->f = f;
+    task->arg = arg;
+    task->refs.store(refs, std::memory_order_relaxed);
+    return task;
+}
+
 void threadpool_produce(ThreadPool* tp, void (*f)(void*), void* arg) {
+    enqueue(tp, task_new(tp, f, arg, 1));
+}
+
+ThreadPoolTask* threadpool_submit(ThreadPool* tp, void (*f)(void*), void* arg) {
+    ThreadPoolTask* task = task_new(tp, f, arg, 2);
+    enqueue(tp, task);
+    return task;
+}
+
+void threadpool_wait(ThreadPool* tp, ThreadPoolTask* task) {
+    // A worker waiting on a task keeps running other tasks so fork-join inside the pool can't deadlock
+    while (!task->done.load(std::memory_order_acquire)) {
+        if (curr_worker && curr_worker->tp == tp) {
+            ThreadPoolTask* other = find_task(curr_worker);
+            if (other) {
+                run_task(tp, other);
+                continue;
+            }
+            if (tp->pending.load(std::memory_order_seq_cst) > 0) {
+                sched_yield();
+                continue;
+            }
+        }
+
+        // Pairs with the done / waited check in run_task()
+        task->waited.store(1, std::memory_order_seq_cst);
+        pthread_mutex_lock(&tp->mutex);
+        while (!task->done.load(std::memory_order_seq_cst)) {
+            pthread_cond_wait(&tp->done_cond, &tp->mutex);
+        }
+        pthread_mutex_unlock(&tp->mutex);
+    }
+    task_release(tp, task);
+}
+
+void threadpool_shutdown(ThreadPool* tp) {
     pthread_mutex_lock(&tp->mutex);
-    tp->queue.push(ThreadPoolWork{f, arg});
-    pthread_cond_signal(&tp->cond);
+    tp->stopping.store(true, std::memory_order_seq_cst);
+    pthread_cond_broadcast(&tp->cond);
     pthread_mutex_unlock(&tp->mutex);
-}
 
+    for (TPWorker* w : tp->workers) {
+        pthread_join(w->thread, NULL);
+    }
+    for (TPWorker* w : tp->workers) {
+        deque_free(&w->deque);
+        delete w;
+    }
+    tp->workers.clear();
+    delete[] tp->inject.cells;
+    tp->inject.cells = NULL;
+    while (ThreadPoolTask* task = inject_pop(&tp->free_tasks)) {
+        delete task;
+    }
+    delete[] tp->free_tasks.cells;
+    tp->free_tasks.cells = NULL;
 
+    pthread_cond_destroy(&tp->done_cond);
+    pthread_cond_destroy(&tp->cond);
+    pthread_mutex_destroy(&tp->mutex);
+}
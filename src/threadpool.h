@@ -1,23 +1,80 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <queue>
+#include <atomic>
 #include <stdint.h>
 #include <pthread.h>
+#include <vector>
 
-struct ThreadPoolWork {
+#define TP_INJECT_CAP 4096 // slots in the shared injection queue, power of 2
+#define TP_DEQUE_CAP 256 // initial slots of a worker deque, doubled when full
+
+struct ThreadPoolTask {
     void (*f)(void* arg) = NULL;
     void* arg = NULL;
+    std::atomic<uint8_t> done{0};
+    std::atomic<uint8_t> waited{0}; // someone is blocked in threadpool_wait()
+    std::atomic<uint8_t> refs{1}; // the pool plus the handle returned by threadpool_submit()
+};
+
+// Bounded lock-free MPMC queue (Vyukov). The sequence number of a cell tells whether it is free
+// for the producer at position pos (seq == pos) or filled for the consumer at pos (seq == pos + 1)
+struct TPCell {
+    std::atomic<size_t> seq{0};
+    ThreadPoolTask* task = NULL;
+};
+
+struct TPInjectQueue {
+    TPCell* cells = NULL;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{0}; // next position to pop
+    alignas(64) std::atomic<size_t> tail{0}; // next position to push
+};
+
+// Chase-Lev deque. The owning worker pushes and pops at the bottom, other workers steal from the top
+struct TPDequeBuf {
+    int64_t cap;
+    std::atomic<ThreadPoolTask*>* slots;
+};
+
+struct TPDeque {
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<TPDequeBuf*> buf{NULL};
+    std::vector<TPDequeBuf*> retired; // thieves may still read replaced buffers, freed on shutdown
+};
+
+struct ThreadPool;
+
+struct TPWorker {
+    ThreadPool* tp = NULL;
+    pthread_t thread;
+    TPDeque deque;
+    uint64_t rng = 0; // picks the first steal victim
 };
 
 struct ThreadPool {
-    std::vector<pthread_t> threads;
-    std::queue<ThreadPoolWork> queue;
-    pthread_mutex_t mutex;
+    std::vector<TPWorker*> workers;
+    TPInjectQueue inject;
+    TPInjectQueue free_tasks; // finished tasks kept for reuse
+    std::atomic<int64_t> pending{0}; // tasks sitting in a queue, not yet taken by a worker
+    std::atomic<uint32_t> sleepers{0}; // parked workers nobody has signalled yet
+    uint32_t wakeups = 0; // signals not yet consumed by a parked worker, guarded by mutex
+    std::atomic<bool> stopping{false};
+    pthread_mutex_t mutex; // only taken to park idle workers and blocked waiters
     pthread_cond_t cond;
+    pthread_cond_t done_cond;
 };
 
 void threadpool_init(ThreadPool* tp, uint32_t thread_cnt);
 void threadpool_produce(ThreadPool* tp, void (*f)(void*), void* arg);
 
+// Same as threadpool_produce() but returns a handle that must be passed to threadpool_wait() exactly once
+ThreadPoolTask* threadpool_submit(ThreadPool* tp, void (*f)(void*), void* arg);
+void threadpool_wait(ThreadPool* tp, ThreadPoolTask* task);
+
+// Runs every queued task (including ones they spawn), then joins the workers. Tasks produced
+// afterwards run on the caller's thread
+void threadpool_shutdown(ThreadPool* tp);
+
 #endif
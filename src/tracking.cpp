@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <cstdlib>
+#include <string.h>
+#include "tracking.h"
+#include "buffer_funcs.h"
+#include "out_helpers.h"
+#include "utils/common.h"
+
+static void free_tracked(Tracking* t, TrackedKey* tk) {
+    hm_remove_key(&t->keys, &tk->node);
+    delete tk;
+}
+
+static uint64_t reader_ref(Tracking* t, TrackingClient* client) {
+    return (uint64_t)client->slot << 32 | t->gens[client->slot];
+}
+
+static TrackingClient* ref_client(Tracking* t, uint64_t ref) {
+    uint32_t slot = ref >> 32;
+    TrackingClient* client = t->slots[slot];
+    return client && t->gens[slot] == (uint32_t)ref ? client : NULL;
+}
+
+static void drop_prefixes(Tracking* t, TrackingClient* client) {
+    for (TrackingPrefix* prefix : client->prefixes) {
+        std::vector<TrackingClient*>& clients = prefix->clients;
+        for (size_t i = 0; i < clients.size(); i++) {
+            if (clients[i] == client) {
+                clients[i] = clients.back();
+                clients.pop_back();
+                break;
+            }
+        }
+        if (!clients.empty()) {
+            continue;
+        }
+        for (size_t i = 0; i < t->prefixes.size(); i++) {
+            if (t->prefixes[i] == prefix) {
+                t->prefixes[i] = t->prefixes.back();
+                t->prefixes.pop_back();
+                break;
+            }
+        }
+        free(prefix->prefix);
+        delete prefix;
+    }
+    client->prefixes.clear();
+}
+
+static void add_prefix(Tracking* t, TrackingClient* client, dstr* str) {
+    TrackingPrefix* prefix = NULL;
+    for (TrackingPrefix* p : t->prefixes) {
+        if (p->prefix->size == str->size && !memcmp(p->prefix->buf, str->buf, str->size)) {
+            prefix = p;
+        }
+    }
+    for (TrackingPrefix* p : client->prefixes) {
+        if (p == prefix) {
+            return;
+        }
+    }
+    if (!prefix) {
+        prefix = new TrackingPrefix();
+        prefix->prefix = dstr_init(str->size);
+        dstr_append(&prefix->prefix, str->buf, str->size);
+        t->prefixes.push_back(prefix);
+    }
+    prefix->clients.push_back(client);
+    client->prefixes.push_back(prefix);
+}
+
+void tracking_on(Tracking* t, Conn* conn, uint8_t flags, dstr** prefixes, size_t n) {
+    TrackingClient* client = conn->tracking;
+    if (!client) {
+        client = new TrackingClient();
+        client->conn = conn;
+        if (!t->free_slots.empty()) {
+            client->slot = t->free_slots.back();
+            t->free_slots.pop_back();
+        }
+        else {
+            client->slot = t->slots.size();
+            t->slots.push_back(NULL);
+            t->gens.push_back(0);
+        }
+        t->slots[client->slot] = client;
+        conn->tracking = client;
+    }
+
+    drop_prefixes(t, client);
+    client->flags = flags;
+    if (!(flags & TRACK_BCAST)) {
+        return;
+    }
+    dstr* all = dstr_init(0);
+    for (size_t i = 0; i < n; i++) {
+        add_prefix(t, client, prefixes[i]);
+    }
+    if (!n) {
+        add_prefix(t, client, all);
+    }
+    free(all);
+}
+
+void tracking_off(Tracking* t, Conn* conn) {
+    TrackingClient* client = conn->tracking;
+    if (!client) {
+        return;
+    }
+    drop_prefixes(t, client);
+    t->slots[client->slot] = NULL;
+    t->gens[client->slot]++;
+    t->free_slots.push_back(client->slot);
+    delete client;
+    conn->tracking = NULL;
+}
+
+void tracking_read(Tracking* t, Conn* conn, const char* key, size_t len) {
+    TrackingClient* client = conn->tracking;
+    if (!client || (client->flags & TRACK_BCAST)) {
+        return;
+    }
+
+    TrackedKey* tk = hm_find_entry<TrackedKey>(&t->keys, key, len);
+    if (!tk) {
+        tk = new TrackedKey();
+        hm_insert_key(&t->keys, &tk->node, key, len);
+    }
+
+    // A hot key is read again and again by the same few connections
+    uint64_t ref = reader_ref(t, client);
+    for (uint64_t reader : tk->readers) {
+        if (reader == ref) {
+            return;
+        }
+    }
+    tk->readers.push_back(ref);
+}
+
+static void frame_str(std::vector<uint8_t>& out, const char* str, size_t len) {
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, len);
+    buf_append(out, (const uint8_t*)str, len);
+}
+
+// [len][arr][RES_PUSH] "invalidate" [key], or null for all keys
+static SharedBuf* invalidate_frame(const char* key, size_t len) {
+    static std::vector<uint8_t> frame;
+    frame.clear();
+    buf_append_u32(frame, 0);
+    buf_append_u8(frame, TAG_ARR);
+    buf_append_u32(frame, 2);
+    buf_append_u8(frame, TAG_INT);
+    buf_append_u32(frame, RES_PUSH);
+    frame_str(frame, "invalidate", 10);
+    if (key) {
+        buf_append_u8(frame, TAG_ARR);
+        buf_append_u32(frame, 1);
+        frame_str(frame, key, len);
+    }
+    else {
+        buf_append_u8(frame, TAG_NULL);
+    }
+
+    uint32_t frame_len = frame.size() - 4;
+    memcpy(frame.data(), &frame_len, 4);
+    return shared_buf_new(frame);
+}
+
+static bool skip_writer(TrackingClient* client, Conn* writer) {
+    return client->conn == writer && (client->flags & TRACK_NOLOOP);
+}
+
+size_t tracking_invalidate(Tracking* t, const char* key, size_t len, Conn* writer) {
+    if (!hm_size(&t->keys) && t->prefixes.empty()) {
+        return 0;
+    }
+
+    size_t sent = 0;
+    SharedBuf* buf = NULL;
+    TrackedKey* tk = hm_find_entry<TrackedKey>(&t->keys, key, len);
+    if (tk) {
+        for (uint64_t reader : tk->readers) {
+            TrackingClient* client = ref_client(t, reader);
+            if (!client || skip_writer(client, writer)) {
+                continue;
+            }
+            buf = buf ? buf : invalidate_frame(key, len);
+            out_shared(client->conn, buf);
+            sent++;
+        }
+        free_tracked(t, tk);
+    }
+
+    // A client with overlapping prefixes (user: and user:1) gets the key once
+    t->matched.clear();
+    for (TrackingPrefix* prefix : t->prefixes) {
+        dstr* p = prefix->prefix;
+        if (p->size > len || memcmp(p->buf, key, p->size)) {
+            continue;
+        }
+        for (TrackingClient* client : prefix->clients) {
+            if (!skip_writer(client, writer)) {
+                t->matched.push_back(client);
+            }
+        }
+    }
+    std::sort(t->matched.begin(), t->matched.end());
+    auto end = std::unique(t->matched.begin(), t->matched.end());
+    for (auto it = t->matched.begin(); it != end; it++) {
+        buf = buf ? buf : invalidate_frame(key, len);
+        out_shared((*it)->conn, buf);
+        sent++;
+    }
+
+    if (buf) {
+        shared_buf_release(buf);
+    }
+    return sent;
+}
+
+size_t tracking_invalidate_all(Tracking* t) {
+    std::vector<HNode*> nodes;
+    hm_keys(&t->keys, nodes);
+    for (HNode* node : nodes) {
+        free_tracked(t, container_of(node, TrackedKey, node));
+    }
+
+    size_t sent = 0;
+    SharedBuf* buf = invalidate_frame(NULL, 0);
+    for (TrackingClient* client : t->slots) {
+        if (client) {
+            out_shared(client->conn, buf);
+            sent++;
+        }
+    }
+    shared_buf_release(buf);
+    return sent;
+}
+
+size_t tracking_size(Tracking* t) {
+    return hm_size(&t->keys);
+}
@@ -0,0 +1,61 @@
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "server.h"
+
+// Server assisted client side caching (CLIENT TRACKING). The server remembers which tracking
+// connection read which key and pushes an invalidation the next time the key is written, so the
+// client can cache the value until then. In broadcast mode a connection instead gets the invalidations
+// of every key that starts with one of its prefixes, and the server remembers nothing per key.
+
+enum TrackingFlags {
+    TRACK_BCAST = 1 << 0, // by prefix instead of by the keys read
+    TRACK_NOLOOP = 1 << 1, // no invalidations for the connection's own writes
+};
+
+struct TrackingPrefix;
+
+struct TrackingClient {
+    Conn* conn;
+    uint32_t slot; // in Tracking::slots
+    uint8_t flags; // TRACK_*
+    std::vector<TrackingPrefix*> prefixes; // TRACK_BCAST
+};
+
+// A key read by tracking connections since it was last written. Readers are slot << 32 | generation,
+// a reader that stopped tracking (or closed) is skipped when the key is invalidated and otherwise
+// costs its 8 bytes until then
+struct TrackedKey {
+    HNode node; // node.key is the table's own copy of the key
+    std::vector<uint64_t> readers;
+};
+
+struct TrackingPrefix {
+    dstr* prefix;
+    std::vector<TrackingClient*> clients;
+};
+
+struct Tracking {
+    HMap keys; // TrackedKey nodes
+    std::vector<TrackingClient*> slots; // NULL for a free slot
+    std::vector<uint32_t> gens; // bumped when a slot is freed, so old readers don't match its next client
+    std::vector<uint32_t> free_slots;
+    std::vector<TrackingPrefix*> prefixes; // TRACK_BCAST, "" matches every key
+    std::vector<TrackingClient*> matched; // scratch of tracking_invalidate()
+};
+
+// Starts tracking for conn, or changes its mode if it is tracking already. Prefixes only apply to TRACK_BCAST
+void tracking_on(Tracking* t, Conn* conn, uint8_t flags, dstr** prefixes, size_t n);
+void tracking_off(Tracking* t, Conn* conn); // also when the conn closes
+void tracking_read(Tracking* t, Conn* conn, const char* key, size_t len); // no-op unless conn tracks keys
+
+// The key was written (by writer, NULL for expiry). Queues an invalidation to every connection that
+// read it or has a matching prefix and forgets the readers. Returns the number of messages queued
+size_t tracking_invalidate(Tracking* t, const char* key, size_t len, Conn* writer);
+size_t tracking_invalidate_all(Tracking* t); // FLUSHALL: a null invalidation to every tracking conn
+size_t tracking_size(Tracking* t); // keys with readers
+
+#endif
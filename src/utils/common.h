@@ -30,7 +30,8 @@ enum EntryTypes {
     T_LIST = 3,
     T_SET = 4,
     T_BITMAP = 5,
-    T_HLL = 6
+    T_HLL = 6,
+    T_STREAM = 7
 };
 
 // FNV hash
@@ -93,4 +94,36 @@ static inline uint64_t murmurHash64A(const uint8_t *key, size_t len, uint64_t se
 inline uint64_t str_hash(const uint8_t *key, size_t len) {
     return murmurHash64A(key, len, 0xadc83b19ULL);
 }
+
+// Strict parse: an optional '-', no '+', spaces or leading zeros, and it fits in int64. Exactly the
+// strings that "%lld" prints back unchanged
+static inline bool str_to_int64(const char *s, size_t len, int64_t *out) {
+    if (len == 0 || len > 20) {
+        return false;
+    }
+    bool neg = s[0] == '-';
+    size_t i = neg;
+    if (i == len || (s[i] == '0' && (len > 1))) {
+        return false;
+    }
+
+    uint64_t v = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        uint64_t digit = s[i] - '0';
+        if (v > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+    }
+
+    uint64_t limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    if (v > limit) {
+        return false;
+    }
+    *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+    return true;
+}
 #endif
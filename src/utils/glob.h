@@ -0,0 +1,84 @@
+#ifndef GLOB_H
+#define GLOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Matches one pattern token (?, [class], \x or a plain char) against c and moves *pp past the token
+static inline bool glob_one(const char **pp, const char *pend, char c) {
+    const char *p = *pp;
+    if (*p == '?') {
+        *pp = p + 1;
+        return true;
+    }
+    if (*p == '\\' && p + 1 < pend) {
+        *pp = p + 2;
+        return p[1] == c;
+    }
+    if (*p != '[') {
+        *pp = p + 1;
+        return *p == c;
+    }
+
+    // [abc], [^abc], [a-z], \ escapes the next char. An unterminated class runs to the end of the pattern
+    p++;
+    bool negate = p < pend && *p == '^';
+    if (negate) {
+        p++;
+    }
+    bool match = false;
+    while (p < pend && *p != ']') {
+        if (*p == '\\' && p + 1 < pend) {
+            p++;
+            match |= *p == c;
+            p++;
+        }
+        else if (p + 2 < pend && p[1] == '-' && p[2] != ']') {
+            char lo = p[0] < p[2] ? p[0] : p[2];
+            char hi = p[0] < p[2] ? p[2] : p[0];
+            match |= lo <= c && c <= hi;
+            p += 3;
+        }
+        else {
+            match |= *p == c;
+            p++;
+        }
+    }
+    *pp = p < pend ? p + 1 : p;
+    return match != negate;
+}
+
+// Redis style glob: * ? [class] and \ escapes. Only the last * is ever backtracked to, so the
+// match is O(plen * slen) even for patterns like a*a*a*a*b
+static inline bool glob_match(const char *p, size_t plen, const char *s, size_t slen) {
+    const char *pend = p + plen;
+    const char *send = s + slen;
+    const char *star_p = NULL;
+    const char *star_s = NULL;
+
+    while (s < send) {
+        if (p < pend && *p == '*') {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        const char *next = p;
+        if (p < pend && glob_one(&next, pend, *s)) {
+            p = next;
+            s++;
+            continue;
+        }
+        if (!star_p) {
+            return false;
+        }
+        // Let the last * eat one more char and retry from there
+        p = star_p;
+        s = ++star_s;
+    }
+    while (p < pend && *p == '*') {
+        p++;
+    }
+    return p == pend;
+}
+
+#endif
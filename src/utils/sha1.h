@@ -0,0 +1,89 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// SHA-1 (RFC 3174). Only names cached scripts, the way Redis does, not for anything security related
+
+static inline uint32_t sha1_rol(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static inline void sha1_block(uint32_t h[5], const uint8_t *block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 |
+               block[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = sha1_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t tmp = sha1_rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = sha1_rol(b, 30);
+        b = a;
+        a = tmp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+// Writes the 40 lowercase hex digits of the digest and a terminator to out
+static inline void sha1_hex(const char *data, size_t len, char out[41]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    const uint8_t *p = (const uint8_t*)data;
+    size_t left = len;
+    for (; left >= 64; left -= 64, p += 64) {
+        sha1_block(h, p);
+    }
+
+    // The rest, a 1 bit, zeros and the length in bits, in one or two blocks
+    uint8_t tail[128] = {};
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+    size_t tail_len = left < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = bits >> (8 * i);
+    }
+    sha1_block(h, tail);
+    if (tail_len == 128) {
+        sha1_block(h, tail + 64);
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 20; i++) {
+        uint8_t byte = h[i / 4] >> (24 - 8 * (i % 4));
+        out[2 * i] = digits[byte >> 4];
+        out[2 * i + 1] = digits[byte & 15];
+    }
+    out[40] = '\0';
+}
+
+#endif
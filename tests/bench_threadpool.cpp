@@ -0,0 +1,168 @@
+// Tasks/sec of the work stealing thread pool against the previous single mutex + condvar queue.
+//   ./bench_threadpool [threads] [tasks]
+#include <pthread.h>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "threadpool.h"
+
+// The pool as it was before the work stealing rewrite, plus a stop flag so it can be torn down
+struct LegacyPool {
+    std::vector<pthread_t> threads;
+    std::queue<ThreadPoolTask> queue;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stop = false;
+};
+
+static void* legacy_work(void* arg) {
+    LegacyPool* tp = (LegacyPool*)arg;
+    while (true) {
+        pthread_mutex_lock(&tp->mutex);
+        while (tp->queue.empty() && !tp->stop) {
+            pthread_cond_wait(&tp->cond, &tp->mutex);
+        }
+        if (tp->queue.empty()) {
+            pthread_mutex_unlock(&tp->mutex);
+            return NULL;
+        }
+        void (*f)(void*) = tp->queue.front().f;
+        void* f_arg = tp->queue.front().arg;
+        tp->queue.pop();
+        pthread_mutex_unlock(&tp->mutex);
+        f(f_arg);
+    }
+}
+
+static void legacy_init(LegacyPool* tp, uint32_t thread_cnt) {
+    pthread_mutex_init(&tp->mutex, NULL);
+    pthread_cond_init(&tp->cond, NULL);
+    tp->threads.resize(thread_cnt);
+    for (pthread_t& t : tp->threads) {
+        pthread_create(&t, NULL, &legacy_work, tp);
+    }
+}
+
+static void legacy_produce(LegacyPool* tp, void (*f)(void*), void* arg) {
+    pthread_mutex_lock(&tp->mutex);
+    tp->queue.emplace();
+    tp->queue.back().f = f;
+    tp->queue.back().arg = arg;
+    pthread_cond_signal(&tp->cond);
+    pthread_mutex_unlock(&tp->mutex);
+}
+
+static void legacy_shutdown(LegacyPool* tp) {
+    pthread_mutex_lock(&tp->mutex);
+    tp->stop = true;
+    pthread_cond_broadcast(&tp->cond);
+    pthread_mutex_unlock(&tp->mutex);
+    for (pthread_t t : tp->threads) {
+        pthread_join(t, NULL);
+    }
+}
+
+static std::atomic<uint64_t> done_cnt{0};
+static LegacyPool legacy;
+static ThreadPool pool;
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void wait_done(uint64_t n) {
+    while (done_cnt.load(std::memory_order_acquire) < n) {
+        sched_yield();
+    }
+}
+
+// Small fixed amount of work so the queue overhead dominates
+static void tiny_task(void*) {
+    volatile uint64_t x = 0;
+    for (int i = 0; i < 32; i++) {
+        x = x + i;
+    }
+    done_cnt.fetch_add(1, std::memory_order_release);
+}
+
+// Every task spawns `fanout` children until the depth runs out
+static void legacy_spawn(void* arg) {
+    uintptr_t depth = (uintptr_t)arg;
+    if (depth > 0) {
+        for (int i = 0; i < 4; i++) {
+            legacy_produce(&legacy, &legacy_spawn, (void*)(depth - 1));
+        }
+    }
+    tiny_task(NULL);
+}
+
+static void pool_spawn(void* arg) {
+    uintptr_t depth = (uintptr_t)arg;
+    if (depth > 0) {
+        for (int i = 0; i < 4; i++) {
+            threadpool_produce(&pool, &pool_spawn, (void*)(depth - 1));
+        }
+    }
+    tiny_task(NULL);
+}
+
+static void report(const char* name, uint64_t tasks, uint64_t ns) {
+    printf("%-28s %10llu tasks %8.1f ms %12.0f tasks/sec\n", name, (unsigned long long)tasks, ns / 1e6,
+           tasks * 1e9 / ns);
+}
+
+int main(int argc, char** argv) {
+    uint32_t threads = argc > 1 ? atoi(argv[1]) : 4;
+    uint64_t tasks = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+    uintptr_t depth = 9; // 4^0 + ... + 4^9 tasks
+    uint64_t tree_tasks = ((1ull << (2 * (depth + 1))) - 1) / 3;
+    printf("threads: %u\n", threads);
+
+    legacy_init(&legacy, threads);
+    done_cnt.store(0);
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < tasks; i++) {
+        legacy_produce(&legacy, &tiny_task, NULL);
+    }
+    wait_done(tasks);
+    report("mutex queue, external", tasks, now_ns() - start);
+
+    done_cnt.store(0);
+    start = now_ns();
+    legacy_produce(&legacy, &legacy_spawn, (void*)depth);
+    wait_done(tree_tasks);
+    report("mutex queue, spawn tree", tree_tasks, now_ns() - start);
+    legacy_shutdown(&legacy);
+
+    threadpool_init(&pool, threads);
+    done_cnt.store(0);
+    start = now_ns();
+    for (uint64_t i = 0; i < tasks; i++) {
+        threadpool_produce(&pool, &tiny_task, NULL);
+    }
+    wait_done(tasks);
+    report("work stealing, external", tasks, now_ns() - start);
+
+    done_cnt.store(0);
+    start = now_ns();
+    threadpool_produce(&pool, &pool_spawn, (void*)depth);
+    wait_done(tree_tasks);
+    report("work stealing, spawn tree", tree_tasks, now_ns() - start);
+
+    // Same work through handles, the producer joins every task
+    done_cnt.store(0);
+    std::vector<ThreadPoolTask*> handles(tasks);
+    start = now_ns();
+    for (uint64_t i = 0; i < tasks; i++) {
+        handles[i] = threadpool_submit(&pool, &tiny_task, NULL);
+    }
+    for (uint64_t i = 0; i < tasks; i++) {
+        threadpool_wait(&pool, handles[i]);
+    }
+    report("work stealing, submit+wait", tasks, now_ns() - start);
+    threadpool_shutdown(&pool);
+    return 0;
+}
@@ -0,0 +1,251 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "data_structures/bitmap.cpp"
+#include "bitmap.h"
+
+// Sizes around every kernel's block boundary (8, 32, 64 and 512 bytes)
+static const size_t lens[] = {0, 1, 7, 8, 9, 31, 32, 33, 63, 64, 65, 511, 512, 513, 1000, 4096 + 17};
+
+static uint8_t* random_buf(size_t len) {
+    uint8_t* buf = (uint8_t*)malloc(len + 1);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = rand() & 255;
+    }
+    return buf;
+}
+
+static uint64_t ref_popcount(const uint8_t* buf, size_t len) {
+    uint64_t cnt = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            cnt += (buf[i] >> bit) & 1;
+        }
+    }
+    return cnt;
+}
+
+static uint64_t ref_count_range(const uint8_t* buf, uint64_t start, uint64_t end) {
+    uint64_t cnt = 0;
+    for (uint64_t pos = start; pos <= end; pos++) {
+        cnt += (buf[pos / 8] >> (7 - pos % 8)) & 1;
+    }
+    return cnt;
+}
+
+static void test_popcount_kernels() {
+    for (size_t len : lens) {
+        uint8_t* buf = random_buf(len);
+        uint64_t expected = ref_popcount(buf, len);
+
+        assert(popcount_scalar(buf, len) == expected);
+        assert(bitmap_popcount(buf, len) == expected);
+#ifdef BITMAP_X86
+        if (__builtin_cpu_supports("popcnt")) {
+            assert(popcount_hw(buf, len) == expected);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            assert(popcount_avx2(buf, len) == expected);
+        }
+        if (__builtin_cpu_supports("avx512vpopcntdq")) {
+            assert(popcount_avx512(buf, len) == expected);
+        }
+#endif
+        free(buf);
+    }
+
+    // All ones - every counter of the Harley-Seal tree overflows into the next one
+    uint8_t ones[2048];
+    memset(ones, 0xff, sizeof(ones));
+    assert(bitmap_popcount(ones, sizeof(ones)) == sizeof(ones) * 8);
+}
+
+static void test_count_range() {
+    size_t len = 300;
+    uint8_t* buf = random_buf(len);
+
+    uint64_t bits = len * 8;
+    uint64_t starts[] = {0, 1, 7, 8, 13, 100, 1000, bits - 1};
+    for (uint64_t start : starts) {
+        for (uint64_t end = start; end < bits; end += 1 + end % 37) {
+            assert(bitmap_count_range(buf, start, end) == ref_count_range(buf, start, end));
+        }
+    }
+
+    // Single byte, single bit
+    uint8_t byte = 0b10100000;
+    assert(bitmap_count_range(&byte, 0, 0) == 1);
+    assert(bitmap_count_range(&byte, 1, 1) == 0);
+    assert(bitmap_count_range(&byte, 1, 2) == 1);
+    assert(bitmap_count_range(&byte, 0, 7) == 2);
+    free(buf);
+}
+
+static void test_op_kernels() {
+    for (size_t len : lens) {
+        uint8_t* a = random_buf(len);
+        uint8_t* b = random_buf(len);
+        uint8_t* expected = (uint8_t*)malloc(len + 1);
+        uint8_t* got = (uint8_t*)malloc(len + 1);
+
+        for (uint8_t op = BITOP_AND; op <= BITOP_NOT; op++) {
+            for (size_t i = 0; i < len; i++) {
+                if (op == BITOP_AND) expected[i] = a[i] & b[i];
+                if (op == BITOP_OR) expected[i] = a[i] | b[i];
+                if (op == BITOP_XOR) expected[i] = a[i] ^ b[i];
+                if (op == BITOP_NOT) expected[i] = ~b[i];
+            }
+
+            memcpy(got, a, len);
+            op_scalar(op, got, b, len);
+            assert(!memcmp(got, expected, len));
+
+            memcpy(got, a, len);
+            bitmap_op(op, got, b, len);
+            assert(!memcmp(got, expected, len));
+#ifdef BITMAP_X86
+            if (__builtin_cpu_supports("avx2")) {
+                memcpy(got, a, len);
+                op_avx2(op, got, b, len);
+                assert(!memcmp(got, expected, len));
+            }
+#endif
+        }
+
+        // NOT in place
+        memcpy(got, b, len);
+        bitmap_op(BITOP_NOT, got, got, len);
+        for (size_t i = 0; i < len; i++) {
+            assert(got[i] == (uint8_t)~b[i]);
+        }
+
+        free(a);
+        free(b);
+        free(expected);
+        free(got);
+    }
+}
+
+static int64_t ref_find_bit(const uint8_t* buf, uint64_t start, uint64_t end, uint8_t bit) {
+    for (uint64_t pos = start; pos <= end; pos++) {
+        if (((buf[pos / 8] >> (7 - pos % 8)) & 1) == bit) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+static void test_find_bit() {
+    // Long runs of 0x00 / 0xff with a single odd bit, so the skip kernels have something to skip
+    size_t len = 1000;
+    uint8_t* zeros = (uint8_t*)calloc(len, 1);
+    uint8_t* ones = (uint8_t*)malloc(len);
+    memset(ones, 0xff, len);
+
+    uint64_t bits = len * 8;
+    uint64_t targets[] = {0, 5, 8, 63, 64, 255, 256, 257, 4000, bits - 1};
+    for (uint64_t target : targets) {
+        zeros[target / 8] |= 1 << (7 - target % 8);
+        ones[target / 8] &= ~(1 << (7 - target % 8));
+
+        uint64_t starts[] = {0, 1, target, target + 1};
+        for (uint64_t start : starts) {
+            if (start >= bits) {
+                continue;
+            }
+            assert(bitmap_find_bit(zeros, start, bits - 1, 1) == ref_find_bit(zeros, start, bits - 1, 1));
+            assert(bitmap_find_bit(ones, start, bits - 1, 0) == ref_find_bit(ones, start, bits - 1, 0));
+            assert(bitmap_find_bit(zeros, start, target, 1) == ref_find_bit(zeros, start, target, 1));
+        }
+#ifdef BITMAP_X86
+        if (__builtin_cpu_supports("avx2")) {
+            assert(skip_avx2(zeros, len, 0x00) == skip_scalar(zeros, len, 0x00));
+            assert(skip_avx2(ones, len, 0xff) == skip_scalar(ones, len, 0xff));
+        }
+#endif
+        zeros[target / 8] = 0;
+        ones[target / 8] = 0xff;
+    }
+
+    assert(bitmap_find_bit(zeros, 0, bits - 1, 1) == -1);
+    assert(bitmap_find_bit(ones, 0, bits - 1, 0) == -1);
+    free(zeros);
+    free(ones);
+}
+
+static void test_pos_range() {
+    uint64_t start_bit, end_bit;
+    assert(bitmap_pos_range(0, -1, 4, true, &start_bit, &end_bit));
+    assert(start_bit == 0 && end_bit == 31);
+    assert(bitmap_pos_range(-2, -1, 4, true, &start_bit, &end_bit));
+    assert(start_bit == 16 && end_bit == 31);
+    assert(bitmap_pos_range(5, 100, 4, false, &start_bit, &end_bit));
+    assert(start_bit == 5 && end_bit == 31);
+    assert(bitmap_pos_range(-100, 1, 4, true, &start_bit, &end_bit));
+    assert(start_bit == 0 && end_bit == 15);
+
+    // Empty ranges: BITPOS replies -1 for them, even for a 0-bit without an end
+    assert(!bitmap_pos_range(3, 1, 4, true, &start_bit, &end_bit));
+    assert(!bitmap_pos_range(10, -1, 4, true, &start_bit, &end_bit));
+    assert(!bitmap_pos_range(40, -1, 4, false, &start_bit, &end_bit));
+    assert(!bitmap_pos_range(0, -1, 0, true, &start_bit, &end_bit));
+}
+
+static void test_fields() {
+    uint8_t buf[16];
+    memset(buf, 0, sizeof(buf));
+
+    // Round trip of every width at unaligned offsets, neighbouring bits must stay untouched
+    for (uint8_t bits = 1; bits <= 64; bits++) {
+        for (uint64_t offset = 0; offset < 16; offset += 3) {
+            memset(buf, 0xa5, sizeof(buf));
+            uint64_t value = 0x123456789abcdef1ull & (bits == 64 ? UINT64_MAX : (1ull << bits) - 1);
+            bitmap_set_field(buf, offset, bits, value);
+            assert((uint64_t)bitmap_get_field(buf, sizeof(buf), offset, bits, false) == value);
+
+            if (offset > 0) {
+                assert(bitmap_get_field(buf, sizeof(buf), 0, offset, false) ==
+                       bitmap_get_field((const uint8_t*)"\xa5\xa5\xa5", 3, 0, offset, false));
+            }
+        }
+    }
+
+    // Sign extension and reads past the end
+    memset(buf, 0, sizeof(buf));
+    bitmap_set_field(buf, 3, 5, (uint64_t)-7);
+    assert(bitmap_get_field(buf, sizeof(buf), 3, 5, true) == -7);
+    assert(bitmap_get_field(buf, sizeof(buf), 3, 5, false) == 25);
+    assert(bitmap_get_field(buf, 1, 4, 8, false) == (int64_t)((buf[0] & 15) << 4));
+    assert(bitmap_get_field(NULL, 0, 100, 64, true) == 0);
+
+    // Overflow handling
+    int64_t res = 0;
+    assert(bitmap_field_add(250, 10, 8, false, BF_OVERFLOW_WRAP, &res) && res == 4);
+    assert(bitmap_field_add(250, 10, 8, false, BF_OVERFLOW_SAT, &res) && res == 255);
+    assert(!bitmap_field_add(250, 10, 8, false, BF_OVERFLOW_FAIL, &res));
+    assert(bitmap_field_add(3, -10, 8, false, BF_OVERFLOW_SAT, &res) && res == 0);
+    assert(bitmap_field_add(-7, -20, 5, true, BF_OVERFLOW_WRAP, &res) && res == 5);
+    assert(bitmap_field_add(-7, -20, 5, true, BF_OVERFLOW_SAT, &res) && res == -16);
+    assert(bitmap_field_add(INT64_MAX, 1, 64, true, BF_OVERFLOW_WRAP, &res) && res == INT64_MIN);
+    assert(bitmap_field_add(INT64_MAX, 1, 64, true, BF_OVERFLOW_SAT, &res) && res == INT64_MAX);
+    assert(bitmap_field_add(100, 0, 8, true, BF_OVERFLOW_FAIL, &res) && res == 100);
+}
+
+int run_all_bitmap() {
+    srand(26);
+    test_popcount_kernels();
+    printf("[bitmap]: popcount kernels passed! (1/6)\n");
+    test_count_range();
+    printf("[bitmap]: bitmap_count_range() passed! (2/6)\n");
+    test_op_kernels();
+    printf("[bitmap]: bitmap_op() kernels passed! (3/6)\n");
+    test_find_bit();
+    printf("[bitmap]: bitmap_find_bit() passed! (4/6)\n");
+    test_pos_range();
+    printf("[bitmap]: bitmap_pos_range() passed! (5/6)\n");
+    test_fields();
+    printf("[bitmap]: bitmap fields passed! (6/6)\n");
+    printf("[bitmap]: ALL BITMAP TESTS PASSED!\n");
+    return 0;
+}
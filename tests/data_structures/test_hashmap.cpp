@@ -0,0 +1,317 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include "data_structures/hashmap.cpp"
+#include "hashmap.h"
+#include "utils/glob.h"
+
+static HNode* hm_test_node(const char* key) {
+    dstr* k = dstr_init(strlen(key));
+    dstr_append(&k, key, strlen(key));
+    HNode* node = new_node(k, T_STR);
+    free(k);
+    return node;
+}
+
+static void hm_test_fill(HMap* hmap, uint32_t from, uint32_t to) {
+    char buf[32];
+    for (uint32_t i = from; i < to; i++) {
+        snprintf(buf, sizeof(buf), "key%u", i);
+        hm_insert(hmap, hm_test_node(buf));
+    }
+}
+
+static std::string hm_test_key(HNode* node) {
+    size_t len;
+    const char* key = hn_key(node, &len);
+    return std::string(key, len);
+}
+
+static void hm_test_count(HNode* node, void* arg) {
+    (*(std::map<std::string, int>*)arg)[hm_test_key(node)]++;
+}
+
+static void test_scan_stable() {
+    HMap hmap;
+    assert(hm_scan(&hmap, 0, &hm_test_count, NULL) == 0);
+
+    // Sizes that end mid rehash and with a single table
+    uint32_t sizes[] = {1, 33, 500, 4096, 10000};
+    for (uint32_t n : sizes) {
+        hm_test_fill(&hmap, 0, n);
+        std::map<std::string, int> seen;
+        size_t cursor = 0;
+        size_t calls = 0;
+        do {
+            cursor = hm_scan(&hmap, cursor, &hm_test_count, &seen);
+            calls++;
+        } while (cursor);
+
+        // Without changes in between every key comes back exactly once
+        assert(seen.size() == n && calls <= dmax(hmap.newer.mask, hmap.older.mask) + 1);
+        for (auto& it : seen) {
+            assert(it.second == 1);
+        }
+        hm_destroy(&hmap);
+    }
+}
+
+static void test_scan_growing() {
+    // Inserts between calls start and advance rehashes, keys present from the start are still all seen
+    HMap hmap;
+    hm_test_fill(&hmap, 0, 1000);
+    std::map<std::string, int> seen;
+    size_t cursor = 0;
+    uint32_t next = 1000;
+    bool rehashed = false;
+    do {
+        cursor = hm_scan(&hmap, cursor, &hm_test_count, &seen);
+        hm_test_fill(&hmap, next, next + 40);
+        next += 40;
+        rehashed |= hmap.older.tab != NULL;
+    } while (cursor);
+    assert(rehashed);
+
+    char buf[32];
+    for (uint32_t i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "key%u", i);
+        assert(seen.count(buf));
+    }
+    hm_destroy(&hmap);
+}
+
+static void test_lookup_many() {
+    // Mid rehash, both tables hold keys
+    HMap hmap;
+    hm_test_fill(&hmap, 0, 2050);
+    assert(hmap.older.tab);
+
+    char buf[32];
+    std::vector<HNode> tmp(4100);
+    std::vector<HNode*> keys(tmp.size());
+    for (uint32_t i = 0; i < tmp.size(); i++) {
+        // Every third key doesn't exist, the rest come in random order with repeats
+        uint32_t k = i % 3 ? (uint32_t)rand() % 2050 : 2050 + i;
+        snprintf(buf, sizeof(buf), "key%u", k);
+        tmp[i].key = dstr_init(strlen(buf));
+        dstr_append(&tmp[i].key, buf, strlen(buf));
+        tmp[i].hcode = str_hash((uint8_t*)buf, strlen(buf));
+        keys[i] = &tmp[i];
+    }
+
+    size_t sizes[] = {0, 1, 15, 16, 17, 100, 4100};
+    for (size_t n : sizes) {
+        std::vector<HNode*> out(n, (HNode*)1);
+        hm_lookup_many(&hmap, keys.data(), n, out.data());
+        for (size_t i = 0; i < n; i++) {
+            assert(out[i] == hm_lookup(&hmap, keys[i]));
+            assert(i % 3 ? out[i] && hm_test_key(out[i]) == keys[i]->key->buf : !out[i]);
+        }
+    }
+
+    for (HNode& node : tmp) {
+        free(node.key);
+    }
+    hm_destroy(&hmap);
+}
+
+static bool int_of(const char* s, int64_t* v) {
+    return str_to_int64(s, strlen(s), v);
+}
+
+static void test_int_values() {
+    int64_t v;
+    assert(int_of("0", &v) && v == 0);
+    assert(int_of("-42", &v) && v == -42);
+    assert(int_of("9223372036854775807", &v) && v == INT64_MAX);
+    assert(int_of("-9223372036854775808", &v) && v == INT64_MIN);
+    const char* bad[] = {"", "-", "-0", "007", "+1", " 1", "1 ", "1.0", "1e3", "9223372036854775808",
+                         "-9223372036854775809", "99999999999999999999", "123456789012345678901"};
+    for (const char* s : bad) {
+        assert(!int_of(s, &v));
+    }
+
+    // Canonical integers are unboxed, anything else keeps its exact bytes
+    dstr* key = dstr_init(1);
+    dstr_append(&key, "k", 1);
+    char buf[HN_INT_BUF];
+    size_t len;
+    const char* cases[] = {"17", "9999", "10000", "-1", "-9223372036854775808", "017", "hello", "-0", ""};
+    for (const char* c : cases) {
+        HNode* node = new_str_node(key, c, strlen(c));
+        assert(hn_is_int(node) == int_of(c, &v));
+        const char* got = hn_str(node, buf, &len);
+        assert(len == strlen(c) && !memcmp(got, c, len));
+        hn_free(node);
+    }
+
+    // Switching between the encodings frees what is no longer used
+    HNode* node = new_str_node(key, "text", 4);
+    hn_set_int(node, 5);
+    assert(hn_is_int(node) && node->ival == 5);
+    assert(hn_str(node, buf, &len) != buf && len == 1);
+    hn_set_int(node, 123456);
+    assert(hn_str(node, buf, &len) == buf && len == 6 && !memcmp(buf, "123456", 6));
+    hn_set_str(node, "1.5", 3);
+    assert(!hn_is_int(node) && hn_str(node, buf, &len) != buf && len == 3);
+    hn_set_str(node, "-3", 2);
+    assert(hn_is_int(node) && node->ival == -3);
+    hn_free(node);
+    free(key);
+}
+
+static void test_embedded() {
+    // Key lengths on both sides of every length header size
+    size_t sizes[] = {0, 1, 255, 256, 65535, 65536, 70000};
+    HMap hmap;
+    std::string val(HN_EMBED_VAL_MAX, 'v');
+    for (size_t n : sizes) {
+        std::string s(n, 'k');
+        s += std::to_string(n);
+        dstr* key = dstr_init(s.size());
+        dstr_append(&key, s.data(), s.size());
+        hm_insert(&hmap, new_str_node(key, val.data(), n % HN_EMBED_VAL_MAX));
+        free(key);
+    }
+    for (size_t n : sizes) {
+        std::string s(n, 'k');
+        s += std::to_string(n);
+        HNode tmp;
+        tmp.key = dstr_init(s.size());
+        dstr_append(&tmp.key, s.data(), s.size());
+        tmp.hcode = str_hash((uint8_t*)s.data(), s.size());
+        HNode* node = hm_lookup(&hmap, &tmp);
+        assert(node && !node->key && hm_test_key(node) == s);
+
+        // Keys sharing a prefix and hash bucket don't match each other
+        tmp.key->size--;
+        assert(!hm_lookup(&hmap, &tmp));
+        free(tmp.key);
+
+        char buf[HN_INT_BUF];
+        size_t len;
+        const char* got = hn_str(node, buf, &len);
+        assert(!node->val && len == n % HN_EMBED_VAL_MAX && !memcmp(got, val.data(), len) && !got[len]);
+    }
+    hm_destroy(&hmap);
+
+    // A value is rewritten in place while it fits the slot, moves out and back in when it doesn't
+    dstr* key = dstr_init(3);
+    dstr_append(&key, "key", 3);
+    HNode* node = new_str_node(key, "hello", 5);
+    assert((node->flags & HN_VAL_EMBED) && !node->val);
+    char buf[HN_INT_BUF];
+    size_t len;
+    const char* slot = hn_str(node, buf, &len);
+    hn_set_str(node, "bye", 3);
+    assert(hn_str(node, buf, &len) == slot && len == 3 && !memcmp(slot, "bye", 4));
+    std::string big(HN_EMBED_VAL_MAX + 1, 'x');
+    hn_set_str(node, big.data(), big.size());
+    assert(!(node->flags & HN_VAL_EMBED) && node->val && hn_str(node, buf, &len) == node->val->buf);
+    hn_set_str(node, "hi", 2);
+    assert((node->flags & HN_VAL_EMBED) && !node->val && hn_str(node, buf, &len) == slot && len == 2);
+    hn_set_int(node, 7);
+    assert(hn_is_int(node) && hn_str(node, buf, &len) != slot);
+    hn_free(node);
+
+    // Long values never get a slot, counters neither
+    node = new_str_node(key, big.data(), big.size());
+    assert(!(node->flags & HN_VAL_ROOM) && node->val && node->val->size == big.size());
+    hn_set_str(node, "hi", 2);
+    assert(!(node->flags & HN_VAL_EMBED) && node->val);
+    hn_free(node);
+    node = new_str_node(key, "12", 2);
+    assert(!(node->flags & HN_VAL_ROOM) && hn_is_int(node));
+    hn_free(node);
+
+    // The other types get the whole node, the collections they don't use are empty
+    node = new_node(key, T_LIST);
+    assert(!node->list.head && !node->list.size && !hm_size(&node->hmap) && !hm_size(&node->set));
+    assert(!node->zset && !node->bitmap && !node->roaring && !node->hll && !node->stream);
+    hn_free(node);
+    free(key);
+}
+
+static void test_shared_values() {
+    dstr* key = dstr_init(3);
+    dstr_append(&key, "key", 3);
+    std::string big(HN_SHARED_VAL_MIN, 'a');
+    HNode* node = new_str_node(key, big.data(), HN_SHARED_VAL_MIN - 1);
+    assert(!hn_shared_val(node));
+
+    // The buffer holds exactly the bytes a reply sends
+    hn_set_str(node, big.data(), big.size());
+    SharedBuf* buf = hn_shared_val(node);
+    size_t pos = offsetof(dstr, buf);
+    assert(buf && buf->refs == 1 && buf->len == pos + big.size() && (char*)buf->data + pos == node->val->buf);
+
+    // Rewritten in place while nothing else references it
+    big.assign(HN_SHARED_VAL_MIN, 'b');
+    hn_set_str(node, big.data(), big.size());
+    assert(hn_shared_val(node) == buf && buf->data[pos] == 'b');
+
+    // A referenced value keeps its bytes, the node moves on to a new buffer
+    buf->refs++;
+    big.assign(HN_SHARED_VAL_MIN + 1, 'c');
+    hn_set_str(node, big.data(), big.size());
+    SharedBuf* next = hn_shared_val(node);
+    assert(next != buf && buf->refs == 1 && buf->data[pos] == 'b' && buf->len == pos + HN_SHARED_VAL_MIN);
+    assert(next->len == pos + big.size() && node->val->buf[0] == 'c');
+
+    // And drops its reference when it gets a short value or is freed
+    next->refs++;
+    hn_set_str(node, "short", 5);
+    assert(!hn_shared_val(node) && next->refs == 1);
+    hn_set_str(node, big.data(), big.size());
+    hn_free(node);
+    shared_buf_release(buf);
+    shared_buf_release(next);
+    free(key);
+}
+
+static bool glob(const char* pattern, const char* str) {
+    return glob_match(pattern, strlen(pattern), str, strlen(str));
+}
+
+static void test_glob() {
+    assert(glob("*", "") && glob("*", "anything"));
+    assert(glob("user:*", "user:42") && !glob("user:*", "users:42"));
+    assert(glob("h?llo", "hello") && glob("h?llo", "hallo") && !glob("h?llo", "hllo"));
+    assert(glob("h[ae]llo", "hello") && glob("h[ae]llo", "hallo") && !glob("h[ae]llo", "hillo"));
+    assert(glob("h[^e]llo", "hallo") && !glob("h[^e]llo", "hello"));
+    assert(glob("h[a-b]llo", "hbllo") && glob("h[b-a]llo", "hallo") && !glob("h[a-b]llo", "hcllo"));
+    assert(glob("a\\*b", "a*b") && !glob("a\\*b", "axb"));
+    assert(glob("*a*b*c", "xxaxxbxxc") && !glob("*a*b*c", "xxaxxcxxb"));
+    assert(glob("a*", "a") && !glob("a", "ab") && !glob("ab", "a"));
+    assert(glob("[abc", "b") && !glob("[abc", "d"));
+
+    // Backtracking only to the last * keeps this linear instead of exponential
+    std::string s(5000, 'a');
+    std::string p;
+    for (int i = 0; i < 30; i++) {
+        p += "a*";
+    }
+    p += "b";
+    assert(!glob(p.c_str(), s.c_str()));
+}
+
+int run_all_hashmap() {
+    test_scan_stable();
+    printf("[hashmap]: hm_scan() on a stable map passed! (1/7)\n");
+    test_scan_growing();
+    printf("[hashmap]: hm_scan() while rehashing passed! (2/7)\n");
+    test_lookup_many();
+    printf("[hashmap]: hm_lookup_many() passed! (3/7)\n");
+    test_glob();
+    printf("[hashmap]: glob_match() passed! (4/7)\n");
+    test_int_values();
+    printf("[hashmap]: integer encoded strings passed! (5/7)\n");
+    test_embedded();
+    printf("[hashmap]: embedded keys and values passed! (6/7)\n");
+    test_shared_values();
+    printf("[hashmap]: shared long values passed! (7/7)\n");
+    printf("[hashmap]: ALL HASHMAP TESTS PASSED!\n");
+    return 0;
+}
@@ -147,23 +147,194 @@ void test_set_cache_and_get_cache() {
     free(hll);
 }
 
+// === REGISTER BLOCK TESTS ===
+static void add_range(dstr** phll, uint32_t from, uint32_t to) {
+    char buf[32];
+    for (uint32_t i = from; i < to; i++) {
+        int len = snprintf(buf, sizeof(buf), "elem:%u", i);
+        dstr* val = dstr_init(len);
+        dstr_append(&val, buf, len);
+        hll_add(phll, val);
+        free(val);
+    }
+}
+
+void test_decode_regs() {
+    dstr* hll = NULL;
+    dense_init(&hll);
+    for (uint32_t reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
+        set_reg(hll, reg_no, (reg_no * 7 + reg_no / 3) % 64);
+    }
+
+    uint8_t regs[REGISTER_CNT];
+    const uint8_t* src = (const uint8_t*)hll->buf + HLL_HEADER_SIZE_BYTES;
+    decode_scalar(src, regs);
+    for (uint32_t reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
+        assert(regs[reg_no] == get_reg(hll, reg_no));
+        assert(regs[reg_no] == (reg_no * 7 + reg_no / 3) % 64);
+    }
+#ifdef HLL_X86
+    if (__builtin_cpu_supports("avx2")) {
+        uint8_t regs_avx2[REGISTER_CNT];
+        decode_avx2(src, regs_avx2);
+        assert(!memcmp(regs, regs_avx2, REGISTER_CNT));
+    }
+#endif
+
+    // encode_regs is the inverse of the decoders
+    dstr* copy = NULL;
+    dense_init(&copy);
+    encode_regs((uint8_t*)copy->buf + HLL_HEADER_SIZE_BYTES, regs);
+    assert(!memcmp(copy->buf, hll->buf, hll->size));
+
+    // Sparse hlls decode to the same registers as their dense form
+    dstr* sparse = NULL;
+    hll_init(&sparse);
+    add_range(&sparse, 0, 100);
+    assert(get_enc(sparse) == HLL_SPARSE);
+    regs_decode(sparse, regs);
+    densify(&sparse);
+    for (uint32_t reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
+        assert(regs[reg_no] == get_reg(sparse, reg_no));
+    }
+
+    free(hll);
+    free(copy);
+    free(sparse);
+}
+
+void test_merge_and_union() {
+    dstr* a = NULL;
+    dstr* b = NULL;
+    dstr* c = NULL;
+    dstr* all = NULL;
+    hll_init(&a);
+    hll_init(&b);
+    hll_init(&c);
+    hll_init(&all);
+    add_range(&a, 0, 5000);
+    add_range(&b, 3000, 8000);
+    add_range(&c, 7950, 8050);
+    add_range(&all, 0, 8050);
+    assert(get_enc(a) == HLL_DENSE && get_enc(c) == HLL_SPARSE);
+
+    // The union has exactly the registers of an hll that saw every element
+    dstr* srcs[] = {a, b, c};
+    uint64_t expected = hll_count(all);
+    assert(hll_count_union(srcs, 3) == expected);
+    assert(expected > 8050 * 0.97 && expected < 8050 * 1.03);
+
+    // Merge into a sparse dest that is also one of the sources
+    dstr* msrcs[] = {a, b, c};
+    hll_merge(&c, msrcs, 3);
+    assert(get_enc(c) == HLL_DENSE);
+    assert(!cache_valid(c));
+    assert(hll_count(c) == expected);
+    assert(!memcmp(c->buf + HLL_HEADER_SIZE_BYTES, all->buf + HLL_HEADER_SIZE_BYTES, HLL_DENSE_SIZE_BYTES));
+
+    free(a);
+    free(b);
+    free(c);
+    free(all);
+}
+
+void test_sum_kernels() {
+    uint8_t regs[REGISTER_CNT];
+    for (uint32_t reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
+        regs[reg_no] = reg_no % 5 ? (reg_no * 13) % 52 : 0;
+    }
+
+    long double expected = 0.0l;
+    uint32_t expected_zeros = 0;
+    for (uint32_t reg_no = 0; reg_no < REGISTER_CNT; reg_no++) {
+        expected += 1.0l / (1ull << regs[reg_no]);
+        expected_zeros += !regs[reg_no];
+    }
+
+    uint32_t zeros = 0;
+    assert(fabsl(sum_scalar(regs, &zeros) - expected) < 1e-9l);
+    assert(zeros == expected_zeros);
+#ifdef HLL_X86
+    if (__builtin_cpu_supports("avx2")) {
+        zeros = 0;
+        assert(fabsl(sum_avx2(regs, &zeros) - expected) < 1e-9l);
+        assert(zeros == expected_zeros);
+    }
+#endif
+
+    // Empty hll: every register is zero
+    memset(regs, 0, sizeof(regs));
+    assert(sum_impl(regs, &zeros) == REGISTER_CNT && zeros == REGISTER_CNT);
+    assert(regs_count(regs) == 0);
+}
+
+void test_add_batch() {
+    // Small batches stay sparse, large ones go dense halfway through
+    uint32_t sizes[] = {1, 50, 5000};
+    for (uint32_t n : sizes) {
+        dstr* one = NULL;
+        dstr* batch = NULL;
+        hll_init(&one);
+        hll_init(&batch);
+
+        std::vector<dstr*> vals;
+        char buf[32];
+        for (uint32_t i = 0; i < n; i++) {
+            int len = snprintf(buf, sizeof(buf), "elem:%u", i % (n / 2 + 1)); // with duplicates
+            dstr* val = dstr_init(len);
+            dstr_append(&val, buf, len);
+            vals.push_back(val);
+            hll_add(&one, val);
+        }
+
+        assert(hll_add_batch(&batch, vals.data(), vals.size()) == 1);
+        assert(!cache_valid(batch));
+        assert(get_enc(one) == get_enc(batch));
+        assert(hll_count(one) == hll_count(batch));
+
+        uint8_t regs_one[REGISTER_CNT];
+        uint8_t regs_batch[REGISTER_CNT];
+        regs_decode(one, regs_one);
+        regs_decode(batch, regs_batch);
+        assert(!memcmp(regs_one, regs_batch, REGISTER_CNT));
+
+        // Adding the same elements again changes nothing
+        assert(hll_add_batch(&batch, vals.data(), vals.size()) == 0);
+        assert(cache_valid(batch));
+
+        for (dstr* val : vals) {
+            free(val);
+        }
+        free(one);
+        free(batch);
+    }
+}
+
 int run_all_hll() {
     test_get_enc();
-    printf("[hll]: get_enc() passed! (1/8)\n");
+    printf("[hll]: get_enc() passed! (1/12)\n");
     test_set_enc();
-    printf("[hll]: set_enc() passed! (2/8)\n");
+    printf("[hll]: set_enc() passed! (2/12)\n");
     test_cache_valid_and_invalidate();
-    printf("[hll]: cache_valid_and_invalidate() passed! (3/8)\n");
+    printf("[hll]: cache_valid_and_invalidate() passed! (3/12)\n");
     test_is_val_and_is_zero();
-    printf("[hll]: is_val_and_is_zero() passed! (4/8)\n");
+    printf("[hll]: is_val_and_is_zero() passed! (4/12)\n");
     test_val_value_and_val_cnt();
-    printf("[hll]: val_value_and_val_cnt() passed! (5/8)\n");
+    printf("[hll]: val_value_and_val_cnt() passed! (5/12)\n");
     test_zero_cnt();
-    printf("[hll]: zero_cnt() passed! (6/8)\n");
+    printf("[hll]: zero_cnt() passed! (6/12)\n");
     test_xzero_cnt();
-    printf("[hll]: xzero_cnt() passed! (7/8)\n");
+    printf("[hll]: xzero_cnt() passed! (7/12)\n");
     test_set_cache_and_get_cache();
-    printf("[hll]: set_cache_and_get_cache() passed! (8/8)\n");
+    printf("[hll]: set_cache_and_get_cache() passed! (8/12)\n");
+    test_decode_regs();
+    printf("[hll]: register decoding passed! (9/12)\n");
+    test_merge_and_union();
+    printf("[hll]: hll_merge() / hll_count_union() passed! (10/12)\n");
+    test_sum_kernels();
+    printf("[hll]: harmonic sum kernels passed! (11/12)\n");
+    test_add_batch();
+    printf("[hll]: hll_add_batch() passed! (12/12)\n");
     printf("[hll]: ALL HLL TESTS PASSED!\n");
     return 0;
 }
@@ -0,0 +1,227 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "data_structures/roaring.cpp"
+#include "roaring.h"
+
+// Plain bitmap of 4 containers that the roaring results are compared against
+static const size_t REF_LEN = 4 * RC_BITSET_BYTES;
+
+static uint8_t ref_get(const uint8_t* buf, uint64_t pos) {
+    return (buf[pos / 8] >> (7 - pos % 8)) & 1;
+}
+
+static void ref_set(uint8_t* buf, uint64_t pos, uint8_t bit) {
+    if (bit) {
+        buf[pos / 8] |= 0x80 >> (pos % 8);
+    }
+    else {
+        buf[pos / 8] &= ~(0x80 >> (pos % 8));
+    }
+}
+
+static void assert_same(Roaring* r, const uint8_t* ref, size_t len) {
+    assert(r->size == len);
+    dstr* dense = roaring_to_dense(r);
+    assert(dense->size == len && !memcmp(dense->buf, ref, len));
+    free(dense);
+
+    // Cardinalities are kept up to date on every write
+    for (RContainer& c : r->containers) {
+        assert(c.card && c.card == rc_count_range(&c, 0, RC_BITS - 1));
+    }
+}
+
+// Sparse bits, a dense random block and long runs in different containers
+static uint8_t* mixed_ref(Roaring* r) {
+    uint8_t* ref = (uint8_t*)calloc(REF_LEN, 1);
+    for (int i = 0; i < 500; i++) {
+        uint64_t pos = rand() % RC_BITS;
+        ref_set(ref, pos, 1);
+        roaring_set(r, pos, 1);
+    }
+    for (int i = 0; i < 20000; i++) {
+        uint64_t pos = RC_BITS + rand() % RC_BITS;
+        ref_set(ref, pos, 1);
+        roaring_set(r, pos, 1);
+    }
+    for (uint64_t pos = 3 * RC_BITS + 100; pos < 4 * RC_BITS; pos++) {
+        if (pos % 1000 < 900) {
+            ref_set(ref, pos, 1);
+            roaring_set(r, pos, 1);
+        }
+    }
+    return ref;
+}
+
+static void test_set_get() {
+    Roaring* r = roaring_init();
+    uint8_t* ref = (uint8_t*)calloc(REF_LEN, 1);
+
+    // Random writes over 4 containers, container 2 goes through array -> bitset -> array
+    for (int i = 0; i < 40000; i++) {
+        uint64_t pos = rand() % (REF_LEN * 8);
+        uint8_t bit = i < 30000 ? rand() % 4 != 0 : 0;
+        if (i >= 30000) {
+            pos = 2 * RC_BITS + pos % RC_BITS;
+        }
+        assert(roaring_set(r, pos, bit) == ref_get(ref, pos));
+        ref_set(ref, pos, bit);
+    }
+    roaring_set(r, REF_LEN * 8 - 1, 0);
+    ref_set(ref, REF_LEN * 8 - 1, 0);
+    assert_same(r, ref, REF_LEN);
+    for (uint64_t pos = 0; pos < REF_LEN * 8; pos += 7) {
+        assert(roaring_get(r, pos) == ref_get(ref, pos));
+    }
+    roaring_free(r);
+
+    // Runs: extend, merge, split and remove
+    r = roaring_init();
+    memset(ref, 0, REF_LEN);
+    for (uint64_t pos = 10; pos < 30000; pos++) {
+        roaring_set(r, pos, 1);
+        ref_set(ref, pos, 1);
+    }
+    roaring_optimize(r);
+    assert(r->containers[0].type == RC_RUN && r->containers[0].len == 1);
+
+    uint64_t holes[] = {10, 29999, 500, 501, 1000, 20000};
+    for (uint64_t pos : holes) {
+        assert(roaring_set(r, pos, 0) == 1);
+        ref_set(ref, pos, 0);
+    }
+    assert(r->containers[0].type == RC_RUN && r->containers[0].len == 4);
+    assert(roaring_set(r, 500, 1) == 0 && roaring_set(r, 501, 1) == 0);
+    ref_set(ref, 500, 1);
+    ref_set(ref, 501, 1);
+    assert(r->containers[0].len == 3);
+    roaring_set(r, REF_LEN * 8 - 1, 0);
+    assert_same(r, ref, REF_LEN);
+
+    // Clearing every bit drops the container
+    for (uint64_t pos = 0; pos < 30000; pos++) {
+        roaring_set(r, pos, 0);
+    }
+    assert(r->containers.empty() && r->mem == 0);
+    roaring_free(r);
+    free(ref);
+}
+
+static void test_count_find() {
+    Roaring* r = roaring_init();
+    uint8_t* ref = mixed_ref(r);
+    uint64_t bits = REF_LEN * 8;
+
+    uint64_t starts[] = {0, 1, 777, RC_BITS - 1, RC_BITS, 2 * RC_BITS + 5, 3 * RC_BITS + 99, bits - 1};
+    for (uint64_t start : starts) {
+        for (uint64_t end = start; end < bits; end += 1 + end % 20011) {
+            assert(roaring_count_range(r, start, end) == bitmap_count_range(ref, start, end));
+            assert(roaring_find_bit(r, start, end, 1) == bitmap_find_bit(ref, start, end, 1));
+            assert(roaring_find_bit(r, start, end, 0) == bitmap_find_bit(ref, start, end, 0));
+        }
+    }
+    roaring_free(r);
+    free(ref);
+}
+
+static void test_ops() {
+    Roaring* a = roaring_init();
+    Roaring* b = roaring_init();
+    uint8_t* ref_a = mixed_ref(a);
+    uint8_t* ref_b = mixed_ref(b);
+
+    // b is shorter, everything past it is 0
+    for (uint64_t pos = 3 * RC_BITS; pos < 4 * RC_BITS; pos++) {
+        roaring_set(b, pos, 0);
+    }
+    memset(ref_b + 3 * RC_BITSET_BYTES, 0, RC_BITSET_BYTES);
+    b->size = 3 * RC_BITSET_BYTES;
+    a->size = REF_LEN;
+
+    uint8_t* expected = (uint8_t*)malloc(REF_LEN);
+    for (uint8_t op = BITOP_AND; op <= BITOP_NOT; op++) {
+        memcpy(expected, ref_a, REF_LEN);
+        bitmap_op(op, expected, op == BITOP_NOT ? ref_a : ref_b, REF_LEN);
+
+        Roaring* srcs[] = {a, b};
+        Roaring* res = roaring_op(op, srcs, op == BITOP_NOT ? 1 : 2);
+        assert_same(res, expected, REF_LEN);
+        roaring_free(res);
+    }
+
+    // Missing sources
+    Roaring* srcs[] = {a, NULL};
+    Roaring* res = roaring_op(BITOP_AND, srcs, 2);
+    assert(res->containers.empty() && res->size == REF_LEN);
+    roaring_free(res);
+    res = roaring_op(BITOP_OR, srcs, 2);
+    assert_same(res, ref_a, REF_LEN);
+    roaring_free(res);
+
+    roaring_free(a);
+    roaring_free(b);
+    free(ref_a);
+    free(ref_b);
+    free(expected);
+}
+
+static void test_conversions() {
+    Roaring* r = roaring_init();
+    uint8_t* ref = mixed_ref(r);
+
+    Roaring* conv = roaring_from_dense(ref, REF_LEN);
+    assert_same(conv, ref, REF_LEN);
+    assert(conv->containers.size() == 3);
+    assert(conv->containers[0].type == RC_ARRAY);
+    assert(conv->containers[1].type == RC_BITSET);
+    assert(conv->containers[2].type == RC_RUN);
+
+    // Each container is smaller than the plain bytes it replaces
+    assert(roaring_mem(conv) < REF_LEN);
+    roaring_free(conv);
+    roaring_free(r);
+
+    // Odd lengths
+    conv = roaring_from_dense(ref, 5);
+    assert_same(conv, ref, 5);
+    roaring_free(conv);
+    conv = roaring_from_dense(ref, 0);
+    assert(conv->containers.empty() && conv->size == 0);
+    roaring_free(conv);
+    free(ref);
+}
+
+static void test_roaring_fields() {
+    Roaring* r = roaring_init();
+    uint8_t ref[16];
+    memset(ref, 0, sizeof(ref));
+
+    for (uint8_t bits = 1; bits <= 64; bits += 7) {
+        uint64_t offset = bits % 13;
+        uint64_t value = 0x9abcdef123456789ull & (bits == 64 ? UINT64_MAX : (1ull << bits) - 1);
+        roaring_set_field(r, offset, bits, value);
+        bitmap_set_field(ref, offset, bits, value);
+        assert(roaring_get_field(r, offset, bits, true) == bitmap_get_field(ref, sizeof(ref), offset, bits, true));
+        assert(roaring_get_field(r, offset, bits, false) == bitmap_get_field(ref, sizeof(ref), offset, bits, false));
+    }
+    assert(roaring_get_field(r, 1000, 16, false) == 0);
+    roaring_free(r);
+}
+
+int run_all_roaring() {
+    srand(28);
+    test_set_get();
+    printf("[roaring]: roaring_set() / roaring_get() passed! (1/5)\n");
+    test_count_find();
+    printf("[roaring]: roaring_count_range() / roaring_find_bit() passed! (2/5)\n");
+    test_ops();
+    printf("[roaring]: roaring_op() passed! (3/5)\n");
+    test_conversions();
+    printf("[roaring]: dense conversions passed! (4/5)\n");
+    test_roaring_fields();
+    printf("[roaring]: roaring fields passed! (5/5)\n");
+    printf("[roaring]: ALL ROARING TESTS PASSED!\n");
+    return 0;
+}
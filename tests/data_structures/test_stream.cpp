@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "data_structures/stream.cpp"
+#include "stream.h"
+
+static dstr* st_str(const char* s) {
+    dstr* str = dstr_init(strlen(s));
+    dstr_append(&str, s, strlen(s));
+    return str;
+}
+
+// Appends [name, value] pairs, entries with an odd ms get a different field set than the master
+static void st_append(Stream* s, StreamID id) {
+    char val[32];
+    snprintf(val, sizeof(val), "v%llu-%llu", (unsigned long long)id.ms, (unsigned long long)id.seq);
+    dstr* pairs[4] = {st_str("name"), st_str(val), st_str(id.ms % 2 ? "odd" : "count"), st_str("1")};
+    stream_append(s, id, pairs, 4);
+    for (dstr* p : pairs) {
+        free(p);
+    }
+}
+
+struct StCollect {
+    std::vector<StreamID> ids;
+    bool values_ok = true;
+};
+
+static void st_collect(StreamEntry* e, void* arg) {
+    StCollect* out = (StCollect*)arg;
+    out->ids.push_back(e->id);
+
+    char val[32];
+    int len = snprintf(val, sizeof(val), "v%llu-%llu", (unsigned long long)e->id.ms, (unsigned long long)e->id.seq);
+    const char* second = e->id.ms % 2 ? "odd" : "count";
+    out->values_ok &= e->fields.size() == 4 && e->fields[0].len == 4 && !memcmp(e->fields[0].buf, "name", 4) &&
+                      e->fields[1].len == (size_t)len && !memcmp(e->fields[1].buf, val, len) &&
+                      e->fields[2].len == strlen(second) && !memcmp(e->fields[2].buf, second, strlen(second));
+}
+
+static StCollect st_range(Stream* s, StreamID start, StreamID end, size_t count, bool rev) {
+    StCollect out;
+    size_t n = stream_range(s, start, end, count, rev, &st_collect, &out);
+    assert(n == out.ids.size() && out.values_ok);
+    return out;
+}
+
+static void test_ids() {
+    StreamID id;
+    assert(stream_parse_id("1526919030474-55", 16, 0, &id) && id.ms == 1526919030474 && id.seq == 55);
+    assert(stream_parse_id("42", 2, UINT64_MAX, &id) && id.ms == 42 && id.seq == UINT64_MAX);
+    assert(!stream_parse_id("42-", 3, 0, &id) && !stream_parse_id("-1", 2, 0, &id));
+    assert(!stream_parse_id("1-2-3", 5, 0, &id) && !stream_parse_id("99999999999999999999-0", 22, 0, &id));
+
+    char buf[STREAM_ID_BUF];
+    StreamID max = {UINT64_MAX, UINT64_MAX};
+    size_t len = stream_format_id(max, buf);
+    assert(len == strlen("18446744073709551615-18446744073709551615") && !strcmp(buf, "18446744073709551615-18446744073709551615"));
+    assert(stream_parse_id(buf, len, 0, &id) && !stream_id_cmp(id, max));
+
+    // Increments carry into ms, the ends of the ID space don't wrap
+    id = {7, UINT64_MAX};
+    assert(stream_id_incr(&id) && id.ms == 8 && id.seq == 0);
+    assert(stream_id_decr(&id) && id.ms == 7 && id.seq == UINT64_MAX);
+    assert(!stream_id_incr(&max));
+    StreamID zero = {0, 0};
+    assert(!stream_id_decr(&zero));
+    assert(stream_id_cmp({1, 5}, {2, 0}) < 0 && stream_id_cmp({2, 0}, {1, 5}) > 0);
+
+    // The clock going back keeps the IDs growing
+    Stream* s = stream_new();
+    assert(stream_id_cmp(stream_next_id(s, 100), {100, 0}) == 0);
+    st_append(s, {100, 0});
+    assert(stream_id_cmp(stream_next_id(s, 100), {100, 1}) == 0);
+    assert(stream_id_cmp(stream_next_id(s, 50), {100, 1}) == 0);
+    stream_free(s);
+}
+
+static void test_append_range() {
+    Stream* s = stream_new();
+    std::vector<StreamID> all;
+    for (uint64_t i = 0; i < 5000; i++) {
+        // Runs of the same ms, gaps across whole tree bytes
+        StreamID id = {1000 + i / 3 + (i / 700) * 100000, i % 3};
+        st_append(s, id);
+        all.push_back(id);
+    }
+    assert(s->length == all.size() && s->blocks > 1 && !stream_id_cmp(s->last_id, all.back()));
+
+    StCollect fwd = st_range(s, {0, 0}, {UINT64_MAX, UINT64_MAX}, 0, false);
+    assert(fwd.ids.size() == all.size());
+    for (size_t i = 0; i < all.size(); i++) {
+        assert(!stream_id_cmp(fwd.ids[i], all[i]));
+    }
+    StCollect rev = st_range(s, {0, 0}, {UINT64_MAX, UINT64_MAX}, 0, true);
+    assert(rev.ids.size() == all.size() && !stream_id_cmp(rev.ids[0], all.back()));
+
+    // Seeks that start and end between entries and blocks
+    for (int t = 0; t < 200; t++) {
+        size_t a = rand() % all.size(), b = rand() % all.size();
+        if (a > b) {
+            std::swap(a, b);
+        }
+        // Half the starts fall right after the entry before, between two IDs
+        StreamID start = all[a], end = all[b];
+        if (a && rand() % 2) {
+            start = all[a - 1];
+            stream_id_incr(&start);
+        }
+        size_t count = rand() % 3 ? 0 : 1 + rand() % 50;
+        size_t want = count ? std::min(count, b - a + 1) : b - a + 1;
+
+        StCollect got = st_range(s, start, end, count, false);
+        assert(got.ids.size() == want);
+        for (size_t i = 0; i < want; i++) {
+            assert(!stream_id_cmp(got.ids[i], all[a + i]));
+        }
+        got = st_range(s, start, end, count, true);
+        assert(got.ids.size() == want);
+        for (size_t i = 0; i < want; i++) {
+            assert(!stream_id_cmp(got.ids[i], all[b - i]));
+        }
+    }
+
+    // Empty ranges
+    assert(st_range(s, {0, 0}, {999, UINT64_MAX}, 0, false).ids.empty());
+    assert(st_range(s, {1000, 3}, {1000, 9}, 0, true).ids.empty());
+    assert(st_range(s, all[10], all[9], 0, false).ids.empty());
+    stream_free(s);
+}
+
+static void test_trim() {
+    Stream* s = stream_new();
+    for (uint64_t i = 1; i <= 1000; i++) {
+        st_append(s, {i, 0});
+    }
+
+    // Approximate trimming drops whole blocks only
+    uint64_t blocks = s->blocks;
+    assert(!stream_trim(s, 1000 - STREAM_BLOCK_ENTRIES + 1, true) && s->blocks == blocks);
+    assert(stream_trim(s, 800, true) == STREAM_BLOCK_ENTRIES && s->blocks == blocks - 1);
+
+    // Exact trimming cuts into the head block, the rest stays readable
+    uint64_t before = s->length;
+    assert(stream_trim(s, 555, false) == before - 555 && s->length == 555);
+    StCollect got = st_range(s, {0, 0}, {UINT64_MAX, UINT64_MAX}, 0, false);
+    assert(got.ids.size() == 555 && got.ids[0].ms == 446 && got.ids.back().ms == 1000);
+    got = st_range(s, {0, 0}, {500, 0}, 0, true);
+    assert(got.ids.size() == 55 && got.ids[0].ms == 500 && got.ids.back().ms == 446);
+
+    // Appending after trimming and down to nothing, the last ID stays
+    st_append(s, {1001, 0});
+    assert(stream_trim(s, 0, false) == 556 && !s->length && !s->blocks);
+    assert(!stream_id_cmp(s->last_id, {1001, 0}));
+    assert(st_range(s, {0, 0}, {UINT64_MAX, UINT64_MAX}, 0, false).ids.empty());
+    st_append(s, {1002, 0});
+    assert(s->length == 1 && st_range(s, {0, 0}, {UINT64_MAX, UINT64_MAX}, 0, false).ids.size() == 1);
+    stream_free(s);
+}
+
+static void test_stream_mem() {
+    // Time based IDs with the same fields: an entry costs a few bytes of ID deltas plus its values, well
+    // below its raw 16 byte ID and strings with the field names repeated in every entry
+    Stream* s = stream_new();
+    size_t raw = 0;
+    for (uint64_t i = 0; i < 10000; i++) {
+        StreamID id = {1700000000000 + i / 4, i % 4};
+        st_append(s, id);
+        char val[32];
+        raw += sizeof(StreamID) + strlen("name") + snprintf(val, sizeof(val), "v%llu-%llu", (unsigned long long)id.ms,
+                                                             (unsigned long long)id.seq) + strlen("count") + 1;
+    }
+    size_t mem = stream_mem(s);
+    assert(mem < raw * 3 / 4);
+    stream_free(s);
+}
+
+int run_all_stream() {
+    srand(46);
+    test_ids();
+    printf("[stream]: stream ids passed! (1/4)\n");
+    test_append_range();
+    printf("[stream]: stream_append() / stream_range() passed! (2/4)\n");
+    test_trim();
+    printf("[stream]: stream_trim() passed! (3/4)\n");
+    test_stream_mem();
+    printf("[stream]: stream_mem() passed! (4/4)\n");
+    printf("[stream]: ALL STREAM TESTS PASSED!\n");
+    return 0;
+}
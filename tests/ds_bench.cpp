@@ -0,0 +1,436 @@
+// Microbenchmarks of the data_structures library. Prints one JSON document so runs on different
+// commits can be diffed by a script:
+//   ./ds_bench [n] [filter]
+// n scales every benchmark (default 200000), filter keeps the benchmarks whose name contains it.
+// Allocations are counted by wrapping malloc/calloc/realloc at link time (see CMakeLists.txt), cache
+// misses come from perf_event_open and are null where the kernel doesn't allow it (e.g. containers)
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "data_structures/dlist.h"
+#include "data_structures/dstr.h"
+#include "data_structures/hashmap.h"
+#include "data_structures/heap.h"
+#include "data_structures/hyperloglog.h"
+#include "data_structures/zset.h"
+#include "utils/common.h"
+
+static uint64_t alloc_cnt = 0;
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    alloc_cnt++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    alloc_cnt++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    alloc_cnt++;
+    return __real_realloc(ptr, size);
+}
+}
+
+// std containers allocate through operator new, send it through the wrapped malloc too
+void* operator new(size_t size) {
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops;
+    uint64_t ns;
+    uint64_t allocs;
+    int64_t cache_misses; // -1 if unavailable
+};
+
+static std::vector<BenchResult> results;
+static const char* filter = NULL;
+static int perf_fd = -1;
+
+static void perf_init() {
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Measures everything between bench_start() and bench_stop(), so setup and teardown stay out
+struct BenchRun {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t start_allocs;
+};
+
+static bool bench_enabled(const char* name) {
+    return !filter || strstr(name, filter);
+}
+
+static BenchRun bench_start(const char* name) {
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return {name, now_ns(), alloc_cnt};
+}
+
+// Benchmarks that others build on always run, only the filtered ones are reported
+static void bench_stop(BenchRun& run, uint64_t ops) {
+    uint64_t ns = now_ns() - run.start_ns;
+    uint64_t allocs = alloc_cnt - run.start_allocs;
+    int64_t misses = -1;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t cnt = 0;
+        if (read(perf_fd, &cnt, sizeof(cnt)) == sizeof(cnt)) {
+            misses = cnt;
+        }
+    }
+    if (bench_enabled(run.name)) {
+        results.push_back({run.name, ops, ns, allocs, misses});
+    }
+}
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t next_rand() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static dstr* make_str(const char* fmt, uint64_t i) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), fmt, (unsigned long long)i);
+    dstr* s = dstr_init(len);
+    dstr_append(&s, buf, len);
+    return s;
+}
+
+static std::vector<dstr*> make_keys(uint64_t n, const char* fmt) {
+    std::vector<dstr*> keys(n);
+    for (uint64_t i = 0; i < n; i++) {
+        keys[i] = make_str(fmt, i);
+    }
+    return keys;
+}
+
+static void free_keys(std::vector<dstr*>& keys) {
+    for (dstr* k : keys) {
+        free(k);
+    }
+}
+
+static HNode probe(dstr* key) {
+    HNode tmp;
+    tmp.key = key;
+    tmp.hcode = str_hash((uint8_t*)key->buf, key->size);
+    return tmp;
+}
+
+static void bench_hashmap(uint64_t n) {
+    std::vector<dstr*> keys = make_keys(n, "key:%012llu");
+    std::vector<dstr*> missing = make_keys(n, "nokey:%012llu");
+    std::vector<HNode> probes(n);
+    std::vector<HNode> miss_probes(n);
+    for (uint64_t i = 0; i < n; i++) {
+        probes[i] = probe(keys[(i * 7919) % n]);
+        miss_probes[i] = probe(missing[i]);
+    }
+
+    // Growing from empty goes through every rehash up to n keys
+    HMap hmap;
+    BenchRun run = bench_start("hm_insert");
+    for (uint64_t i = 0; i < n; i++) {
+        hm_insert(&hmap, new_str_node(keys[i], "value", 5));
+    }
+    bench_stop(run, n);
+
+    if (bench_enabled("hm_lookup_hit")) {
+        run = bench_start("hm_lookup_hit");
+        uint64_t found = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            found += hm_lookup(&hmap, &probes[i]) != NULL;
+        }
+        bench_stop(run, n);
+        assert(found == n);
+    }
+    if (bench_enabled("hm_lookup_miss")) {
+        run = bench_start("hm_lookup_miss");
+        uint64_t found = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            found += hm_lookup(&hmap, &miss_probes[i]) != NULL;
+        }
+        bench_stop(run, n);
+        assert(found == 0);
+    }
+    if (bench_enabled("hm_delete")) {
+        run = bench_start("hm_delete");
+        for (uint64_t i = 0; i < n; i++) {
+            hm_delete(&hmap, &probes[i], true);
+        }
+        bench_stop(run, n);
+    }
+    hm_destroy(&hmap);
+
+    // One past a resize threshold: every lookup checks both tables while the migration is pending
+    uint64_t mid = 8 * 4;
+    while (mid * 2 <= n) {
+        mid *= 2;
+    }
+    mid++;
+    for (uint64_t i = 0; i < mid; i++) {
+        hm_insert(&hmap, new_str_node(keys[i], "value", 5));
+        probes[i] = probe(keys[(i * 7919) % mid]);
+    }
+    if (bench_enabled("hm_lookup_rehashing") && hmap.older.tab) {
+        run = bench_start("hm_lookup_rehashing");
+        for (uint64_t i = 0; i < n; i++) {
+            hm_lookup(&hmap, &probes[i % mid]);
+        }
+        bench_stop(run, n);
+    }
+    hm_destroy(&hmap);
+    free_keys(keys);
+    free_keys(missing);
+}
+
+static void bench_zset(uint64_t n) {
+    std::vector<dstr*> members = make_keys(n, "member:%llu");
+    std::vector<double> scores(n);
+    for (double& s : scores) {
+        s = next_rand() % 1000000;
+    }
+
+    ZSet zset;
+    BenchRun run = bench_start("zset_insert");
+    for (uint64_t i = 0; i < n; i++) {
+        zset_insert(&zset, scores[i], members[i]);
+    }
+    bench_stop(run, n);
+
+    std::vector<ZNode*> found(n);
+    run = bench_start("zset_lower_bound");
+    for (uint64_t i = 0; i < n; i++) {
+        found[i] = zset_lower_bound(&zset, scores[(i * 7919) % n], members[0]);
+    }
+    bench_stop(run, n);
+
+    // Short hops like ZRANGE pagination does
+    if (bench_enabled("zset_offset")) {
+        run = bench_start("zset_offset");
+        uint64_t hits = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            hits += found[i] && zset_offset(found[i], (int32_t)(next_rand() % 21) - 10) != NULL;
+        }
+        bench_stop(run, n);
+    }
+    zset_clear(&zset);
+    free_keys(members);
+}
+
+struct HeapItem {
+    size_t heap_idx;
+};
+
+static void bench_heap(uint64_t n) {
+    if (!bench_enabled("heap_fix")) {
+        return;
+    }
+    std::vector<HeapItem> items(n);
+    std::vector<HeapNode> heap;
+    heap.reserve(n);
+    for (uint64_t i = 0; i < n; i++) {
+        items[i].heap_idx = i;
+        heap.push_back({next_rand() % 1000000, &items[i].heap_idx});
+        heap_fix(heap, i);
+    }
+
+    // TTL updates: a random entry gets a new deadline
+    BenchRun run = bench_start("heap_fix");
+    for (uint64_t i = 0; i < n; i++) {
+        size_t pos = items[next_rand() % n].heap_idx;
+        heap[pos].val = next_rand() % 1000000;
+        heap_fix(heap, pos);
+    }
+    bench_stop(run, n);
+}
+
+static void bench_dstr(uint64_t n) {
+    if (!bench_enabled("dstr_append")) {
+        return;
+    }
+    dstr* s = dstr_init(0);
+    BenchRun run = bench_start("dstr_append");
+    for (uint64_t i = 0; i < n; i++) {
+        dstr_append(&s, "0123456789abcdef", 16);
+    }
+    bench_stop(run, n);
+    free(s);
+}
+
+static void bench_hll(uint64_t n) {
+    std::vector<dstr*> elems = make_keys(n, "element:%llu");
+
+    // Sparse: few elements per hll, so every add stays in the sparse encoding
+    const uint64_t per_sparse = 100;
+    std::vector<dstr*> hlls(n / per_sparse + 1, NULL);
+    for (dstr*& hll : hlls) {
+        hll_init(&hll);
+    }
+    if (bench_enabled("hll_add_sparse")) {
+        BenchRun run = bench_start("hll_add_sparse");
+        for (uint64_t i = 0; i < n; i++) {
+            hll_add(&hlls[i / per_sparse], elems[i]);
+        }
+        bench_stop(run, n);
+    }
+
+    // Adding an element invalidates the cached cardinality, so every count is a full one
+    uint64_t counts = dmin(n / 10, (uint64_t)hlls.size());
+    if (bench_enabled("hll_count_sparse")) {
+        BenchRun run = bench_start("hll_count_sparse");
+        for (uint64_t i = 0; i < counts; i++) {
+            hll_add(&hlls[i], elems[0]);
+            hll_count(hlls[i]);
+        }
+        bench_stop(run, counts);
+    }
+    for (dstr* hll : hlls) {
+        free(hll);
+    }
+
+    dstr* dense = NULL;
+    hll_init(&dense);
+    for (uint64_t i = 0; i < 20000 && i < n; i++) {
+        hll_add(&dense, elems[i]);
+    }
+    if (bench_enabled("hll_add_dense")) {
+        BenchRun run = bench_start("hll_add_dense");
+        for (uint64_t i = 0; i < n; i++) {
+            hll_add(&dense, elems[i]);
+        }
+        bench_stop(run, n);
+    }
+    if (bench_enabled("hll_count_dense")) {
+        counts = dmax(n / 1000, (uint64_t)1);
+        BenchRun run = bench_start("hll_count_dense");
+        for (uint64_t i = 0; i < counts; i++) {
+            hll_add(&dense, elems[next_rand() % n]);
+            hll_count(dense);
+        }
+        bench_stop(run, counts);
+    }
+    free(dense);
+    free_keys(elems);
+}
+
+static void bench_dlist(uint64_t n) {
+    if (!bench_enabled("dlist")) {
+        return;
+    }
+    std::vector<DListNode> nodes(n);
+    DListNode head;
+    dlist_init(&head);
+
+    BenchRun run = bench_start("dlist_insert");
+    for (uint64_t i = 0; i < n; i++) {
+        if (i & 1) {
+            dlist_insert_before(&head, &nodes[i]);
+        }
+        else {
+            dlist_insert_after(&head, &nodes[i]);
+        }
+    }
+    bench_stop(run, n);
+
+    // Moving to the back is what the idle connection list does on every request
+    run = bench_start("dlist_move_to_back");
+    for (uint64_t i = 0; i < n; i++) {
+        DListNode* node = &nodes[next_rand() % n];
+        dlist_deatach(node);
+        dlist_insert_before(&head, node);
+    }
+    bench_stop(run, n);
+
+    run = bench_start("dlist_detach");
+    for (uint64_t i = 0; i < n; i++) {
+        dlist_deatach(&nodes[i]);
+    }
+    bench_stop(run, n);
+    assert(dlist_empty(&head));
+}
+
+static void print_json(uint64_t n) {
+    printf("{\n  \"n\": %llu,\n  \"cache_misses\": %s,\n  \"benchmarks\": [\n", (unsigned long long)n,
+           perf_fd >= 0 ? "true" : "false");
+    for (size_t i = 0; i < results.size(); i++) {
+        BenchResult& r = results[i];
+        printf("    {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, "
+               "\"cache_misses_per_op\": ",
+               r.name.c_str(), (unsigned long long)r.ops, (double)r.ns / r.ops, (double)r.allocs / r.ops);
+        if (r.cache_misses < 0) {
+            printf("null");
+        }
+        else {
+            printf("%.3f", (double)r.cache_misses / r.ops);
+        }
+        printf("}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+    uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+    filter = argc > 2 ? argv[2] : NULL;
+    n = dmax(n, (uint64_t)1000);
+    perf_init();
+
+    bench_hashmap(n);
+    bench_zset(n);
+    bench_heap(n);
+    bench_dstr(n);
+    bench_hll(n);
+    bench_dlist(n);
+    print_json(n);
+    return 0;
+}
@@ -1,10 +1,25 @@
 #include "data_structures/test_avl_tree.cpp"
+#include "data_structures/test_bitmap.cpp"
 #include "data_structures/test_dlist.cpp"
 #include "data_structures/test_dstr.cpp"
 #include "data_structures/test_hashmap.cpp"
 #include "data_structures/test_heap.cpp"
 #include "data_structures/test_hyperloglog.cpp"
+#include "data_structures/test_roaring.cpp"
+#include "data_structures/test_stream.cpp"
 #include "data_structures/test_zset.cpp"
+#include "test_client.cpp"
+#include "test_latency.cpp"
+#include "test_lazyfree.cpp"
+#include "test_logger.cpp"
+#include "test_slowlog.cpp"
+#include "test_tblock.cpp"
+#include "test_script.cpp"
+#include "test_pubsub.cpp"
+#include "test_blocking.cpp"
+#include "test_tracking.cpp"
+#include "test_server.cpp"
+#include "test_threadpool.cpp"
 
 int main() {
     run_all_hll();
@@ -14,4 +29,36 @@ int main() {
     run_all_dlist();
     printf("\n");
     run_all_avl();
+    printf("\n");
+    run_all_hashmap();
+    printf("\n");
+    run_all_bitmap();
+    printf("\n");
+    run_all_roaring();
+    printf("\n");
+    run_all_stream();
+    printf("\n");
+    run_all_threadpool();
+    printf("\n");
+    run_all_lazyfree();
+    printf("\n");
+    run_all_latency();
+    printf("\n");
+    run_all_logger();
+    printf("\n");
+    run_all_slowlog();
+    printf("\n");
+    run_all_client();
+    printf("\n");
+    run_all_tblock();
+    printf("\n");
+    run_all_script();
+    printf("\n");
+    run_all_pubsub();
+    printf("\n");
+    run_all_blocking();
+    printf("\n");
+    run_all_tracking();
+    printf("\n");
+    run_all_server();
 }
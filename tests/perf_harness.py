@@ -0,0 +1,247 @@
+#!/usr/bin/env python3
+"""End-to-end performance regression harness.
+
+Starts redis_server from a build directory, runs a fixed matrix of redis_bench workloads against it and
+records throughput, latency percentiles, RSS and server CPU time per workload. Two result files (e.g.
+from builds of two commits) are then diffed and regressions beyond the noise threshold are flagged.
+
+    cmake -S src -B build-bench -DBENCH=ON && cmake --build build-bench
+    ./tests/perf_harness.py run build-bench -o before.json
+    ... rebuild on the other commit ...
+    ./tests/perf_harness.py run build-bench -o after.json
+    ./tests/perf_harness.py compare before.json after.json
+
+Every repeat of every workload gets a fresh server so the keyspace and RSS of one don't leak into the
+next, the median of the repeats is recorded. compare exits with 1 if something regressed.
+"""
+import argparse
+import json
+import os
+import platform
+import signal
+import socket
+import statistics
+import subprocess
+import sys
+import time
+
+# name, redis_bench arguments, requests (scaled by --scale)
+WORKLOADS = [
+    ("get_set_p1", ["-c", "4", "-P", "1"], 100000),
+    ("get_set_p16", ["-c", "4", "-P", "16"], 500000),
+    ("get_set_50_conns", ["-c", "50", "-P", "1"], 200000),
+    ("set_1k_values", ["-c", "4", "-P", "16", "-d", "1024", "--mix", "set:1"], 200000),
+    ("mixed_zipf", ["-c", "4", "-P", "16", "--dist", "zipf", "--mix", "get:40,set:40,zadd:10,lpush:5,pfadd:5"],
+     500000),
+]
+
+# metric -> True if bigger is better
+METRICS = {
+    "ops_per_sec": True,
+    "p50_us": False,
+    "p99_us": False,
+    "p999_us": False,
+    "cpu_us_per_op": False,
+    "rss_kb": False,
+    "peak_rss_kb": False,
+}
+LATENCY_METRICS = ("p50_us", "p99_us", "p999_us")
+
+CLK_TCK = os.sysconf("SC_CLK_TCK")
+
+
+def proc_cpu_seconds(pid):
+    with open(f"/proc/{pid}/stat") as f:
+        # The command name can hold spaces, the fields after it can't
+        fields = f.read().rsplit(")", 1)[1].split()
+    # utime and stime are fields 14 and 15, the first two are cut off above
+    return (int(fields[11]) + int(fields[12])) / CLK_TCK
+
+
+def proc_rss_kb(pid):
+    rss = peak = 0
+    with open(f"/proc/{pid}/status") as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                rss = int(line.split()[1])
+            elif line.startswith("VmHWM:"):
+                peak = int(line.split()[1])
+    return rss, peak
+
+
+def wait_for_port(port, proc, timeout=10):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            raise RuntimeError(f"redis_server exited with {proc.returncode} before listening")
+        try:
+            with socket.create_connection(("127.0.0.1", port), timeout=0.2):
+                return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError(f"redis_server didn't listen on {port} within {timeout}s")
+
+
+def is_sanitized(path):
+    with open(path, "rb") as f:
+        return b"__asan_init" in f.read()
+
+
+def run_once(server, bench, port, args, requests, seed):
+    with socket.socket() as probe:
+        if probe.connect_ex(("127.0.0.1", port)) == 0:
+            raise RuntimeError(f"something already listens on {port}, pick another --port")
+
+    proc = subprocess.Popen([server, str(port)], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        wait_for_port(port, proc)
+        cpu_before = proc_cpu_seconds(proc.pid)
+        cmd = [bench, "-p", str(port), "-n", str(requests), "--seed", str(seed), "--format", "json"] + args
+        out = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+        if out.returncode:
+            raise RuntimeError(f"{' '.join(cmd)} failed: {out.stderr.strip()}")
+        cpu = proc_cpu_seconds(proc.pid) - cpu_before
+        rss, peak = proc_rss_kb(proc.pid)
+    finally:
+        proc.send_signal(signal.SIGTERM)
+        try:
+            proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+
+    result = json.loads(out.stdout)
+    total = result["commands"]["all"]
+    if total["errors"]:
+        raise RuntimeError(f"{' '.join(cmd)}: {total['errors']} error replies")
+    return {
+        "ops_per_sec": total["ops_per_sec"],
+        "p50_us": total["p50_us"],
+        "p99_us": total["p99_us"],
+        "p999_us": total["p999_us"],
+        "cpu_us_per_op": cpu * 1e6 / requests,
+        "rss_kb": rss,
+        "peak_rss_kb": peak,
+    }
+
+
+def git_commit(path):
+    try:
+        out = subprocess.run(["git", "rev-parse", "--short", "HEAD"], cwd=path, stdout=subprocess.PIPE,
+                             stderr=subprocess.DEVNULL, text=True)
+        return out.stdout.strip() or None
+    except OSError:
+        return None
+
+
+def cmd_run(opts):
+    server = os.path.join(opts.build, "redis_server")
+    bench = os.path.join(opts.build, "redis_bench")
+    for path in (server, bench):
+        if not os.access(path, os.X_OK):
+            sys.exit(f"{path} not found, build with -DBENCH=ON first")
+    if is_sanitized(server) and not opts.allow_sanitized:
+        sys.exit(f"{server} is built with sanitizers, its numbers mean nothing. Configure with -DBENCH=ON "
+                 "(or pass --allow-sanitized)")
+
+    results = {
+        "meta": {
+            "commit": git_commit(os.path.dirname(os.path.abspath(__file__))),
+            "build": os.path.abspath(opts.build),
+            "host": platform.node(),
+            "cpu": platform.processor() or platform.machine(),
+            "nproc": os.cpu_count(),
+            "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+            "repeat": opts.repeat,
+            "scale": opts.scale,
+        },
+        "workloads": {},
+    }
+
+    for name, args, requests in WORKLOADS:
+        if opts.only and name not in opts.only:
+            continue
+        requests = max(1000, int(requests * opts.scale))
+        runs = [run_once(server, bench, opts.port, args, requests, seed=i + 1) for i in range(opts.repeat)]
+        summary = {m: statistics.median(r[m] for r in runs) for m in METRICS}
+        # How far apart the repeats were, compare won't flag differences smaller than this
+        ops = [r["ops_per_sec"] for r in runs]
+        summary["spread_pct"] = 100 * (max(ops) - min(ops)) / summary["ops_per_sec"]
+        summary["args"] = args + ["-n", str(requests)]
+        summary["runs"] = runs
+        results["workloads"][name] = summary
+        print(f"{name:<18} {summary['ops_per_sec']:>10.0f} ops/sec  p99 {summary['p99_us']:>8.1f} us  "
+              f"{summary['cpu_us_per_op']:>6.2f} cpu us/op  rss {int(summary['peak_rss_kb']) // 1024} MB  "
+              f"(spread {summary['spread_pct']:.1f}%)", file=sys.stderr)
+
+    with open(opts.out, "w") as f:
+        json.dump(results, f, indent=2)
+        f.write("\n")
+
+
+def cmd_compare(opts):
+    with open(opts.base) as f:
+        base = json.load(f)
+    with open(opts.new) as f:
+        new = json.load(f)
+
+    regressions = 0
+    print(f"{'workload':<18} {'metric':<14} {'base':>12} {'new':>12} {'change':>9}")
+    for name, b in base["workloads"].items():
+        n = new["workloads"].get(name)
+        if n is None:
+            print(f"{name:<18} missing from {opts.new}")
+            continue
+        noise = max(b.get("spread_pct", 0), n.get("spread_pct", 0))
+        for metric, higher_better in METRICS.items():
+            if not b[metric]:
+                continue
+            change = 100 * (n[metric] - b[metric]) / b[metric]
+            worse = -change if higher_better else change
+            threshold = opts.latency_threshold if metric in LATENCY_METRICS else opts.threshold
+            threshold = max(threshold, noise)
+            flag = ""
+            if worse > threshold:
+                flag = "REGRESSION"
+                regressions += 1
+            elif -worse > threshold:
+                flag = "improved"
+            print(f"{name:<18} {metric:<14} {b[metric]:>12.1f} {n[metric]:>12.1f} {change:>+8.1f}%  {flag}")
+
+    if regressions:
+        print(f"\n{regressions} regression(s) beyond the noise threshold")
+        return 1
+    print("\nno regressions")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    run = sub.add_parser("run", help="benchmark the server of a build directory")
+    run.add_argument("build", help="directory with redis_server and redis_bench")
+    run.add_argument("-o", "--out", default="perf_results.json")
+    run.add_argument("--port", type=int, default=8100)
+    run.add_argument("--repeat", type=int, default=3, help="runs per workload, the median is kept")
+    run.add_argument("--scale", type=float, default=1.0, help="multiplies the request counts")
+    run.add_argument("--only", nargs="*", help="workload names to run")
+    run.add_argument("--allow-sanitized", action="store_true")
+
+    compare = sub.add_parser("compare", help="diff two result files")
+    compare.add_argument("base")
+    compare.add_argument("new")
+    compare.add_argument("--threshold", type=float, default=5.0,
+                         help="percent change flagged for throughput, CPU and RSS")
+    compare.add_argument("--latency-threshold", type=float, default=10.0,
+                         help="percent change flagged for the latency percentiles")
+
+    opts = parser.parse_args()
+    if opts.command == "run":
+        cmd_run(opts)
+        return 0
+    return cmd_compare(opts)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,94 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "blocking.cpp"
+#include "blocking.h"
+
+static dstr* bl_str(const char* s) {
+    dstr* str = dstr_init(strlen(s));
+    dstr_append(&str, s, strlen(s));
+    return str;
+}
+
+static void bl_block(Blocking* b, Conn* conn, std::vector<const char*> names, uint64_t deadline_ms) {
+    std::vector<dstr*> keys;
+    for (const char* name : names) {
+        keys.push_back(bl_str(name));
+    }
+    block_conn(b, conn, keys.data(), keys.size(), deadline_ms);
+    for (dstr* key : keys) {
+        free(key);
+    }
+}
+
+static void test_block_signal() {
+    Blocking b;
+    Conn a, c;
+
+    // Nothing blocked: signals are dropped
+    block_signal(&b, "s", 1);
+    assert(b.ready.empty());
+
+    bl_block(&b, &a, {"s", "t", "s"}, 0);
+    bl_block(&b, &c, {"s"}, 0);
+    assert(a.blocked && a.blocked->keys.size() == 2 && hm_size(&b.keys) == 2);
+    BlockedKey* s = a.blocked->keys[0];
+    assert(s->waiters.size() == 2 && s->waiters[0] == &a && s->waiters[1] == &c);
+    assert(block_find(&b, "s", 1) == s && !block_find(&b, "u", 1));
+
+    // A key is ready once however often it's signaled, and only keys someone waits on
+    block_signal(&b, "s", 1);
+    block_signal(&b, "s", 1);
+    block_signal(&b, "u", 1);
+    assert(b.ready.size() == 1 && b.ready[0] == s && s->ready);
+
+    // While served, the key stays even when its last waiter leaves
+    std::vector<BlockedKey*> ready;
+    block_take_ready(&b, ready);
+    assert(ready.size() == 1 && b.ready.empty() && s->serving && !s->ready);
+    unblock_conn(&b, &a);
+    unblock_conn(&b, &c);
+    assert(!a.blocked && !c.blocked && hm_size(&b.keys) == 1);
+    block_done(&b, s);
+    assert(!hm_size(&b.keys));
+
+    // Unblocking a conn that isn't blocked does nothing
+    unblock_conn(&b, &a);
+    hm_clear(&b.keys);
+}
+
+static void test_block_timeouts() {
+    Blocking b;
+    Conn conns[4];
+    uint64_t deadlines[4] = {300, 0, 100, 200};
+    for (int i = 0; i < 4; i++) {
+        bl_block(&b, &conns[i], {"k"}, deadlines[i]);
+    }
+    assert(b.timeouts.size() == 3); // 0 blocks forever
+
+    assert(!block_expired(&b, 99));
+    assert(block_expired(&b, 100) == &conns[2]);
+
+    // Unblocked before the timeout, it's out of the heap
+    unblock_conn(&b, &conns[3]);
+    assert(b.timeouts.size() == 2);
+    unblock_conn(&b, &conns[2]);
+    assert(!block_expired(&b, 299) && block_expired(&b, 1000) == &conns[0]);
+    unblock_conn(&b, &conns[0]);
+    assert(!block_expired(&b, UINT64_MAX));
+
+    // The conn blocked forever is the last waiter of k
+    assert(hm_size(&b.keys) == 1);
+    unblock_conn(&b, &conns[1]);
+    assert(!hm_size(&b.keys));
+    hm_clear(&b.keys);
+}
+
+int run_all_blocking() {
+    test_block_signal();
+    printf("[blocking]: block_signal() / block_find() / block_take_ready() passed! (1/2)\n");
+    test_block_timeouts();
+    printf("[blocking]: block_expired() passed! (2/2)\n");
+    printf("[blocking]: ALL BLOCKING TESTS PASSED!\n");
+    return 0;
+}
@@ -0,0 +1,184 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "redis_client.cpp"
+#include "redis_client.h"
+
+// Reply frame the way the server builds it: status first, then the values
+static std::vector<uint8_t> cl_frame(uint32_t code, std::vector<uint8_t> values) {
+    std::vector<uint8_t> out;
+    buf_append_u32(out, 10 + values.size());
+    buf_append_u8(out, TAG_ARR);
+    buf_append_u32(out, 2);
+    buf_append_u8(out, TAG_INT);
+    buf_append_u32(out, code);
+    buf_append(out, values.data(), values.size());
+    return out;
+}
+
+static std::vector<uint8_t> cl_str(uint8_t tag, const char* s) {
+    std::vector<uint8_t> out;
+    buf_append_u8(out, tag);
+    buf_append_u32(out, strlen(s));
+    buf_append(out, (const uint8_t*)s, strlen(s));
+    return out;
+}
+
+static void test_parse() {
+    // [str, [int, null, int64, double]]
+    std::vector<uint8_t> vals = cl_str(TAG_STR, "hello");
+    buf_append_u8(vals, TAG_ARR);
+    buf_append_u32(vals, 4);
+    buf_append_u8(vals, TAG_INT);
+    buf_append_u32(vals, (uint32_t)-1);
+    buf_append_u8(vals, TAG_NULL);
+    buf_append_u8(vals, TAG_INT64);
+    buf_append_i64(vals, -5000000000ll);
+    buf_append_u8(vals, TAG_DOUBLE);
+    buf_append_double(vals, 1.5);
+    std::vector<uint8_t> frame = cl_frame(RES_OK, vals);
+
+    ClientReply reply;
+    for (size_t len = 0; len < frame.size(); len++) {
+        assert(client_parse_reply(frame.data(), len, &reply) == 0);
+    }
+    assert(client_parse_reply(frame.data(), frame.size(), &reply) == (int64_t)frame.size());
+    assert(reply.code == RES_OK && reply.values.size() == 2);
+    assert(reply.values[0].tag == TAG_STR && reply.values[0].str == "hello");
+    std::vector<ClientValue>& arr = reply.values[1].arr;
+    assert(reply.values[1].tag == TAG_ARR && arr.size() == 4);
+    assert(arr[0].num == -1 && arr[1].tag == TAG_NULL && arr[2].num == -5000000000ll && arr[3].dbl == 1.5);
+
+    // Status only replies (e.g. SADD) and errors
+    frame = cl_frame(RES_NX, {});
+    assert(client_parse_reply(frame.data(), frame.size(), &reply) == 14);
+    assert(reply.code == RES_NX && reply.values.empty());
+    frame = cl_frame(RES_ERR, cl_str(TAG_ERROR, "bad"));
+    assert(client_parse_reply(frame.data(), frame.size(), &reply) == (int64_t)frame.size());
+    assert(reply.code == RES_ERR && reply.values[0].tag == TAG_ERROR && reply.values[0].str == "bad");
+
+    // Garbage: unknown tag, string longer than the frame, array count past the end
+    frame = cl_frame(RES_OK, {9});
+    assert(client_parse_reply(frame.data(), frame.size(), &reply) == -1);
+    std::vector<uint8_t> str = cl_str(TAG_STR, "abc");
+    str[1] = 200;
+    frame = cl_frame(RES_OK, str);
+    assert(client_parse_reply(frame.data(), frame.size(), &reply) == -1);
+    std::vector<uint8_t> big_arr;
+    buf_append_u8(big_arr, TAG_ARR);
+    buf_append_u32(big_arr, 1000);
+    frame = cl_frame(RES_OK, big_arr);
+    assert(client_parse_reply(frame.data(), frame.size(), &reply) == -1);
+}
+
+struct ClSeen {
+    std::vector<std::string> replies;
+};
+
+static void cl_record(ClientReply* reply, void* arg) {
+    ClSeen* seen = (ClSeen*)arg;
+    seen->replies.push_back(reply->values.empty() ? "" : reply->values[0].str);
+}
+
+// The test plays the server on the other end of a socketpair
+static void cl_pair(ClientConn* c, int* server_fd) {
+    int sv[2];
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    c->fd = sv[0];
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    *server_fd = sv[1];
+}
+
+static void cl_read_all(int fd, uint8_t* buf, size_t n) {
+    while (n) {
+        ssize_t rv = read(fd, buf, n);
+        assert(rv > 0);
+        buf += rv;
+        n -= rv;
+    }
+}
+
+static void test_pipeline() {
+    ClientConn c;
+    int server_fd;
+    cl_pair(&c, &server_fd);
+    ClientConn* conns[] = {&c};
+
+    // Several requests go out in one write, before any reply
+    ClSeen seen;
+    const char* argv[] = {"set", "key", "value"};
+    size_t lens[] = {3, 3, 5};
+    assert(!client_send(&c, argv, lens, 3, &cl_record, &seen));
+    assert(!client_send(&c, argv, lens, 2, &cl_record, &seen));
+    assert(!client_send(&c, argv, lens, 1, &cl_record, &seen));
+    assert(client_poll(conns, 1, 0) == 0 && c.outgoing.empty());
+
+    // What the server receives: [len][arr argc][str len bytes]...
+    size_t expect = (4 + 5 + 3 * 5 + 11) + (4 + 5 + 2 * 5 + 6) + (4 + 5 + 5 + 3);
+    std::vector<uint8_t> got(expect);
+    cl_read_all(server_fd, got.data(), expect);
+    uint32_t len, argc;
+    memcpy(&len, &got[0], 4);
+    memcpy(&argc, &got[5], 4);
+    assert(len == 5 + 3 * 5 + 11 && got[4] == TAG_ARR && argc == 3);
+    assert(got[9] == TAG_STR && !memcmp(&got[14], "set", 3));
+
+    // Replies come back split at awkward places, callbacks still run once each and in order
+    std::vector<uint8_t> replies;
+    const char* names[] = {"first", "second", "third"};
+    for (const char* name : names) {
+        std::vector<uint8_t> frame = cl_frame(RES_OK, cl_str(TAG_STR, name));
+        replies.insert(replies.end(), frame.begin(), frame.end());
+    }
+    size_t cuts[] = {3, 17, 30, replies.size()};
+    size_t from = 0;
+    for (size_t cut : cuts) {
+        assert(write(server_fd, &replies[from], cut - from) == (ssize_t)(cut - from));
+        from = cut;
+        while (client_poll(conns, 1, 10) > 0) {}
+    }
+    assert(seen.replies.size() == 3 && c.pending.empty() && c.incoming.empty());
+    assert(seen.replies[0] == "first" && seen.replies[1] == "second" && seen.replies[2] == "third");
+
+    // A reply nobody asked for breaks the connection
+    std::vector<uint8_t> extra = cl_frame(RES_OK, {});
+    assert(write(server_fd, extra.data(), extra.size()) == (ssize_t)extra.size());
+    assert(client_poll(conns, 1, 1000) == -1 && c.broken);
+    client_close(&c);
+    close(server_fd);
+}
+
+static void test_call() {
+    ClientConn c;
+    int server_fd;
+    cl_pair(&c, &server_fd);
+
+    // The reply is written before the call, client_call() still waits for the request to go out first
+    std::vector<uint8_t> frame = cl_frame(RES_OK, cl_str(TAG_STR, "pong"));
+    assert(write(server_fd, frame.data(), frame.size()) == (ssize_t)frame.size());
+    dstr* arg = dstr_init(4);
+    dstr_append(&arg, "ping", 4);
+    std::vector<dstr*> cmd = {arg};
+    ClientReply reply;
+    assert(!client_call(&c, cmd, &reply));
+    assert(reply.code == RES_OK && reply.values.size() == 1 && reply.values[0].str == "pong");
+
+    // The server going away fails the call
+    close(server_fd);
+    assert(client_call(&c, cmd, &reply) == -1 && c.fd == -1);
+    free(arg);
+}
+
+int run_all_client() {
+    test_parse();
+    printf("[client]: reply parsing passed! (1/3)\n");
+    test_pipeline();
+    printf("[client]: pipelined requests passed! (2/3)\n");
+    test_call();
+    printf("[client]: blocking calls passed! (3/3)\n");
+    printf("[client]: ALL CLIENT TESTS PASSED!\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "latency.cpp"
+#include "latency.h"
+
+static void test_buckets() {
+    // Buckets are contiguous and every value lands in the bucket whose bounds contain it
+    for (uint32_t i = 0; i + 1 < LAT_BUCKETS; i++) {
+        assert(hist_bucket_upper(i) + 1 == hist_bucket_lower(i + 1));
+        assert(hist_bucket(hist_bucket_lower(i)) == i);
+        assert(hist_bucket(hist_bucket_upper(i)) == i);
+    }
+    for (int i = 0; i < 100000; i++) {
+        uint64_t ns = (uint64_t)rand() * rand() % (1ull << LAT_MAX_BITS);
+        uint32_t idx = hist_bucket(ns);
+        assert(hist_bucket_lower(idx) <= ns && ns <= hist_bucket_upper(idx));
+
+        // Relative error is bounded by 1 / LAT_SUB_BUCKETS
+        assert((hist_bucket_upper(idx) - hist_bucket_lower(idx)) * LAT_SUB_BUCKETS <= dmax(ns, (uint64_t)LAT_SUB_BUCKETS));
+    }
+    assert(hist_bucket(UINT64_MAX) == LAT_BUCKETS - 1);
+    assert(hist_bucket(1ull << LAT_MAX_BITS) == LAT_BUCKETS - 1);
+}
+
+static void test_percentiles() {
+    LatencyHist h;
+    assert(hist_percentile(&h, 50) == 0);
+
+    // 1..10000 us, every value once
+    for (uint64_t us = 1; us <= 10000; us++) {
+        hist_record(&h, us * 1000);
+    }
+    assert(h.count == 10000 && h.max_ns == 10000000);
+    assert(h.total_ns == 10000ull * 10001 / 2 * 1000);
+
+    double ps[] = {1, 50, 90, 99, 99.9};
+    for (double p : ps) {
+        uint64_t exact = (uint64_t)(p * 100) * 1000;
+        uint64_t got = hist_percentile(&h, p);
+        assert(got >= exact && got <= exact + exact / LAT_SUB_BUCKETS);
+    }
+    assert(hist_percentile(&h, 100) == h.max_ns);
+    assert(hist_percentile(&h, 0) == hist_bucket_upper(hist_bucket(1000)));
+}
+
+static void test_cmdstats() {
+    cmdstats_record("get", 1000);
+    cmdstats_record("get", 3000);
+    cmdstats_record("set", 2000);
+    cmdstats_record("a_command_name_that_is_way_too_long", 5);
+
+    CmdStats* get = cmdstats_get("get");
+    assert(get && get->hist.count == 2 && get->hist.total_ns == 4000 && get->hist.max_ns == 3000);
+    assert(!cmdstats_get("del"));
+    assert(!cmdstats_get("a_command_name_that_is_way_too_long"));
+
+    std::vector<CmdStats*> all;
+    cmdstats_all(all);
+    assert(all.size() == 2 && !strcmp(all[0]->name, "get") && !strcmp(all[1]->name, "set"));
+
+    cmdstats_reset();
+    all.clear();
+    cmdstats_all(all);
+    assert(all.empty() && cmdstats_get("get")->hist.count == 0);
+
+    // Timestamps are monotonic and the calibrated tick length is sane
+    latency_init();
+    uint64_t start = latency_now();
+    timespec ts = {0, 2000000};
+    nanosleep(&ts, NULL);
+    uint64_t ns = latency_ns(latency_now() - start);
+    assert(ns >= 1000000 && ns < 1000000000);
+}
+
+int run_all_latency() {
+    srand(33);
+    test_buckets();
+    printf("[latency]: hist_bucket() passed! (1/3)\n");
+    test_percentiles();
+    printf("[latency]: hist_percentile() passed! (2/3)\n");
+    test_cmdstats();
+    printf("[latency]: cmdstats passed! (3/3)\n");
+    printf("[latency]: ALL LATENCY TESTS PASSED!\n");
+    return 0;
+}
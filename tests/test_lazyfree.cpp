@@ -0,0 +1,197 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "lazyfree.cpp"
+#include "lazyfree.h"
+#include "roaring.h"
+#include "zset.h"
+
+static dstr* lf_str(const char* s) {
+    dstr* str = dstr_init(strlen(s));
+    dstr_append(&str, s, strlen(s));
+    return str;
+}
+
+static HNode* lf_node(const char* key, uint32_t type) {
+    dstr* k = lf_str(key);
+    HNode* node = new_node(k, type);
+    free(k);
+    return node;
+}
+
+// Fields / members are plain T_STR nodes, the same as HSET and SADD create them
+static void lf_fill_hmap(HMap* hmap, uint32_t n) {
+    char buf[32];
+    for (uint32_t i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "field%u", i);
+        HNode* field = lf_node(buf, T_STR);
+        dstr_append(&field->val, "value", 5);
+        hm_insert(hmap, field);
+    }
+}
+
+static void lf_fill_list(HNode* node, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        DListNode* item = (DListNode*)malloc(sizeof(DListNode));
+        item->prev = node->list.tail;
+        item->next = NULL;
+        item->val = lf_str("item");
+        if (node->list.tail) {
+            node->list.tail->next = item;
+        }
+        else {
+            node->list.head = item;
+        }
+        node->list.tail = item;
+        node->list.size++;
+    }
+}
+
+static void lf_fill_zset(HNode* node, uint32_t n) {
+    char buf[32];
+    for (uint32_t i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "member%u", i);
+        dstr* member = lf_str(buf);
+        zset_insert(node->zset, i, member);
+        free(member);
+    }
+}
+
+static void test_cost() {
+    HNode* str = lf_node("str", T_STR);
+    dstr_append(&str->val, "abc", 3);
+    assert(lazyfree_cost(str) == 1);
+
+    HNode* list = lf_node("list", T_LIST);
+    lf_fill_list(list, 1000);
+    assert(lazyfree_cost(list) == 1000);
+
+    HNode* hset = lf_node("hset", T_HSET);
+    lf_fill_hmap(&hset->hmap, 100);
+    assert(lazyfree_cost(hset) == 100);
+
+    HNode* set = lf_node("set", T_SET);
+    lf_fill_hmap(&set->set, 10);
+    assert(lazyfree_cost(set) == 10);
+
+    HNode* zset = lf_node("zset", T_ZSET);
+    lf_fill_zset(zset, 200);
+    assert(lazyfree_cost(zset) == 200);
+
+    // 1 MB plain bitmap is one allocation but 16 units of unmapping
+    HNode* bitmap = lf_node("bitmap", T_BITMAP);
+    dstr_reserve(&bitmap->bitmap, 1 << 20);
+    bitmap->bitmap->size = 1 << 20;
+    assert(lazyfree_cost(bitmap) == 17);
+
+    HNode* sparse = lf_node("sparse", T_BITMAP);
+    free(sparse->bitmap);
+    sparse->bitmap = NULL;
+    sparse->roaring = roaring_init();
+    for (uint32_t i = 0; i < 100; i++) {
+        roaring_set(sparse->roaring, i * RC_BITS, 1);
+    }
+    assert(lazyfree_cost(sparse) == 100);
+
+    HNode* hll = lf_node("hll", T_HLL);
+    assert(lazyfree_cost(hll) == 1);
+
+    HNode* nodes[] = {str, list, hset, set, zset, bitmap, sparse, hll};
+    for (HNode* node : nodes) {
+        hn_free(node);
+    }
+}
+
+// Rehashing the keyspace used to go through the delete path and wipe nested hashes and zsets
+static void test_rehash_keeps_values() {
+    HMap db;
+    char buf[32];
+    for (uint32_t i = 0; i < 300; i++) {
+        snprintf(buf, sizeof(buf), "key%u", i);
+        HNode* node = lf_node(buf, i % 2 ? T_HSET : T_ZSET);
+        if (i % 2) {
+            lf_fill_hmap(&node->hmap, 3);
+        }
+        else {
+            lf_fill_zset(node, 3);
+        }
+        hm_insert(&db, node);
+    }
+    assert(hm_size(&db) == 300);
+
+    for (uint32_t i = 0; i < 300; i++) {
+        snprintf(buf, sizeof(buf), "key%u", i);
+        HNode tmp;
+        tmp.key = lf_str(buf);
+        tmp.hcode = str_hash((uint8_t*)tmp.key->buf, tmp.key->size);
+        HNode* node = hm_lookup(&db, &tmp);
+        assert(node);
+        assert(hm_size(i % 2 ? &node->hmap : &node->zset->hmap) == 3);
+
+        // Deleting a key frees the whole value
+        if (i % 3 == 0) {
+            assert(hm_delete(&db, &tmp, true) == 1);
+            assert(hm_delete(&db, &tmp, true) == 0);
+        }
+        free(tmp.key);
+    }
+    assert(hm_size(&db) == 200);
+    hm_destroy(&db);
+    assert(hm_size(&db) == 0 && !db.newer.tab && !db.older.tab);
+}
+
+static void test_lazyfree_node() {
+    lazyfree_init();
+
+    // Big values go to the reclaimer, small ones are freed inline
+    for (uint32_t i = 0; i < 20; i++) {
+        HNode* list = lf_node("list", T_LIST);
+        lf_fill_list(list, i % 2 ? 10 : 5000);
+        lazyfree_node(list);
+
+        HNode* hset = lf_node("hset", T_HSET);
+        lf_fill_hmap(&hset->hmap, i % 2 ? 10 : 2000);
+        lazyfree_node(hset);
+
+        HNode* zset = lf_node("zset", T_ZSET);
+        lf_fill_zset(zset, i % 2 ? 10 : 1000);
+        lazyfree_node(zset);
+    }
+    assert(lazyfree_pending() <= 30);
+
+    HMap db;
+    char buf[32];
+    for (uint32_t i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "key%u", i);
+        HNode* node = lf_node(buf, T_SET);
+        lf_fill_hmap(&node->set, 5);
+        hm_insert(&db, node);
+    }
+    lazyfree_hmap(&db);
+    assert(hm_size(&db) == 0 && !db.newer.tab && !db.older.tab);
+
+    // The emptied map is usable right away
+    lf_fill_hmap(&db, 10);
+    assert(hm_size(&db) == 10);
+    hm_destroy(&db);
+
+    lazyfree_shutdown();
+    assert(lazyfree_pending() == 0);
+
+    // After shutdown everything is freed inline
+    HNode* list = lf_node("list", T_LIST);
+    lf_fill_list(list, 5000);
+    lazyfree_node(list);
+    assert(lazyfree_pending() == 0);
+}
+
+int run_all_lazyfree() {
+    test_cost();
+    printf("[lazyfree]: lazyfree_cost() passed! (1/3)\n");
+    test_rehash_keeps_values();
+    printf("[lazyfree]: rehash keeps nested values passed! (2/3)\n");
+    test_lazyfree_node();
+    printf("[lazyfree]: lazyfree_node() / lazyfree_hmap() passed! (3/3)\n");
+    printf("[lazyfree]: ALL LAZYFREE TESTS PASSED!\n");
+    return 0;
+}
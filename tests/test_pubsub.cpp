@@ -0,0 +1,212 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "pubsub.cpp"
+#include "pubsub.h"
+
+static dstr* ps_str(const char* s) {
+    dstr* str = dstr_init(strlen(s));
+    dstr_append(&str, s, strlen(s));
+    return str;
+}
+
+static size_t ps_publish(PubSub* ps, const char* channel, const char* message) {
+    dstr* ch = ps_str(channel);
+    dstr* msg = ps_str(message);
+    size_t n = pubsub_publish(ps, ch, msg);
+    free(ch);
+    free(msg);
+    return n;
+}
+
+static size_t ps_sub(PubSub* ps, Conn* conn, const char* name, bool pattern) {
+    dstr* str = ps_str(name);
+    size_t n = pubsub_subscribe(ps, conn, str, pattern);
+    free(str);
+    return n;
+}
+
+static size_t ps_unsub(PubSub* ps, Conn* conn, const char* name, bool pattern) {
+    dstr* str = ps_str(name);
+    size_t n = pubsub_unsubscribe(ps, conn, str, pattern);
+    free(str);
+    return n;
+}
+
+static void test_subscribe() {
+    PubSub ps;
+    Conn a, b;
+    assert(ps_sub(&ps, &a, "news", false) == 1);
+    assert(ps_sub(&ps, &a, "news", false) == 1);
+    assert(ps_sub(&ps, &a, "news", true) == 2); // a pattern is another topic
+    assert(ps_sub(&ps, &b, "news", false) == 1);
+    assert(pubsub_size(&ps) == 2);
+    Topic* news = a.subscriptions[0]->topic;
+    assert(news->subs.size() == 2 && news->subs[1]->conn == &b);
+
+    // The last subscriber moves into the freed slot
+    assert(ps_unsub(&ps, &a, "news", false) == 1);
+    assert(news->subs.size() == 1 && news->subs[0]->conn == &b && news->subs[0]->idx == 0);
+    assert(ps_unsub(&ps, &a, "other", false) == 1);
+
+    pubsub_unsubscribe_all(&ps, &a);
+    pubsub_unsubscribe_all(&ps, &b);
+    assert(!pubsub_size(&ps) && a.subscriptions.empty());
+    assert(ps.pattern_root.kids.empty() && ps.pattern_root.topics.empty());
+    hm_clear(&ps.channels);
+    hm_clear(&ps.patterns);
+}
+
+static void test_publish() {
+    PubSub ps;
+    Conn a, b, c;
+    ps_sub(&ps, &a, "news.tech", false);
+    ps_sub(&ps, &b, "news.tech", false);
+    ps_sub(&ps, &c, "news.*", true);
+
+    // Every channel subscriber gets the same frame, the pattern subscriber its own
+    out_str(&a, "reply", 5);
+    assert(ps_publish(&ps, "news.tech", "hello") == 3);
+    assert(a.out_chunks.size() == 1 && b.out_chunks.size() == 1 && c.out_chunks.size() == 1);
+    SharedBuf* buf = a.out_chunks[0].buf;
+    assert(buf == b.out_chunks[0].buf && buf->refs == 2 && c.out_chunks[0].buf->refs == 1);
+    assert(a.out_chunks[0].at == a.outgoing.size() && b.out_chunks[0].at == 0);
+
+    ClientReply reply;
+    assert(client_parse_reply(buf->data, buf->len, &reply) == buf->len && reply.code == RES_PUSH);
+    assert(reply.values.size() == 3 && reply.values[0].str == "message" && reply.values[2].str == "hello");
+    SharedBuf* pbuf = c.out_chunks[0].buf;
+    assert(client_parse_reply(pbuf->data, pbuf->len, &reply) == pbuf->len && reply.values.size() == 4);
+    assert(reply.values[0].str == "pmessage" && reply.values[1].str == "news.*" && reply.values[2].str == "news.tech");
+
+    assert(ps_publish(&ps, "news", "x") == 0);
+    assert(ps_publish(&ps, "news.sport", "x") == 1 && c.out_chunks.size() == 2);
+
+    // Dropping the output releases the references
+    out_clear(&a);
+    assert(buf->refs == 1 && a.out_chunks.empty() && a.out_base == 10);
+    out_clear(&b);
+    out_clear(&c);
+    pubsub_unsubscribe_all(&ps, &a);
+    pubsub_unsubscribe_all(&ps, &b);
+    pubsub_unsubscribe_all(&ps, &c);
+    hm_clear(&ps.channels);
+    hm_clear(&ps.patterns);
+}
+
+static void test_patterns() {
+    PubSub ps;
+    const char* patterns[] = {"*", "n*", "news.*", "news.t?ch", "news.[st]*", "news\\.tech", "sport.*", "news.tech"};
+    const size_t n = sizeof(patterns) / sizeof(patterns[0]);
+    Conn conns[n];
+    for (size_t i = 0; i < n; i++) {
+        ps_sub(&ps, &conns[i], patterns[i], true);
+    }
+
+    // news\.tech is indexed under "news" and matches, sport.* is never looked at
+    assert(ps_publish(&ps, "news.tech", "m") == 7);
+    assert(conns[6].out_chunks.empty());
+    assert(ps_publish(&ps, "news.sport", "m") == 4);
+    assert(ps_publish(&ps, "sport.x", "m") == 2);
+    assert(ps_publish(&ps, "", "m") == 1);
+
+    // Freeing patterns prunes their trie nodes, shared prefixes stay
+    pubsub_unsubscribe_all(&ps, &conns[7]);
+    assert(ps_publish(&ps, "news.tech", "m") == 6);
+    pubsub_unsubscribe_all(&ps, &conns[6]);
+    PatternNode* s = pattern_kid(&ps.pattern_root, 's');
+    assert(!s && pattern_kid(&ps.pattern_root, 'n'));
+    for (size_t i = 0; i < n; i++) {
+        out_clear(&conns[i]);
+        pubsub_unsubscribe_all(&ps, &conns[i]);
+    }
+    assert(ps.pattern_root.kids.empty() && !pubsub_size(&ps));
+    hm_clear(&ps.channels);
+    hm_clear(&ps.patterns);
+}
+
+static void test_reply_values() {
+    PubSub ps;
+    Conn a;
+    ps_sub(&ps, &a, "news", false);
+    dstr* key = ps_str("big");
+    std::string val(HN_SHARED_VAL_MIN, 'v');
+    HNode* node = new_str_node(key, val.data(), val.size());
+    free(key);
+
+    // Inside a reply a long value is referenced, a message published meanwhile goes before the reply
+    a.fd = 0;
+    out_str(&a, "x", 1);
+    size_t start = a.outgoing.size();
+    a.reply_at = start;
+    out_int(&a, RES_OK);
+    out_hn_str(&a, node);
+    out_int(&a, 7);
+    assert(ps_publish(&ps, "news", "hello") == 1);
+    a.reply_at = UINT64_MAX;
+    SharedBuf* buf = hn_shared_val(node);
+    assert(a.outgoing.size() == start + 15 && a.out_chunks.size() == 2 && buf->refs == 2);
+    assert(a.out_chunks[0].at == start && a.out_chunks[1].buf == buf && a.out_chunks[1].at == start + 10);
+    assert(out_reply_len(&a, start) == 15 + val.size());
+    assert(out_pending_bytes(&a) == a.outgoing.size() + a.out_chunks[0].buf->len + val.size());
+
+    // Replies that are read back from outgoing (scripts, EXEC) get a copy
+    a.in_multi = true;
+    out_hn_str(&a, node);
+    a.in_multi = false;
+    assert(a.outgoing.size() == start + 20 + val.size() && a.out_chunks.size() == 2);
+
+    // Dropping the end of the reply drops the values it references, not the earlier message
+    out_truncate(&a, start);
+    assert(a.out_chunks.size() == 1 && buf->refs == 1 && a.outgoing.size() == start);
+    a.fd = -1;
+    out_clear(&a);
+    hn_free(node);
+    pubsub_unsubscribe_all(&ps, &a);
+    hm_clear(&ps.channels);
+    hm_clear(&ps.patterns);
+}
+
+static void test_out_limits() {
+    PubSub ps;
+    Conn a;
+    ps_sub(&ps, &a, "news", false);
+    OutLimit limit = {150, 80, 1000}; // a message frame is 60 bytes
+    std::string msg(20, 'm');
+
+    // Over the soft limit the clock starts, back under it stops
+    assert(ps_publish(&ps, "news", msg.c_str()) == 1 && out_pending_bytes(&a) == 60);
+    assert(!out_over_limit(&a, &limit, 10) && a.out_soft_since_ms == UINT64_MAX);
+    ps_publish(&ps, "news", msg.c_str());
+    assert(out_pending_bytes(&a) == 120 && !out_over_limit(&a, &limit, 20) && a.out_soft_since_ms == 20);
+    assert(!out_over_limit(&a, &limit, 1019) && out_over_limit(&a, &limit, 1020));
+    out_clear(&a);
+    assert(!out_over_limit(&a, &limit, 1030) && a.out_soft_since_ms == UINT64_MAX);
+
+    // The hard limit closes right away, 0 is no limit
+    for (int i = 0; i < 3; i++) {
+        ps_publish(&ps, "news", msg.c_str());
+    }
+    assert(out_pending_bytes(&a) == 180 && out_over_limit(&a, &limit, 2000));
+    OutLimit none = {0, 0, 0};
+    assert(!out_over_limit(&a, &none, 2000));
+    out_clear(&a);
+    pubsub_unsubscribe_all(&ps, &a);
+    hm_clear(&ps.channels);
+    hm_clear(&ps.patterns);
+}
+
+int run_all_pubsub() {
+    test_subscribe();
+    printf("[pubsub]: subscriptions passed! (1/5)\n");
+    test_publish();
+    printf("[pubsub]: shared message frames passed! (2/5)\n");
+    test_patterns();
+    printf("[pubsub]: pattern index passed! (3/5)\n");
+    test_reply_values();
+    printf("[pubsub]: long values in replies passed! (4/5)\n");
+    test_out_limits();
+    printf("[pubsub]: out_over_limit() passed! (5/5)\n");
+    printf("[pubsub]: ALL PUBSUB TESTS PASSED!\n");
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "script.cpp"
+#include "script.h"
+
+static dstr* sc_str(const char* s) {
+    dstr* str = dstr_init(strlen(s));
+    dstr_append(&str, s, strlen(s));
+    return str;
+}
+
+// Stands in for the server: "fail" replies an error, "count" the number of arguments, anything
+// else its arguments joined with spaces
+static void sc_call(std::vector<dstr*>& cmd, std::vector<uint8_t>& out, void* arg) {
+    (*(int*)arg)++;
+    std::vector<uint8_t> vals;
+    uint32_t code = RES_OK;
+    if (!strcmp(cmd[0]->buf, "fail")) {
+        code = RES_ERR;
+        buf_append_u8(vals, TAG_ERROR);
+        buf_append_u32(vals, 4);
+        buf_append(vals, (const uint8_t*)"boom", 4);
+    }
+    else if (!strcmp(cmd[0]->buf, "count")) {
+        buf_append_u8(vals, TAG_INT64);
+        buf_append_i64(vals, cmd.size() - 1);
+    }
+    else {
+        std::string joined;
+        for (dstr* part : cmd) {
+            joined += (joined.empty() ? "" : " ") + std::string(part->buf, part->size);
+        }
+        buf_append_u8(vals, TAG_STR);
+        buf_append_u32(vals, joined.size());
+        buf_append(vals, (const uint8_t*)joined.data(), joined.size());
+    }
+    buf_append_u32(out, 10 + vals.size());
+    buf_append_u8(out, TAG_ARR);
+    buf_append_u32(out, 2);
+    buf_append_u8(out, TAG_INT);
+    buf_append_u32(out, code);
+    buf_append(out, vals.data(), vals.size());
+}
+
+// Compiles and runs src with KEYS = {"k1", "k2"} and ARGV = {"5", "x"}, false if either failed
+static bool sc_run(const char* src, ScriptValue* res, std::string& err, int* calls = NULL) {
+    int count = 0;
+    Script* script = script_compile(src, strlen(src), err);
+    if (!script) {
+        return false;
+    }
+    std::vector<dstr*> keys = {sc_str("k1"), sc_str("k2")};
+    std::vector<dstr*> argv = {sc_str("5"), sc_str("x")};
+    bool ok = script_run(script, keys, argv, &sc_call, &count, res, err);
+    for (dstr* s : keys) {
+        free(s);
+    }
+    for (dstr* s : argv) {
+        free(s);
+    }
+    script_free(script);
+    if (calls) {
+        *calls = count;
+    }
+    return ok;
+}
+
+static bool sc_int(const char* src, int64_t expect) {
+    ScriptValue res;
+    std::string err;
+    return sc_run(src, &res, err) && res.type == SV_INT && res.num == expect;
+}
+
+static bool sc_string(const char* src, const char* expect) {
+    ScriptValue res;
+    std::string err;
+    return sc_run(src, &res, err) && res.type == SV_STR && res.str == expect;
+}
+
+static void test_expressions() {
+    assert(sc_int("return 1 + 2 * 3 - 4", 3));
+    assert(sc_int("return (1 + 2) * 3", 9));
+    assert(sc_int("return -7 % 3", 2));
+    assert(sc_int("return 7 % -3", -2));
+    assert(sc_int("return #KEYS + #ARGV[2]", 3));
+    assert(sc_int("return tonumber(ARGV[1]) * 2", 10));
+    assert(sc_int("return ARGV[1] + 1", 6)); // numeric strings coerce
+    assert(sc_int("return 9223372036854775807 + 0", INT64_MAX));
+    assert(sc_string("return KEYS[1] .. ':' .. 10 .. ARGV[2]", "k1:10x"));
+    assert(sc_string("return tostring(1 < 2) .. tostring(nil)", "truenil"));
+    assert(sc_string("return nil or false or 'third'", "third"));
+    assert(sc_int("return 1 and 2", 2));
+
+    ScriptValue res;
+    std::string err;
+    assert(sc_run("return 7 / 2", &res, err) && res.type == SV_DOUBLE && res.dbl == 3.5);
+    assert(sc_run("return 9223372036854775807 + 1", &res, err) && res.type == SV_DOUBLE);
+    assert(sc_run("return KEYS[3]", &res, err) && res.type == SV_NIL);
+    assert(sc_run("return 'a' == 'a' and 1 == 1.0 and not (1 == '1')", &res, err));
+    assert(res.type == SV_BOOL && res.num == 1);
+    assert(sc_run("return {1, {'a'}, nil}", &res, err) && res.type == SV_ARR && res.arr.size() == 3);
+    assert(res.arr[1].type == SV_ARR && res.arr[1].arr[0].str == "a" && res.arr[2].type == SV_NIL);
+    assert(sc_run("-- nothing returned", &res, err) && res.type == SV_NIL);
+}
+
+static void test_statements() {
+    assert(sc_int("local x = 1 if x == 1 then x = 10 elseif x == 2 then x = 20 else x = 30 end return x", 10));
+    assert(sc_int("local x = 3 if x == 1 then x = 10 elseif x == 2 then x = 20 else x = 30 end return x", 30));
+    assert(sc_int("local s = 0 for i = 1, 10 do s = s + i end return s", 55));
+    assert(sc_int("local s = 0 for i = 10, 1, -2 do s = s + i end return s", 30));
+    assert(sc_int("local n = 0 while true do n = n + 1 if n == 7 then break end end return n", 7));
+    assert(sc_int("local t = {} for i = 1, 5 do t[#t + 1] = i * i end t[1] = 100 return t[1] + t[5]", 125));
+    assert(sc_int("local x = 1 do local x = 2 end return x", 1) == false); // no do-blocks
+    assert(sc_int("local x = 1 if true then local x = 2 end return x", 1)); // block scope
+    assert(sc_int("local x = 5 local x = x + 1 return x", 6));
+
+    // Arrays are values: the copy doesn't see later appends
+    assert(sc_int("local a = {1} local b = a a[2] = 2 return #b", 1));
+}
+
+static void test_calls() {
+    ScriptValue res;
+    std::string err;
+    int calls = 0;
+    assert(sc_run("return redis.call('echo', KEYS[1], 42, 1.5)", &res, err, &calls));
+    assert(res.type == SV_STR && res.str == "echo k1 42 1.5" && calls == 1);
+    assert(sc_int("return redis.call('count', 'a', 'b', 'c')", 3));
+
+    // call() stops the script at an error reply, pcall() returns it
+    assert(!sc_run("redis.call('fail') return 1", &res, err) && err == "line 1: boom");
+    assert(sc_run("local e = redis.pcall('fail') return e", &res, err));
+    assert(res.type == SV_ERR && res.str == "boom");
+    assert(!sc_run("return redis.call('echo', {})", &res, err, &calls) && calls == 0);
+    assert(!sc_run("return redis.call()", &res, err));
+}
+
+static void test_errors() {
+    ScriptValue res;
+    std::string err;
+    assert(!sc_run("return y", &res, err) && err.find("unknown variable 'y'") != std::string::npos);
+    assert(!sc_run("local x = ", &res, err) && err == "line 1: unexpected symbol");
+    assert(!sc_run("if true then\nreturn 1", &res, err) && err == "line 2: 'end' expected");
+    assert(!sc_run("return 'abc", &res, err) && err == "line 1: unfinished string");
+    assert(!sc_run("break", &res, err) && err == "line 1: break outside a loop");
+    assert(!sc_run("return redis.get('x')", &res, err));
+
+    // Nesting is limited instead of overflowing the compiler's stack
+    std::string deep = "return " + std::string(200000, '(') + "1" + std::string(200000, ')');
+    assert(!sc_run(deep.c_str(), &res, err) && err == "line 1: expression or block nested too deep");
+    std::string nots = "return ";
+    for (int i = 0; i < 200000; i++) {
+        nots += "not ";
+    }
+    assert(!sc_run((nots + "1").c_str(), &res, err) && err == "line 1: expression or block nested too deep");
+    std::string ifs;
+    for (int i = 0; i < 10000; i++) {
+        ifs += "if true then ";
+    }
+    assert(!sc_run(ifs.c_str(), &res, err) && err == "line 1: expression or block nested too deep");
+    std::string ok = "return " + std::string(50, '(') + "1" + std::string(50, ')');
+    assert(sc_run(ok.c_str(), &res, err) && res.type == SV_INT && res.num == 1);
+
+    // Runtime errors name the line
+    assert(!sc_run("local x = 1\nreturn x + {}", &res, err) && err == "line 2: attempt to perform arithmetic on a array value");
+    assert(!sc_run("return 1 < 'a'", &res, err) && err == "line 1: attempt to compare number with string");
+    assert(!sc_run("return 1 % 0", &res, err));
+    assert(!sc_run("local t = {} t[3] = 1", &res, err));
+    assert(!sc_run("while true do end", &res, err) && err == "script exceeded the instruction limit");
+}
+
+static void test_cache() {
+    // The SHA-1 test vectors
+    char sha[41];
+    sha1_hex("abc", 3, sha);
+    assert(!strcmp(sha, "a9993e364706816aba3e25717850c26c9cd0d89d"));
+    const char* two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    sha1_hex(two_blocks, strlen(two_blocks), sha);
+    assert(!strcmp(sha, "84983e441c3bd26ebaae4aa1f95129e5e54670f1"));
+
+    std::string err;
+    const char* src = "return 1";
+    Script* script = script_cache_load(src, strlen(src), sha, err);
+    assert(script && script_cache_size() == 1);
+    assert(script_cache_load(src, strlen(src), sha, err) == script && script_cache_size() == 1);
+    assert(script_cache_get(sha, 40) == script);
+
+    // Lookups ignore the case of the digest
+    char upper[41];
+    for (int i = 0; i <= 40; i++) {
+        upper[i] = toupper(sha[i]);
+    }
+    assert(script_cache_get(upper, 40) == script);
+    assert(!script_cache_get(sha, 39));
+    assert(!script_cache_load("return (", 8, sha, err) && script_cache_size() == 1);
+
+    script_cache_flush();
+    assert(!script_cache_size() && !script_cache_get(upper, 40));
+}
+
+int run_all_script() {
+    test_expressions();
+    printf("[script]: expressions passed! (1/5)\n");
+    test_statements();
+    printf("[script]: statements passed! (2/5)\n");
+    test_calls();
+    printf("[script]: redis.call passed! (3/5)\n");
+    test_errors();
+    printf("[script]: errors passed! (4/5)\n");
+    test_cache();
+    printf("[script]: script cache passed! (5/5)\n");
+    printf("[script]: ALL SCRIPT TESTS PASSED!\n");
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+// The command table and its dispatch are static in server.cpp, main() is renamed so the file can be
+// built into the tests
+#define main server_main
+#include "server.cpp"
+#undef main
+
+// Runs cmd the way try_one_req() does and returns the error message of the reply, "" if there is none
+static std::string sv_run(std::vector<std::string> args) {
+    std::vector<dstr*> cmd;
+    for (std::string& arg : args) {
+        dstr* str = dstr_init(arg.size());
+        dstr_append(&str, arg.data(), arg.size());
+        cmd.push_back(str);
+    }
+
+    Conn conn;
+    uint32_t header_pos = 0;
+    before_res_build(conn.outgoing, header_pos);
+    out_buffer(&conn, cmd);
+    for (dstr* arg : cmd) {
+        free(arg);
+    }
+
+    ClientReply reply;
+    after_res_build(&conn, header_pos);
+    assert(client_parse_reply(conn.outgoing.data(), conn.outgoing.size(), &reply) == conn.outgoing.size());
+    return reply.code == RES_ERR ? reply.values[0].str : "";
+}
+
+static void test_arity() {
+    // Every command with one argument too few, and one too many where there is a maximum. The
+    // arguments are never read, the table check comes first
+    for (const CmdSpec& spec : commands) {
+        std::vector<std::string> args = {spec.name};
+        while ((int)args.size() < spec.min_args - 1) {
+            args.push_back("1");
+        }
+        if (spec.min_args > 1) {
+            assert(sv_run(args) == "wrong number of arguments");
+        }
+        if (spec.max_args != -1) {
+            while ((int)args.size() <= spec.max_args) {
+                args.push_back("1");
+            }
+            assert(sv_run(args) == "wrong number of arguments");
+        }
+    }
+
+    // The ones that read past cmd before they were given real minimums
+    assert(sv_run({"sadd", "k"}) == "wrong number of arguments");
+    assert(sv_run({"setbit", "k"}) == "wrong number of arguments");
+    assert(sv_run({"getbit", "k"}) == "wrong number of arguments");
+    assert(sv_run({"bitcount"}) == "wrong number of arguments");
+    assert(sv_run({"zquery", "k", "1"}) == "wrong number of arguments");
+}
+
+int run_all_server() {
+    test_arity();
+    printf("[server]: command arity passed! (1/1)\n");
+    printf("[server]: ALL SERVER TESTS PASSED!\n");
+    return 0;
+}
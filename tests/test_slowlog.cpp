@@ -0,0 +1,124 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "slowlog.cpp"
+#include "slowlog.h"
+
+static std::vector<dstr*> sl_cmd(uint32_t argc, size_t arg_len) {
+    std::vector<dstr*> cmd;
+    for (uint32_t i = 0; i < argc; i++) {
+        dstr* arg = dstr_init(arg_len);
+        for (size_t j = 0; j < arg_len; j++) {
+            dstr_append(&arg, "abcdefghij" + (i + j) % 10, 1);
+        }
+        cmd.push_back(arg);
+    }
+    return cmd;
+}
+
+static void sl_free(std::vector<dstr*>& cmd) {
+    for (dstr* arg : cmd) {
+        free(arg);
+    }
+}
+
+static void test_threshold() {
+    std::vector<dstr*> cmd = sl_cmd(3, 5);
+    slowlog_set_threshold(100);
+    assert(!slowlog_record(7, cmd, 99));
+    assert(slowlog_record(7, cmd, 100));
+    assert(slowlog_len() == 1);
+
+    // Negative disables, 0 logs everything
+    slowlog_set_threshold(-1);
+    assert(!slowlog_record(7, cmd, 1000000));
+    slowlog_set_threshold(0);
+    assert(slowlog_record(8, cmd, 0));
+    assert(slowlog_len() == 2);
+
+    std::vector<SlowlogEntry*> got;
+    slowlog_get(got, 10);
+    assert(got.size() == 2);
+    assert(got[0]->id == 1 && got[0]->fd == 8 && got[0]->duration_us == 0);
+    assert(got[1]->id == 0 && got[1]->fd == 7 && got[1]->duration_us == 100);
+    assert(got[1]->argc == 3 && got[1]->stored == 3);
+    for (uint32_t i = 0; i < 3; i++) {
+        assert(got[1]->arg_size[i] == 5 && !memcmp(got[1]->argv[i], cmd[i]->buf, 5));
+    }
+    assert(got[1]->timestamp > 0);
+
+    slowlog_reset();
+    assert(slowlog_len() == 0);
+    got.clear();
+    slowlog_get(got, 10);
+    assert(got.empty());
+    sl_free(cmd);
+}
+
+static void test_truncation() {
+    slowlog_set_threshold(0);
+    std::vector<dstr*> cmd = sl_cmd(SLOWLOG_MAX_ARGC + 10, SLOWLOG_MAX_ARG_LEN + 50);
+    assert(slowlog_record(1, cmd, 5));
+
+    std::vector<SlowlogEntry*> got;
+    slowlog_get(got, 1);
+    assert(got.size() == 1);
+    SlowlogEntry* entry = got[0];
+    assert(entry->argc == SLOWLOG_MAX_ARGC + 10 && entry->stored == SLOWLOG_MAX_ARGC - 1);
+    for (uint32_t i = 0; i < entry->stored; i++) {
+        assert(entry->arg_size[i] == SLOWLOG_MAX_ARG_LEN + 50);
+        assert(!memcmp(entry->argv[i], cmd[i]->buf, SLOWLOG_MAX_ARG_LEN));
+    }
+
+    // Exactly SLOWLOG_MAX_ARGC args all fit
+    sl_free(cmd);
+    cmd = sl_cmd(SLOWLOG_MAX_ARGC, 1);
+    slowlog_record(1, cmd, 5);
+    got.clear();
+    slowlog_get(got, 1);
+    assert(got[0]->argc == SLOWLOG_MAX_ARGC && got[0]->stored == SLOWLOG_MAX_ARGC);
+    sl_free(cmd);
+    slowlog_reset();
+}
+
+static void test_wraparound() {
+    slowlog_set_threshold(0);
+    std::vector<dstr*> cmd = sl_cmd(1, 3);
+    uint64_t first_id = 0;
+    for (uint32_t i = 0; i < SLOWLOG_LEN * 3 + 5; i++) {
+        slowlog_record(i, cmd, i);
+        if (i == 0) {
+            std::vector<SlowlogEntry*> got;
+            slowlog_get(got, 1);
+            first_id = got[0]->id;
+        }
+    }
+    assert(slowlog_len() == SLOWLOG_LEN);
+
+    // Only the newest SLOWLOG_LEN are kept, newest first
+    std::vector<SlowlogEntry*> got;
+    slowlog_get(got, SLOWLOG_LEN * 10);
+    assert(got.size() == SLOWLOG_LEN);
+    for (uint32_t i = 0; i < SLOWLOG_LEN; i++) {
+        uint32_t nth = SLOWLOG_LEN * 3 + 4 - i;
+        assert(got[i]->id == first_id + nth && got[i]->fd == (int)nth && got[i]->duration_us == nth);
+    }
+    got.clear();
+    slowlog_get(got, 3);
+    assert(got.size() == 3);
+
+    sl_free(cmd);
+    slowlog_reset();
+    slowlog_set_threshold(SLOWLOG_DEFAULT_THRESHOLD_US);
+}
+
+int run_all_slowlog() {
+    test_threshold();
+    printf("[slowlog]: threshold passed! (1/3)\n");
+    test_truncation();
+    printf("[slowlog]: argument truncation passed! (2/3)\n");
+    test_wraparound();
+    printf("[slowlog]: circular buffer passed! (3/3)\n");
+    printf("[slowlog]: ALL SLOWLOG TESTS PASSED!\n");
+    return 0;
+}
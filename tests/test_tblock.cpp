@@ -0,0 +1,160 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "tblock.cpp"
+#include "tblock.h"
+
+static dstr* tb_str(const char* s) {
+    dstr* str = dstr_init(strlen(s));
+    dstr_append(&str, s, strlen(s));
+    return str;
+}
+
+static uint8_t tb_nop(Conn*, std::vector<dstr*>&) {
+    return 0;
+}
+
+static void test_queue() {
+    static const CmdSpec spec = {"set", 3, 3, tb_nop, CMD_WRITE, 1, 0};
+    Conn conn;
+    tb_begin(&conn);
+    assert(conn.in_multi && conn.tb && conn.tb->alive);
+
+    // The queue takes the arguments, the caller's vector is left empty
+    std::vector<dstr*> cmd = {tb_str("set"), tb_str("key"), tb_str("value")};
+    tb_queue(&conn, &spec, cmd);
+    assert(cmd.empty());
+    cmd = {tb_str("set"), tb_str("other"), tb_str("value")};
+    tb_queue(&conn, &spec, cmd);
+    assert(conn.tb->commands.size() == 2 && conn.tb->commands[1].spec == &spec);
+    assert(!strcmp(conn.tb->commands[1].argv[1]->buf, "other"));
+
+    tb_end(&conn);
+    assert(!conn.in_multi && !conn.tb);
+    tb_end(&conn); // no-op without a block
+}
+
+static void test_watch() {
+    HMap watched;
+    Conn a, b;
+    dstr* key = tb_str("key");
+    dstr* other = tb_str("other");
+
+    // Nothing watched: a touch is only the size check
+    watch_touch(&watched, "key", 3);
+    assert(!hm_size(&watched));
+
+    watch_key(&watched, &a, key);
+    watch_key(&watched, &a, key);
+    watch_key(&watched, &b, key);
+    watch_key(&watched, &b, other);
+    assert(hm_size(&watched) == 2 && a.watching.size() == 1 && b.watching.size() == 2);
+    assert(a.watching[0].key == b.watching[0].key && a.watching[0].key->watchers == 2);
+
+    // Writes to other keys don't matter, a write to a watched key makes both watchers dirty
+    watch_touch(&watched, "unrelated", 9);
+    assert(!watch_dirty(&a) && !watch_dirty(&b));
+    watch_touch(&watched, "key", 3);
+    assert(watch_dirty(&a) && watch_dirty(&b));
+
+    // A new WATCH starts from the current version
+    unwatch_all(&watched, &a);
+    assert(a.watching.empty() && hm_size(&watched) == 2);
+    watch_key(&watched, &a, key);
+    assert(!watch_dirty(&a));
+
+    // FLUSHALL touches everything, the last watcher frees the entry
+    unwatch_all(&watched, &b);
+    assert(hm_size(&watched) == 1);
+    watch_touch_all(&watched);
+    assert(watch_dirty(&a));
+    unwatch_all(&watched, &a);
+    assert(!hm_size(&watched));
+
+    hm_clear(&watched);
+    free(key);
+    free(other);
+}
+
+static uint8_t tb_echo(Conn* conn, std::vector<dstr*>& cmd) {
+    out_str(conn, cmd[1]->buf, cmd[1]->size);
+    return 0;
+}
+
+// Like KEYS: the array length is written once the elements are
+static uint8_t tb_list(Conn* conn, std::vector<dstr*>& cmd) {
+    size_t len_pos = out_unknown_arr(conn);
+    uint32_t n = 50;
+    for (uint32_t i = 0; i < n; i++) {
+        out_str(conn, cmd[1]->buf, cmd[1]->size);
+    }
+    memcpy(&conn->outgoing[len_pos], &n, 4);
+    return 0;
+}
+
+static uint8_t tb_fail(Conn* conn, std::vector<dstr*>&) {
+    out_err(conn, "no");
+    return 1;
+}
+
+static size_t tb_touched = 0;
+
+static void tb_touch(Conn*, const CmdSpec*, std::vector<dstr*>&) {
+    tb_touched++;
+}
+
+static void tb_exec_queue(Conn* conn) {
+    static const CmdSpec echo = {"echo", 2, 2, tb_echo, 0, 0, 0};
+    static const CmdSpec list = {"list", 2, 2, tb_list, 0, 0, 0};
+    static const CmdSpec fail = {"fail", 1, 1, tb_fail, 0, 0, 0};
+    std::string big(100, 'x');
+    tb_begin(conn);
+    std::vector<dstr*> cmd = {tb_str("echo"), tb_str(big.c_str())};
+    tb_queue(conn, &echo, cmd);
+    cmd = {tb_str("list"), tb_str("elem")};
+    tb_queue(conn, &list, cmd);
+    cmd = {tb_str("fail")};
+    tb_queue(conn, &fail, cmd);
+    cmd = {tb_str("echo"), tb_str("y")};
+    tb_queue(conn, &echo, cmd);
+}
+
+static void test_exec() {
+    // One [status, values...] array per command, errors aren't touched
+    Conn conn;
+    tb_exec_queue(&conn);
+    tb_touched = 0;
+    tb_exec(&conn, tb_touch);
+    tb_end(&conn);
+    std::vector<uint8_t>& out = conn.outgoing;
+    assert(tb_touched == 3 && out_value_size(out.data()) == out.size());
+    size_t pos = 5;
+    for (size_t i = 0; i < 4; i++) {
+        uint32_t count = 0;
+        memcpy(&count, &out[pos + 1], 4);
+        assert(count == 2 && out_reply_failed(out, pos + 6) == (i == 2));
+        pos += out_value_size(&out[pos]);
+    }
+
+    // Past a tiny cap the values stop, every command still runs and the reply stays in bounds
+    Conn capped;
+    capped.out_cap = 16;
+    tb_exec_queue(&capped);
+    tb_touched = 0;
+    tb_exec(&capped, tb_touch);
+    tb_end(&capped);
+    assert(tb_touched == 3 && out_full(&capped) && capped.outgoing.size() < out.size() / 2);
+    assert(!out_reply_failed(capped.outgoing, capped.outgoing.size()));
+}
+
+int run_all_tblock() {
+    test_queue();
+    printf("[tblock]: command queue passed! (1/3)\n");
+    test_watch();
+    printf("[tblock]: watched key versions passed! (2/3)\n");
+    test_exec();
+    printf("[tblock]: EXEC replies passed! (3/3)\n");
+    printf("[tblock]: ALL TBLOCK TESTS PASSED!\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <assert.h>
+#include <stdio.h>
+#include "threadpool.cpp"
+#include "threadpool.h"
+
+static std::atomic<uint64_t> tp_counter{0};
+
+static void count_task(void* arg) {
+    tp_counter.fetch_add((uint64_t)(uintptr_t)arg, std::memory_order_relaxed);
+}
+
+static ThreadPoolTask* fake_task(uintptr_t id) {
+    ThreadPoolTask* task = new ThreadPoolTask;
+    task->f = &count_task;
+    task->arg = (void*)id;
+    return task;
+}
+
+static void test_inject_queue() {
+    TPInjectQueue q;
+    inject_init(&q, 8);
+    assert(inject_pop(&q) == NULL);
+
+    // Wraps around the ring a few times, FIFO order and full / empty checks on every lap
+    for (uintptr_t lap = 0; lap < 3; lap++) {
+        ThreadPoolTask* tasks[8];
+        for (uintptr_t i = 0; i < 8; i++) {
+            tasks[i] = fake_task(lap * 8 + i);
+            assert(inject_push(&q, tasks[i]));
+        }
+        ThreadPoolTask* extra = fake_task(0);
+        assert(!inject_push(&q, extra));
+        delete extra;
+
+        for (uintptr_t i = 0; i < 8; i++) {
+            ThreadPoolTask* task = inject_pop(&q);
+            assert(task == tasks[i] && (uintptr_t)task->arg == lap * 8 + i);
+            delete task;
+        }
+        assert(inject_pop(&q) == NULL);
+    }
+    delete[] q.cells;
+}
+
+static void test_deque() {
+    TPDeque d;
+    deque_init(&d, 4);
+    assert(deque_pop(&d) == NULL && deque_steal(&d) == NULL);
+
+    // Pushing 100 tasks grows the buffer from 4 slots, the owner pops LIFO and thieves steal FIFO
+    ThreadPoolTask* tasks[100];
+    for (uintptr_t i = 0; i < 100; i++) {
+        tasks[i] = fake_task(i);
+        deque_push(&d, tasks[i]);
+    }
+    assert(d.buf.load()->cap == 128 && d.retired.size() == 5);
+    for (int i = 0; i < 10; i++) {
+        assert(deque_steal(&d) == tasks[i]);
+    }
+    for (int i = 99; i >= 10; i--) {
+        assert(deque_pop(&d) == tasks[i]);
+    }
+    assert(deque_pop(&d) == NULL && deque_steal(&d) == NULL);
+
+    // Interleaved pushes after the deque was emptied
+    deque_push(&d, tasks[0]);
+    deque_push(&d, tasks[1]);
+    assert(deque_steal(&d) == tasks[0]);
+    assert(deque_pop(&d) == tasks[1]);
+    assert(deque_pop(&d) == NULL);
+
+    for (ThreadPoolTask* task : tasks) {
+        delete task;
+    }
+    deque_free(&d);
+}
+
+static void test_submit_wait() {
+    ThreadPool tp;
+    threadpool_init(&tp, 4);
+    tp_counter.store(0);
+
+    // More tasks than the injection queue holds, the producer has to wait for free slots
+    std::vector<ThreadPoolTask*> handles;
+    for (uintptr_t i = 1; i <= 3 * TP_INJECT_CAP; i++) {
+        handles.push_back(threadpool_submit(&tp, &count_task, (void*)i));
+    }
+    for (ThreadPoolTask* task : handles) {
+        threadpool_wait(&tp, task);
+    }
+    uint64_t n = 3 * TP_INJECT_CAP;
+    assert(tp_counter.load() == n * (n + 1) / 2);
+    threadpool_shutdown(&tp);
+}
+
+// Recursive range sum, every level submits the left half to the pool and waits for it
+struct SumJob {
+    ThreadPool* tp;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t res;
+};
+
+static void sum_task(void* arg) {
+    SumJob* job = (SumJob*)arg;
+    if (job->hi - job->lo <= 64) {
+        job->res = 0;
+        for (uint64_t i = job->lo; i < job->hi; i++) {
+            job->res += i;
+        }
+        return;
+    }
+    uint64_t mid = job->lo + (job->hi - job->lo) / 2;
+    SumJob left = {job->tp, job->lo, mid, 0};
+    SumJob right = {job->tp, mid, job->hi, 0};
+    ThreadPoolTask* handle = threadpool_submit(job->tp, &sum_task, &left);
+    sum_task(&right);
+    threadpool_wait(job->tp, handle);
+    job->res = left.res + right.res;
+}
+
+static void test_fork_join() {
+    ThreadPool tp;
+    threadpool_init(&tp, 4);
+
+    SumJob job = {&tp, 0, 1 << 16, 0};
+    ThreadPoolTask* handle = threadpool_submit(&tp, &sum_task, &job);
+    threadpool_wait(&tp, handle);
+    assert(job.res == (uint64_t)(1 << 16) * ((1 << 16) - 1) / 2);
+    threadpool_shutdown(&tp);
+}
+
+static void spawn_task(void* arg) {
+    ThreadPool* tp = (ThreadPool*)arg;
+    for (uintptr_t i = 0; i < 10; i++) {
+        threadpool_produce(tp, &count_task, (void*)1);
+    }
+}
+
+static void test_shutdown() {
+    ThreadPool tp;
+    threadpool_init(&tp, 3);
+    tp_counter.store(0);
+
+    // Shutdown runs everything still queued, including the tasks spawned while draining
+    for (int i = 0; i < 1000; i++) {
+        threadpool_produce(&tp, &spawn_task, &tp);
+    }
+    threadpool_shutdown(&tp);
+    assert(tp_counter.load() == 10000);
+
+    // After shutdown tasks run inline
+    ThreadPoolTask* handle = threadpool_submit(&tp, &count_task, (void*)5);
+    assert(handle->done.load());
+    threadpool_wait(&tp, handle);
+    assert(tp_counter.load() == 10005);
+}
+
+int run_all_threadpool() {
+    test_inject_queue();
+    printf("[threadpool]: injection queue passed! (1/5)\n");
+    test_deque();
+    printf("[threadpool]: work stealing deque passed! (2/5)\n");
+    test_submit_wait();
+    printf("[threadpool]: threadpool_submit() / threadpool_wait() passed! (3/5)\n");
+    test_fork_join();
+    printf("[threadpool]: fork join passed! (4/5)\n");
+    test_shutdown();
+    printf("[threadpool]: threadpool_shutdown() passed! (5/5)\n");
+    printf("[threadpool]: ALL THREADPOOL TESTS PASSED!\n");
+    return 0;
+}
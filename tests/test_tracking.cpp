@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "tracking.cpp"
+#include "tracking.h"
+
+static dstr* tr_str(const char* s) {
+    dstr* str = dstr_init(strlen(s));
+    dstr_append(&str, s, strlen(s));
+    return str;
+}
+
+static size_t tr_write(Tracking* t, const char* key, Conn* writer) {
+    return tracking_invalidate(t, key, strlen(key), writer);
+}
+
+static void tr_read(Tracking* t, Conn* conn, const char* key) {
+    tracking_read(t, conn, key, strlen(key));
+}
+
+static void tr_bcast(Tracking* t, Conn* conn, std::vector<const char*> names) {
+    std::vector<dstr*> prefixes;
+    for (const char* name : names) {
+        prefixes.push_back(tr_str(name));
+    }
+    tracking_on(t, conn, TRACK_BCAST, prefixes.data(), prefixes.size());
+    for (dstr* prefix : prefixes) {
+        free(prefix);
+    }
+}
+
+// The invalidated key of a frame, "" for the null of a flush
+static std::string tr_frame_key(SharedBuf* buf) {
+    ClientReply reply;
+    assert(client_parse_reply(buf->data, buf->len, &reply) == buf->len && reply.code == RES_PUSH);
+    assert(reply.values.size() == 2 && reply.values[0].str == "invalidate");
+    if (reply.values[1].tag == TAG_NULL) {
+        return "";
+    }
+    assert(reply.values[1].tag == TAG_ARR && reply.values[1].arr.size() == 1);
+    return reply.values[1].arr[0].str;
+}
+
+static void test_track_keys() {
+    Tracking t;
+    Conn a, b, w;
+    tracking_on(&t, &a, 0, NULL, 0);
+    tracking_on(&t, &b, 0, NULL, 0);
+
+    // Untracked connections and repeated reads add nothing
+    tr_read(&t, &w, "k");
+    assert(!tracking_size(&t));
+    tr_read(&t, &a, "k");
+    tr_read(&t, &a, "k");
+    tr_read(&t, &b, "k");
+    tr_read(&t, &a, "other");
+    TrackedKey* k = hm_find_entry<TrackedKey>(&t.keys, "k", 1);
+    assert(tracking_size(&t) == 2 && k->readers.size() == 2);
+
+    // One shared frame per write, then the key is forgotten until it's read again
+    assert(tr_write(&t, "k", &w) == 2 && tracking_size(&t) == 1);
+    assert(a.out_chunks.size() == 1 && b.out_chunks[0].buf == a.out_chunks[0].buf);
+    assert(tr_frame_key(a.out_chunks[0].buf) == "k");
+    assert(tr_write(&t, "k", &w) == 0 && tr_write(&t, "nope", NULL) == 0);
+
+    // NOLOOP leaves out the connection's own writes
+    tracking_on(&t, &a, TRACK_NOLOOP, NULL, 0);
+    tr_read(&t, &a, "k");
+    tr_read(&t, &b, "k");
+    assert(tr_write(&t, "k", &a) == 1 && a.out_chunks.size() == 1 && b.out_chunks.size() == 2);
+
+    // A reader that stopped tracking is skipped, its slot goes to the next client with a new generation
+    tr_read(&t, &b, "k");
+    uint32_t slot = b.tracking->slot;
+    tracking_off(&t, &b);
+    Conn c;
+    tracking_on(&t, &c, 0, NULL, 0);
+    assert(c.tracking->slot == slot && t.gens[slot] == 1);
+    assert(tr_write(&t, "k", NULL) == 0 && c.out_chunks.empty());
+
+    out_clear(&a);
+    out_clear(&b);
+    tracking_off(&t, &a);
+    tracking_off(&t, &c);
+    tr_write(&t, "other", NULL);
+    assert(!tracking_size(&t));
+    hm_clear(&t.keys);
+}
+
+static void test_track_bcast() {
+    Tracking t;
+    Conn a, b, all;
+    tr_bcast(&t, &a, {"user:", "cfg:"});
+    tr_bcast(&t, &b, {"user:", "user:"});
+    tr_bcast(&t, &all, {});
+    assert(t.prefixes.size() == 3 && b.tracking->prefixes.size() == 1);
+
+    // Reads are not remembered in broadcast mode
+    tr_read(&t, &a, "user:1");
+    assert(!tracking_size(&t));
+    assert(tr_write(&t, "user:1", NULL) == 3);
+    assert(tr_write(&t, "cfg:x", NULL) == 2);
+    assert(tr_write(&t, "user", NULL) == 1);
+    assert(a.out_chunks.size() == 2 && tr_frame_key(a.out_chunks[1].buf) == "cfg:x");
+
+    // Overlapping prefixes of one connection send the key once
+    Conn o;
+    tr_bcast(&t, &o, {"user:", "user:1", "u"});
+    assert(tr_write(&t, "user:12", NULL) == 4 && o.out_chunks.size() == 1);
+    assert(tr_frame_key(o.out_chunks[0].buf) == "user:12");
+    assert(tr_write(&t, "user:2", NULL) == 4 && tr_write(&t, "usr", NULL) == 2 && o.out_chunks.size() == 3);
+    tracking_off(&t, &o);
+    out_clear(&o);
+
+    // A flush reaches every tracking connection once
+    assert(tracking_invalidate_all(&t) == 3 && tr_frame_key(all.out_chunks.back().buf) == "");
+
+    // Prefixes are freed with their last client, switching modes drops them
+    tracking_off(&t, &a);
+    assert(t.prefixes.size() == 2);
+    tracking_on(&t, &b, 0, NULL, 0);
+    assert(t.prefixes.size() == 1 && tr_write(&t, "user:2", NULL) == 1);
+    tracking_off(&t, &b);
+    tracking_off(&t, &all);
+    assert(t.prefixes.empty() && t.free_slots.size() == 4);
+    out_clear(&a);
+    out_clear(&b);
+    out_clear(&all);
+    hm_clear(&t.keys);
+}
+
+int run_all_tracking() {
+    test_track_keys();
+    printf("[tracking]: key tracking passed! (1/2)\n");
+    test_track_bcast();
+    printf("[tracking]: broadcast mode passed! (2/2)\n");
+    printf("[tracking]: ALL TRACKING TESTS PASSED!\n");
+    return 0;
+}